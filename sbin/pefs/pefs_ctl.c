@@ -72,6 +72,7 @@ static int	pefs_addchain(int argc, char *argv[]);
 static int	pefs_delchain(int argc, char *argv[]);
 static int	pefs_randomchain(int argc, char *argv[]);
 static int	pefs_showkeys(int argc, char *argv[]);
+static int	pefs_showstats(int argc, char *argv[]);
 static int	pefs_getkey(int argc, char *argv[]);
 static int	pefs_showchains(int argc, char *argv[]);
 static int	pefs_showalgs(int argc, char *argv[]);
@@ -96,6 +97,7 @@ static struct command cmds[] = {
 	{ "showkeys",	pefs_showkeys },
 	{ "getkey",	pefs_getkey },
 	{ "status",	pefs_showkeys },
+	{ "showstats",	pefs_showstats },
 	{ "randomchain", pefs_randomchain },
 	{ "addchain",	pefs_addchain },
 	{ "delchain",	pefs_delchain },
@@ -268,11 +270,19 @@ pefs_key_get(struct pefs_xkey *xk, const char *prompt, int verify,
 	return (error);
 }
 
+static inline const char *
+pefs_key_flags_name(struct pefs_xkey *xk)
+{
+	if ((xk->pxk_alg & PEFS_ALG_DETNAME) != 0)
+		return (" detname");
+	return ("");
+}
+
 static inline void
 pefs_key_showind(struct pefs_xkey *xk, int ind)
 {
-	printf("\t%-4d %016jx %s\n", ind, pefs_keyid_as_int(xk->pxk_keyid),
-	    pefs_alg_name(xk));
+	printf("\t%-4d %016jx %s%s\n", ind, pefs_keyid_as_int(xk->pxk_keyid),
+	    pefs_alg_name(xk), pefs_key_flags_name(xk));
 }
 
 static inline void
@@ -282,8 +292,9 @@ pefs_key_shownode(struct pefs_xkey *xk, const char *path)
 	if (xk == NULL)
 		printf("Key(%s): <not specified>\n", path);
 	else
-		printf("Key(%s): %016jx %s\n", path,
-		    pefs_keyid_as_int(xk->pxk_keyid), pefs_alg_name(xk));
+		printf("Key(%s): %016jx %s%s\n", path,
+		    pefs_keyid_as_int(xk->pxk_keyid), pefs_alg_name(xk),
+		    pefs_key_flags_name(xk));
 }
 
 static int
@@ -319,12 +330,15 @@ pefs_keyop(keyop_func_t func, int argc, char *argv[])
 	int verbose = 0;
 
 	pefs_keyparam_create(&kp);
-	while ((i = getopt(argc, argv, "cCpva:i:j:k:")) != -1)
+	while ((i = getopt(argc, argv, "cCdpva:i:j:k:")) != -1)
 		switch(i) {
 		case 'a':
 			if (pefs_keyparam_setalg(&kp, optarg) != 0)
 				pefs_usage_alg();
 			break;
+		case 'd':
+			kp.kp_flags |= PEFS_ALG_DETNAME;
+			break;
 		case 'c':
 			chain = PEFS_KEYCHAIN_USE;
 			break;
@@ -436,12 +450,15 @@ pefs_setkey(int argc, char *argv[])
 	int chain = PEFS_KEYCHAIN_IGNORE_MISSING;
 
 	pefs_keyparam_create(&kp);
-	while ((i = getopt(argc, argv, "cCpvxa:i:j:k:")) != -1)
+	while ((i = getopt(argc, argv, "cCdpvxa:i:j:k:")) != -1)
 		switch(i) {
 		case 'a':
 			if (pefs_keyparam_setalg(&kp, optarg) != 0)
 				pefs_usage_alg();
 			break;
+		case 'd':
+			kp.kp_flags |= PEFS_ALG_DETNAME;
+			break;
 		case 'c':
 			chain = PEFS_KEYCHAIN_USE;
 			break;
@@ -655,6 +672,58 @@ pefs_showkeys(int argc, char *argv[])
 	return (0);
 }
 
+static int
+pefs_showstats(int argc, char *argv[])
+{
+	char fsroot[MAXPATHLEN];
+	struct pefs_xstats xs;
+	int fd;
+
+	initfsroot(argc, argv, 0, fsroot, sizeof(fsroot));
+
+	fd = openx_rdonly(fsroot);
+	if (fd == -1)
+		return (PEFS_ERR_IO);
+
+	bzero(&xs, sizeof(xs));
+	if (ioctl(fd, PEFS_GETSTATS, &xs) == -1) {
+		warn("cannot get statistics");
+		close(fd);
+		return (PEFS_ERR_IO);
+	}
+	close(fd);
+
+	printf("Sectors decrypted:\t%ju\n", (uintmax_t)xs.pxs_decrypted);
+	printf("Zero sectors skipped:\t%ju\n", (uintmax_t)xs.pxs_holes);
+	printf("Zero sectors stored as holes:\t%ju\n",
+	    (uintmax_t)xs.pxs_holes_written);
+	printf("Dircache lookup hits:\t%ju\n",
+	    (uintmax_t)xs.pxs_lookup_hits);
+	printf("Dircache lookup misses:\t%ju\n",
+	    (uintmax_t)xs.pxs_lookup_misses);
+	printf("Dircache lookups outdated:\t%ju\n",
+	    (uintmax_t)xs.pxs_lookup_stale);
+	printf("Directory scans:\t%ju\n", (uintmax_t)xs.pxs_scans);
+	printf("Directory entries scanned:\t%ju\n",
+	    (uintmax_t)xs.pxs_scan_entries);
+	printf("Names decrypted:\t%ju\n", (uintmax_t)xs.pxs_names_decrypted);
+	printf("Key trials per name:\t%.2f\n",
+	    xs.pxs_names_decrypted == 0 ? 0.0 :
+	    (double)xs.pxs_name_trials / xs.pxs_names_decrypted);
+	printf("Dircache entries:\t%ju\n",
+	    (uintmax_t)xs.pxs_dircache_entries);
+	printf("Dircache evictions:\t%ju\n",
+	    (uintmax_t)xs.pxs_dircache_evictions);
+	printf("Dircache insert collisions:\t%ju\n",
+	    (uintmax_t)xs.pxs_dircache_collisions);
+	printf("Dircache purges:\t%ju\n",
+	    (uintmax_t)xs.pxs_dircache_purges);
+	printf("Pages read ahead:	%ju
+", (uintmax_t)xs.pxs_readahead);
+
+	return (0);
+}
+
 static int
 pefs_mount(int argc, char *argv[])
 {
@@ -746,7 +815,7 @@ pefs_addchain(int argc, char *argv[])
 
 	pefs_keyparam_create(&p[0].kp);
 	pefs_keyparam_create(&p[1].kp);
-	while ((i = getopt(argc, argv, "a:A:i:I:j:J:k:K:fpPvZ")) != -1)
+	while ((i = getopt(argc, argv, "a:A:i:I:j:J:k:K:dDfpPvZ")) != -1)
 		switch(i) {
 		case 'v':
 			verbose = 1;
@@ -765,6 +834,13 @@ pefs_addchain(int argc, char *argv[])
 			if (pefs_keyparam_setalg(kpi, optarg) != 0)
 				pefs_usage_alg();
 			break;
+		case 'd':
+		case 'D':
+			if (isupper(i))
+				optchainedkey = i;
+			kpi = &p[isupper(i) ? 1 : 0].kp;
+			kpi->kp_flags |= PEFS_ALG_DETNAME;
+			break;
 		case 'p':
 		case 'P':
 			if (isupper(i))
@@ -1115,13 +1191,14 @@ pefs_usage(void)
 	fprintf(stderr,
 "usage:	pefs mount [-o options] [from filesystem]\n"
 "	pefs unmount [-fv] filesystem\n"
-"	pefs addkey [-cCpv] [-a alg] [-i iterations] [-j passfile] [-k keyfile] filesystem\n"
+"	pefs addkey [-cCdpv] [-a alg] [-i iterations] [-j passfile] [-k keyfile] filesystem\n"
 "	pefs delkey [-cCpv] [-i iterations] [-j passfile] [-k keyfile] filesystem\n"
 "	pefs flushkeys filesystem\n"
 "	pefs getkey [-t] file\n"
-"	pefs setkey [-cCpvx] [-a alg] [-i iterations] [-j passfile] [-k keyfile] directory\n"
+"	pefs setkey [-cCdpvx] [-a alg] [-i iterations] [-j passfile] [-k keyfile] directory\n"
 "	pefs showkeys [-t] filesystem\n"
-"	pefs addchain [-fpPvZ] [-a alg] [-i iterations] [-j passfile] [-k keyfile]\n"
+"	pefs showstats filesystem\n"
+"	pefs addchain [-dDfpPvZ] [-a alg] [-i iterations] [-j passfile] [-k keyfile]\n"
 "		[-A alg] [-I iterations] [-J passfile] [-K keyfile] filesystem\n"
 "	pefs delchain [-fFpv] [-i iterations] [-j passfile] [-k keyfile] filesystem\n"
 "	pefs randomchain [-fv] [-n min] [-N max] filesystem\n"
@@ -71,6 +71,7 @@ struct pefs_xkeyenc {
 struct pefs_keyparam {
 	int		kp_alg;
 	int		kp_keybits;
+	int		kp_flags;
 	int		kp_nopassphrase;
 	int		kp_iterations;
 	int		kp_keyfile_count;
@@ -111,4 +112,5 @@ pefs_keyparam_create(struct pefs_keyparam *kp)
 	kp->kp_passfile_count = 0;
 	kp->kp_alg = 0;
 	kp->kp_keybits = 0;
+	kp->kp_flags = 0;
 }
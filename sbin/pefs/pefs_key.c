@@ -108,7 +108,8 @@ pefs_alg_name(struct pefs_xkey *xk)
 	struct algorithm *alg;
 
 	for (alg = algs; alg->name != NULL; alg++) {
-		if (alg->id == xk->pxk_alg && alg->keybits == xk->pxk_keybits)
+		if (alg->id == (xk->pxk_alg & PEFS_ALG_MASK) &&
+		    alg->keybits == xk->pxk_keybits)
 			return (alg->name);
 	}
 
@@ -290,7 +291,7 @@ pefs_key_generate(struct pefs_xkey *xk, const char *passphrase,
 	}
 
 	xk->pxk_index = -1;
-	xk->pxk_alg = kp->kp_alg;
+	xk->pxk_alg = kp->kp_alg | kp->kp_flags;
 	xk->pxk_keybits = kp->kp_keybits;
 
 	hmac_sha512_init(&ctx, NULL, 0);
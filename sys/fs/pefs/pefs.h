@@ -32,6 +32,10 @@
 #define	PEFS_ALG_INVALID		0
 #define	PEFS_ALG_AES_XTS		4
 #define	PEFS_ALG_CAMELLIA_XTS		5
+#define	PEFS_ALG_MASK			0x0000ffff
+
+/* Key flags passed in upper bits of pxk_alg. */
+#define	PEFS_ALG_DETNAME		0x00010000
 
 #define	PEFS_TWEAK_SIZE			8
 #define	PEFS_KEY_BITS			512
@@ -48,6 +52,24 @@ struct pefs_xkey {
 	char			pxk_key[PEFS_KEY_SIZE];
 };
 
+struct pefs_xstats {
+	uint64_t		pxs_holes;
+	uint64_t		pxs_decrypted;
+	uint64_t		pxs_holes_written;
+	uint64_t		pxs_lookup_hits;
+	uint64_t		pxs_lookup_misses;
+	uint64_t		pxs_lookup_stale;
+	uint64_t		pxs_scans;
+	uint64_t		pxs_scan_entries;
+	uint64_t		pxs_names_decrypted;
+	uint64_t		pxs_name_trials;
+	uint64_t		pxs_dircache_entries;
+	uint64_t		pxs_dircache_evictions;
+	uint64_t		pxs_dircache_collisions;
+	uint64_t		pxs_dircache_purges;
+	uint64_t		pxs_readahead;
+};
+
 #ifdef _IO
 #define	PEFS_GETKEY			_IOWR('p', 0, struct pefs_xkey)
 #define	PEFS_ADDKEY			_IOWR('p', 1, struct pefs_xkey)
@@ -55,6 +77,7 @@ struct pefs_xkey {
 #define	PEFS_DELKEY			_IOWR('p', 3, struct pefs_xkey)
 #define	PEFS_FLUSHKEYS			_IO('p', 4)
 #define	PEFS_GETNODEKEY			_IOWR('p', 5, struct pefs_xkey)
+#define	PEFS_GETSTATS			_IOR('p', 6, struct pefs_xstats)
 #endif
 
 #ifdef _KERNEL
@@ -69,9 +92,12 @@ struct pefs_xkey {
 #endif /* PEFS_DEBUG */
 
 struct pefs_alg;
+struct pefs_crypto_async;
 struct pefs_ctx;
 struct pefs_dircache;
+struct pefs_dircache_entry;
 struct pefs_dircache_pool;
+struct dirent;
 struct vfsconf;
 
 TAILQ_HEAD(pefs_key_head, pefs_key);
@@ -82,23 +108,39 @@ struct pefs_key {
 	const struct		pefs_alg *pk_alg;
 	struct pefs_ctx		*pk_name_csum_ctx;
 	struct pefs_ctx		*pk_name_ctx;
+	struct pefs_ctx		*pk_name_tweak_ctx;
 	struct pefs_ctx		*pk_tweak_ctx;
 	struct pefs_ctx		*pk_data_ctx;
 	struct mtx		*pk_entry_lock;
 	int			pk_algid;
 	int			pk_keybits;
+	int			pk_flags;
+	uint16_t		pk_namehint;
 	char			pk_keyid[PEFS_KEYID_SIZE];
 };
 
+#define	PEFS_KEY_DETNAME		0x0001
+
+#define	PEFS_TKEY_NAMEHINT		0x0001
+
 struct pefs_tkey {
 	struct pefs_key		*ptk_key;
 	char			ptk_tweak[PEFS_TWEAK_SIZE];
+	int			ptk_flags;
+};
+
+#define	PEFS_KEYORDER_SIZE		4
+
+/*
+ * Keys recently used in directory, most recent first.  Tried before the
+ * rest of mount keys when decrypting names.  Holds key references.
+ */
+struct pefs_keyorder {
+	struct pefs_key		*pko_keys[PEFS_KEYORDER_SIZE];
 };
 
 #define	PN_HASKEY			0x000001
 #define	PN_WANTRECYCLE			0x000100
-#define	PN_LOCKBUF_SMALL		0x001000
-#define	PN_LOCKBUF_LARGE		0x002000
 
 struct pefs_node {
 	LIST_ENTRY(pefs_node)	pn_listentry;
@@ -106,16 +148,46 @@ struct pefs_node {
 	struct vnode		*pn_lowervp_dead;
 	struct vnode		*pn_vnode;
 	struct pefs_dircache	*pn_dircache;
-	void			*pn_buf_small;
-	void			*pn_buf_large;
+	struct pefs_wbsector	*pn_wbsector;
 	int			pn_flags;
 	volatile u_int		pn_rename_xlock;
+	volatile u_int		pn_readahead;	/* read-ahead queued */
 	struct pefs_tkey	pn_tkey;
 };
 
 #define	PM_ROOT_CANRECURSE		0x01
 #define	PM_DIRCACHE			0x02
 #define	PM_ASYNCRECLAIM			0x04
+#define	PM_SPARSE			0x08
+#define	PM_NAMEHINT			0x10
+#define	PM_WARMUP			0x20
+
+/*
+ * Per mount statistics, updated atomically without locks.
+ */
+struct pefs_stats {
+	u_long			ps_holes;	/* zero sectors skipped */
+	u_long			ps_decrypted;	/* sectors decrypted */
+	u_long			ps_holes_written; /* zero sectors not encrypted */
+	u_long			ps_lookup_hits;	/* names found in dircache */
+	u_long			ps_lookup_misses; /* not found, cache valid */
+	u_long			ps_lookup_stale; /* dircache is outdated */
+	u_long			ps_scans;	/* lower directory scans */
+	u_long			ps_scan_entries; /* entries read by scans */
+	u_long			ps_names_decrypted; /* file names decrypted */
+	u_long			ps_name_trials;	/* name checksums computed */
+	u_long			ps_readahead;	/* pages read ahead */
+};
+
+/*
+ * Background dircache warm-up state, protected by pw_mtx.
+ */
+struct pefs_warmup {
+	struct mtx		pw_mtx;
+	u_int			pw_pending;	/* directories queued */
+	u_int			pw_blocked;	/* warm-up not allowed */
+	u_long			pw_entries;	/* entries scanned by warm-up */
+};
 
 struct pefs_mount {
 	struct mount		*pm_lowervfs;
@@ -123,25 +195,74 @@ struct pefs_mount {
 	struct mtx		pm_keys_lock;
 	struct pefs_key_head	pm_keys;
 	struct pefs_dircache_pool *pm_dircache_pool;
+	struct pefs_stats	pm_stats;
+	struct pefs_warmup	pm_warmup;
+	size_t			pm_maxio;
 	int			pm_flags;
 };
 
+#define	PEFS_NAME_BATCH			32
+
+struct pefs_name_dec {
+	const char		*pnd_enc;
+	size_t			pnd_enclen;
+	struct pefs_tkey	pnd_tkey;
+	int			pnd_namelen;
+	char			pnd_name[MAXNAMLEN + 1];
+};
+
+/*
+ * Chunks larger than PEFS_CHUNK_SEGSIZE consist of several segments of
+ * PEFS_CHUNK_SEGSIZE bytes, pc_base points to the first segment.
+ */
+#define	PEFS_CHUNK_SEGSIZE	DFLTPHYS
+#define	PEFS_CHUNK_MAXSEGS	32
+#define	PEFS_CHUNK_MAXSIZE	(PEFS_CHUNK_SEGSIZE * PEFS_CHUNK_MAXSEGS)
+
 struct pefs_chunk {
 	size_t			pc_size;
 	size_t			pc_capacity;
 	void			*pc_base;
-	int			pc_nodebuf;
+	int			pc_nsegs;
+	void			**pc_segs;	/* segment buffers */
+	struct iovec		*pc_iovs;
 	struct iovec		pc_iov;
 	struct uio		pc_uio;
 };
 
+/*
+ * Plaintext of partially written sector not yet written to lower file.
+ * Protected by vnode lock.
+ */
+struct pefs_wbsector {
+	struct pefs_chunk	pws_chunk;
+	off_t			pws_offset;	/* file offset */
+	size_t			pws_size;	/* file data in sector */
+};
+
 int	pefs_init(struct vfsconf *vfsp);
 int	pefs_uninit(struct vfsconf *vfsp);
 void	pefs_crypto_init(void);
 void	pefs_crypto_uninit(void);
+void	pefs_warmup_init(void);
+void	pefs_warmup_uninit(void);
+void	pefs_readahead_init(void);
+void	pefs_readahead_uninit(void);
+void	pefs_readahead_drain(void);
+
+void	pefs_warmup_mount(struct pefs_mount *pm);
+void	pefs_warmup_unmount(struct pefs_mount *pm);
+void	pefs_warmup_start(struct mount *mp);
+void	pefs_warmup_block(struct pefs_mount *pm);
+void	pefs_warmup_unblock(struct pefs_mount *pm);
+
+typedef int	pefs_fill_cb_t(void *arg, struct dirent *de,
+	    struct pefs_dircache_entry *pde);
+int	pefs_wbcache_sync(struct mount *mp, int waitfor);
+int	pefs_readdir_fill(struct vnode *dvp, struct ucred *cred,
+	    pefs_fill_cb_t *cb, void *arg);
 
 void	pefs_zone_dtor_bzero(void *mem, int size, void *arg);
-void	pefs_zone_fini_bzero(void *mem, int size);
 
 int	pefs_node_get_nokey(struct mount *mp, struct vnode *lvp,
 	    struct vnode **vpp);
@@ -151,7 +272,6 @@ int	pefs_node_get_lookupkey(struct mount *mp, struct vnode *lvp,
 	    struct vnode **vpp, struct ucred *cred);
 void	pefs_node_asyncfree(struct pefs_node *xp);
 struct pefs_key	*pefs_node_key(struct pefs_node *pn);
-void	pefs_node_buf_free(struct pefs_node *pn);
 
 struct pefs_ctx	*pefs_ctx_get(void);
 void	pefs_ctx_free(struct pefs_ctx *ctx);
@@ -168,27 +288,47 @@ int	pefs_key_remove_all(struct pefs_mount *pm);
 
 void	pefs_data_encrypt(struct pefs_tkey *ptk, off_t offset,
 	    struct pefs_chunk *pc);
-void	pefs_data_decrypt(struct pefs_tkey *ptk, off_t offset,
-	    struct pefs_chunk *pc);
-
+void	pefs_data_decrypt(struct pefs_mount *pm, struct pefs_tkey *ptk,
+	    off_t offset, struct pefs_chunk *pc);
+struct pefs_crypto_async *pefs_data_decrypt_async(struct pefs_tkey *ptk,
+	    off_t offset, struct pefs_chunk *pc);
+void	pefs_data_decrypt_wait(struct pefs_mount *pm,
+	    struct pefs_crypto_async *pca);
+int	pefs_data_encrypt_uio(struct pefs_tkey *ptk, off_t offset,
+	    struct pefs_chunk *pc, size_t skip, struct uio *uio);
+int	pefs_data_decrypt_uio(struct pefs_mount *pm, struct pefs_tkey *ptk,
+	    off_t offset, struct pefs_chunk *pc, size_t skip, struct uio *uio);
+int	pefs_data_iszero(struct pefs_chunk *pc, size_t skip);
+
+void	pefs_name_tweak(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
+	    const char *parent_tweak, const char *name, size_t namelen);
 int	pefs_name_encrypt(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
 	    const char *plain, size_t plain_len, char *enc, size_t enc_size);
 int	pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
 	    struct pefs_tkey *ptk, const char *enc, size_t enc_len, char *plain,
 	    size_t plain_size);
+u_int	pefs_name_decrypt_batch(struct pefs_ctx *ctx, struct pefs_key *pk,
+	    struct pefs_keyorder *pko, struct pefs_name_dec *pnd, int count);
+
+void	pefs_keyorder_copy(struct pefs_keyorder *dst,
+	    const struct pefs_keyorder *src);
+void	pefs_keyorder_release(struct pefs_keyorder *pko);
 
 int	pefs_name_ntop(u_char const *src, size_t srclength, char *target,
 	    size_t targsize);
 int	pefs_name_pton(char const *src, size_t srclen, u_char *target,
 	    size_t targsize);
 
-void	pefs_chunk_create(struct pefs_chunk *pc, struct pefs_node *pn,
-	    size_t size);
+void	pefs_chunk_create(struct pefs_chunk *pc, size_t size);
 void	pefs_chunk_restore(struct pefs_chunk* pc);
-void	pefs_chunk_free(struct pefs_chunk* pc, struct pefs_node *pn);
+void	pefs_chunk_free(struct pefs_chunk* pc);
 void	pefs_chunk_zero(struct pefs_chunk *pc);
 int	pefs_chunk_copy(struct pefs_chunk *pc, size_t skip, struct uio *uio);
 void	pefs_chunk_setsize(struct pefs_chunk *pc, size_t size);
+void	pefs_chunk_slice(struct pefs_chunk *pc, struct pefs_chunk *src,
+	    size_t skip, size_t size);
+int	pefs_chunk_segment(struct pefs_chunk *pc, int i,
+	    struct pefs_chunk *seg);
 struct uio	*pefs_chunk_uio(struct pefs_chunk *pc, off_t uio_offset,
 	    enum uio_rw uio_rw);
 
@@ -242,14 +382,17 @@ PEFS_LOWERVP(struct vnode *vp)
 	return (lvp);
 }
 
-static __inline void **
-pefs_node_buf(struct pefs_node *pn, int flag)
+/*
+ * File size including sector in write-back cache.
+ */
+static __inline u_quad_t
+pefs_wbcache_size(struct pefs_node *pn, u_quad_t lsize)
 {
-	MPASS(flag == PN_LOCKBUF_SMALL || flag == PN_LOCKBUF_LARGE);
-	if (flag == PN_LOCKBUF_SMALL)
-		return (&pn->pn_buf_small);
-	else
-		return (&pn->pn_buf_large);
+	struct pefs_wbsector *pws = pn->pn_wbsector;
+
+	if (pws == NULL)
+		return (lsize);
+	return (qmax(lsize, pws->pws_offset + pws->pws_size));
 }
 
 static __inline struct pefs_key *
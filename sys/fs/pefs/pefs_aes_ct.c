@@ -0,0 +1,706 @@
+/*-
+ * Copyright (c) 2016 Thomas Pornin <pornin@bolet.org>
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * Constant-time bitsliced AES implementation based on BearSSL aes_ct64.
+ * Four blocks are processed in parallel, no table lookups or data
+ * dependent branches are performed.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/systm.h>
+#include <sys/endian.h>
+
+#include <fs/pefs/pefs_crypto.h>
+
+#define	AES_CT_ENABLE_ENV	"vfs.pefs.aes_ct_enable"
+
+#define	AES_CT_BLOCK_LEN	16
+#define	AES_CT_PARALLEL		4
+
+static u_long	pefs_aes_ct_enable;
+
+/*
+ * S-box circuit by Boyar and Peralta, "A new combinational logic
+ * minimization technique with applications to cryptology".
+ * Variables x* (input) and s* (output) are numbered in "reverse" order:
+ * x0 is the high bit, x7 is the low bit.
+ */
+static void
+aes_ct_bitslice_sbox(uint64_t *q)
+{
+	uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+	uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+	uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+	uint64_t y20, y21;
+	uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+	uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+	uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+
+	/* Top linear transformation. */
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	/* Non-linear section. */
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	/* Bottom linear transformation. */
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+}
+
+/*
+ * Inverse S-box is computed using forward S-box:
+ *	iS(x) = B(S(B(x ^ 0x63)) ^ 0x63)
+ * where B() is inverse of the S-box affine transformation.
+ */
+static __inline void
+aes_ct_bitslice_invaffine(uint64_t *q)
+{
+	uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+	q0 = ~q[0];
+	q1 = ~q[1];
+	q2 = q[2];
+	q3 = q[3];
+	q4 = q[4];
+	q5 = ~q[5];
+	q6 = ~q[6];
+	q7 = q[7];
+	q[7] = q1 ^ q4 ^ q6;
+	q[6] = q0 ^ q3 ^ q5;
+	q[5] = q7 ^ q2 ^ q4;
+	q[4] = q6 ^ q1 ^ q3;
+	q[3] = q5 ^ q0 ^ q2;
+	q[2] = q4 ^ q7 ^ q1;
+	q[1] = q3 ^ q6 ^ q0;
+	q[0] = q2 ^ q5 ^ q7;
+}
+
+static void
+aes_ct_bitslice_invsbox(uint64_t *q)
+{
+	aes_ct_bitslice_invaffine(q);
+	aes_ct_bitslice_sbox(q);
+	aes_ct_bitslice_invaffine(q);
+}
+
+#define	SWAPN(cl, ch, s, x, y)	do {					\
+	uint64_t a, b;							\
+	a = (x);							\
+	b = (y);							\
+	(x) = (a & (uint64_t)(cl)) | ((b & (uint64_t)(cl)) << (s));	\
+	(y) = ((a & (uint64_t)(ch)) >> (s)) | (b & (uint64_t)(ch));	\
+} while (0)
+
+#define	SWAP2(x, y)	SWAPN(0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, \
+			    1, x, y)
+#define	SWAP4(x, y)	SWAPN(0x3333333333333333ULL, 0xCCCCCCCCCCCCCCCCULL, \
+			    2, x, y)
+#define	SWAP8(x, y)	SWAPN(0x0F0F0F0F0F0F0F0FULL, 0xF0F0F0F0F0F0F0F0ULL, \
+			    4, x, y)
+
+static void
+aes_ct_ortho(uint64_t *q)
+{
+	SWAP2(q[0], q[1]);
+	SWAP2(q[2], q[3]);
+	SWAP2(q[4], q[5]);
+	SWAP2(q[6], q[7]);
+
+	SWAP4(q[0], q[2]);
+	SWAP4(q[1], q[3]);
+	SWAP4(q[4], q[6]);
+	SWAP4(q[5], q[7]);
+
+	SWAP8(q[0], q[4]);
+	SWAP8(q[1], q[5]);
+	SWAP8(q[2], q[6]);
+	SWAP8(q[3], q[7]);
+}
+
+static void
+aes_ct_interleave_in(uint64_t *q0, uint64_t *q1, const uint32_t *w)
+{
+	uint64_t x0, x1, x2, x3;
+
+	x0 = w[0];
+	x1 = w[1];
+	x2 = w[2];
+	x3 = w[3];
+	x0 |= (x0 << 16);
+	x1 |= (x1 << 16);
+	x2 |= (x2 << 16);
+	x3 |= (x3 << 16);
+	x0 &= 0x0000FFFF0000FFFFULL;
+	x1 &= 0x0000FFFF0000FFFFULL;
+	x2 &= 0x0000FFFF0000FFFFULL;
+	x3 &= 0x0000FFFF0000FFFFULL;
+	x0 |= (x0 << 8);
+	x1 |= (x1 << 8);
+	x2 |= (x2 << 8);
+	x3 |= (x3 << 8);
+	x0 &= 0x00FF00FF00FF00FFULL;
+	x1 &= 0x00FF00FF00FF00FFULL;
+	x2 &= 0x00FF00FF00FF00FFULL;
+	x3 &= 0x00FF00FF00FF00FFULL;
+	*q0 = x0 | (x2 << 8);
+	*q1 = x1 | (x3 << 8);
+}
+
+static void
+aes_ct_interleave_out(uint32_t *w, uint64_t q0, uint64_t q1)
+{
+	uint64_t x0, x1, x2, x3;
+
+	x0 = q0 & 0x00FF00FF00FF00FFULL;
+	x1 = q1 & 0x00FF00FF00FF00FFULL;
+	x2 = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+	x3 = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+	x0 |= (x0 >> 8);
+	x1 |= (x1 >> 8);
+	x2 |= (x2 >> 8);
+	x3 |= (x3 >> 8);
+	x0 &= 0x0000FFFF0000FFFFULL;
+	x1 &= 0x0000FFFF0000FFFFULL;
+	x2 &= 0x0000FFFF0000FFFFULL;
+	x3 &= 0x0000FFFF0000FFFFULL;
+	w[0] = (uint32_t)x0 | (uint32_t)(x0 >> 16);
+	w[1] = (uint32_t)x1 | (uint32_t)(x1 >> 16);
+	w[2] = (uint32_t)x2 | (uint32_t)(x2 >> 16);
+	w[3] = (uint32_t)x3 | (uint32_t)(x3 >> 16);
+}
+
+static __inline void
+aes_ct_add_round_key(uint64_t *q, const uint64_t *sk)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		q[i] ^= sk[i];
+}
+
+static __inline void
+aes_ct_shift_rows(uint64_t *q)
+{
+	uint64_t x;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		x = q[i];
+		q[i] = (x & 0x000000000000FFFFULL) |
+		    ((x & 0x00000000FFF00000ULL) >> 4) |
+		    ((x & 0x00000000000F0000ULL) << 12) |
+		    ((x & 0x0000FF0000000000ULL) >> 8) |
+		    ((x & 0x000000FF00000000ULL) << 8) |
+		    ((x & 0xF000000000000000ULL) >> 12) |
+		    ((x & 0x0FFF000000000000ULL) << 4);
+	}
+}
+
+static __inline void
+aes_ct_inv_shift_rows(uint64_t *q)
+{
+	uint64_t x;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		x = q[i];
+		q[i] = (x & 0x000000000000FFFFULL) |
+		    ((x & 0x000000000FFF0000ULL) << 4) |
+		    ((x & 0x00000000F0000000ULL) >> 12) |
+		    ((x & 0x000000FF00000000ULL) << 8) |
+		    ((x & 0x0000FF0000000000ULL) >> 8) |
+		    ((x & 0x000F000000000000ULL) << 12) |
+		    ((x & 0xFFF0000000000000ULL) >> 4);
+	}
+}
+
+static __inline uint64_t
+rotr32(uint64_t x)
+{
+	return ((x << 32) | (x >> 32));
+}
+
+static __inline void
+aes_ct_mix_columns(uint64_t *q)
+{
+	uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+	uint64_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+	q0 = q[0];
+	q1 = q[1];
+	q2 = q[2];
+	q3 = q[3];
+	q4 = q[4];
+	q5 = q[5];
+	q6 = q[6];
+	q7 = q[7];
+	r0 = (q0 >> 16) | (q0 << 48);
+	r1 = (q1 >> 16) | (q1 << 48);
+	r2 = (q2 >> 16) | (q2 << 48);
+	r3 = (q3 >> 16) | (q3 << 48);
+	r4 = (q4 >> 16) | (q4 << 48);
+	r5 = (q5 >> 16) | (q5 << 48);
+	r6 = (q6 >> 16) | (q6 << 48);
+	r7 = (q7 >> 16) | (q7 << 48);
+
+	q[0] = q7 ^ r7 ^ r0 ^ rotr32(q0 ^ r0);
+	q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ rotr32(q1 ^ r1);
+	q[2] = q1 ^ r1 ^ r2 ^ rotr32(q2 ^ r2);
+	q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ rotr32(q3 ^ r3);
+	q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ rotr32(q4 ^ r4);
+	q[5] = q4 ^ r4 ^ r5 ^ rotr32(q5 ^ r5);
+	q[6] = q5 ^ r5 ^ r6 ^ rotr32(q6 ^ r6);
+	q[7] = q6 ^ r6 ^ r7 ^ rotr32(q7 ^ r7);
+}
+
+static __inline void
+aes_ct_inv_mix_columns(uint64_t *q)
+{
+	uint64_t q0, q1, q2, q3, q4, q5, q6, q7;
+	uint64_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+	q0 = q[0];
+	q1 = q[1];
+	q2 = q[2];
+	q3 = q[3];
+	q4 = q[4];
+	q5 = q[5];
+	q6 = q[6];
+	q7 = q[7];
+	r0 = (q0 >> 16) | (q0 << 48);
+	r1 = (q1 >> 16) | (q1 << 48);
+	r2 = (q2 >> 16) | (q2 << 48);
+	r3 = (q3 >> 16) | (q3 << 48);
+	r4 = (q4 >> 16) | (q4 << 48);
+	r5 = (q5 >> 16) | (q5 << 48);
+	r6 = (q6 >> 16) | (q6 << 48);
+	r7 = (q7 >> 16) | (q7 << 48);
+
+	q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^
+	    rotr32(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+	q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^
+	    rotr32(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+	q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^
+	    rotr32(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+	q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5 ^
+	    rotr32(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+	q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7 ^
+	    rotr32(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+	q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7 ^
+	    rotr32(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+	q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7 ^
+	    rotr32(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+	q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^
+	    rotr32(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+static void
+aes_ct_bitslice_encrypt(int rounds, const uint64_t *skey, uint64_t *q)
+{
+	int r;
+
+	aes_ct_add_round_key(q, skey);
+	for (r = 1; r < rounds; r++) {
+		aes_ct_bitslice_sbox(q);
+		aes_ct_shift_rows(q);
+		aes_ct_mix_columns(q);
+		aes_ct_add_round_key(q, skey + (r << 3));
+	}
+	aes_ct_bitslice_sbox(q);
+	aes_ct_shift_rows(q);
+	aes_ct_add_round_key(q, skey + (rounds << 3));
+}
+
+static void
+aes_ct_bitslice_decrypt(int rounds, const uint64_t *skey, uint64_t *q)
+{
+	int r;
+
+	aes_ct_add_round_key(q, skey + (rounds << 3));
+	for (r = rounds - 1; r > 0; r--) {
+		aes_ct_inv_shift_rows(q);
+		aes_ct_bitslice_invsbox(q);
+		aes_ct_add_round_key(q, skey + (r << 3));
+		aes_ct_inv_mix_columns(q);
+	}
+	aes_ct_inv_shift_rows(q);
+	aes_ct_bitslice_invsbox(q);
+	aes_ct_add_round_key(q, skey);
+}
+
+static uint32_t
+aes_ct_sub_word(uint32_t x)
+{
+	uint64_t q[8];
+
+	memset(q, 0, sizeof(q));
+	q[0] = x;
+	aes_ct_ortho(q);
+	aes_ct_bitslice_sbox(q);
+	aes_ct_ortho(q);
+	return ((uint32_t)q[0]);
+}
+
+int
+pefs_aes_ct_setkey(struct pefs_aes_ct_ctx *ctx, const uint8_t *key,
+    int keybits)
+{
+	static const uint8_t rcon[] = {
+		0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+	};
+	uint32_t skey[(PEFS_AES_CT_MAXROUNDS + 1) * 4];
+	uint64_t q[8], x0, x1, x2, x3, cskey[2];
+	uint32_t tmp;
+	int i, j, k, nk, nkf;
+
+	switch (keybits) {
+	case 128:
+		ctx->rounds = 10;
+		break;
+	case 192:
+		ctx->rounds = 12;
+		break;
+	case 256:
+		ctx->rounds = 14;
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	nk = keybits / 32;
+	nkf = (ctx->rounds + 1) * 4;
+	for (i = 0; i < nk; i++)
+		skey[i] = le32dec(key + i * 4);
+	tmp = skey[nk - 1];
+	for (i = nk, j = 0, k = 0; i < nkf; i++) {
+		if (j == 0) {
+			tmp = (tmp << 24) | (tmp >> 8);
+			tmp = aes_ct_sub_word(tmp) ^ rcon[k];
+		} else if (nk > 6 && j == 4) {
+			tmp = aes_ct_sub_word(tmp);
+		}
+		tmp ^= skey[i - nk];
+		skey[i] = tmp;
+		if (++j == nk) {
+			j = 0;
+			k++;
+		}
+	}
+
+	/*
+	 * Convert round keys to bitsliced representation and expand them
+	 * for all four parallel blocks.
+	 */
+	for (i = 0; i < nkf; i += 4) {
+		aes_ct_interleave_in(&q[0], &q[4], skey + i);
+		q[1] = q[0];
+		q[2] = q[0];
+		q[3] = q[0];
+		q[5] = q[4];
+		q[6] = q[4];
+		q[7] = q[4];
+		aes_ct_ortho(q);
+		cskey[0] = (q[0] & 0x1111111111111111ULL) |
+		    (q[1] & 0x2222222222222222ULL) |
+		    (q[2] & 0x4444444444444444ULL) |
+		    (q[3] & 0x8888888888888888ULL);
+		cskey[1] = (q[4] & 0x1111111111111111ULL) |
+		    (q[5] & 0x2222222222222222ULL) |
+		    (q[6] & 0x4444444444444444ULL) |
+		    (q[7] & 0x8888888888888888ULL);
+		for (j = 0; j < 2; j++) {
+			x0 = cskey[j] & 0x1111111111111111ULL;
+			x1 = (cskey[j] & 0x2222222222222222ULL) >> 1;
+			x2 = (cskey[j] & 0x4444444444444444ULL) >> 2;
+			x3 = (cskey[j] & 0x8888888888888888ULL) >> 3;
+			ctx->skey[i * 2 + j * 4 + 0] = (x0 << 4) - x0;
+			ctx->skey[i * 2 + j * 4 + 1] = (x1 << 4) - x1;
+			ctx->skey[i * 2 + j * 4 + 2] = (x2 << 4) - x2;
+			ctx->skey[i * 2 + j * 4 + 3] = (x3 << 4) - x3;
+		}
+	}
+
+	bzero(skey, sizeof(skey));
+	bzero(q, sizeof(q));
+	bzero(cskey, sizeof(cskey));
+
+	return (0);
+}
+
+static void
+aes_ct_crypt(const struct pefs_aes_ct_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t nblocks, int encrypt)
+{
+	uint32_t w[AES_CT_PARALLEL * 4];
+	uint64_t q[8];
+	size_t i, n;
+
+	for (; nblocks > 0; nblocks -= n) {
+		n = MIN(nblocks, AES_CT_PARALLEL);
+		memset(w, 0, sizeof(w));
+		for (i = 0; i < n * 4; i++)
+			w[i] = le32dec(in + i * 4);
+		for (i = 0; i < AES_CT_PARALLEL; i++)
+			aes_ct_interleave_in(&q[i], &q[i + 4], w + (i << 2));
+		aes_ct_ortho(q);
+		if (encrypt)
+			aes_ct_bitslice_encrypt(ctx->rounds, ctx->skey, q);
+		else
+			aes_ct_bitslice_decrypt(ctx->rounds, ctx->skey, q);
+		aes_ct_ortho(q);
+		for (i = 0; i < AES_CT_PARALLEL; i++)
+			aes_ct_interleave_out(w + (i << 2), q[i], q[i + 4]);
+		for (i = 0; i < n * 4; i++)
+			le32enc(out + i * 4, w[i]);
+		in += n * AES_CT_BLOCK_LEN;
+		out += n * AES_CT_BLOCK_LEN;
+	}
+	bzero(w, sizeof(w));
+	bzero(q, sizeof(q));
+}
+
+void
+pefs_aes_ct_encrypt(const struct pefs_aes_ct_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t nblocks)
+{
+	aes_ct_crypt(ctx, in, out, nblocks, 1);
+}
+
+void
+pefs_aes_ct_decrypt(const struct pefs_aes_ct_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t nblocks)
+{
+	aes_ct_crypt(ctx, in, out, nblocks, 0);
+}
+
+static int
+pefs_aes_ct_keysetup(const struct pefs_session *ses __unused,
+    struct pefs_ctx *ctx, const uint8_t *key, uint32_t keybits)
+{
+	return (pefs_aes_ct_setkey(&ctx->o.pctx_aes_ct, key, keybits));
+}
+
+static void
+pefs_aes_ct_encrypt_block(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out)
+{
+	pefs_aes_ct_encrypt(&ctx->o.pctx_aes_ct, in, out, 1);
+}
+
+static void
+pefs_aes_ct_decrypt_block(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out)
+{
+	pefs_aes_ct_decrypt(&ctx->o.pctx_aes_ct, in, out, 1);
+}
+
+static void
+pefs_aes_ct_encrypt_blocks(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	pefs_aes_ct_encrypt(&ctx->o.pctx_aes_ct, in, out, nblocks);
+}
+
+static void
+pefs_aes_ct_decrypt_blocks(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	pefs_aes_ct_decrypt(&ctx->o.pctx_aes_ct, in, out, nblocks);
+}
+
+int
+pefs_aes_ct_enabled(void)
+{
+	return (pefs_aes_ct_enable != 0);
+}
+
+/*
+ * Bitsliced implementation is 2-3 times slower than table driven rijndael
+ * and always pays for 4 blocks, use it only if requested.
+ */
+void
+pefs_aes_ct_init(struct pefs_alg *pa)
+{
+	TUNABLE_ULONG_FETCH(AES_CT_ENABLE_ENV, &pefs_aes_ct_enable);
+
+	if (pefs_aes_ct_enable != 0) {
+#ifndef PEFS_DEBUG
+		if (bootverbose)
+#endif
+			printf("pefs: constant-time AES enabled\n");
+		pa->pa_keysetup = pefs_aes_ct_keysetup;
+		pa->pa_encrypt = pefs_aes_ct_encrypt_block;
+		pa->pa_decrypt = pefs_aes_ct_decrypt_block;
+		pa->pa_encrypt_blocks = pefs_aes_ct_encrypt_blocks;
+		pa->pa_decrypt_blocks = pefs_aes_ct_decrypt_blocks;
+	}
+}
@@ -0,0 +1,42 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#define	PEFS_AES_CT_MAXROUNDS	14
+
+struct pefs_aes_ct_ctx {
+	uint64_t		skey[(PEFS_AES_CT_MAXROUNDS + 1) * 8];
+	int			rounds;
+};
+
+int	pefs_aes_ct_enabled(void);
+int	pefs_aes_ct_setkey(struct pefs_aes_ct_ctx *ctx, const uint8_t *key,
+	    int keybits);
+void	pefs_aes_ct_encrypt(const struct pefs_aes_ct_ctx *ctx,
+	    const uint8_t *in, uint8_t *out, size_t nblocks);
+void	pefs_aes_ct_decrypt(const struct pefs_aes_ct_ctx *ctx,
+	    const uint8_t *in, uint8_t *out, size_t nblocks);
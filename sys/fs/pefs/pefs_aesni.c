@@ -39,13 +39,61 @@ __FBSDID("$FreeBSD$");
 #include <sys/smp.h>
 #include <sys/systm.h>
 #include <machine/atomic.h>
+#ifdef __amd64__
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+#endif
 
 #include <fs/pefs/pefs_crypto.h>
 
 #define	AESNI_ENABLE_ENV	"vfs.pefs.aesni_enable"
+#define	VAES_ENABLE_ENV		"vfs.pefs.vaes_enable"
 
 DPCPU_DEFINE(struct fpu_kern_ctx *, pefs_aesni_fpu);
 
+static int pefs_aesni_fpu_refs;
+static int pefs_aesni_sw_ct;
+
+static pefs_aesni_ecb_t *pefs_aesni_encrypt_ecb = aesni_encrypt_ecb;
+static pefs_aesni_ecb_t *pefs_aesni_decrypt_ecb = aesni_decrypt_ecb;
+
+#ifdef PEFS_SIMD
+static pefs_simd_iszero_t *pefs_aesni_simd_iszero = pefs_simd_iszero_sse2;
+#endif
+
+/*
+ * Software fallback used if FPU context is not available.
+ */
+static void
+pefs_aesni_sw_encrypt(const struct pefs_aesni_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t nblocks)
+{
+	if (pefs_aesni_sw_ct) {
+		pefs_aes_ct_encrypt(&ctx->sw.ct, in, out, nblocks);
+		return;
+	}
+	for (; nblocks > 0; nblocks--) {
+		rijndael_encrypt(&ctx->sw.table, in, out);
+		in += AES_BLOCK_LEN;
+		out += AES_BLOCK_LEN;
+	}
+}
+
+static void
+pefs_aesni_sw_decrypt(const struct pefs_aesni_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t nblocks)
+{
+	if (pefs_aesni_sw_ct) {
+		pefs_aes_ct_decrypt(&ctx->sw.ct, in, out, nblocks);
+		return;
+	}
+	for (; nblocks > 0; nblocks--) {
+		rijndael_decrypt(&ctx->sw.table, in, out);
+		in += AES_BLOCK_LEN;
+		out += AES_BLOCK_LEN;
+	}
+}
+
 #if __FreeBSD_version < 900503
 static struct fpu_kern_ctx *
 fpu_kern_alloc_ctx(int flags __unused)
@@ -109,7 +157,10 @@ pefs_aesni_keysetup(const struct pefs_session *xses,
 
 	aesni_set_enckey(key, ctx->enc_schedule, ctx->rounds);
 	aesni_set_deckey(ctx->enc_schedule, ctx->dec_schedule, ctx->rounds);
-	rijndael_set_key(&ctx->sw, key, keybits);
+	if (pefs_aesni_sw_ct)
+		pefs_aes_ct_setkey(&ctx->sw.ct, key, keybits);
+	else
+		rijndael_set_key(&ctx->sw.table, key, keybits);
 
 	if (tmpctx != NULL) {
 		fpu_kern_leave(curthread, tmpctx);
@@ -130,7 +181,7 @@ pefs_aesni_encrypt(const struct pefs_session *xses,
 		aesni_encrypt_ecb(ctx->rounds, ctx->enc_schedule, AES_BLOCK_LEN,
 		    in, out);
 	else
-		rijndael_encrypt(&ctx->sw, in, out);
+		pefs_aesni_sw_encrypt(ctx, in, out, 1);
 }
 
 static void
@@ -144,10 +195,64 @@ pefs_aesni_decrypt(const struct pefs_session *xses,
 		aesni_decrypt_ecb(ctx->rounds, ctx->dec_schedule, AES_BLOCK_LEN,
 		    in, out);
 	else
-		rijndael_decrypt(&ctx->sw, in, out);
+		pefs_aesni_sw_decrypt(ctx, in, out, 1);
 }
 
+/*
+ * aesni_encrypt_ecb/aesni_decrypt_ecb process 8 blocks at a time with
+ * interleaved rounds, pass all blocks at once to keep AES pipeline busy.
+ * VAES variants are used instead if supported by CPU.
+ */
 static void
+pefs_aesni_encrypt_blocks(const struct pefs_session *xses,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	const struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
+	const struct pefs_aesni_ctx *ctx = &xctx->o.pctx_aesni;
+
+	if (ses->fpu_saved >= 0) {
+		pefs_aesni_encrypt_ecb(ctx->rounds, ctx->enc_schedule,
+		    nblocks * AES_BLOCK_LEN, in, out);
+		return;
+	}
+	pefs_aesni_sw_encrypt(ctx, in, out, nblocks);
+}
+
+static void
+pefs_aesni_decrypt_blocks(const struct pefs_session *xses,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	const struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
+	const struct pefs_aesni_ctx *ctx = &xctx->o.pctx_aesni;
+
+	if (ses->fpu_saved >= 0) {
+		pefs_aesni_decrypt_ecb(ctx->rounds, ctx->dec_schedule,
+		    nblocks * AES_BLOCK_LEN, in, out);
+		return;
+	}
+	pefs_aesni_sw_decrypt(ctx, in, out, nblocks);
+}
+
+/*
+ * Zero sector detection is done with SIMD instructions while in FPU kernel
+ * context to avoid additional FPU context switches.
+ */
+int
+pefs_aesni_iszero(const struct pefs_session *xses, const void *buf,
+    size_t len)
+{
+#ifdef PEFS_SIMD
+	const struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
+
+	if (ses->fpu_saved >= 0)
+		return (pefs_aesni_simd_iszero(buf, len));
+#endif
+	return (pefs_iszero(buf, len));
+}
+
+void
 pefs_aesni_enter(struct pefs_session *xses)
 {
 	struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
@@ -171,7 +276,7 @@ pefs_aesni_enter(struct pefs_session *xses)
 	critical_exit();
 }
 
-static void
+void
 pefs_aesni_leave(struct pefs_session *xses)
 {
 	struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
@@ -183,12 +288,35 @@ pefs_aesni_leave(struct pefs_session *xses)
 	DPCPU_ID_SET(ses->fpu_cpuid, pefs_aesni_fpu, ses->fpu_ctx);
 }
 
-static void
-pefs_aesni_uninit(struct pefs_alg *pa)
+/*
+ * Per-CPU FPU contexts are shared by all algorithms using AESNI sessions.
+ * Called on module load and unload only.
+ */
+void
+pefs_aesni_fpu_init(void)
 {
 	struct fpu_kern_ctx *fpu_ctx;
 	u_int cpuid;
 
+	if (pefs_aesni_fpu_refs++ != 0)
+		return;
+
+	CPU_FOREACH(cpuid) {
+		fpu_ctx = fpu_kern_alloc_ctx(FPU_KERN_NORMAL);
+		DPCPU_ID_SET(cpuid, pefs_aesni_fpu, fpu_ctx);
+	}
+}
+
+void
+pefs_aesni_fpu_uninit(void)
+{
+	struct fpu_kern_ctx *fpu_ctx;
+	u_int cpuid;
+
+	MPASS(pefs_aesni_fpu_refs > 0);
+	if (--pefs_aesni_fpu_refs != 0)
+		return;
+
 	CPU_FOREACH(cpuid) {
 		fpu_ctx = (void *)atomic_swap_ptr(
 		    (volatile void *)DPCPU_ID_PTR(cpuid, pefs_aesni_fpu),
@@ -198,27 +326,89 @@ pefs_aesni_uninit(struct pefs_alg *pa)
 	}
 }
 
+#ifdef __amd64__
+/*
+ * Check if AVX instructions are supported and AVX state is enabled by OS.
+ */
+int
+pefs_aesni_avx_enabled(void)
+{
+	return ((cpu_feature2 & (CPUID2_AVX | CPUID2_OSXSAVE)) ==
+	    (CPUID2_AVX | CPUID2_OSXSAVE) &&
+	    (xsave_mask & XFEATURE_AVX) == XFEATURE_AVX);
+}
+#endif
+
+static void
+pefs_aesni_uninit(struct pefs_alg *pa __unused)
+{
+	pefs_aesni_fpu_uninit();
+}
+
+#ifdef PEFS_VAES
+static void
+pefs_vaes_init(void)
+{
+	u_long enable = 1;
+
+	TUNABLE_ULONG_FETCH(VAES_ENABLE_ENV, &enable);
+
+	if (enable != 0 && pefs_aesni_avx_enabled() &&
+	    (cpu_stdext_feature & CPUID_STDEXT_AVX2) != 0 &&
+	    (cpu_stdext_feature2 & CPUID_STDEXT2_VAES) != 0) {
+		printf("pefs: VAES hardware acceleration enabled\n");
+		pefs_aesni_encrypt_ecb = pefs_vaes_encrypt_ecb;
+		pefs_aesni_decrypt_ecb = pefs_vaes_decrypt_ecb;
+	} else
+#ifndef PEFS_DEBUG
+	if (bootverbose)
+#endif
+		printf("pefs: VAES hardware acceleration disabled\n");
+}
+#endif
+
+#ifdef PEFS_SIMD
+/*
+ * Called by all algorithms using AESNI sessions, AVX2 state is enabled by
+ * OS if AVX is.
+ */
+void
+pefs_aesni_simd_init(void)
+{
+	if (pefs_aesni_avx_enabled() &&
+	    (cpu_stdext_feature & CPUID_STDEXT_AVX2) != 0)
+		pefs_aesni_simd_iszero = pefs_simd_iszero_avx2;
+	else
+		pefs_aesni_simd_iszero = pefs_simd_iszero_sse2;
+}
+#endif
+
 void
 pefs_aesni_init(struct pefs_alg *pa)
 {
-	struct fpu_kern_ctx *fpu_ctx;
 	u_long enable = 1;
-	u_int cpuid;
 
 	TUNABLE_ULONG_FETCH(AESNI_ENABLE_ENV, &enable);
 
 	if (enable != 0 && (cpu_feature2 & CPUID2_AESNI) != 0) {
 		printf("pefs: AESNI hardware acceleration enabled\n");
+		pefs_aesni_sw_ct = pefs_aes_ct_enabled();
 		pa->pa_uninit = pefs_aesni_uninit;
 		pa->pa_enter = pefs_aesni_enter;
 		pa->pa_leave = pefs_aesni_leave;
 		pa->pa_keysetup = pefs_aesni_keysetup;
 		pa->pa_encrypt = pefs_aesni_encrypt;
 		pa->pa_decrypt = pefs_aesni_decrypt;
-		CPU_FOREACH(cpuid) {
-			fpu_ctx = fpu_kern_alloc_ctx(FPU_KERN_NORMAL);
-			DPCPU_ID_SET(cpuid, pefs_aesni_fpu, fpu_ctx);
-		}
+		pa->pa_encrypt_blocks = pefs_aesni_encrypt_blocks;
+		pa->pa_decrypt_blocks = pefs_aesni_decrypt_blocks;
+#ifdef PEFS_SIMD
+		pa->pa_iszero = pefs_aesni_iszero;
+		pefs_aesni_simd_init();
+#endif
+#ifdef PEFS_VAES
+		pefs_vaes_init();
+#endif
+		pefs_aesni_fpu_init();
 	} else
 #ifndef PEFS_DEBUG
 	if (bootverbose)
@@ -34,7 +34,10 @@ struct pefs_aesni_ctx {
 	uint8_t enc_schedule[AES_SCHED_LEN] __aligned(16);
 	uint8_t dec_schedule[AES_SCHED_LEN] __aligned(16);
 	int			rounds;
-	rijndael_ctx		sw;
+	union {
+		rijndael_ctx		table;
+		struct pefs_aes_ct_ctx	ct;
+	} sw;
 };
 
 struct pefs_aesni_ses {
@@ -44,4 +47,42 @@ struct pefs_aesni_ses {
 	int			fpu_saved;
 };
 
+#ifdef PEFS_CAMELLIA_AVX
+/*
+ * Subkeys of camellia_set_key() rearranged for byte-sliced implementation.
+ * kw[0] is XORed to the left half before the first round and kw[1] to the
+ * right half after the last one, round keys are XORed to F-function output.
+ */
+struct pefs_camellia_aesni_sched {
+	uint64_t		kw[2];
+	uint64_t		k[24];
+	uint64_t		ke[6];
+};
+
+struct pefs_camellia_aesni_ctx {
+	struct pefs_camellia_aesni_sched enc;
+	struct pefs_camellia_aesni_sched dec;
+	int			rounds;
+	camellia_ctx		sw;
+};
+
+void	pefs_camellia_avx_crypt(const struct pefs_camellia_aesni_sched *ks,
+	    int rounds, const uint8_t *in, uint8_t *out, size_t nblocks);
+#endif
+
+typedef void	pefs_aesni_ecb_t(int rounds, const void *key_schedule,
+	    size_t len, const uint8_t *from, uint8_t *to);
+
+#ifdef PEFS_VAES
+pefs_aesni_ecb_t	pefs_vaes_encrypt_ecb;
+pefs_aesni_ecb_t	pefs_vaes_decrypt_ecb;
+#endif
+
+#ifdef PEFS_SIMD
+typedef int	pefs_simd_iszero_t(const void *buf, size_t len);
+
+pefs_simd_iszero_t	pefs_simd_iszero_sse2;
+pefs_simd_iszero_t	pefs_simd_iszero_avx2;
+#endif
+
 #endif
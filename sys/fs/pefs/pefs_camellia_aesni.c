@@ -0,0 +1,263 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/proc.h>
+#include <sys/systm.h>
+#include <machine/md_var.h>
+#include <machine/specialreg.h>
+
+#include <fs/pefs/pefs_crypto.h>
+
+#define	CAMELLIA_AESNI_ENABLE_ENV	"vfs.pefs.camellia_aesni_enable"
+
+#define	CAMELLIA_BLOCK_LEN		16
+
+#define	CAMELLIA_SUBKEY(sw, i)						\
+	((uint64_t)(sw)->subkey[(i) * 2] << 32 | (sw)->subkey[(i) * 2 + 1])
+
+/*
+ * Round key pair (kl, kr) of camellia.c is applied in the middle of
+ * P-function by CAMELLIA_ROUNDSM.  Return value it XORs to F-function
+ * output: (kl ^ kr, (kl >>> 8) ^ kl ^ kr).
+ */
+static uint64_t
+camellia_aesni_round_key(const camellia_ctx *sw, int i)
+{
+	uint32_t kl, kr, l;
+
+	kl = sw->subkey[i * 2];
+	kr = sw->subkey[i * 2 + 1];
+	l = kl ^ kr;
+	return ((uint64_t)l << 32 | (((kl >> 8) | (kl << 24)) ^ l));
+}
+
+/*
+ * Rearrange subkeys computed by camellia_set_key().  Whitening keys and
+ * round keys there are combined ("absorbed"), so that every round XORs key
+ * to F-function output instead of input, only left half is XORed with key
+ * before first round and right half after last round.  Subkey slots:
+ *	0			pre-whitening
+ *	2-7, 10-15, 18-23, 26-31	rounds
+ *	8-9, 16-17, 24-25	FL and FL^-1 after every 6 rounds
+ *	24 or 32		post-whitening
+ */
+static void
+camellia_aesni_schedule(struct pefs_camellia_aesni_ctx *ctx)
+{
+	const camellia_ctx *sw = &ctx->sw;
+	struct pefs_camellia_aesni_sched *ks = &ctx->enc;
+	struct pefs_camellia_aesni_sched *dks = &ctx->dec;
+	int i, nke;
+
+	ctx->rounds = (sw->bits == 128) ? 18 : 24;
+	nke = ctx->rounds / 3 - 2;
+
+	ks->kw[0] = CAMELLIA_SUBKEY(sw, 0);
+	ks->kw[1] = CAMELLIA_SUBKEY(sw, ctx->rounds + ctx->rounds / 3);
+	for (i = 0; i < ctx->rounds; i++)
+		ks->k[i] = camellia_aesni_round_key(sw, 2 + i + i / 6 * 2);
+	for (i = 0; i < nke; i++)
+		ks->ke[i] = CAMELLIA_SUBKEY(sw, 8 + i / 2 * 8 + i % 2);
+
+	/* Decryption uses subkeys in reverse order. */
+	dks->kw[0] = ks->kw[1];
+	dks->kw[1] = ks->kw[0];
+	for (i = 0; i < ctx->rounds; i++)
+		dks->k[i] = ks->k[ctx->rounds - 1 - i];
+	for (i = 0; i < nke; i++)
+		dks->ke[i] = ks->ke[nke - 1 - i];
+}
+
+#undef CAMELLIA_SUBKEY
+
+/*
+ * Key schedule layout is internal to camellia.c, check that byte-sliced
+ * implementation produces the same results before enabling it.
+ */
+static int
+camellia_aesni_selftest(void)
+{
+	struct pefs_camellia_aesni_ctx *ctx;
+	struct fpu_kern_ctx *fpu_ctx;
+	uint8_t key[32], exp[CAMELLIA_BLOCK_LEN], out[CAMELLIA_BLOCK_LEN];
+	int i, keybits, error;
+
+	for (i = 0; i < (int)sizeof(key); i++)
+		key[i] = i * 0x11;
+
+	fpu_ctx = fpu_kern_alloc_ctx(FPU_KERN_NORMAL);
+	if (fpu_ctx == NULL)
+		return (0);
+	ctx = malloc(sizeof(*ctx), M_TEMP, M_WAITOK | M_ZERO);
+	fpu_kern_enter(curthread, fpu_ctx, FPU_KERN_NORMAL);
+	error = 0;
+	for (keybits = 128; keybits <= 256 && error == 0; keybits += 64) {
+		camellia_set_key(&ctx->sw, key, keybits);
+		camellia_aesni_schedule(ctx);
+		camellia_encrypt(&ctx->sw, key, exp);
+		pefs_camellia_avx_crypt(&ctx->enc, ctx->rounds, key, out, 1);
+		if (memcmp(out, exp, CAMELLIA_BLOCK_LEN) != 0)
+			error = 1;
+		pefs_camellia_avx_crypt(&ctx->dec, ctx->rounds, exp, out, 1);
+		if (memcmp(out, key, CAMELLIA_BLOCK_LEN) != 0)
+			error = 1;
+	}
+	fpu_kern_leave(curthread, fpu_ctx);
+	fpu_kern_free_ctx(fpu_ctx);
+	explicit_bzero(ctx, sizeof(*ctx));
+	free(ctx, M_TEMP);
+
+	return (error == 0);
+}
+
+static int
+pefs_camellia_aesni_keysetup(const struct pefs_session *xses __unused,
+    struct pefs_ctx *xctx, const uint8_t *key, uint32_t keybits)
+{
+	struct pefs_camellia_aesni_ctx *ctx = &xctx->o.pctx_camellia_aesni;
+
+	switch (keybits) {
+	case 128:
+	case 192:
+	case 256:
+		break;
+	default:
+		printf("pefs: Camellia AESNI: invalid key length: %d",
+		    keybits);
+		return (EINVAL);
+	}
+
+	camellia_set_key(&ctx->sw, key, keybits);
+	camellia_aesni_schedule(ctx);
+
+	return (0);
+}
+
+/*
+ * Single block operations are used for XTS tweak and are not worth
+ * switching to byte-sliced representation.
+ */
+static void
+pefs_camellia_aesni_encrypt(const struct pefs_session *xses __unused,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out)
+{
+	camellia_encrypt(&xctx->o.pctx_camellia_aesni.sw, in, out);
+}
+
+static void
+pefs_camellia_aesni_decrypt(const struct pefs_session *xses __unused,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out)
+{
+	camellia_decrypt(&xctx->o.pctx_camellia_aesni.sw, in, out);
+}
+
+static void
+pefs_camellia_aesni_encrypt_blocks(const struct pefs_session *xses,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	const struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
+	const struct pefs_camellia_aesni_ctx *ctx =
+	    &xctx->o.pctx_camellia_aesni;
+
+	if (ses->fpu_saved >= 0) {
+		pefs_camellia_avx_crypt(&ctx->enc, ctx->rounds, in, out,
+		    nblocks);
+		return;
+	}
+	for (; nblocks > 0; nblocks--) {
+		camellia_encrypt(&ctx->sw, in, out);
+		in += CAMELLIA_BLOCK_LEN;
+		out += CAMELLIA_BLOCK_LEN;
+	}
+}
+
+static void
+pefs_camellia_aesni_decrypt_blocks(const struct pefs_session *xses,
+    const struct pefs_ctx *xctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	const struct pefs_aesni_ses *ses = &xses->o.ps_aesni;
+	const struct pefs_camellia_aesni_ctx *ctx =
+	    &xctx->o.pctx_camellia_aesni;
+
+	if (ses->fpu_saved >= 0) {
+		pefs_camellia_avx_crypt(&ctx->dec, ctx->rounds, in, out,
+		    nblocks);
+		return;
+	}
+	for (; nblocks > 0; nblocks--) {
+		camellia_decrypt(&ctx->sw, in, out);
+		in += CAMELLIA_BLOCK_LEN;
+		out += CAMELLIA_BLOCK_LEN;
+	}
+}
+
+static void
+pefs_camellia_aesni_uninit(struct pefs_alg *pa __unused)
+{
+	pefs_aesni_fpu_uninit();
+}
+
+void
+pefs_camellia_aesni_init(struct pefs_alg *pa)
+{
+	u_long enable = 1;
+
+	TUNABLE_ULONG_FETCH(CAMELLIA_AESNI_ENABLE_ENV, &enable);
+
+	if (enable != 0 &&
+	    (cpu_feature2 & (CPUID2_AESNI | CPUID2_SSSE3)) ==
+	    (CPUID2_AESNI | CPUID2_SSSE3) && pefs_aesni_avx_enabled() &&
+	    camellia_aesni_selftest()) {
+		printf("pefs: Camellia AESNI/AVX acceleration enabled\n");
+		pefs_aesni_fpu_init();
+		pa->pa_uninit = pefs_camellia_aesni_uninit;
+		pa->pa_enter = pefs_aesni_enter;
+		pa->pa_leave = pefs_aesni_leave;
+		pa->pa_keysetup = pefs_camellia_aesni_keysetup;
+		pa->pa_encrypt = pefs_camellia_aesni_encrypt;
+		pa->pa_decrypt = pefs_camellia_aesni_decrypt;
+		pa->pa_encrypt_blocks = pefs_camellia_aesni_encrypt_blocks;
+		pa->pa_decrypt_blocks = pefs_camellia_aesni_decrypt_blocks;
+#ifdef PEFS_SIMD
+		pa->pa_iszero = pefs_aesni_iszero;
+		pefs_aesni_simd_init();
+#endif
+	} else
+#ifndef PEFS_DEBUG
+	if (bootverbose)
+#endif
+		printf("pefs: Camellia AESNI/AVX acceleration disabled\n");
+}
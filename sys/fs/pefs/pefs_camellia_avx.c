@@ -0,0 +1,318 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include <crypto/camellia/camellia.h>
+#include <crypto/rijndael/rijndael.h>
+
+#include <fs/pefs/pefs_aes_ct.h>
+#include <fs/pefs/pefs_aesni.h>
+
+#include <immintrin.h>
+
+/*
+ * Byte-sliced Camellia processing 16 blocks in parallel.  Register i holds
+ * byte i of all 16 blocks.  Camellia s1 is affine equivalent to AES S-box:
+ *	s1(x) = A2(S(A1(x)))
+ * S-box is computed with AESENCLAST using zero round key, affine
+ * transformations are applied with PSHUFB on nibbles.  s2, s3 and s4 are
+ * derived from s1 by rotating output (s2, s3) or input (s4) of affine
+ * transformations.
+ */
+
+#define	CAM_BLOCK_LEN		16
+#define	CAM_PARALLEL		16
+
+#define	CAM_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)	\
+	_mm_setr_epi8(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p)
+
+struct cam_sbox_tf {
+	__m128i		pre_lo;
+	__m128i		pre_hi;
+	__m128i		post_lo;
+	__m128i		post_hi;
+};
+
+struct cam_consts {
+	struct cam_sbox_tf s1, s2, s3, s4;
+	__m128i		inv_shift_rows;
+	__m128i		mask_0f;
+	__m128i		mask_01;
+};
+
+static __inline void
+cam_consts_init(struct cam_consts *c)
+{
+	__m128i pre_lo_s1, pre_hi_s1, pre_lo_s4, pre_hi_s4;
+	__m128i post_lo_s1, post_hi_s1;
+
+	pre_lo_s1 = CAM_TABLE(0x45, 0xe8, 0x40, 0xed, 0x2e, 0x83, 0x2b, 0x86,
+	    0x4b, 0xe6, 0x4e, 0xe3, 0x20, 0x8d, 0x25, 0x88);
+	pre_hi_s1 = CAM_TABLE(0x00, 0x51, 0xf1, 0xa0, 0x8a, 0xdb, 0x7b, 0x2a,
+	    0x09, 0x58, 0xf8, 0xa9, 0x83, 0xd2, 0x72, 0x23);
+	pre_lo_s4 = CAM_TABLE(0x45, 0x40, 0x2e, 0x2b, 0x4b, 0x4e, 0x20, 0x25,
+	    0x14, 0x11, 0x7f, 0x7a, 0x1a, 0x1f, 0x71, 0x74);
+	pre_hi_s4 = CAM_TABLE(0x00, 0xf1, 0x8a, 0x7b, 0x09, 0xf8, 0x83, 0x72,
+	    0xad, 0x5c, 0x27, 0xd6, 0xa4, 0x55, 0x2e, 0xdf);
+	post_lo_s1 = CAM_TABLE(0x3c, 0xcc, 0xcf, 0x3f, 0x32, 0xc2, 0xc1, 0x31,
+	    0xdc, 0x2c, 0x2f, 0xdf, 0xd2, 0x22, 0x21, 0xd1);
+	post_hi_s1 = CAM_TABLE(0x00, 0xf9, 0x86, 0x7f, 0xd7, 0x2e, 0x51, 0xa8,
+	    0xa4, 0x5d, 0x22, 0xdb, 0x73, 0x8a, 0xf5, 0x0c);
+
+	c->s1.pre_lo = pre_lo_s1;
+	c->s1.pre_hi = pre_hi_s1;
+	c->s1.post_lo = post_lo_s1;
+	c->s1.post_hi = post_hi_s1;
+
+	/* s2(x) = s1(x) <<< 1 */
+	c->s2.pre_lo = pre_lo_s1;
+	c->s2.pre_hi = pre_hi_s1;
+	c->s2.post_lo = CAM_TABLE(0x78, 0x99, 0x9f, 0x7e, 0x64, 0x85, 0x83,
+	    0x62, 0xb9, 0x58, 0x5e, 0xbf, 0xa5, 0x44, 0x42, 0xa3);
+	c->s2.post_hi = CAM_TABLE(0x00, 0xf3, 0x0d, 0xfe, 0xaf, 0x5c, 0xa2,
+	    0x51, 0x49, 0xba, 0x44, 0xb7, 0xe6, 0x15, 0xeb, 0x18);
+
+	/* s3(x) = s1(x) >>> 1 */
+	c->s3.pre_lo = pre_lo_s1;
+	c->s3.pre_hi = pre_hi_s1;
+	c->s3.post_lo = CAM_TABLE(0x1e, 0x66, 0xe7, 0x9f, 0x19, 0x61, 0xe0,
+	    0x98, 0x6e, 0x16, 0x97, 0xef, 0x69, 0x11, 0x90, 0xe8);
+	c->s3.post_hi = CAM_TABLE(0x00, 0xfc, 0x43, 0xbf, 0xeb, 0x17, 0xa8,
+	    0x54, 0x52, 0xae, 0x11, 0xed, 0xb9, 0x45, 0xfa, 0x06);
+
+	/* s4(x) = s1(x <<< 1) */
+	c->s4.pre_lo = pre_lo_s4;
+	c->s4.pre_hi = pre_hi_s4;
+	c->s4.post_lo = post_lo_s1;
+	c->s4.post_hi = post_hi_s1;
+
+	c->inv_shift_rows = CAM_TABLE(0, 13, 10, 7, 4, 1, 14, 11,
+	    8, 5, 2, 15, 12, 9, 6, 3);
+	c->mask_0f = _mm_set1_epi8(0x0f);
+	c->mask_01 = _mm_set1_epi8(0x01);
+}
+
+static __inline __m128i
+cam_filter(__m128i x, __m128i lo, __m128i hi, __m128i mask_0f)
+{
+	__m128i l, h;
+
+	l = _mm_and_si128(x, mask_0f);
+	h = _mm_and_si128(_mm_srli_epi16(x, 4), mask_0f);
+	return (_mm_xor_si128(_mm_shuffle_epi8(lo, l),
+	    _mm_shuffle_epi8(hi, h)));
+}
+
+static __inline __m128i
+cam_sbox(__m128i x, const struct cam_sbox_tf *tf, const struct cam_consts *c)
+{
+	x = cam_filter(x, tf->pre_lo, tf->pre_hi, c->mask_0f);
+	x = _mm_shuffle_epi8(x, c->inv_shift_rows);
+	x = _mm_aesenclast_si128(x, _mm_setzero_si128());
+	return (cam_filter(x, tf->post_lo, tf->post_hi, c->mask_0f));
+}
+
+static __inline __m128i
+cam_key_byte(uint64_t k, int i)
+{
+	return (_mm_set1_epi8((char)(k >> (56 - i * 8))));
+}
+
+/*
+ * dst ^= P(S(src)) ^ k
+ *
+ * Round key is XORed to F-function output, see camellia_aesni_schedule().
+ */
+static __inline void
+cam_f(const __m128i *src, __m128i *dst, uint64_t k,
+    const struct cam_consts *c)
+{
+	__m128i y0, y1, y2, y3, y4, y5, y6, y7;
+	__m128i t;
+	int i;
+
+	y0 = cam_sbox(src[0], &c->s1, c);
+	y1 = cam_sbox(src[1], &c->s2, c);
+	y2 = cam_sbox(src[2], &c->s3, c);
+	y3 = cam_sbox(src[3], &c->s4, c);
+	y4 = cam_sbox(src[4], &c->s2, c);
+	y5 = cam_sbox(src[5], &c->s3, c);
+	y6 = cam_sbox(src[6], &c->s4, c);
+	y7 = cam_sbox(src[7], &c->s1, c);
+
+	for (i = 0; i < 8; i++)
+		dst[i] = _mm_xor_si128(dst[i], cam_key_byte(k, i));
+
+	/* P-function */
+	t = _mm_xor_si128(y0, _mm_xor_si128(y6, y7));
+	dst[0] = _mm_xor_si128(dst[0], _mm_xor_si128(t,
+	    _mm_xor_si128(y2, _mm_xor_si128(y3, y5))));
+	dst[4] = _mm_xor_si128(dst[4], _mm_xor_si128(t,
+	    _mm_xor_si128(y1, y5)));
+	t = _mm_xor_si128(y1, _mm_xor_si128(y4, y7));
+	dst[1] = _mm_xor_si128(dst[1], _mm_xor_si128(t,
+	    _mm_xor_si128(y0, _mm_xor_si128(y3, y6))));
+	dst[5] = _mm_xor_si128(dst[5], _mm_xor_si128(t,
+	    _mm_xor_si128(y2, y6)));
+	t = _mm_xor_si128(y2, _mm_xor_si128(y5, y4));
+	dst[2] = _mm_xor_si128(dst[2], _mm_xor_si128(t,
+	    _mm_xor_si128(y0, _mm_xor_si128(y1, y7))));
+	dst[6] = _mm_xor_si128(dst[6], _mm_xor_si128(t,
+	    _mm_xor_si128(y3, y7)));
+	t = _mm_xor_si128(y3, _mm_xor_si128(y5, y6));
+	dst[3] = _mm_xor_si128(dst[3], _mm_xor_si128(t,
+	    _mm_xor_si128(y1, _mm_xor_si128(y2, y4))));
+	dst[7] = _mm_xor_si128(dst[7], _mm_xor_si128(t,
+	    _mm_xor_si128(y0, y4)));
+}
+
+/*
+ * Rotate byte-sliced 32-bit words x[0..3] (x[0] is the most significant
+ * byte) left by one bit.
+ */
+static __inline void
+cam_rol32_1(__m128i *x, const struct cam_consts *c)
+{
+	__m128i carry[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		carry[i] = _mm_and_si128(_mm_srli_epi16(x[i], 7), c->mask_01);
+	for (i = 0; i < 4; i++)
+		x[i] = _mm_or_si128(_mm_add_epi8(x[i], x[i]),
+		    carry[(i + 1) % 4]);
+}
+
+/*
+ * FL on bytes x[0..7] and FL^-1 on bytes x[8..15].
+ */
+static __inline void
+cam_fl(__m128i *x, uint64_t kl, uint64_t klinv, const struct cam_consts *c)
+{
+	__m128i t[4];
+	int i;
+
+	/* XR ^= (XL & klL) <<< 1; XL ^= XR | klR */
+	for (i = 0; i < 4; i++)
+		t[i] = _mm_and_si128(x[i], cam_key_byte(kl, i));
+	cam_rol32_1(t, c);
+	for (i = 0; i < 4; i++)
+		x[4 + i] = _mm_xor_si128(x[4 + i], t[i]);
+	for (i = 0; i < 4; i++)
+		x[i] = _mm_xor_si128(x[i],
+		    _mm_or_si128(x[4 + i], cam_key_byte(kl, 4 + i)));
+
+	/* YL ^= YR | klR; YR ^= (YL & klL) <<< 1 */
+	for (i = 0; i < 4; i++)
+		x[8 + i] = _mm_xor_si128(x[8 + i],
+		    _mm_or_si128(x[12 + i], cam_key_byte(klinv, 4 + i)));
+	for (i = 0; i < 4; i++)
+		t[i] = _mm_and_si128(x[8 + i], cam_key_byte(klinv, i));
+	cam_rol32_1(t, c);
+	for (i = 0; i < 4; i++)
+		x[12 + i] = _mm_xor_si128(x[12 + i], t[i]);
+}
+
+/*
+ * Transpose 16x16 byte matrix.  Each pass is a perfect shuffle of
+ * (row, column) index bits, four passes swap rows and columns.
+ */
+static __inline void
+cam_transpose(__m128i *x)
+{
+	__m128i t[CAM_PARALLEL];
+	int i, pass;
+
+	for (pass = 0; pass < 4; pass++) {
+		for (i = 0; i < CAM_PARALLEL / 2; i++) {
+			t[i * 2] = _mm_unpacklo_epi8(x[i],
+			    x[i + CAM_PARALLEL / 2]);
+			t[i * 2 + 1] = _mm_unpackhi_epi8(x[i],
+			    x[i + CAM_PARALLEL / 2]);
+		}
+		for (i = 0; i < CAM_PARALLEL; i++)
+			x[i] = t[i];
+	}
+}
+
+static void
+cam_crypt16(const struct pefs_camellia_aesni_sched *ks, int rounds,
+    __m128i *x, const struct cam_consts *c)
+{
+	__m128i t;
+	int i, r;
+
+	cam_transpose(x);
+
+	for (i = 0; i < 8; i++)
+		x[i] = _mm_xor_si128(x[i], cam_key_byte(ks->kw[0], i));
+
+	for (r = 0; r < rounds; r += 2) {
+		if (r != 0 && r % 6 == 0)
+			cam_fl(x, ks->ke[r / 3 - 2], ks->ke[r / 3 - 1], c);
+		cam_f(x, x + 8, ks->k[r], c);
+		cam_f(x + 8, x, ks->k[r + 1], c);
+	}
+
+	for (i = 0; i < 8; i++) {
+		t = x[i];
+		x[i] = _mm_xor_si128(x[8 + i], cam_key_byte(ks->kw[1], i));
+		x[8 + i] = t;
+	}
+
+	cam_transpose(x);
+}
+
+void
+pefs_camellia_avx_crypt(const struct pefs_camellia_aesni_sched *ks,
+    int rounds, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+	struct cam_consts c;
+	__m128i x[CAM_PARALLEL];
+	size_t i, n;
+
+	cam_consts_init(&c);
+
+	for (; nblocks > 0; nblocks -= n) {
+		n = MIN(nblocks, CAM_PARALLEL);
+		for (i = 0; i < n; i++)
+			x[i] = _mm_loadu_si128((const __m128i *)in + i);
+		for (; i < CAM_PARALLEL; i++)
+			x[i] = _mm_setzero_si128();
+		cam_crypt16(ks, rounds, x, &c);
+		for (i = 0; i < n; i++)
+			_mm_storeu_si128((__m128i *)out + i, x[i]);
+		in += n * CAM_BLOCK_LEN;
+		out += n * CAM_BLOCK_LEN;
+	}
+}
@@ -31,13 +31,20 @@ __FBSDID("$FreeBSD$");
 #include <sys/systm.h>
 #include <sys/dirent.h>
 #include <sys/endian.h>
+#include <sys/kernel.h>
 #include <sys/lock.h>
 #include <sys/libkern.h>
 #include <sys/limits.h>
 #include <sys/malloc.h>
 #include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/priority.h>
 #include <sys/refcount.h>
 #include <sys/queue.h>
+#include <sys/smp.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+#include <sys/uio.h>
 #include <sys/vnode.h>
 #include <vm/uma.h>
 
@@ -47,12 +54,42 @@ __FBSDID("$FreeBSD$");
 #include <fs/pefs/pefs_crypto.h>
 
 #define	PEFS_NAME_KEY_BITS	128
+#define	PEFS_NAME_BATCH_BLOCKS	32
+#define	PEFS_NAME_HINT_SIZE	2
+
+#define	CRYPTO_THREADS_ENV	"vfs.pefs.crypto.threads"
+#define	CRYPTO_MAXJOBS		8
+#define	CRYPTO_MINJOB		(4 * PEFS_SECTOR_SIZE)
+
+struct pefs_crypto_req {
+	struct pefs_tkey	*pcr_tkey;
+	int			pcr_encrypt;
+	u_int			pcr_pending;
+	u_long			pcr_holes;
+	u_long			pcr_sectors;
+};
+
+struct pefs_crypto_job {
+	struct task		pcj_task;
+	struct pefs_crypto_req	*pcj_req;
+	off_t			pcj_offset;
+	char			*pcj_buf;
+	size_t			pcj_size;
+};
+
+struct pefs_crypto_async {
+	struct pefs_crypto_req	pca_req;
+	struct pefs_crypto_job	pca_job;
+};
 
 CTASSERT(PEFS_KEY_SIZE <= SHA512_DIGEST_LENGTH);
 CTASSERT(PEFS_TWEAK_SIZE == 64/8);
 CTASSERT(PEFS_NAME_CSUM_SIZE <= sizeof(uint64_t));
 CTASSERT(MAXNAMLEN >= PEFS_NAME_PTON_SIZE(MAXNAMLEN) + PEFS_NAME_BLOCK_SIZE);
+CTASSERT(PEFS_NAME_BATCH_BLOCKS * PEFS_NAME_BLOCK_SIZE >=
+    PEFS_NAME_PTON_SIZE(MAXNAMLEN));
 
+static algop_init_t pefs_aes_init;
 static algop_keysetup_t pefs_aes_keysetup;
 static algop_crypt_t pefs_aes_encrypt;
 static algop_crypt_t pefs_aes_decrypt;
@@ -63,14 +100,32 @@ static algop_crypt_t pefs_camellia_decrypt;
 
 static uma_zone_t		pefs_ctx_zone;
 static uma_zone_t		pefs_key_zone;
+static uma_zone_t		pefs_async_zone;
 
 static const char		magic_keyinfo_v1[] = "PEFSKEY-V1";
 
+static struct taskqueue		*pefs_crypto_tq;
+static struct mtx		pefs_crypto_mtx;
+
+SYSCTL_NODE(_vfs_pefs, OID_AUTO, crypto, CTLFLAG_RW, 0,
+    "PEFS data encryption");
+
+static int	pefs_crypto_threads = -1;
+SYSCTL_INT(_vfs_pefs_crypto, OID_AUTO, threads, CTLFLAG_RD,
+    &pefs_crypto_threads, 0, "Number of worker threads");
+
+static u_long	pefs_crypto_parallel_min = 64 * 1024;
+SYSCTL_ULONG(_vfs_pefs_crypto, OID_AUTO, parallel_min, CTLFLAG_RW,
+    &pefs_crypto_parallel_min, 0,
+    "Minimal chunk size to process by worker threads, 0 to disable");
+
+static u_long	pefs_crypto_parallel;
+SYSCTL_ULONG(_vfs_pefs_crypto, OID_AUTO, parallel, CTLFLAG_RD,
+    &pefs_crypto_parallel, 0, "Number of chunks processed in parallel");
+
 static struct pefs_alg pefs_alg_aes = {
 	.pa_id =		PEFS_ALG_AES_XTS,
-#ifdef PEFS_AESNI
-	.pa_init =		pefs_aesni_init,
-#endif
+	.pa_init =		pefs_aes_init,
 	.pa_keysetup =		pefs_aes_keysetup,
 	.pa_encrypt =		pefs_aes_encrypt,
 	.pa_decrypt =		pefs_aes_decrypt,
@@ -78,6 +133,9 @@ static struct pefs_alg pefs_alg_aes = {
 
 static struct pefs_alg pefs_alg_camellia = {
 	.pa_id =		PEFS_ALG_CAMELLIA_XTS,
+#ifdef PEFS_CAMELLIA_AVX
+	.pa_init =		pefs_camellia_aesni_init,
+#endif
 	.pa_keysetup =		pefs_camellia_keysetup,
 	.pa_encrypt =		pefs_camellia_encrypt,
 	.pa_decrypt =		pefs_camellia_decrypt,
@@ -104,17 +162,37 @@ pefs_crypto_init(void)
 	    NULL, pefs_zone_dtor_bzero, NULL, NULL, UMA_ALIGN_CACHE, 0);
 	pefs_key_zone = uma_zcreate("pefs_key", sizeof(struct pefs_key),
 	    NULL, pefs_zone_dtor_bzero, NULL, NULL, UMA_ALIGN_PTR, 0);
+	pefs_async_zone = uma_zcreate("pefs_crypto_async",
+	    sizeof(struct pefs_crypto_async), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
 	pefs_alg_init(&pefs_alg_aes);
 	pefs_alg_init(&pefs_alg_camellia);
+
+	TUNABLE_INT_FETCH(CRYPTO_THREADS_ENV, &pefs_crypto_threads);
+	if (pefs_crypto_threads < 0)
+		pefs_crypto_threads = (mp_ncpus > 1 ? mp_ncpus : 0);
+	mtx_init(&pefs_crypto_mtx, "pefs_crypto_mtx", NULL, MTX_DEF);
+	if (pefs_crypto_threads > 0) {
+		pefs_crypto_tq = taskqueue_create("pefs_crypto", M_WAITOK,
+		    taskqueue_thread_enqueue, &pefs_crypto_tq);
+		taskqueue_start_threads(&pefs_crypto_tq, pefs_crypto_threads,
+		    PRIBIO, "pefs crypto");
+	}
 }
 
 void
 pefs_crypto_uninit(void)
 {
+	if (pefs_crypto_tq != NULL) {
+		taskqueue_free(pefs_crypto_tq);
+		pefs_crypto_tq = NULL;
+	}
+	mtx_destroy(&pefs_crypto_mtx);
 	pefs_alg_uninit(&pefs_alg_aes);
 	pefs_alg_uninit(&pefs_alg_camellia);
 	uma_zdestroy(pefs_ctx_zone);
 	uma_zdestroy(pefs_key_zone);
+	uma_zdestroy(pefs_async_zone);
 }
 
 struct pefs_ctx *
@@ -172,6 +250,8 @@ pefs_key_wipe(struct pefs_key *pk)
 {
 	bzero(pk->pk_name_ctx, sizeof(struct pefs_ctx));
 	bzero(pk->pk_name_csum_ctx, sizeof(struct pefs_ctx));
+	if (pk->pk_name_tweak_ctx != NULL)
+		bzero(pk->pk_name_tweak_ctx, sizeof(struct pefs_ctx));
 	bzero(pk->pk_data_ctx, sizeof(struct pefs_ctx));
 	bzero(pk->pk_tweak_ctx, sizeof(struct pefs_ctx));
 }
@@ -225,6 +305,15 @@ pefs_key_generate(struct pefs_key *pk, const uint8_t *masterkey,
 	pefs_hkdf_expand(ctx, masterkey, key, 4, magic, magicsize);
 	vmac_set_key(key, &pk->pk_name_csum_ctx->o.pctx_vmac);
 
+	pefs_hkdf_expand(ctx, masterkey, key, 5, magic, magicsize);
+	pk->pk_namehint = le16dec(key);
+
+	if (pk->pk_name_tweak_ctx != NULL) {
+		pefs_hkdf_expand(ctx, masterkey, key, 6, magic, magicsize);
+		hmac_sha512_init(&pk->pk_name_tweak_ctx->o.pctx_hmac, key,
+		    PEFS_KEY_SIZE);
+	}
+
 out:
 	if (error != 0)
 		pefs_key_wipe(pk);
@@ -241,6 +330,10 @@ pefs_key_get(int alg, int keybits, const char *key, const char *keyid)
 
 	pk = uma_zalloc(pefs_key_zone, M_WAITOK | M_ZERO);
 
+	if ((alg & PEFS_ALG_DETNAME) != 0)
+		pk->pk_flags |= PEFS_KEY_DETNAME;
+	alg &= PEFS_ALG_MASK;
+
 	switch (alg) {
 	case PEFS_ALG_AES_XTS:
 		pk->pk_alg = &pefs_alg_aes;
@@ -272,6 +365,8 @@ pefs_key_get(int alg, int keybits, const char *key, const char *keyid)
 	pk->pk_name_csum_ctx = pefs_ctx_get();
 	pk->pk_data_ctx = pefs_ctx_get();
 	pk->pk_tweak_ctx = pefs_ctx_get();
+	if ((pk->pk_flags & PEFS_KEY_DETNAME) != 0)
+		pk->pk_name_tweak_ctx = pefs_ctx_get();
 
 	pefs_key_generate(pk, key, magic_keyinfo_v1, sizeof(magic_keyinfo_v1));
 
@@ -296,6 +391,8 @@ pefs_key_release(struct pefs_key *pk)
 		pefs_ctx_free(pk->pk_name_csum_ctx);
 		pefs_ctx_free(pk->pk_data_ctx);
 		pefs_ctx_free(pk->pk_tweak_ctx);
+		if (pk->pk_name_tweak_ctx != NULL)
+			pefs_ctx_free(pk->pk_name_tweak_ctx);
 		uma_zfree(pefs_key_zone, pk);
 	}
 }
@@ -382,69 +479,400 @@ pefs_key_remove_all(struct pefs_mount *pm)
 	return (n);
 }
 
+/*
+ * Check whether buffer contains only zeros.  Scan 8 words (single cache line
+ * on 64-bit platforms) per iteration and stop on first non-zero line.
+ * Length should be multiple of 8 words.
+ */
+int
+pefs_iszero(const void *buf, size_t len)
+{
+	const u_long *p, *end;
+
+	MPASS(len % (8 * sizeof(u_long)) == 0);
+
+	p = buf;
+	end = p + len / sizeof(u_long);
+	for (; p < end; p += 8) {
+		if ((p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7]) != 0)
+			return (0);
+	}
+	return (1);
+}
+
+static __inline int
+pefs_sector_iszero(const struct pefs_alg *alg, struct pefs_session *ses,
+    const void *buf)
+{
+	if (alg->pa_iszero != NULL)
+		return (alg->pa_iszero(ses, buf, PEFS_SECTOR_SIZE));
+	return (pefs_iszero(buf, PEFS_SECTOR_SIZE));
+}
+
+/*
+ * Check whether chunk sector at given offset contains only zeros.
+ * Incomplete sectors are never treated as zero.
+ */
+int
+pefs_data_iszero(struct pefs_chunk *pc, size_t skip)
+{
+	MPASS((skip & PEFS_SECTOR_MASK) == 0);
+
+	if (pc->pc_size - skip < PEFS_SECTOR_SIZE)
+		return (0);
+	return (pefs_iszero((char *)pc->pc_base + skip, PEFS_SECTOR_SIZE));
+}
+
+static void
+pefs_data_crypt_range(struct pefs_tkey *ptk, int encrypt, off_t offset,
+    char *buf, size_t size, u_long *holesp, u_long *sectorsp)
+{
+	struct pefs_session ses;
+	const struct pefs_alg *alg;
+	char *end;
+	size_t block;
+
+	alg = ptk->ptk_key->pk_alg;
+	pefs_session_enter(alg, &ses);
+	for (end = buf + size; buf < end; buf += block, offset += block) {
+		block = qmin(end - buf, PEFS_SECTOR_SIZE);
+		if (encrypt != 0) {
+			pefs_xts_block_encrypt(alg, &ses,
+			    ptk->ptk_key->pk_tweak_ctx,
+			    ptk->ptk_key->pk_data_ctx, offset, ptk->ptk_tweak,
+			    block, buf, buf);
+			continue;
+		}
+		if (block == PEFS_SECTOR_SIZE &&
+		    pefs_sector_iszero(alg, &ses, buf)) {
+			(*holesp)++;
+			continue;
+		}
+		pefs_xts_block_decrypt(alg, &ses,
+		    ptk->ptk_key->pk_tweak_ctx, ptk->ptk_key->pk_data_ctx,
+		    offset, ptk->ptk_tweak, block, buf, buf);
+		(*sectorsp)++;
+	}
+	pefs_session_leave(alg, &ses);
+}
+
+static void
+pefs_crypto_task(void *arg, int pending __unused)
+{
+	struct pefs_crypto_job *job = arg;
+	struct pefs_crypto_req *req = job->pcj_req;
+	u_long holes, sectors;
+
+	holes = sectors = 0;
+	pefs_data_crypt_range(req->pcr_tkey, req->pcr_encrypt,
+	    job->pcj_offset, job->pcj_buf, job->pcj_size, &holes, &sectors);
+
+	mtx_lock(&pefs_crypto_mtx);
+	req->pcr_holes += holes;
+	req->pcr_sectors += sectors;
+	if (--req->pcr_pending == 0)
+		wakeup(req);
+	mtx_unlock(&pefs_crypto_mtx);
+}
+
+static __inline int
+pefs_crypto_isparallel(size_t size)
+{
+	return (pefs_crypto_tq != NULL && pefs_crypto_parallel_min != 0 &&
+	    size >= pefs_crypto_parallel_min && size >= 2 * CRYPTO_MINJOB);
+}
+
+/*
+ * Split large chunks into sector ranges processed by worker threads.
+ * Calling thread processes the first range and waits for workers to finish.
+ */
+static void
+pefs_data_crypt(struct pefs_tkey *ptk, int encrypt, off_t offset,
+    char *buf, size_t size, u_long *holesp, u_long *sectorsp)
+{
+	struct pefs_crypto_job jobs[CRYPTO_MAXJOBS];
+	struct pefs_crypto_req req;
+	size_t jsize, pos;
+	u_int i, njobs;
+
+	MPASS(ptk->ptk_key != NULL);
+	MPASS((offset & PEFS_SECTOR_MASK) == 0);
+
+	if (!pefs_crypto_isparallel(size)) {
+		pefs_data_crypt_range(ptk, encrypt, offset, buf, size,
+		    holesp, sectorsp);
+		return;
+	}
+
+	njobs = MIN(size / CRYPTO_MINJOB, CRYPTO_MAXJOBS);
+	njobs = MIN(njobs, (u_int)pefs_crypto_threads + 1);
+	jsize = roundup(howmany(size, njobs), PEFS_SECTOR_SIZE);
+
+	req.pcr_tkey = ptk;
+	req.pcr_encrypt = encrypt;
+	req.pcr_holes = 0;
+	req.pcr_sectors = 0;
+	for (i = 0, pos = 0; pos < size; i++, pos += jsize) {
+		jobs[i].pcj_req = &req;
+		jobs[i].pcj_offset = offset + pos;
+		jobs[i].pcj_buf = buf + pos;
+		jobs[i].pcj_size = qmin(jsize, size - pos);
+		TASK_INIT(&jobs[i].pcj_task, 0, pefs_crypto_task, &jobs[i]);
+	}
+	njobs = i;
+	req.pcr_pending = njobs - 1;
+	for (i = 1; i < njobs; i++)
+		taskqueue_enqueue(pefs_crypto_tq, &jobs[i].pcj_task);
+
+	pefs_data_crypt_range(ptk, encrypt, jobs[0].pcj_offset,
+	    jobs[0].pcj_buf, jobs[0].pcj_size, holesp, sectorsp);
+
+	mtx_lock(&pefs_crypto_mtx);
+	while (req.pcr_pending != 0)
+		msleep(&req, &pefs_crypto_mtx, PRIBIO, "pefscr", 0);
+	mtx_unlock(&pefs_crypto_mtx);
+
+	*holesp += req.pcr_holes;
+	*sectorsp += req.pcr_sectors;
+	atomic_add_long(&pefs_crypto_parallel, 1);
+}
+
 void
 pefs_data_encrypt(struct pefs_tkey *ptk, off_t offset, struct pefs_chunk *pc)
+{
+	u_long holes, sectors;
+
+	holes = sectors = 0;
+	pefs_data_crypt(ptk, 1, offset, pc->pc_base, pc->pc_size,
+	    &holes, &sectors);
+}
+
+void
+pefs_data_decrypt(struct pefs_mount *pm, struct pefs_tkey *ptk, off_t offset,
+    struct pefs_chunk *pc)
+{
+	u_long holes, sectors;
+
+	holes = sectors = 0;
+	pefs_data_crypt(ptk, 0, offset, pc->pc_base, pc->pc_size,
+	    &holes, &sectors);
+
+	if (holes != 0)
+		atomic_add_long(&pm->pm_stats.ps_holes, holes);
+	if (sectors != 0)
+		atomic_add_long(&pm->pm_stats.ps_decrypted, sectors);
+}
+
+/*
+ * Start decrypting chunk by a worker thread and return without waiting.
+ * Chunk is decrypted synchronously if there are no worker threads.
+ * pefs_data_decrypt_wait should be called before accessing chunk data.
+ */
+struct pefs_crypto_async *
+pefs_data_decrypt_async(struct pefs_tkey *ptk, off_t offset,
+    struct pefs_chunk *pc)
+{
+	struct pefs_crypto_async *pca;
+
+	MPASS(ptk->ptk_key != NULL);
+	MPASS((offset & PEFS_SECTOR_MASK) == 0);
+
+	pca = uma_zalloc(pefs_async_zone, M_WAITOK);
+	pca->pca_req.pcr_tkey = ptk;
+	pca->pca_req.pcr_encrypt = 0;
+	pca->pca_req.pcr_holes = 0;
+	pca->pca_req.pcr_sectors = 0;
+	pca->pca_req.pcr_pending = 1;
+	pca->pca_job.pcj_req = &pca->pca_req;
+	pca->pca_job.pcj_offset = offset;
+	pca->pca_job.pcj_buf = pc->pc_base;
+	pca->pca_job.pcj_size = pc->pc_size;
+	TASK_INIT(&pca->pca_job.pcj_task, 0, pefs_crypto_task, &pca->pca_job);
+	if (pefs_crypto_tq != NULL)
+		taskqueue_enqueue(pefs_crypto_tq, &pca->pca_job.pcj_task);
+	else
+		pefs_crypto_task(&pca->pca_job, 0);
+
+	return (pca);
+}
+
+void
+pefs_data_decrypt_wait(struct pefs_mount *pm, struct pefs_crypto_async *pca)
+{
+	mtx_lock(&pefs_crypto_mtx);
+	while (pca->pca_req.pcr_pending != 0)
+		msleep(&pca->pca_req, &pefs_crypto_mtx, PRIBIO, "pefscr", 0);
+	mtx_unlock(&pefs_crypto_mtx);
+
+	if (pca->pca_req.pcr_holes != 0)
+		atomic_add_long(&pm->pm_stats.ps_holes,
+		    pca->pca_req.pcr_holes);
+	if (pca->pca_req.pcr_sectors != 0)
+		atomic_add_long(&pm->pm_stats.ps_decrypted,
+		    pca->pca_req.pcr_sectors);
+	uma_zfree(pefs_async_zone, pca);
+}
+
+/*
+ * Out-of-place variants of pefs_data_encrypt/pefs_data_decrypt combined with
+ * pefs_chunk_copy.  Plaintext of a whole sector is encrypted from or
+ * decrypted into kernel space uio buffer directly.  User space buffers,
+ * unaligned head and tail sectors are copied sector by sector while data is
+ * still in cache.  Chunks large enough to be processed by worker threads are
+ * copied and encrypted/decrypted in place.
+ */
+
+static __inline int
+pefs_uio_direct(struct uio *uio, size_t len)
+{
+	return (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt > 0 &&
+	    uio->uio_iov->iov_len >= len);
+}
+
+static void
+pefs_uio_advance(struct uio *uio, size_t len)
+{
+	uio->uio_iov->iov_base = (char *)uio->uio_iov->iov_base + len;
+	uio->uio_iov->iov_len -= len;
+	if (uio->uio_iov->iov_len == 0) {
+		uio->uio_iov++;
+		uio->uio_iovcnt--;
+	}
+	uio->uio_offset += len;
+	uio->uio_resid -= len;
+}
+
+/*
+ * Copy data from uio into chunk starting at skip and encrypt the chunk.
+ * Chunk data not overwritten by uio should contain plaintext.
+ */
+int
+pefs_data_encrypt_uio(struct pefs_tkey *ptk, off_t offset,
+    struct pefs_chunk *pc, size_t skip, struct uio *uio)
 {
 	struct pefs_session ses;
+	const struct pefs_alg *alg;
 	char *buf;
-	ssize_t resid, block;
+	size_t pos, end, block, cskip, cend, clen;
+	int error;
 
 	MPASS(ptk->ptk_key != NULL);
 	MPASS((offset & PEFS_SECTOR_MASK) == 0);
+	MPASS(skip < pc->pc_size);
+	MPASS(uio->uio_rw == UIO_WRITE);
 
-	pefs_session_enter(ptk->ptk_key->pk_alg, &ses);
+	alg = ptk->ptk_key->pk_alg;
 	buf = pc->pc_base;
-	resid = pc->pc_size;
-	while (resid > 0) {
-		block = qmin(resid, PEFS_SECTOR_SIZE);
-		pefs_xts_block_encrypt(ptk->ptk_key->pk_alg, &ses,
+	end = skip + qmin(pc->pc_size - skip, uio->uio_resid);
+	if (pefs_crypto_isparallel(pc->pc_size)) {
+		error = uiomove(buf + skip, end - skip, uio);
+		if (error == 0)
+			pefs_data_encrypt(ptk, offset, pc);
+		return (error);
+	}
+
+	error = 0;
+	pefs_session_enter(alg, &ses);
+	for (pos = 0; pos < pc->pc_size; pos += block) {
+		block = qmin(pc->pc_size - pos, PEFS_SECTOR_SIZE);
+		cskip = qmax(pos, skip);
+		cend = qmin(pos + block, end);
+		clen = cend > cskip ? cend - cskip : 0;
+		if (clen == block && pefs_uio_direct(uio, block)) {
+			pefs_xts_block_encrypt(alg, &ses,
+			    ptk->ptk_key->pk_tweak_ctx,
+			    ptk->ptk_key->pk_data_ctx, offset + pos,
+			    ptk->ptk_tweak, block, uio->uio_iov->iov_base,
+			    buf + pos);
+			pefs_uio_advance(uio, block);
+			continue;
+		}
+		if (clen != 0) {
+			error = uiomove(buf + cskip, clen, uio);
+			if (error != 0)
+				break;
+		}
+		pefs_xts_block_encrypt(alg, &ses,
 		    ptk->ptk_key->pk_tweak_ctx, ptk->ptk_key->pk_data_ctx,
-		    offset, ptk->ptk_tweak, block,
-		    buf, buf);
-		offset += block;
-		buf += block;
-		resid -= block;
+		    offset + pos, ptk->ptk_tweak, block, buf + pos, buf + pos);
 	}
-	pefs_session_leave(ptk->ptk_key->pk_alg, &ses);
+	pefs_session_leave(alg, &ses);
+
+	return (error);
 }
 
-void
-pefs_data_decrypt(struct pefs_tkey *ptk, off_t offset, struct pefs_chunk *pc)
+/*
+ * Decrypt chunk and copy plaintext starting at skip into uio.  Sectors not
+ * copied are not decrypted, chunk content is undefined afterwards.
+ */
+int
+pefs_data_decrypt_uio(struct pefs_mount *pm, struct pefs_tkey *ptk,
+    off_t offset, struct pefs_chunk *pc, size_t skip, struct uio *uio)
 {
 	struct pefs_session ses;
-	ssize_t resid;
-	long *p;
-	char *buf, *end;
+	const struct pefs_alg *alg;
+	char *buf;
+	size_t pos, end, block, cskip, clen;
+	u_long holes, sectors;
+	int error;
 
 	MPASS(ptk->ptk_key != NULL);
 	MPASS((offset & PEFS_SECTOR_MASK) == 0);
+	MPASS(skip < pc->pc_size);
+	MPASS(uio->uio_rw == UIO_READ);
 
-	pefs_session_enter(ptk->ptk_key->pk_alg, &ses);
-	buf = (char *)pc->pc_base;
-	end = buf + pc->pc_size;
-	while (buf < end) {
-		if ((end - buf) >= PEFS_SECTOR_SIZE) {
-			p = (long *)buf;
-			resid = PEFS_SECTOR_SIZE / sizeof(long);
-			for (; resid > 0; resid--)
-				if (*(p++) != 0)
-					break;
-			if (resid == 0) {
-				bzero(buf, PEFS_SECTOR_SIZE);
-				offset += PEFS_SECTOR_SIZE;
-				buf += PEFS_SECTOR_SIZE;
-				continue;
-			}
-			resid = PEFS_SECTOR_SIZE;
-		} else
-			resid = end - buf;
-		pefs_xts_block_decrypt(ptk->ptk_key->pk_alg, &ses,
-		    ptk->ptk_key->pk_tweak_ctx, ptk->ptk_key->pk_data_ctx,
-		    offset, ptk->ptk_tweak, resid, buf, buf);
-		buf += resid;
-		offset += resid;
+	alg = ptk->ptk_key->pk_alg;
+	buf = pc->pc_base;
+	end = skip + qmin(pc->pc_size - skip, uio->uio_resid);
+	holes = sectors = 0;
+	pos = rounddown(skip, PEFS_SECTOR_SIZE);
+	block = qmin(roundup(end, PEFS_SECTOR_SIZE), pc->pc_size) - pos;
+	if (pefs_crypto_isparallel(block)) {
+		pefs_data_crypt(ptk, 0, offset + pos, buf + pos, block,
+		    &holes, &sectors);
+		error = uiomove(buf + skip, end - skip, uio);
+		goto out;
+	}
+
+	error = 0;
+	pefs_session_enter(alg, &ses);
+	for (; pos < end; pos += block) {
+		block = qmin(pc->pc_size - pos, PEFS_SECTOR_SIZE);
+		cskip = qmax(pos, skip);
+		clen = qmin(pos + block, end) - cskip;
+		if (block == PEFS_SECTOR_SIZE &&
+		    pefs_sector_iszero(alg, &ses, buf + pos)) {
+			/* Hole: ciphertext is already zero filled. */
+			holes++;
+		} else if (clen == block && pefs_uio_direct(uio, block)) {
+			pefs_xts_block_decrypt(alg, &ses,
+			    ptk->ptk_key->pk_tweak_ctx,
+			    ptk->ptk_key->pk_data_ctx, offset + pos,
+			    ptk->ptk_tweak, block, buf + pos,
+			    uio->uio_iov->iov_base);
+			pefs_uio_advance(uio, block);
+			sectors++;
+			continue;
+		} else {
+			pefs_xts_block_decrypt(alg, &ses,
+			    ptk->ptk_key->pk_tweak_ctx,
+			    ptk->ptk_key->pk_data_ctx, offset + pos,
+			    ptk->ptk_tweak, block, buf + pos, buf + pos);
+			sectors++;
+		}
+		error = uiomove(buf + cskip, clen, uio);
+		if (error != 0)
+			break;
 	}
-	pefs_session_leave(ptk->ptk_key->pk_alg, &ses);
+	pefs_session_leave(alg, &ses);
+
+out:
+	if (holes != 0)
+		atomic_add_long(&pm->pm_stats.ps_holes, holes);
+	if (sectors != 0)
+		atomic_add_long(&pm->pm_stats.ps_decrypted, sectors);
+
+	return (error);
 }
 
 /*
@@ -554,37 +982,110 @@ pefs_name_enccbc(struct pefs_key *pk, u_char *data, ssize_t size)
 	pefs_session_leave(&pefs_alg_aes, &ses);
 }
 
+static void
+pefs_name_decblocks(const struct pefs_session *ses, struct pefs_key *pk,
+    u_char *blocks, size_t nblocks)
+{
+	if (pefs_alg_aes.pa_decrypt_blocks != NULL) {
+		pefs_alg_aes.pa_decrypt_blocks(ses, pk->pk_name_ctx, blocks,
+		    blocks, nblocks);
+		return;
+	}
+	for (; nblocks > 0; nblocks--, blocks += PEFS_NAME_BLOCK_SIZE)
+		pefs_alg_aes.pa_decrypt(ses, pk->pk_name_ctx, blocks, blocks);
+}
+
+/*
+ * CBC decryption does not depend on previous plaintext block: decrypt all
+ * blocks at once and xor them with previous ciphertext blocks.
+ * data contains ciphertext on input (zero iv), dec contains decrypted blocks.
+ */
+static void
+pefs_name_cbcxor(u_char *data, const u_char *dec, size_t nblocks)
+{
+	size_t pos;
+	int i;
+
+	MPASS(nblocks > 0);
+	/* Walk backwards to keep previous ciphertext block intact. */
+	for (pos = (nblocks - 1) * PEFS_NAME_BLOCK_SIZE; pos > 0;
+	    pos -= PEFS_NAME_BLOCK_SIZE) {
+		for (i = 0; i < PEFS_NAME_BLOCK_SIZE; i++)
+			data[pos + i] = dec[pos + i] ^
+			    data[pos + i - PEFS_NAME_BLOCK_SIZE];
+	}
+	memcpy(data, dec, PEFS_NAME_BLOCK_SIZE);
+}
+
 static void
 pefs_name_deccbc(struct pefs_key *pk, u_char *data, ssize_t size)
 {
 	struct pefs_session ses;
-	u_char tmp[PEFS_NAME_BLOCK_SIZE], iv[PEFS_NAME_BLOCK_SIZE];
-	int i;
+	u_char dec[MAXNAMLEN + 1];
 
 	size -= PEFS_NAME_CSUM_SIZE;
 	data += PEFS_NAME_CSUM_SIZE;
 	MPASS(size > 0 && size % PEFS_NAME_BLOCK_SIZE == 0);
 
+	memcpy(dec, data, size);
 	pefs_session_enter(&pefs_alg_aes, &ses);
-	bzero(iv, PEFS_NAME_BLOCK_SIZE);
-	while (size > 0) {
-		memcpy(tmp, data, PEFS_NAME_BLOCK_SIZE);
-		pefs_alg_aes.pa_decrypt(&ses, pk->pk_name_ctx, data, data);
-		for (i = 0; i < PEFS_NAME_BLOCK_SIZE; i++)
-			data[i] ^= iv[i];
-		memcpy(iv, tmp, PEFS_NAME_BLOCK_SIZE);
-		data += PEFS_NAME_BLOCK_SIZE;
-		size -= PEFS_NAME_BLOCK_SIZE;
-	}
+	pefs_name_decblocks(&ses, pk, dec, size / PEFS_NAME_BLOCK_SIZE);
 	pefs_session_leave(&pefs_alg_aes, &ses);
+	pefs_name_cbcxor(data, dec, size / PEFS_NAME_BLOCK_SIZE);
 }
 
+/*
+ * Derive tweak of a new name for key with PEFS_KEY_DETNAME flag: truncated
+ * HMAC of parent directory tweak and plaintext name.  The same name created
+ * in the same directory always gets the same tweak and thus the same
+ * encrypted name, which allows to look it up without decrypting directory.
+ * parent_tweak is NULL for directories without a key.
+ */
+void
+pefs_name_tweak(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
+    const char *parent_tweak, const char *name, size_t namelen)
+{
+	char zero_tweak[PEFS_TWEAK_SIZE];
+	int free_ctx = 0;
+
+	KASSERT(ptk != NULL && ptk->ptk_key != NULL &&
+	    ptk->ptk_key->pk_name_tweak_ctx != NULL,
+	    ("pefs_name_tweak: invalid key"));
+
+	if (parent_tweak == NULL) {
+		bzero(zero_tweak, PEFS_TWEAK_SIZE);
+		parent_tweak = zero_tweak;
+	}
+	if (ctx == NULL) {
+		ctx = pefs_ctx_get();
+		free_ctx = 1;
+	}
+
+	pefs_ctx_cpy(ctx, ptk->ptk_key->pk_name_tweak_ctx);
+	hmac_sha512_update(&ctx->o.pctx_hmac, (const uint8_t *)parent_tweak,
+	    PEFS_TWEAK_SIZE);
+	hmac_sha512_update(&ctx->o.pctx_hmac, (const uint8_t *)name, namelen);
+	hmac_sha512_final(&ctx->o.pctx_hmac, (uint8_t *)ptk->ptk_tweak,
+	    PEFS_TWEAK_SIZE);
+
+	if (free_ctx != 0)
+		pefs_ctx_free(ctx);
+}
+
+/*
+ * Names encrypted with PEFS_TKEY_NAMEHINT flag are prepended with key hint
+ * derived from the key: [hint] [checksum] [tweak] [name].  Hint allows to
+ * skip checksum verification for keys name was not encrypted with.
+ * Such names are distinguished by size: (size - hint - checksum) is
+ * multiple of block size.
+ */
 int
 pefs_name_encrypt(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
     const char *plain, size_t plain_len, char *enc, size_t enc_size)
 {
 	char buf[MAXNAMLEN + 1];
-	size_t size;
+	char *name;
+	size_t size, hsize;
 	int free_ctx = 0;
 	int r;
 
@@ -594,9 +1095,11 @@ pefs_name_encrypt(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
 	if (plain_len > MAXNAMLEN) {
 		return (-ENAMETOOLONG);
 	}
+	hsize = (ptk->ptk_flags & PEFS_TKEY_NAMEHINT) != 0 ?
+	    PEFS_NAME_HINT_SIZE : 0;
 	size = PEFS_NAME_CSUM_SIZE + PEFS_TWEAK_SIZE + plain_len;
 	/* Resulting name size, count '.' prepended to name */
-	r = PEFS_NAME_NTOP_SIZE(pefs_name_padsize(size)) + 1;
+	r = PEFS_NAME_NTOP_SIZE(hsize + pefs_name_padsize(size)) + 1;
 	if (r > MAXNAMLEN) {
 		return (-ENAMETOOLONG);
 	}
@@ -611,18 +1114,21 @@ pefs_name_encrypt(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
 		free_ctx = 1;
 	}
 
-	memcpy(buf + PEFS_NAME_CSUM_SIZE, ptk->ptk_tweak, PEFS_TWEAK_SIZE);
-	memcpy(buf + PEFS_NAME_CSUM_SIZE + PEFS_TWEAK_SIZE, plain, plain_len);
+	name = buf + hsize;
+	memcpy(name + PEFS_NAME_CSUM_SIZE, ptk->ptk_tweak, PEFS_TWEAK_SIZE);
+	memcpy(name + PEFS_NAME_CSUM_SIZE + PEFS_TWEAK_SIZE, plain, plain_len);
 
-	size = pefs_name_pad(buf, size, sizeof(buf));
-	pefs_name_enccbc(ptk->ptk_key, buf, size);
-	pefs_name_checksum(ctx, ptk->ptk_key, buf, buf, size);
+	size = pefs_name_pad(name, size, sizeof(buf) - hsize);
+	pefs_name_enccbc(ptk->ptk_key, name, size);
+	pefs_name_checksum(ctx, ptk->ptk_key, name, name, size);
+	if (hsize != 0)
+		le16enc(buf, ptk->ptk_key->pk_namehint);
 
 	if (free_ctx != 0)
 		pefs_ctx_free(ctx);
 
 	enc[0] = '.';
-	r = pefs_name_ntop(buf, size, enc + 1, enc_size - 1);
+	r = pefs_name_ntop(buf, hsize + size, enc + 1, enc_size - 1);
 	if (r <= 0)
 		return (r);
 	r++;
@@ -630,18 +1136,16 @@ pefs_name_encrypt(struct pefs_ctx *ctx, struct pefs_tkey *ptk,
 	return (r);
 }
 
-int
-pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
-    struct pefs_tkey *ptk, const char *enc, size_t enc_len,
-    char *plain, size_t plain_size)
+/*
+ * Decode name and strip key hint.  Hint is returned in *hintp, -1 is
+ * returned if name has no key hint.
+ */
+static int
+pefs_name_decode(const char *enc, size_t enc_len, char *plain,
+    size_t plain_size, int *hintp)
 {
-	struct pefs_key *ki;
-	char csum[PEFS_NAME_CSUM_SIZE];
-	int free_ctx = 0;
-	int r, ki_rev;
+	int r, hint;
 
-	KASSERT(enc != plain, ("pefs_name_decrypt: "
-	    "ciphertext and plaintext buffers should differ"));
 	MPASS(enc_len > 0 && enc_len <= MAXNAMLEN);
 
 	if (enc[0] != '.' || enc_len <= 1)
@@ -650,8 +1154,15 @@ pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
 	enc_len--;
 
 	r = PEFS_NAME_PTON_SIZE(enc_len);
-	if (r <= PEFS_TWEAK_SIZE + PEFS_NAME_CSUM_SIZE ||
-	    (r - PEFS_NAME_CSUM_SIZE) % PEFS_NAME_BLOCK_SIZE != 0)
+	if (r <= PEFS_TWEAK_SIZE + PEFS_NAME_CSUM_SIZE)
+		return (-EINVAL);
+	if ((r - PEFS_NAME_CSUM_SIZE) % PEFS_NAME_BLOCK_SIZE == 0)
+		hint = -1;
+	else if (r > PEFS_NAME_HINT_SIZE + PEFS_TWEAK_SIZE +
+	    PEFS_NAME_CSUM_SIZE && (r - PEFS_NAME_HINT_SIZE -
+	    PEFS_NAME_CSUM_SIZE) % PEFS_NAME_BLOCK_SIZE == 0)
+		hint = 0;
+	else
 		return (-EINVAL);
 	if (plain_size < r) {
 		printf("pefs: name decryption buffer is too small: "
@@ -665,16 +1176,118 @@ pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
 		return (-EINVAL);
 	}
 
-	if (ctx == NULL) {
-		ctx = pefs_ctx_get();
-		free_ctx = 1;
+	if (hint >= 0) {
+		hint = le16dec(plain);
+		r -= PEFS_NAME_HINT_SIZE;
+		memmove(plain, plain + PEFS_NAME_HINT_SIZE, r);
+	}
+	*hintp = hint;
+
+	return (r);
+}
+
+static __inline int
+pefs_keyorder_has(struct pefs_keyorder *pko, struct pefs_key *pk)
+{
+	int i;
+
+	for (i = 0; i < PEFS_KEYORDER_SIZE; i++)
+		if (pko->pko_keys[i] == pk)
+			return (1);
+	return (0);
+}
+
+/*
+ * Move key to the head of the list, the least recently used key is
+ * dropped if key is not in the list.
+ */
+static void
+pefs_keyorder_update(struct pefs_keyorder *pko, struct pefs_key *pk)
+{
+	int i;
+
+	for (i = 0; i < PEFS_KEYORDER_SIZE - 1; i++)
+		if (pko->pko_keys[i] == pk)
+			break;
+	if (pko->pko_keys[i] != pk) {
+		pefs_key_release(pko->pko_keys[i]);
+		pefs_key_ref(pk);
+	}
+	memmove(&pko->pko_keys[1], &pko->pko_keys[0],
+	    i * sizeof(pko->pko_keys[0]));
+	pko->pko_keys[0] = pk;
+}
+
+void
+pefs_keyorder_copy(struct pefs_keyorder *dst, const struct pefs_keyorder *src)
+{
+	int i;
+
+	for (i = 0; i < PEFS_KEYORDER_SIZE; i++) {
+		dst->pko_keys[i] = src->pko_keys[i];
+		if (dst->pko_keys[i] != NULL)
+			pefs_key_ref(dst->pko_keys[i]);
+	}
+}
+
+void
+pefs_keyorder_release(struct pefs_keyorder *pko)
+{
+	int i;
+
+	for (i = 0; i < PEFS_KEYORDER_SIZE; i++) {
+		pefs_key_release(pko->pko_keys[i]);
+		pko->pko_keys[i] = NULL;
+	}
+}
+
+static __inline int
+pefs_name_checkkey(struct pefs_ctx *ctx, struct pefs_key *pk, int hint,
+    char *name, size_t size, u_int *trials)
+{
+	char csum[PEFS_NAME_CSUM_SIZE];
+
+	if (hint >= 0 && pk->pk_namehint != hint)
+		return (0);
+	(*trials)++;
+	pefs_name_checksum(ctx, pk, csum, name, size);
+	return (pefs_name_checksum_eq(csum, name));
+}
+
+/*
+ * Find key name was encrypted with.  Recently used keys from pko are tried
+ * first, then mount keys starting with directory key pk.  Keys removed
+ * from the mount are skipped.  Number of checksums computed is added to
+ * *trials.
+ */
+static struct pefs_key *
+pefs_name_findkey(struct pefs_ctx *ctx, struct pefs_key *pk,
+    struct pefs_keyorder *pko, int hint, char *name, size_t size,
+    u_int *trials)
+{
+	struct pefs_key *ki;
+	int i, ki_rev;
+
+	if (pko != NULL) {
+		for (i = 0; i < PEFS_KEYORDER_SIZE; i++) {
+			ki = pko->pko_keys[i];
+			if (ki == NULL)
+				break;
+			if (ki->pk_entry_lock == NULL)
+				continue;
+			if (pefs_name_checkkey(ctx, ki, hint, name, size,
+			    trials)) {
+				pefs_keyorder_update(pko, ki);
+				return (ki);
+			}
+		}
 	}
 
 	ki = pk;
 	ki_rev = 0;
 	do {
-		pefs_name_checksum(ctx, ki, csum, plain, r);
-		if (pefs_name_checksum_eq(csum, plain))
+		if ((pko == NULL || !pefs_keyorder_has(pko, ki)) &&
+		    pefs_name_checkkey(ctx, ki, hint, name, size, trials))
 			break;
 
 		if (ki_rev == 0) {
@@ -688,18 +1301,21 @@ pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
 			ki = TAILQ_PREV(ki, pefs_key_head, pk_entry);
 	} while (ki != NULL);
 
-	if (free_ctx != 0)
-		pefs_ctx_free(ctx);
-
-	if (ki == NULL)
-		return (-EINVAL);
+	if (ki != NULL && pko != NULL)
+		pefs_keyorder_update(pko, ki);
 
-	pefs_name_deccbc(ki, plain, r);
+	return (ki);
+}
 
+static int
+pefs_name_unpad(struct pefs_key *pk, int flags, struct pefs_tkey *ptk,
+    char *plain, int r)
+{
 	if (ptk != NULL) {
-		ptk->ptk_key = ki;
+		ptk->ptk_key = pk;
 		memcpy(ptk->ptk_tweak, plain + PEFS_NAME_CSUM_SIZE,
 		    PEFS_TWEAK_SIZE);
+		ptk->ptk_flags = flags;
 	}
 
 	r -= PEFS_TWEAK_SIZE + PEFS_NAME_CSUM_SIZE;
@@ -713,6 +1329,160 @@ pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
 	return (r);
 }
 
+int
+pefs_name_decrypt(struct pefs_ctx *ctx, struct pefs_key *pk,
+    struct pefs_tkey *ptk, const char *enc, size_t enc_len,
+    char *plain, size_t plain_size)
+{
+	struct pefs_key *ki;
+	u_int trials;
+	int free_ctx = 0;
+	int r, hint;
+
+	KASSERT(enc != plain, ("pefs_name_decrypt: "
+	    "ciphertext and plaintext buffers should differ"));
+
+	r = pefs_name_decode(enc, enc_len, plain, plain_size, &hint);
+	if (r <= 0)
+		return (r);
+
+	if (ctx == NULL) {
+		ctx = pefs_ctx_get();
+		free_ctx = 1;
+	}
+
+	trials = 0;
+	ki = pefs_name_findkey(ctx, pk, NULL, hint, plain, r, &trials);
+
+	if (free_ctx != 0)
+		pefs_ctx_free(ctx);
+
+	if (ki == NULL)
+		return (-EINVAL);
+
+	pefs_name_deccbc(ki, plain, r);
+
+	return (pefs_name_unpad(ki, hint >= 0 ? PEFS_TKEY_NAMEHINT : 0, ptk,
+	    plain, r));
+}
+
+static void
+pefs_name_decrypt_flush(const struct pefs_session *ses, struct pefs_key *pk,
+    u_char *blocks, size_t nblocks, struct pefs_name_dec *pnd, int count)
+{
+	size_t n;
+
+	if (nblocks == 0)
+		return;
+	pefs_name_decblocks(ses, pk, blocks, nblocks);
+	for (; count > 0; pnd++, count--) {
+		if (pnd->pnd_namelen <= 0)
+			continue;
+		n = (pnd->pnd_namelen - PEFS_NAME_CSUM_SIZE) /
+		    PEFS_NAME_BLOCK_SIZE;
+		pefs_name_cbcxor(pnd->pnd_name + PEFS_NAME_CSUM_SIZE, blocks,
+		    n);
+		blocks += n * PEFS_NAME_BLOCK_SIZE;
+	}
+}
+
+/*
+ * Decrypt several names at once, e.g. all directory entries returned by
+ * single VOP_READDIR call.  Checksums are verified for all names first,
+ * then name blocks are gathered and decrypted within single session,
+ * multi-block ECB operation is used if available.
+ * Result for each name is stored in pnd_namelen, ptk_key is NULL if
+ * decryption failed.  Keys found are moved to the head of pko if not NULL.
+ * Returns number of name checksums computed to find keys.
+ */
+u_int
+pefs_name_decrypt_batch(struct pefs_ctx *ctx, struct pefs_key *pk,
+    struct pefs_keyorder *pko, struct pefs_name_dec *pnd, int count)
+{
+	u_char blocks[PEFS_NAME_BATCH_BLOCKS * PEFS_NAME_BLOCK_SIZE];
+	struct pefs_session ses;
+	struct pefs_key *ki;
+	size_t n, nblocks;
+	u_int trials;
+	int free_ctx = 0;
+	int first, i, r, hint;
+
+	if (ctx == NULL) {
+		ctx = pefs_ctx_get();
+		free_ctx = 1;
+	}
+	trials = 0;
+	for (i = 0; i < count; i++) {
+		pnd[i].pnd_tkey.ptk_key = NULL;
+		r = pefs_name_decode(pnd[i].pnd_enc, pnd[i].pnd_enclen,
+		    pnd[i].pnd_name, sizeof(pnd[i].pnd_name), &hint);
+		if (r > 0) {
+			ki = pefs_name_findkey(ctx, pk, pko, hint,
+			    pnd[i].pnd_name, r, &trials);
+			if (ki == NULL)
+				r = -EINVAL;
+			pnd[i].pnd_tkey.ptk_key = ki;
+			pnd[i].pnd_tkey.ptk_flags = hint >= 0 ?
+			    PEFS_TKEY_NAMEHINT : 0;
+		}
+		pnd[i].pnd_namelen = r;
+	}
+	if (free_ctx != 0)
+		pefs_ctx_free(ctx);
+
+	ki = NULL;
+	nblocks = 0;
+	first = 0;
+	pefs_session_enter(&pefs_alg_aes, &ses);
+	for (i = 0; i < count; i++) {
+		r = pnd[i].pnd_namelen;
+		if (r <= 0)
+			continue;
+		n = (r - PEFS_NAME_CSUM_SIZE) / PEFS_NAME_BLOCK_SIZE;
+		if (nblocks + n > PEFS_NAME_BATCH_BLOCKS ||
+		    (nblocks != 0 && ki != pnd[i].pnd_tkey.ptk_key)) {
+			pefs_name_decrypt_flush(&ses, ki, blocks, nblocks,
+			    pnd + first, i - first);
+			nblocks = 0;
+		}
+		if (nblocks == 0) {
+			ki = pnd[i].pnd_tkey.ptk_key;
+			first = i;
+		}
+		memcpy(blocks + nblocks * PEFS_NAME_BLOCK_SIZE,
+		    pnd[i].pnd_name + PEFS_NAME_CSUM_SIZE,
+		    n * PEFS_NAME_BLOCK_SIZE);
+		nblocks += n;
+	}
+	pefs_name_decrypt_flush(&ses, ki, blocks, nblocks, pnd + first,
+	    count - first);
+	pefs_session_leave(&pefs_alg_aes, &ses);
+
+	for (i = 0; i < count; i++) {
+		if (pnd[i].pnd_namelen <= 0)
+			continue;
+		pnd[i].pnd_namelen = pefs_name_unpad(pnd[i].pnd_tkey.ptk_key,
+		    pnd[i].pnd_tkey.ptk_flags, &pnd[i].pnd_tkey,
+		    pnd[i].pnd_name, pnd[i].pnd_namelen);
+	}
+
+	return (trials);
+}
+
+/*
+ * Prefer AES-NI, fall back to table driven rijndael.  Constant-time
+ * software implementation is used instead of rijndael if enabled by
+ * vfs.pefs.aes_ct_enable tunable.
+ */
+static void
+pefs_aes_init(struct pefs_alg *pa)
+{
+	pefs_aes_ct_init(pa);
+#ifdef PEFS_AESNI
+	pefs_aesni_init(pa);
+#endif
+}
+
 static int
 pefs_aes_keysetup(const struct pefs_session *sess __unused,
     struct pefs_ctx *ctx, const uint8_t *key, uint32_t keybits)
@@ -30,6 +30,7 @@
 #include <crypto/hmac/hmac_sha512.h>
 #include <crypto/rijndael/rijndael.h>
 
+#include <fs/pefs/pefs_aes_ct.h>
 #ifdef PEFS_AESNI
 #include <fs/pefs/pefs_aesni.h>
 #endif
@@ -46,12 +47,28 @@ typedef int	algop_keysetup_t(const struct pefs_session *sess,
 	    struct pefs_ctx *ctx, const uint8_t *key, uint32_t keybits);
 typedef void	algop_crypt_t(const struct pefs_session *sess,
 	    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out);
+typedef void	algop_crypt_blocks_t(const struct pefs_session *sess,
+	    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out,
+	    size_t nblocks);
+typedef int	algop_iszero_t(const struct pefs_session *sess,
+	    const void *buf, size_t len);
 
+/*
+ * pa_encrypt_blocks/pa_decrypt_blocks are optional multi-block ECB
+ * operations.  XTS falls back to calling pa_encrypt/pa_decrypt for every
+ * block if they are not provided.
+ *
+ * pa_iszero is optional, it allows to use vector registers available
+ * within the session for zero sector detection.
+ */
 struct pefs_alg {
 	algop_session_t		*pa_enter;
 	algop_session_t		*pa_leave;
 	algop_crypt_t		*pa_encrypt;
 	algop_crypt_t		*pa_decrypt;
+	algop_crypt_blocks_t	*pa_encrypt_blocks;
+	algop_crypt_blocks_t	*pa_decrypt_blocks;
+	algop_iszero_t		*pa_iszero;
 	algop_keysetup_t	*pa_keysetup;
 	algop_init_t		*pa_init;
 	algop_uninit_t		*pa_uninit;
@@ -62,10 +79,14 @@ struct pefs_ctx {
 	union {
 		camellia_ctx	pctx_camellia;
 		rijndael_ctx	pctx_aes;
+		struct pefs_aes_ct_ctx pctx_aes_ct;
 		struct hmac_sha512_ctx pctx_hmac;
 		vmac_ctx_t	pctx_vmac;
 #ifdef PEFS_AESNI
 		struct pefs_aesni_ctx pctx_aesni;
+#endif
+#ifdef PEFS_CAMELLIA_AVX
+		struct pefs_camellia_aesni_ctx pctx_camellia_aesni;
 #endif
 	} o;
 } __aligned(CACHE_LINE_SIZE);
@@ -79,7 +100,25 @@ struct pefs_session {
 	} o;
 };
 
+algop_init_t	pefs_aes_ct_init;
 algop_init_t	pefs_aesni_init;
+algop_init_t	pefs_camellia_aesni_init;
+
+int	pefs_iszero(const void *buf, size_t len);
+
+#ifdef PEFS_AESNI
+algop_session_t	pefs_aesni_enter;
+algop_session_t	pefs_aesni_leave;
+void	pefs_aesni_fpu_init(void);
+void	pefs_aesni_fpu_uninit(void);
+algop_iszero_t	pefs_aesni_iszero;
+#ifdef PEFS_SIMD
+void	pefs_aesni_simd_init(void);
+#endif
+#ifdef __amd64__
+int	pefs_aesni_avx_enabled(void);
+#endif
+#endif
 
 void	pefs_xts_block_encrypt(const struct pefs_alg *alg,
 	    const struct pefs_session *ses,
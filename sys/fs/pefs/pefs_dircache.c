@@ -36,49 +36,207 @@ __FBSDID("$FreeBSD$");
 #include <sys/mutex.h>
 #include <sys/namei.h>
 #include <sys/dirent.h>
-#include <sys/hash.h>
+#include <sys/endian.h>
+#include <sys/eventhandler.h>
 #include <sys/queue.h>
 #include <sys/proc.h>
+#include <sys/sbuf.h>
 #include <sys/sysctl.h>
 #include <sys/sx.h>
 #include <sys/uio.h>
 #include <sys/taskqueue.h>
 #include <sys/vnode.h>
+#ifdef PEFS_DIRCACHE_EPOCH
+#include <sys/seqc.h>
+#endif
 
 #include <fs/pefs/pefs.h>
+#include <fs/pefs/pefs_compat.h>
 #include <fs/pefs/pefs_dircache.h>
 
 #define	DIRCACHE_SIZE_ENV	"vfs.pefs.dircache.buckets"
-#define	DIRCACHE_SIZE_MIN	512
-#define	DIRCACHE_SIZE_DEFAULT	(desiredvnodes / 8)
+#define	DIRCACHE_SIZE_MIN	MAX(512, MAXCPU)
 
 #define	DIRCACHE_GLOBAL_ENV	"vfs.pefs.dircache.global"
 
-#define DIRCACHE_TBL(pool, hash) \
-	(&(pool)->pdp_tbl[(hash) & dircache_hashmask])
-#define DIRCACHE_ENCTBL(pool, hash) \
-	(&(pool)->pdp_enctbl[(hash) & dircache_hashmask])
+#define	DIRCACHE_MAXENTRIES_ENV	"vfs.pefs.dircache.maxentries"
+#define	DIRCACHE_MAXENTRIES_DEFAULT	(desiredvnodes * 2)
+
+/* Max number of directories to collect garbage in at once while evicting. */
+#define	DIRCACHE_EVICT_BATCH	32
+
+/*
+ * Table is resized to have about one entry per bucket when average chain
+ * length is out of [1/8, 2] range.
+ */
+#define	DIRCACHE_GROW(entries, size)	((entries) > 2 * (size))
+#define	DIRCACHE_SHRINK(entries, size)					\
+	((size) > DIRCACHE_SIZE_MIN && (entries) < (size) / 8)
+
+/* Chain length histogram size, the last slot counts longer chains. */
+#define	DIRCACHE_HIST_SIZE	16
+
+#define	DIRCACHE_PRIME1		0x9e3779b185ebca87ULL
+#define	DIRCACHE_PRIME2		0xc2b2ae3d27d4eb4fULL
+#define	DIRCACHE_PRIME3		0x165667b19e3779f9ULL
+#define	DIRCACHE_PRIME4		0x85ebca77c2b2ae63ULL
+
+CTASSERT(powerof2(MAXCPU));
+
+/*
+ * Bucket locks are indexed by hash value.  Minimal table size is a multiple
+ * of their number, so that all entries of a bucket share the same lock
+ * regardless of table size.
+ */
+#define DIRCACHE_LOCK(hash) \
+	(&dircache_locks[(hash) % MAXCPU])
 #define DIRCACHE_MTX(hash) \
-	(&dircache_mtxs[(hash) % MAXCPU])
+	(&DIRCACHE_LOCK(hash)->dl_mtx)
+
+#define	DIRCACHE_BUCKET(dt, hash)					\
+	(&(dt)->dt_buckets[(hash) & (dt)->dt_mask])
+#define	DIRCACHE_ENCBUCKET(dt, hash)					\
+	(&(dt)->dt_buckets[(dt)->dt_mask + 1 + ((hash) & (dt)->dt_mask)])
+
+/*
+ * Bucket mutexes serialize hash chain modifications.  Lookups either traverse
+ * chains within epoch section, or hold bucket mutex if epoch(9) is not used.
+ * Moving entries to a resized table is also protected by bucket sequence
+ * counter: lock-free lookup can miss an entry being moved, unsuccessful
+ * lookup is retried if sequence counter has changed.
+ */
+#ifdef PEFS_DIRCACHE_EPOCH
+#define	DIRCACHE_HASH_INIT		CK_LIST_INIT
+#define	DIRCACHE_HASH_FIRST		CK_LIST_FIRST
+#define	DIRCACHE_HASH_INSERT_HEAD	CK_LIST_INSERT_HEAD
+#define	DIRCACHE_HASH_REMOVE		CK_LIST_REMOVE
+#define	DIRCACHE_HASH_FOREACH		CK_LIST_FOREACH
+
+struct dircache_rlock {
+	struct epoch_tracker	et;
+	seqc_t			*seqcp;
+	seqc_t			seq;
+};
+
+#define	DIRCACHE_RLOCK(rl, hash) do {					\
+	epoch_enter_preempt(dircache_epoch, &(rl)->et);			\
+	(rl)->seqcp = &DIRCACHE_LOCK(hash)->dl_seqc;			\
+	(rl)->seq = seqc_read((rl)->seqcp);				\
+} while (0)
+#define	DIRCACHE_RUNLOCK(rl)						\
+	epoch_exit_preempt(dircache_epoch, &(rl)->et)
+#define	DIRCACHE_RRETRY(rl)						\
+	(!seqc_consistent((rl)->seqcp, (rl)->seq) &&			\
+	((rl)->seq = seqc_read((rl)->seqcp), 1))
+#else
+#define	DIRCACHE_HASH_INIT		LIST_INIT
+#define	DIRCACHE_HASH_FIRST		LIST_FIRST
+#define	DIRCACHE_HASH_INSERT_HEAD	LIST_INSERT_HEAD
+#define	DIRCACHE_HASH_REMOVE		LIST_REMOVE
+#define	DIRCACHE_HASH_FOREACH		LIST_FOREACH
+
+struct dircache_rlock {
+	struct mtx		*mtx;
+};
+
+#define	DIRCACHE_RLOCK(rl, hash)					\
+	mtx_lock((rl)->mtx = DIRCACHE_MTX(hash))
+#define	DIRCACHE_RUNLOCK(rl)						\
+	mtx_unlock((rl)->mtx)
+#define	DIRCACHE_RRETRY(rl)		0
+#endif
 
+/*
+ * Name chains are dt_buckets[0, size), encrypted name chains are
+ * dt_buckets[size, 2 * size).  While table is being resized dt_old points to
+ * the previous table, entries are moved to the new table bucket lock by
+ * bucket lock and lookups search both tables.
+ */
+struct dircache_table {
+	u_long				dt_mask;
+	struct dircache_table		*dt_old;
+	struct pefs_dircache_hashhead	dt_buckets[];
+};
+
+struct dircache_hash {
+	struct dircache_table	*dh_table;
+	u_long			dh_entries;
+	volatile u_int		dh_resize_pending;
+	struct task		dh_resize_task;
+	/* Keeps table from being freed by resize */
+	struct sx		dh_resize_lock;
+};
+
+/*
+ * Every mount has its own pool, hash tables are either shared with global
+ * pool or private.  Active entries of the pool are kept in approximate LRU
+ * order: referenced entries get second chance during eviction.
+ *
+ * Lock order: pd_mtx -> pdp_lru_mtx -> bucket mutex.  Eviction takes
+ * pdp_lru_mtx first and only tries to lock pd_mtx.
+ */
 struct pefs_dircache_pool
 {
-	struct pefs_dircache_listhead	*pdp_tbl;
-	struct pefs_dircache_listhead	*pdp_enctbl;
+	struct dircache_hash		*pdp_hash;
+	struct mtx			pdp_lru_mtx;
+	struct pefs_dircache_lruhead	pdp_lru;
+	u_long				pdp_entries;
+	u_long				pdp_maxentries;
+	u_long				pdp_evictions;
+	u_long				pdp_collisions;
+	u_long				pdp_purges;
+	LIST_ENTRY(pefs_dircache_pool)	pdp_entry;
+	struct dircache_hash		pdp_privhash;
 };
 
-static struct pefs_dircache_pool dircache_global;
+static struct dircache_hash	dircache_global;
+
+static LIST_HEAD(, pefs_dircache_pool) dircache_pools =
+    LIST_HEAD_INITIALIZER(dircache_pools);
+static struct sx		dircache_pools_lock;
+
+static struct task		dircache_evict_task;
+static volatile u_int		dircache_evict_pending;
+static volatile u_int		dircache_lowmem;
+static eventhandler_tag		dircache_lowmem_tag;
 
-static u_long			dircache_hashmask;
+static uint64_t			dircache_seed;
 
-#if __FreeBSD_version < 1000500
-#define mtx_padalign		mtx
+static struct dircache_lock {
+	struct mtx		dl_mtx;
+#ifdef PEFS_DIRCACHE_EPOCH
+	seqc_t			dl_seqc;
 #endif
+} __aligned(CACHE_LINE_SIZE)	dircache_locks[MAXCPU];
 
-static struct mtx_padalign	dircache_mtxs[MAXCPU];
+#ifdef PEFS_DIRCACHE_EPOCH
+static epoch_t			dircache_epoch;
+#endif
 
 static uma_zone_t		dircache_zone;
-static uma_zone_t		dircache_entry_zone;
+
+#define	DIRCACHE_ENTRY_MAXSIZE						\
+	(offsetof(struct pefs_dircache_entry, pde_name) +		\
+	PEFS_CACHENAME_MAXLEN + 1 + MAXNAMLEN + 1)
+
+/*
+ * Entries are allocated from size class zones according to name lengths,
+ * typical names fit into the smallest classes.  Size of the last class is
+ * DIRCACHE_ENTRY_MAXSIZE.
+ */
+static struct {
+	const char	*name;
+	size_t		size;
+	uma_zone_t	zone;
+} dircache_entry_zones[] = {
+	{ "pefs_dircache_entry_192",	192 },
+	{ "pefs_dircache_entry_256",	256 },
+	{ "pefs_dircache_entry_320",	320 },
+	{ "pefs_dircache_entry_384",	384 },
+	{ "pefs_dircache_entry_max",	0 },
+};
+
+static int	dircache_sysctl_histogram(SYSCTL_HANDLER_ARGS);
 
 SYSCTL_NODE(_vfs_pefs, OID_AUTO, dircache, CTLFLAG_RW, 0,
     "PEFS directory cache");
@@ -93,14 +251,33 @@ SYSCTL_INT(_vfs_pefs_dircache, OID_AUTO, global, CTLFLAG_RD,
 
 static u_long	dircache_buckets = 0;
 SYSCTL_ULONG(_vfs_pefs_dircache, OID_AUTO, buckets, CTLFLAG_RD,
-    &dircache_buckets, 0, "Number of dircache hash table buckets");
+    &dircache_buckets, 0, "Number of global dircache hash table buckets");
+
+static u_long	dircache_resizes = 0;
+SYSCTL_ULONG(_vfs_pefs_dircache, OID_AUTO, resizes, CTLFLAG_RD,
+    &dircache_resizes, 0, "Number of dircache hash table resizes");
+
+SYSCTL_PROC(_vfs_pefs_dircache, OID_AUTO, histogram,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    dircache_sysctl_histogram, "A", "Dircache hash chain length histogram");
 
 static u_long	dircache_entries = 0;
 SYSCTL_ULONG(_vfs_pefs_dircache, OID_AUTO, entries, CTLFLAG_RD,
     &dircache_entries, 0, "Entries in dircache");
 
-static void	pefs_dircache_pool_init(struct pefs_dircache_pool *pdp);
-static void	pefs_dircache_pool_uninit(struct pefs_dircache_pool *pdp);
+static u_long	dircache_maxentries = 0;
+SYSCTL_ULONG(_vfs_pefs_dircache, OID_AUTO, maxentries, CTLFLAG_RW,
+    &dircache_maxentries, 0, "Max number of entries in dircache");
+
+static u_long	dircache_evictions = 0;
+SYSCTL_ULONG(_vfs_pefs_dircache, OID_AUTO, evictions, CTLFLAG_RD,
+    &dircache_evictions, 0, "Entries evicted from dircache");
+
+static void	dircache_hash_init(struct dircache_hash *dh);
+static void	dircache_hash_uninit(struct dircache_hash *dh);
+static void	dircache_resize_task_fn(void *context, int pending);
+static void	dircache_evict_task_fn(void *context, int pending);
+static void	dircache_lowmem_handler(void *arg, int flags);
 
 void
 pefs_dircache_init(void)
@@ -109,26 +286,43 @@ pefs_dircache_init(void)
 
 	TUNABLE_ULONG_FETCH(DIRCACHE_SIZE_ENV, &dircache_buckets);
 	TUNABLE_INT_FETCH(DIRCACHE_GLOBAL_ENV, &dircache_global_enable);
+	TUNABLE_ULONG_FETCH(DIRCACHE_MAXENTRIES_ENV, &dircache_maxentries);
 
 	if (dircache_buckets < DIRCACHE_SIZE_MIN)
-		dircache_buckets = DIRCACHE_SIZE_DEFAULT;
-	dircache_hashmask = (1ULL << flsl(dircache_buckets)) - 1;
+		dircache_buckets = DIRCACHE_SIZE_MIN;
+	dircache_buckets = 1UL << (flsl(dircache_buckets - 1));
 	dircache_global_enable = !!dircache_global_enable;
+	if (dircache_maxentries == 0)
+		dircache_maxentries = DIRCACHE_MAXENTRIES_DEFAULT;
+	arc4rand(&dircache_seed, sizeof(dircache_seed), 0);
 
 	for (i = 0; i < MAXCPU; i++) {
-		mtx_init(&dircache_mtxs[i], "dircache_mtx", NULL, MTX_DEF);
+		mtx_init(&dircache_locks[i].dl_mtx, "dircache_mtx", NULL,
+		    MTX_DEF);
 	}
+	sx_init(&dircache_pools_lock, "pefs_dircache_pools");
+#ifdef PEFS_DIRCACHE_EPOCH
+	dircache_epoch = epoch_alloc("pefs_dircache", EPOCH_PREEMPT);
+#endif
+	TASK_INIT(&dircache_evict_task, 0, dircache_evict_task_fn, NULL);
 
 	dircache_zone = uma_zcreate("pefs_dircache",
 	    sizeof(struct pefs_dircache), NULL, NULL, NULL, NULL,
 	    UMA_ALIGN_PTR, 0);
-	dircache_entry_zone = uma_zcreate("pefs_dircache_entry",
-	    sizeof(struct pefs_dircache_entry), NULL, NULL, NULL,
-	    pefs_zone_fini_bzero, UMA_ALIGN_PTR, 0);
+	dircache_entry_zones[nitems(dircache_entry_zones) - 1].size =
+	    DIRCACHE_ENTRY_MAXSIZE;
+	for (i = 0; i < nitems(dircache_entry_zones); i++) {
+		dircache_entry_zones[i].zone = uma_zcreate(
+		    dircache_entry_zones[i].name, dircache_entry_zones[i].size,
+		    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
+	}
 
 	if (dircache_global_enable != 0) {
-		pefs_dircache_pool_init(&dircache_global);
+		dircache_hash_init(&dircache_global);
 	}
+
+	dircache_lowmem_tag = EVENTHANDLER_REGISTER(vm_lowmem,
+	    dircache_lowmem_handler, NULL, EVENTHANDLER_PRI_FIRST);
 }
 
 void
@@ -136,76 +330,442 @@ pefs_dircache_uninit(void)
 {
 	u_int i;
 
+	EVENTHANDLER_DEREGISTER(vm_lowmem, dircache_lowmem_tag);
+	taskqueue_drain(taskqueue_thread, &dircache_evict_task);
+	MPASS(LIST_EMPTY(&dircache_pools));
+	sx_destroy(&dircache_pools_lock);
+
 	if (dircache_global_enable != 0) {
-		pefs_dircache_pool_uninit(&dircache_global);
+		dircache_hash_uninit(&dircache_global);
 	}
 
+#ifdef PEFS_DIRCACHE_EPOCH
+	epoch_drain_callbacks(dircache_epoch);
+	epoch_free(dircache_epoch);
+#endif
 	uma_zdestroy(dircache_zone);
-	uma_zdestroy(dircache_entry_zone);
+	for (i = 0; i < nitems(dircache_entry_zones); i++)
+		uma_zdestroy(dircache_entry_zones[i].zone);
 
 	for (i = 0; i < MAXCPU; i++) {
-		mtx_destroy(&dircache_mtxs[i]);
+		mtx_destroy(&dircache_locks[i].dl_mtx);
 	}
 }
 
-static void
-pefs_dircache_pool_init(struct pefs_dircache_pool *pdp)
+static struct dircache_table *
+dircache_table_alloc(u_long size)
 {
-	u_long tbl_size = dircache_hashmask + 1;
+	struct dircache_table *dt;
 	u_long i;
 
-	pdp->pdp_tbl = malloc(tbl_size * sizeof(pdp->pdp_tbl[0]),
-	    M_PEFSHASH, M_WAITOK);
-	pdp->pdp_enctbl = malloc(tbl_size * sizeof(pdp->pdp_enctbl[0]),
-	    M_PEFSHASH, M_WAITOK);
-	for (i = 0; i < tbl_size; i++) {
-		LIST_INIT(&pdp->pdp_tbl[i]);
-		LIST_INIT(&pdp->pdp_enctbl[i]);
+	MPASS(powerof2(size) && size >= DIRCACHE_SIZE_MIN);
+	dt = malloc(offsetof(struct dircache_table, dt_buckets) +
+	    2 * size * sizeof(dt->dt_buckets[0]), M_PEFSHASH, M_WAITOK);
+	dt->dt_mask = size - 1;
+	dt->dt_old = NULL;
+	for (i = 0; i < 2 * size; i++)
+		DIRCACHE_HASH_INIT(&dt->dt_buckets[i]);
+	return (dt);
+}
+
+static void
+dircache_hash_init(struct dircache_hash *dh)
+{
+	dh->dh_table = dircache_table_alloc(dircache_buckets);
+	dh->dh_entries = 0;
+	dh->dh_resize_pending = 0;
+	TASK_INIT(&dh->dh_resize_task, 0, dircache_resize_task_fn, dh);
+	sx_init(&dh->dh_resize_lock, "pefs_dircache_resize");
+}
+
+static void
+dircache_hash_uninit(struct dircache_hash *dh)
+{
+	taskqueue_drain(taskqueue_thread, &dh->dh_resize_task);
+	MPASS(dh->dh_entries == 0 && dh->dh_table->dt_old == NULL);
+	sx_destroy(&dh->dh_resize_lock);
+	free(dh->dh_table, M_PEFSHASH);
+	dh->dh_table = NULL;
+}
+
+static __inline struct dircache_table *
+dircache_table_get(struct dircache_hash *dh)
+{
+	return ((void *)atomic_load_acq_ptr((volatile uintptr_t *)
+	    &dh->dh_table));
+}
+
+static __inline struct dircache_table *
+dircache_table_getold(struct dircache_table *dt)
+{
+	return ((void *)atomic_load_acq_ptr((volatile uintptr_t *)
+	    &dt->dt_old));
+}
+
+static void
+dircache_resize_schedule(struct dircache_hash *dh)
+{
+	struct dircache_table *dt;
+	u_long entries, size;
+
+	dt = dircache_table_get(dh);
+	entries = dh->dh_entries;
+	size = dt->dt_mask + 1;
+	if (!DIRCACHE_GROW(entries, size) && !DIRCACHE_SHRINK(entries, size))
+		return;
+	if (atomic_cmpset_int(&dh->dh_resize_pending, 0, 1) != 0)
+		taskqueue_enqueue(taskqueue_thread, &dh->dh_resize_task);
+}
+
+/*
+ * Move entries to a new table one bucket lock at a time.  Lookups and
+ * modifications of other buckets are not blocked.
+ */
+static void
+dircache_resize_task_fn(void *context, int pending __unused)
+{
+	struct dircache_hash *dh = context;
+	struct dircache_table *dt, *odt;
+	struct pefs_dircache_entry *pde;
+	struct dircache_lock *dl;
+	u_long b, entries, size;
+	u_int i;
+
+	sx_xlock(&dh->dh_resize_lock);
+	entries = dh->dh_entries;
+	odt = dh->dh_table;
+	size = 1UL << flsl(MAX(entries, 1) - 1);
+	size = MAX(size, DIRCACHE_SIZE_MIN);
+	size = MIN(size, MAX(DIRCACHE_SIZE_MIN,
+	    1UL << flsl(dircache_maxentries - 1)));
+	if (size == odt->dt_mask + 1) {
+		sx_xunlock(&dh->dh_resize_lock);
+		atomic_store_rel_int(&dh->dh_resize_pending, 0);
+		return;
+	}
+
+	PEFSDEBUG("pefs_dircache_resize: %lu -> %lu buckets, %lu entries\n",
+	    odt->dt_mask + 1, size, entries);
+	dt = dircache_table_alloc(size);
+	dt->dt_old = odt;
+	atomic_store_rel_ptr((volatile uintptr_t *)&dh->dh_table,
+	    (uintptr_t)dt);
+	for (i = 0; i < MAXCPU; i++) {
+		dl = &dircache_locks[i];
+		mtx_lock(&dl->dl_mtx);
+#ifdef PEFS_DIRCACHE_EPOCH
+		seqc_write_begin(&dl->dl_seqc);
+#endif
+		for (b = i; b <= odt->dt_mask; b += MAXCPU) {
+			while ((pde = DIRCACHE_HASH_FIRST(
+			    &odt->dt_buckets[b])) != NULL) {
+				DIRCACHE_HASH_REMOVE(pde, pde_hash_entry);
+				DIRCACHE_HASH_INSERT_HEAD(DIRCACHE_BUCKET(dt,
+				    pde->pde_namehash), pde, pde_hash_entry);
+			}
+			while ((pde = DIRCACHE_HASH_FIRST(
+			    &odt->dt_buckets[odt->dt_mask + 1 + b])) != NULL) {
+				DIRCACHE_HASH_REMOVE(pde, pde_enchash_entry);
+				DIRCACHE_HASH_INSERT_HEAD(DIRCACHE_ENCBUCKET(dt,
+				    pde->pde_encnamehash), pde,
+				    pde_enchash_entry);
+			}
+		}
+#ifdef PEFS_DIRCACHE_EPOCH
+		seqc_write_end(&dl->dl_seqc);
+#endif
+		mtx_unlock(&dl->dl_mtx);
+	}
+	atomic_store_rel_ptr((volatile uintptr_t *)&dt->dt_old, 0);
+
+	/* Wait for lookups that can still reference old table. */
+#ifdef PEFS_DIRCACHE_EPOCH
+	epoch_wait_preempt(dircache_epoch);
+#else
+	for (i = 0; i < MAXCPU; i++) {
+		mtx_lock(&dircache_locks[i].dl_mtx);
+		mtx_unlock(&dircache_locks[i].dl_mtx);
 	}
+#endif
+	sx_xunlock(&dh->dh_resize_lock);
+	free(odt, M_PEFSHASH);
+
+	if (dh == &dircache_global)
+		dircache_buckets = size;
+	atomic_add_long(&dircache_resizes, 1);
+	atomic_store_rel_int(&dh->dh_resize_pending, 0);
+	dircache_resize_schedule(dh);
 }
 
 static void
-pefs_dircache_pool_uninit(struct pefs_dircache_pool *pdp)
+dircache_hash_histogram(struct dircache_hash *dh,
+    u_long hist[2][DIRCACHE_HIST_SIZE])
 {
-	free(pdp->pdp_tbl, M_PEFSHASH);
-	free(pdp->pdp_enctbl, M_PEFSHASH);
-	pdp->pdp_tbl = NULL;
-	pdp->pdp_enctbl = NULL;
+	struct dircache_table *dt;
+	struct pefs_dircache_entry *pde;
+	struct mtx *mtx;
+	u_long b, n;
+
+	sx_slock(&dh->dh_resize_lock);
+	dt = dh->dh_table;
+	for (b = 0; b <= dt->dt_mask; b++) {
+		mtx = DIRCACHE_MTX(b);
+		mtx_lock(mtx);
+		n = 0;
+		DIRCACHE_HASH_FOREACH(pde, &dt->dt_buckets[b], pde_hash_entry)
+			n++;
+		hist[0][MIN(n, DIRCACHE_HIST_SIZE - 1)]++;
+		n = 0;
+		DIRCACHE_HASH_FOREACH(pde, &dt->dt_buckets[dt->dt_mask + 1 + b],
+		    pde_enchash_entry)
+			n++;
+		hist[1][MIN(n, DIRCACHE_HIST_SIZE - 1)]++;
+		mtx_unlock(mtx);
+	}
+	sx_sunlock(&dh->dh_resize_lock);
 }
 
-struct pefs_dircache_pool *
-pefs_dircache_pool_create(void)
+static int
+dircache_sysctl_histogram(SYSCTL_HANDLER_ARGS)
 {
+	u_long hist[2][DIRCACHE_HIST_SIZE];
 	struct pefs_dircache_pool *pdp;
+	struct sbuf sb;
+	u_int i;
+	int error;
 
+	bzero(hist, sizeof(hist));
 	if (dircache_global_enable != 0)
-		return (&dircache_global);
+		dircache_hash_histogram(&dircache_global, hist);
+	sx_slock(&dircache_pools_lock);
+	LIST_FOREACH(pdp, &dircache_pools, pdp_entry) {
+		if (pdp->pdp_hash == &pdp->pdp_privhash)
+			dircache_hash_histogram(pdp->pdp_hash, hist);
+	}
+	sx_sunlock(&dircache_pools_lock);
+
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	sbuf_printf(&sb, "\nchain      names   encnames\n");
+	for (i = 0; i < DIRCACHE_HIST_SIZE; i++)
+		sbuf_printf(&sb, "%4u%s %10lu %10lu\n", i,
+		    i == DIRCACHE_HIST_SIZE - 1 ? "+" : " ",
+		    hist[0][i], hist[1][i]);
+	error = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+	return (error);
+}
+
+static __inline int
+dircache_overlimit(struct pefs_dircache_pool *pdp)
+{
+	if (pdp->pdp_maxentries != 0 &&
+	    pdp->pdp_entries > pdp->pdp_maxentries)
+		return (1);
+	return (dircache_entries > dircache_maxentries);
+}
+
+static void
+dircache_evict_schedule(struct pefs_dircache_pool *pdp)
+{
+	if (dircache_overlimit(pdp) == 0)
+		return;
+	if (atomic_cmpset_int(&dircache_evict_pending, 0, 1) != 0)
+		taskqueue_enqueue(taskqueue_thread, &dircache_evict_task);
+}
+
+/*
+ * Create mount dircache pool.  maxentries of 0 means that number of entries
+ * is limited only by global vfs.pefs.dircache.maxentries.
+ */
+struct pefs_dircache_pool *
+pefs_dircache_pool_create(u_long maxentries)
+{
+	struct pefs_dircache_pool *pdp;
+
+	pdp = malloc(sizeof(*pdp), M_PEFSHASH, M_WAITOK | M_ZERO);
+	if (dircache_global_enable != 0) {
+		pdp->pdp_hash = &dircache_global;
+	} else {
+		pdp->pdp_hash = &pdp->pdp_privhash;
+		dircache_hash_init(pdp->pdp_hash);
+	}
+	mtx_init(&pdp->pdp_lru_mtx, "pefs_dircache_lru", NULL, MTX_DEF);
+	TAILQ_INIT(&pdp->pdp_lru);
+	pdp->pdp_maxentries = maxentries;
+
+	sx_xlock(&dircache_pools_lock);
+	LIST_INSERT_HEAD(&dircache_pools, pdp, pdp_entry);
+	sx_xunlock(&dircache_pools_lock);
 
-	pdp = malloc(sizeof(*pdp), M_PEFSHASH, M_WAITOK);
-	pefs_dircache_pool_init(pdp);
 	return (pdp);
 }
 
 void
-pefs_dircache_pool_free(struct pefs_dircache_pool *pdp)
+pefs_dircache_pool_setmax(struct pefs_dircache_pool *pdp, u_long maxentries)
 {
-	if (dircache_global_enable != 0)
-		return;
+	mtx_lock(&pdp->pdp_lru_mtx);
+	pdp->pdp_maxentries = maxentries;
+	mtx_unlock(&pdp->pdp_lru_mtx);
+	dircache_evict_schedule(pdp);
+}
 
-	pefs_dircache_pool_uninit(pdp);
+void
+pefs_dircache_pool_free(struct pefs_dircache_pool *pdp)
+{
+	sx_xlock(&dircache_pools_lock);
+	LIST_REMOVE(pdp, pdp_entry);
+	sx_xunlock(&dircache_pools_lock);
+
+	MPASS(TAILQ_EMPTY(&pdp->pdp_lru) && pdp->pdp_entries == 0);
+	mtx_destroy(&pdp->pdp_lru_mtx);
+	if (pdp->pdp_hash == &pdp->pdp_privhash)
+		dircache_hash_uninit(pdp->pdp_hash);
 	free(pdp, M_PEFSHASH);
 }
 
+void
+pefs_dircache_pool_stats(struct pefs_dircache_pool *pdp,
+    struct pefs_dircache_stats *pds)
+{
+	mtx_lock(&pdp->pdp_lru_mtx);
+	pds->pds_entries = pdp->pdp_entries;
+	pds->pds_evictions = pdp->pdp_evictions;
+	mtx_unlock(&pdp->pdp_lru_mtx);
+	pds->pds_collisions = pdp->pdp_collisions;
+	pds->pds_purges = pdp->pdp_purges;
+}
+
+static __inline uint64_t
+dircache_rotl64(uint64_t x, int r)
+{
+	return ((x << r) | (x >> (64 - r)));
+}
+
+static __inline uint64_t
+dircache_hashround(uint64_t acc, uint64_t v)
+{
+	acc += v * DIRCACHE_PRIME2;
+	acc = dircache_rotl64(acc, 31);
+	return (acc * DIRCACHE_PRIME1);
+}
+
+/*
+ * Seeded 64-bit string hash, xxHash64 construction.  Four independent lanes
+ * consume 32 byte blocks, which lets compiler keep them in separate registers
+ * and vectorize.  Seed is a per-boot secret, so that names colliding in a
+ * single chain can't be precomputed.
+ */
+static uint64_t
+dircache_hashbuf(const void *buf, size_t len, uint64_t seed)
+{
+	const uint8_t *p = buf, *end = p + len;
+	uint64_t h, v[4];
+	int i;
+
+	if (len >= 32) {
+		v[0] = seed + DIRCACHE_PRIME1 + DIRCACHE_PRIME2;
+		v[1] = seed + DIRCACHE_PRIME2;
+		v[2] = seed;
+		v[3] = seed - DIRCACHE_PRIME1;
+		for (; p + 32 <= end; p += 32) {
+			for (i = 0; i < 4; i++)
+				v[i] = dircache_hashround(v[i],
+				    le64dec(p + i * 8));
+		}
+		h = dircache_rotl64(v[0], 1) + dircache_rotl64(v[1], 7) +
+		    dircache_rotl64(v[2], 12) + dircache_rotl64(v[3], 18);
+		for (i = 0; i < 4; i++) {
+			h ^= dircache_hashround(0, v[i]);
+			h = h * DIRCACHE_PRIME1 + DIRCACHE_PRIME4;
+		}
+	} else
+		h = seed + DIRCACHE_PRIME3;
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= dircache_hashround(0, le64dec(p));
+		h = dircache_rotl64(h, 27) * DIRCACHE_PRIME1 + DIRCACHE_PRIME4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)le32dec(p) * DIRCACHE_PRIME1;
+		h = dircache_rotl64(h, 23) * DIRCACHE_PRIME2 + DIRCACHE_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * DIRCACHE_PRIME4;
+		h = dircache_rotl64(h, 11) * DIRCACHE_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= DIRCACHE_PRIME2;
+	h ^= h >> 29;
+	h *= DIRCACHE_PRIME3;
+	h ^= h >> 32;
+	return (h);
+}
+
 static __inline uint32_t
 dircache_hashname(struct pefs_dircache *pd, char const *buf, size_t len)
 {
-	uint32_t h;
+	uint64_t h;
 
-	h = pefs_hash_mixptr(pd);
-	h ^= hash32_buf(buf, len, HASHINIT * len);
-	return (h);
+	h = dircache_hashbuf(buf, len, dircache_seed ^ (uintptr_t)pd);
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
+static __inline size_t
+dircache_entry_size(size_t name_len, size_t encname_len)
+{
+	return (offsetof(struct pefs_dircache_entry, pde_name) +
+	    name_len + 1 + encname_len + 1);
+}
+
+static __inline uma_zone_t
+dircache_entry_zone(size_t size)
+{
+	u_int i;
+
+	for (i = 0; i < nitems(dircache_entry_zones) - 1; i++)
+		if (size <= dircache_entry_zones[i].size)
+			break;
+	MPASS(size <= dircache_entry_zones[i].size);
+	return (dircache_entry_zones[i].zone);
+}
+
+static struct pefs_dircache_entry *
+dircache_entry_alloc(size_t name_len, size_t encname_len)
+{
+	struct pefs_dircache_entry *pde;
+
+	pde = uma_zalloc(dircache_entry_zone(dircache_entry_size(name_len,
+	    encname_len)), M_WAITOK | M_ZERO);
+	pde->pde_namelen = name_len;
+	pde->pde_encnamelen = encname_len;
+	pde->pde_encname = pde->pde_name + name_len + 1;
+
+	return (pde);
+}
+
+/* Wipe only bytes used by names instead of the whole zone item. */
+static void
+dircache_entry_zfree(struct pefs_dircache_entry *pde)
+{
+	size_t size;
+
+	size = dircache_entry_size(pde->pde_namelen, pde->pde_encnamelen);
+	pefs_zone_dtor_bzero(pde, size, NULL);
+	uma_zfree(dircache_entry_zone(size), pde);
 }
 
+#ifdef PEFS_DIRCACHE_EPOCH
+static void
+dircache_entry_zfree_epoch(epoch_context_t ctx)
+{
+	dircache_entry_zfree(__containerof(ctx, struct pefs_dircache_entry,
+	    pde_epoch_ctx));
+}
+#endif
+
 static void
 dircache_entry_free(struct pefs_dircache_entry *pde)
 {
@@ -216,7 +776,13 @@ dircache_entry_free(struct pefs_dircache_entry *pde)
 	LIST_REMOVE(pde, pde_dir_entry);
 
 	atomic_subtract_long(&dircache_entries, 1);
-	uma_zfree(dircache_entry_zone, pde);
+#ifdef PEFS_DIRCACHE_EPOCH
+	/* Entry can still be referenced by lookups in other directories. */
+	epoch_call(dircache_epoch, dircache_entry_zfree_epoch,
+	    &pde->pde_epoch_ctx);
+#else
+	dircache_entry_zfree(pde);
+#endif
 }
 
 static void
@@ -230,32 +796,50 @@ dircache_gc_locked(struct pefs_dircache *pd)
 	}
 }
 
+/*
+ * Move entry to stale list.  Entry should be already removed from LRU list.
+ */
 static void
-dircache_entry_expire_locked(struct pefs_dircache_entry *pde)
+dircache_entry_unhash_locked(struct pefs_dircache_entry *pde)
 {
-	struct pefs_dircache_pool *pdp;
-	struct pefs_dircache_listhead *bucket;
+	struct dircache_hash *dh;
 	struct pefs_dircache *pd;
-	struct mtx_padalign *bucket_mtx;
+	struct mtx *bucket_mtx;
 
 	pd = pde->pde_dircache;
-	pdp = pd->pd_pool;
+	dh = pd->pd_pool->pdp_hash;
+	mtx_assert(&pd->pd_mtx, MA_OWNED);
 	pde->pde_dircache = NULL;
 
 	LIST_REMOVE(pde, pde_dir_entry);
 	LIST_INSERT_HEAD(&pd->pd_stalehead, pde, pde_dir_entry);
 
-	bucket = DIRCACHE_TBL(pdp, pde->pde_namehash);
 	bucket_mtx = DIRCACHE_MTX(pde->pde_namehash);
 	mtx_lock(bucket_mtx);
-	LIST_REMOVE(pde, pde_hash_entry);
+	DIRCACHE_HASH_REMOVE(pde, pde_hash_entry);
 	mtx_unlock(bucket_mtx);
 
-	bucket = DIRCACHE_ENCTBL(pdp, pde->pde_encnamehash);
 	bucket_mtx = DIRCACHE_MTX(pde->pde_encnamehash);
 	mtx_lock(bucket_mtx);
-	LIST_REMOVE(pde, pde_enchash_entry);
+	DIRCACHE_HASH_REMOVE(pde, pde_enchash_entry);
 	mtx_unlock(bucket_mtx);
+
+	atomic_subtract_long(&dh->dh_entries, 1);
+	dircache_resize_schedule(dh);
+}
+
+static void
+dircache_entry_expire_locked(struct pefs_dircache_entry *pde)
+{
+	struct pefs_dircache_pool *pdp;
+
+	pdp = pde->pde_dircache->pd_pool;
+	mtx_lock(&pdp->pdp_lru_mtx);
+	TAILQ_REMOVE(&pdp->pdp_lru, pde, pde_lru_entry);
+	pdp->pdp_entries--;
+	mtx_unlock(&pdp->pdp_lru_mtx);
+
+	dircache_entry_unhash_locked(pde);
 }
 
 static __inline int
@@ -299,39 +883,209 @@ dircache_retry_clear(struct pefs_dircache *pd)
 		atomic_store_rel_ptr((volatile uintptr_t *)&pd->pd_retry[i], 0);
 }
 
+/*
+ * Mark directory cache incomplete.  Invalidation counter prevents
+ * pefs_dircache_endupdate() of a scan already in progress from marking it
+ * complete again.
+ */
+static __inline void
+dircache_invalidate_locked(struct pefs_dircache *pd)
+{
+	mtx_assert(&pd->pd_mtx, MA_OWNED);
+	atomic_store_rel_long(&pd->pd_gen, 0);
+	pd->pd_invalgen++;
+}
+
+static __inline void
+dircache_entry_ref(struct pefs_dircache_entry *pde)
+{
+	if (pde->pde_referenced == 0)
+		pde->pde_referenced = 1;
+}
+
+/*
+ * Evict unreferenced entries from the head of LRU list until number of
+ * entries in pool drops to target.  Entries of pinned directories are kept.
+ * Directories are marked incomplete, stale entries are freed if directory
+ * vnode can be locked without sleeping, otherwise they will be freed on next
+ * pefs_dircache_gc().
+ */
+static void
+dircache_evict(struct pefs_dircache_pool *pdp, int lowmem, int global)
+{
+	struct vnode *vps[DIRCACHE_EVICT_BATCH];
+	struct pefs_dircache_entry *pde;
+	struct pefs_dircache *pd;
+	struct vnode *vp;
+	u_long scan, target;
+	u_int i, nvps;
+
+	mtx_lock(&pdp->pdp_lru_mtx);
+	target = pdp->pdp_entries;
+	if (lowmem != 0)
+		target /= 2;
+	else if (global != 0)
+		target -= target / 8;
+	if (pdp->pdp_maxentries != 0 && pdp->pdp_entries > pdp->pdp_maxentries)
+		target = ulmin(target,
+		    pdp->pdp_maxentries - pdp->pdp_maxentries / 8);
+	/* Every entry is visited at most twice: to clear reference and evict */
+	scan = 2 * pdp->pdp_entries;
+	while (pdp->pdp_entries > target && scan > 0) {
+		nvps = 0;
+		while (pdp->pdp_entries > target && scan > 0 &&
+		    nvps < DIRCACHE_EVICT_BATCH) {
+			scan--;
+			pde = TAILQ_FIRST(&pdp->pdp_lru);
+			TAILQ_REMOVE(&pdp->pdp_lru, pde, pde_lru_entry);
+			pd = pde->pde_dircache;
+			if (pde->pde_referenced != 0 ||
+			    mtx_trylock(&pd->pd_mtx) == 0) {
+				pde->pde_referenced = 0;
+				TAILQ_INSERT_TAIL(&pdp->pdp_lru, pde,
+				    pde_lru_entry);
+				continue;
+			}
+			if (pd->pd_pinned != 0) {
+				mtx_unlock(&pd->pd_mtx);
+				TAILQ_INSERT_TAIL(&pdp->pdp_lru, pde,
+				    pde_lru_entry);
+				continue;
+			}
+			pdp->pdp_entries--;
+			/* Negative lookups are no longer reliable */
+			dircache_invalidate_locked(pd);
+			dircache_retry_clear(pd);
+			dircache_entry_unhash_locked(pde);
+			for (i = 0; i < nvps; i++)
+				if (vps[i] == pd->pd_vnode)
+					break;
+			if (i == nvps) {
+				vps[nvps++] = pd->pd_vnode;
+				vhold(pd->pd_vnode);
+			}
+			mtx_unlock(&pd->pd_mtx);
+			pdp->pdp_evictions++;
+			atomic_add_long(&dircache_evictions, 1);
+		}
+		mtx_unlock(&pdp->pdp_lru_mtx);
+
+		for (i = 0; i < nvps; i++) {
+			vp = vps[i];
+			if (vn_lock(vp, LK_EXCLUSIVE | LK_NOWAIT) == 0) {
+				if (!VN_IS_DOOMED(vp))
+					pefs_dircache_gc(VP_TO_PN(vp)->pn_dircache);
+				PEFS_VOP_UNLOCK(vp);
+			}
+			vdrop(vp);
+		}
+
+		mtx_lock(&pdp->pdp_lru_mtx);
+	}
+	mtx_unlock(&pdp->pdp_lru_mtx);
+}
+
+static void
+dircache_evict_task_fn(void *context __unused, int pending __unused)
+{
+	struct pefs_dircache_pool *pdp;
+	int global, lowmem;
+
+	atomic_store_rel_int(&dircache_evict_pending, 0);
+	lowmem = atomic_readandclear_int(&dircache_lowmem);
+	global = (dircache_entries > dircache_maxentries);
+
+	sx_slock(&dircache_pools_lock);
+	LIST_FOREACH(pdp, &dircache_pools, pdp_entry) {
+		if (lowmem != 0 || global != 0 || dircache_overlimit(pdp) != 0)
+			dircache_evict(pdp, lowmem, global);
+	}
+	sx_sunlock(&dircache_pools_lock);
+}
+
+static void
+dircache_lowmem_handler(void *arg __unused, int flags __unused)
+{
+	if (dircache_entries == 0)
+		return;
+	atomic_store_rel_int(&dircache_lowmem, 1);
+	taskqueue_enqueue(taskqueue_thread, &dircache_evict_task);
+}
+
 struct pefs_dircache *
-pefs_dircache_create(struct pefs_dircache_pool *pdp)
+pefs_dircache_create(struct pefs_dircache_pool *pdp, struct vnode *vp)
 {
 	struct pefs_dircache *pd;
 
 	pd = uma_zalloc(dircache_zone, M_WAITOK | M_ZERO);
 	mtx_init(&pd->pd_mtx, "pefs_dircache_mtx", NULL, MTX_DEF);
 	pd->pd_pool = pdp;
+	pd->pd_vnode = vp;
 	LIST_INIT(&pd->pd_activehead);
 	LIST_INIT(&pd->pd_stalehead);
 
 	return (pd);
 }
 
-void
-pefs_dircache_purge(struct pefs_dircache *pd)
+static void
+dircache_purge(struct pefs_dircache *pd)
 {
 	struct pefs_dircache_entry *pde, *tmp;
-
-	if (pd == NULL)
-		return;
+	struct pefs_keyorder pko;
 
 	// ASSERT_VOP_ELOCKED
 	mtx_lock(&pd->pd_mtx);
-	atomic_store_rel_long(&pd->pd_gen, 0);
+	dircache_invalidate_locked(pd);
 	LIST_FOREACH_SAFE(pde, &pd->pd_activehead, pde_dir_entry, tmp) {
 		dircache_entry_expire_locked(pde);
 	}
+	pko = pd->pd_keyorder;
+	bzero(&pd->pd_keyorder, sizeof(pd->pd_keyorder));
 	mtx_unlock(&pd->pd_mtx);
 
+	pefs_keyorder_release(&pko);
 	pefs_dircache_gc(pd);
 }
 
+void
+pefs_dircache_purge(struct pefs_dircache *pd)
+{
+	if (pd == NULL)
+		return;
+
+	atomic_add_long(&pd->pd_pool->pdp_purges, 1);
+	dircache_purge(pd);
+}
+
+/*
+ * Return copy of directory key order, caller should release it with
+ * pefs_keyorder_release() or pass to pefs_dircache_keyorder_set().
+ */
+void
+pefs_dircache_keyorder_get(struct pefs_dircache *pd, struct pefs_keyorder *pko)
+{
+	mtx_lock(&pd->pd_mtx);
+	pefs_keyorder_copy(pko, &pd->pd_keyorder);
+	mtx_unlock(&pd->pd_mtx);
+}
+
+/*
+ * Replace directory key order, references are transferred from pko.
+ */
+void
+pefs_dircache_keyorder_set(struct pefs_dircache *pd, struct pefs_keyorder *pko)
+{
+	struct pefs_keyorder old;
+
+	mtx_lock(&pd->pd_mtx);
+	old = pd->pd_keyorder;
+	pd->pd_keyorder = *pko;
+	mtx_unlock(&pd->pd_mtx);
+
+	bzero(pko, sizeof(*pko));
+	pefs_keyorder_release(&old);
+}
+
 void
 pefs_dircache_expire(struct pefs_dircache_entry *pde, u_int dflags)
 {
@@ -341,7 +1095,8 @@ pefs_dircache_expire(struct pefs_dircache_entry *pde, u_int dflags)
 	if (pd == NULL)
 		return;
 	mtx_lock(&pd->pd_mtx);
-	atomic_store_rel_long(&pd->pd_gen, 0);
+	if ((dflags & PEFS_DF_NOINVAL) == 0)
+		dircache_invalidate_locked(pd);
 	dircache_retry_clear(pd);
 	if (pde->pde_dircache != NULL) {
 		dircache_entry_expire_locked(pde);
@@ -379,13 +1134,95 @@ pefs_dircache_gc(struct pefs_dircache *pd)
 	mtx_unlock(&pd->pd_mtx);
 }
 
+/*
+ * Keep directory entries from being evicted.  Names decrypted while reading
+ * directory are inserted into the cache and looked up again by encrypted name
+ * afterwards, eviction in between would make them disappear.
+ */
+void
+pefs_dircache_pin(struct pefs_dircache *pd)
+{
+	mtx_lock(&pd->pd_mtx);
+	pd->pd_pinned++;
+	mtx_unlock(&pd->pd_mtx);
+}
+
+void
+pefs_dircache_unpin(struct pefs_dircache *pd)
+{
+	mtx_lock(&pd->pd_mtx);
+	MPASS(pd->pd_pinned > 0);
+	pd->pd_pinned--;
+	mtx_unlock(&pd->pd_mtx);
+}
+
+/*
+ * Directory is about to be modified by pefs itself with directory vnode
+ * locked.  gen is lower directory generation before modification.  Returns
+ * nonzero if cache is valid: caller should apply the change to the cache using
+ * pefs_dircache_insert() and pefs_dircache_expire() with PEFS_DF_NOINVAL flag.
+ * Every call should be followed by pefs_dircache_endchange().
+ */
+int
+pefs_dircache_beginchange(struct pefs_dircache *pd, u_long gen)
+{
+	int valid;
+
+	mtx_lock(&pd->pd_mtx);
+	/* Give up if there are concurrent changes (rename unlocks directory). */
+	if (pd->pd_changes++ == 0 && gen != 0 && pd->pd_gen == gen)
+		pd->pd_changegen = gen;
+	else
+		pd->pd_changegen = 0;
+	valid = (pd->pd_changegen != 0);
+	mtx_unlock(&pd->pd_mtx);
+
+	return (valid);
+}
+
+/*
+ * Finish directory modification.  gen is lower directory generation after
+ * modification or 0 if modification failed.  Cache generation is advanced
+ * if cache was valid and no other changes happened meanwhile, otherwise
+ * cache is invalidated.
+ */
+void
+pefs_dircache_endchange(struct pefs_dircache *pd, u_long gen)
+{
+	mtx_lock(&pd->pd_mtx);
+	MPASS(pd->pd_changes > 0);
+	pd->pd_changes--;
+	if (gen != 0 && pd->pd_changes == 0 && pd->pd_changegen != 0 &&
+	    pd->pd_gen == pd->pd_changegen) {
+		atomic_store_rel_long(&pd->pd_gen, gen);
+	} else {
+		dircache_invalidate_locked(pd);
+		pd->pd_changegen = 0;
+	}
+	mtx_unlock(&pd->pd_mtx);
+}
+
+/*
+ * Finish full directory scan started with pefs_dircache_beginupdate().
+ * Cache is marked complete for lower directory generation gen only if no
+ * entries were evicted or expired during the scan.
+ */
+void
+pefs_dircache_endupdate(struct pefs_dircache *pd, u_long gen, u_long invalgen)
+{
+	mtx_lock(&pd->pd_mtx);
+	if (pd->pd_invalgen == invalgen)
+		atomic_store_rel_long(&pd->pd_gen, gen);
+	mtx_unlock(&pd->pd_mtx);
+}
+
 void
 pefs_dircache_free(struct pefs_dircache *pd)
 {
 	if (pd == NULL)
 		return;
 
-	pefs_dircache_purge(pd);
+	dircache_purge(pd);
 	mtx_destroy(&pd->pd_mtx);
 	uma_zfree(dircache_zone, pd);
 }
@@ -396,30 +1233,28 @@ pefs_dircache_insert(struct pefs_dircache *pd, struct pefs_tkey *ptk,
     char const *encname, size_t encname_len)
 {
 	struct pefs_dircache_pool *pdp;
-	struct pefs_dircache_listhead *bucket;
 	struct pefs_dircache_entry *pde, *xpde;
-	struct mtx_padalign *bucket_mtx;
+	struct dircache_table *dt;
+	struct mtx *bucket_mtx;
 
 	MPASS(ptk->ptk_key != NULL);
 
-	if (name_len == 0 || name_len >= sizeof(pde->pde_name) ||
-	    encname_len == 0 || encname_len >= sizeof(pde->pde_encname))
+	if (name_len == 0 || name_len > PEFS_CACHENAME_MAXLEN ||
+	    encname_len == 0 || encname_len > MAXNAMLEN)
 		panic("pefs: invalid file name length: %zd/%zd",
 		    name_len, encname_len);
 
-	pde = uma_zalloc(dircache_entry_zone, M_WAITOK | M_ZERO);
+	pde = dircache_entry_alloc(name_len, encname_len);
 	pde->pde_dircache = pd;
 
 	pde->pde_tkey = *ptk;
 	pefs_key_ref(pde->pde_tkey.ptk_key);
 
-	pde->pde_namelen = name_len;
 	memcpy(pde->pde_name, name, name_len);
 	pde->pde_name[name_len] = '\0';
 	pde->pde_namehash = dircache_hashname(pd, pde->pde_name,
 	    pde->pde_namelen);
 
-	pde->pde_encnamelen = encname_len;
 	memcpy(pde->pde_encname, encname, encname_len);
 	pde->pde_encname[encname_len] = '\0';
 	pde->pde_encnamehash = dircache_hashname(pd, pde->pde_encname,
@@ -430,35 +1265,54 @@ pefs_dircache_insert(struct pefs_dircache *pd, struct pefs_tkey *ptk,
 
 	mtx_lock(&pd->pd_mtx);
 
-	bucket = DIRCACHE_ENCTBL(pdp, pde->pde_encnamehash);
+	/*
+	 * Table is resolved under bucket mutex: entries of a bucket are
+	 * either in the current table or in the old one being migrated.
+	 */
 	bucket_mtx = DIRCACHE_MTX(pde->pde_encnamehash);
 	mtx_lock(bucket_mtx);
-	LIST_FOREACH(xpde, bucket, pde_enchash_entry) {
-		if (xpde->pde_dircache == pd &&
-		    dircache_cmp_encname(xpde, pde->pde_encnamehash,
-		    encname, encname_len) != 0) {
-			mtx_unlock(bucket_mtx);
-			mtx_unlock(&pd->pd_mtx);
-			PEFSDEBUG("pefs_dircache_insert: collision %s\n",
-			    pde->pde_name);
-			pefs_key_release(pde->pde_tkey.ptk_key);
-			uma_zfree(dircache_entry_zone, pde);
-			return (xpde);
+	for (dt = pdp->pdp_hash->dh_table; dt != NULL; dt = dt->dt_old) {
+		DIRCACHE_HASH_FOREACH(xpde,
+		    DIRCACHE_ENCBUCKET(dt, pde->pde_encnamehash),
+		    pde_enchash_entry) {
+			if (xpde->pde_dircache == pd &&
+			    dircache_cmp_encname(xpde, pde->pde_encnamehash,
+			    encname, encname_len) != 0) {
+				mtx_unlock(bucket_mtx);
+				mtx_unlock(&pd->pd_mtx);
+				atomic_add_long(&pdp->pdp_collisions, 1);
+				PEFSDEBUG("pefs_dircache_insert: "
+				    "collision %s\n", pde->pde_name);
+				pefs_key_release(pde->pde_tkey.ptk_key);
+				dircache_entry_zfree(pde);
+				return (xpde);
+			}
 		}
 	}
-	LIST_INSERT_HEAD(bucket, pde, pde_enchash_entry);
+	dt = pdp->pdp_hash->dh_table;
+	DIRCACHE_HASH_INSERT_HEAD(DIRCACHE_ENCBUCKET(dt, pde->pde_encnamehash),
+	    pde, pde_enchash_entry);
 	mtx_unlock(bucket_mtx);
 
-	bucket = DIRCACHE_TBL(pdp, pde->pde_namehash);
 	bucket_mtx = DIRCACHE_MTX(pde->pde_namehash);
 	mtx_lock(bucket_mtx);
-	LIST_INSERT_HEAD(bucket, pde, pde_hash_entry);
+	dt = pdp->pdp_hash->dh_table;
+	DIRCACHE_HASH_INSERT_HEAD(DIRCACHE_BUCKET(dt, pde->pde_namehash),
+	    pde, pde_hash_entry);
 	mtx_unlock(bucket_mtx);
 
 	LIST_INSERT_HEAD(&pd->pd_activehead, pde, pde_dir_entry);
+
+	mtx_lock(&pdp->pdp_lru_mtx);
+	TAILQ_INSERT_TAIL(&pdp->pdp_lru, pde, pde_lru_entry);
+	pdp->pdp_entries++;
+	mtx_unlock(&pdp->pdp_lru_mtx);
 	mtx_unlock(&pd->pd_mtx);
 
 	atomic_add_long(&dircache_entries, 1);
+	atomic_add_long(&pdp->pdp_hash->dh_entries, 1);
+	dircache_resize_schedule(pdp->pdp_hash);
+	dircache_evict_schedule(pdp);
 
 	PEFSDEBUG("pefs_dircache_insert: %p %s -> %s\n",
 	    pde, pde->pde_name, pde->pde_encname);
@@ -471,29 +1325,39 @@ pefs_dircache_lookup(struct pefs_dircache *pd, char const *name,
     size_t name_len)
 {
 	struct pefs_dircache_entry *pde;
-	struct pefs_dircache_listhead *bucket;
-	struct mtx_padalign *bucket_mtx;
+	struct dircache_table *dt;
+	struct dircache_hash *dh;
+	struct dircache_rlock rl;
 	uint32_t h;
 
 	MPASS(pd != NULL);
 
 	h = dircache_hashname(pd, name, name_len);
-	bucket = DIRCACHE_TBL(pd->pd_pool, h);
-	bucket_mtx = DIRCACHE_MTX(h);
-	mtx_lock(bucket_mtx);
-	LIST_FOREACH(pde, bucket, pde_hash_entry) {
-		if (pde->pde_dircache == pd &&
-		    dircache_cmp_name(pde, h, name, name_len) != 0) {
-			mtx_unlock(bucket_mtx);
-			PEFSDEBUG("pefs_dircache_lookup: found %s -> %s\n",
-			    pde->pde_name, pde->pde_encname);
-			dircache_retry_set(pd, pde);
-			return (pde);
+	dh = pd->pd_pool->pdp_hash;
+	DIRCACHE_RLOCK(&rl, h);
+	do {
+		for (dt = dircache_table_get(dh); dt != NULL;
+		    dt = dircache_table_getold(dt)) {
+			DIRCACHE_HASH_FOREACH(pde, DIRCACHE_BUCKET(dt, h),
+			    pde_hash_entry) {
+				if (pde->pde_dircache == pd &&
+				    dircache_cmp_name(pde, h, name,
+				    name_len) != 0)
+					goto found;
+			}
 		}
-	}
-	mtx_unlock(bucket_mtx);
+	} while (DIRCACHE_RRETRY(&rl));
+	DIRCACHE_RUNLOCK(&rl);
 	PEFSDEBUG("pefs_dircache_lookup: not found %s\n", name);
 	return (NULL);
+
+found:
+	DIRCACHE_RUNLOCK(&rl);
+	PEFSDEBUG("pefs_dircache_lookup: found %s -> %s\n",
+	    pde->pde_name, pde->pde_encname);
+	dircache_entry_ref(pde);
+	dircache_retry_set(pd, pde);
+	return (pde);
 }
 
 struct pefs_dircache_entry *
@@ -501,27 +1365,37 @@ pefs_dircache_enclookup(struct pefs_dircache *pd, char const *encname,
     size_t encname_len)
 {
 	struct pefs_dircache_entry *pde;
-	struct pefs_dircache_listhead *bucket;
-	struct mtx_padalign *bucket_mtx;
+	struct dircache_table *dt;
+	struct dircache_hash *dh;
+	struct dircache_rlock rl;
 	uint32_t h;
 
 	h = dircache_hashname(pd, encname, encname_len);
-	bucket = DIRCACHE_ENCTBL(pd->pd_pool, h);
-	bucket_mtx = DIRCACHE_MTX(h);
-	mtx_lock(bucket_mtx);
-	LIST_FOREACH(pde, bucket, pde_enchash_entry) {
-		if (pde->pde_dircache == pd &&
-		    dircache_cmp_encname(pde, h, encname, encname_len) != 0) {
-			mtx_unlock(bucket_mtx);
-			PEFSDEBUG("pefs_dircache_enclookup: found %s -> %s\n",
-			    pde->pde_name, pde->pde_encname);
-			dircache_retry_set(pd, pde);
-			return (pde);
+	dh = pd->pd_pool->pdp_hash;
+	DIRCACHE_RLOCK(&rl, h);
+	do {
+		for (dt = dircache_table_get(dh); dt != NULL;
+		    dt = dircache_table_getold(dt)) {
+			DIRCACHE_HASH_FOREACH(pde, DIRCACHE_ENCBUCKET(dt, h),
+			    pde_enchash_entry) {
+				if (pde->pde_dircache == pd &&
+				    dircache_cmp_encname(pde, h, encname,
+				    encname_len) != 0)
+					goto found;
+			}
 		}
-	}
-	mtx_unlock(bucket_mtx);
+	} while (DIRCACHE_RRETRY(&rl));
+	DIRCACHE_RUNLOCK(&rl);
 	PEFSDEBUG("pefs_dircache_enclookup: not found %s\n", encname);
 	return (NULL);
+
+found:
+	DIRCACHE_RUNLOCK(&rl);
+	PEFSDEBUG("pefs_dircache_enclookup: found %s -> %s\n",
+	    pde->pde_name, pde->pde_encname);
+	dircache_entry_ref(pde);
+	dircache_retry_set(pd, pde);
+	return (pde);
 }
 
 struct pefs_dircache_entry *
@@ -537,9 +1411,12 @@ pefs_dircache_lookup_retry(struct pefs_dircache *pd, char const *name,
 		if (pde != NULL && pde->pde_dircache == pd &&
 		    pde->pde_namelen == name_len &&
 		    memcmp(pde->pde_name, name, name_len) == 0)
-			return (pde);
+			break;
 	}
-	return (NULL);
+	if (i == PEFS_DIRCACHE_RETRY_COUNT)
+		return (NULL);
+	dircache_entry_ref(pde);
+	return (pde);
 }
 
 struct pefs_dircache_entry *
@@ -555,7 +1432,10 @@ pefs_dircache_enclookup_retry(struct pefs_dircache *pd, char const *encname,
 		if (pde != NULL && pde->pde_dircache == pd &&
 		    pde->pde_encnamelen == encname_len &&
 		    memcmp(pde->pde_encname, encname, encname_len) == 0)
-			return (pde);
+			break;
 	}
-	return (NULL);
+	if (i == PEFS_DIRCACHE_RETRY_COUNT)
+		return (NULL);
+	dircache_entry_ref(pde);
+	return (pde);
 }
@@ -26,6 +26,23 @@
  * $FreeBSD$
  */
 
+/*
+ * Hash chains are traversed without locks, entries are freed after epoch
+ * grace period.  Define PEFS_DIRCACHE_NOEPOCH to use bucket locks instead.
+ */
+#if __FreeBSD_version >= 1300100 && !defined(PEFS_DIRCACHE_NOEPOCH)
+#define	PEFS_DIRCACHE_EPOCH
+#endif
+
+#ifdef PEFS_DIRCACHE_EPOCH
+#include <sys/ck.h>
+#include <sys/epoch.h>
+#define	PEFS_DIRCACHE_HASH_HEAD		CK_LIST_HEAD
+#define	PEFS_DIRCACHE_HASH_ENTRY	CK_LIST_ENTRY
+#else
+#define	PEFS_DIRCACHE_HASH_HEAD		LIST_HEAD
+#define	PEFS_DIRCACHE_HASH_ENTRY	LIST_ENTRY
+#endif
 
 #define	PEFS_CACHENAME_MAXLEN		PEFS_NAME_PTON_SIZE(MAXNAMLEN)
 
@@ -33,32 +50,57 @@
 #define	PEFS_DIRCACHE_RETRY_MASK	(PEFS_DIRCACHE_RETRY_COUNT - 1)
 
 #define	PEFS_DF_FORCE_GC		0x0001
+#define	PEFS_DF_NOINVAL			0x0002
 
 struct pefs_dircache_pool;
 struct pefs_dircache_entry;
 LIST_HEAD(pefs_dircache_listhead, pefs_dircache_entry);
+PEFS_DIRCACHE_HASH_HEAD(pefs_dircache_hashhead, pefs_dircache_entry);
+TAILQ_HEAD(pefs_dircache_lruhead, pefs_dircache_entry);
 
 struct pefs_dircache {
 	struct mtx			pd_mtx;
 	struct pefs_dircache_listhead	pd_activehead;
 	struct pefs_dircache_listhead	pd_stalehead;
 	volatile u_long			pd_gen;
+	volatile u_long			pd_invalgen;
+	u_long				pd_changegen;
+	u_int				pd_changes;
 	struct pefs_dircache_pool	*pd_pool;
+	struct vnode			*pd_vnode;
 	struct pefs_dircache_entry	*pd_retry[PEFS_DIRCACHE_RETRY_COUNT];
+	struct pefs_keyorder		pd_keyorder;
+	u_int				pd_pinned;
 };
 
 struct pefs_dircache_entry {
 	LIST_ENTRY(pefs_dircache_entry) pde_dir_entry;
-	LIST_ENTRY(pefs_dircache_entry) pde_hash_entry;
-	LIST_ENTRY(pefs_dircache_entry) pde_enchash_entry;
+	PEFS_DIRCACHE_HASH_ENTRY(pefs_dircache_entry) pde_hash_entry;
+	PEFS_DIRCACHE_HASH_ENTRY(pefs_dircache_entry) pde_enchash_entry;
+	TAILQ_ENTRY(pefs_dircache_entry) pde_lru_entry;
 	struct pefs_dircache	*pde_dircache;
 	struct pefs_tkey	pde_tkey;
+#ifdef PEFS_DIRCACHE_EPOCH
+	struct epoch_context	pde_epoch_ctx;
+#endif
 	uint32_t		pde_namehash;
 	uint32_t		pde_encnamehash;
 	uint16_t		pde_namelen;
 	uint16_t		pde_encnamelen;
-	char			pde_name[PEFS_CACHENAME_MAXLEN + 1];
-	char			pde_encname[MAXNAMLEN + 1];
+	volatile u_int		pde_referenced;
+	char			*pde_encname;
+	/* Name and encrypted name, allocated according to their lengths */
+	char			pde_name[];
+};
+
+/*
+ * Per mount pool counters.
+ */
+struct pefs_dircache_stats {
+	u_long			pds_entries;	/* entries in the pool */
+	u_long			pds_evictions;	/* entries evicted */
+	u_long			pds_collisions;	/* inserts of cached names */
+	u_long			pds_purges;	/* directory purges */
 };
 
 extern int			pefs_dircache_enable;
@@ -66,10 +108,15 @@ extern int			pefs_dircache_enable;
 void	pefs_dircache_init(void);
 void	pefs_dircache_uninit(void);
 
-struct pefs_dircache_pool *pefs_dircache_pool_create(void);
+struct pefs_dircache_pool *pefs_dircache_pool_create(u_long maxentries);
+void	pefs_dircache_pool_setmax(struct pefs_dircache_pool *pdp,
+	    u_long maxentries);
 void	pefs_dircache_pool_free(struct pefs_dircache_pool *);
+void	pefs_dircache_pool_stats(struct pefs_dircache_pool *pdp,
+	    struct pefs_dircache_stats *pds);
 
-struct pefs_dircache	*pefs_dircache_create(struct pefs_dircache_pool *pdp);
+struct pefs_dircache	*pefs_dircache_create(struct pefs_dircache_pool *pdp,
+	    struct vnode *vp);
 void	pefs_dircache_purge(struct pefs_dircache *pd);
 void	pefs_dircache_free(struct pefs_dircache *pd);
 struct pefs_dircache_entry *pefs_dircache_lookup(struct pefs_dircache *pd,
@@ -87,6 +134,16 @@ void	pefs_dircache_expire(struct pefs_dircache_entry *pde, u_int dflags);
 void	pefs_dircache_expire_encname(struct pefs_dircache *pd,
 	    char const *encname, size_t encname_len, u_int dflags);
 void	pefs_dircache_gc(struct pefs_dircache *pd);
+void	pefs_dircache_pin(struct pefs_dircache *pd);
+void	pefs_dircache_unpin(struct pefs_dircache *pd);
+int	pefs_dircache_beginchange(struct pefs_dircache *pd, u_long gen);
+void	pefs_dircache_endchange(struct pefs_dircache *pd, u_long gen);
+void	pefs_dircache_endupdate(struct pefs_dircache *pd, u_long gen,
+	    u_long invalgen);
+void	pefs_dircache_keyorder_get(struct pefs_dircache *pd,
+	    struct pefs_keyorder *pko);
+void	pefs_dircache_keyorder_set(struct pefs_dircache *pd,
+	    struct pefs_keyorder *pko);
 
 static __inline int
 pefs_dircache_valid(struct pefs_dircache *pd, u_long gen)
@@ -99,15 +156,14 @@ pefs_dircache_valid(struct pefs_dircache *pd, u_long gen)
 	return (gen == pd_gen);
 }
 
-static __inline void
+/*
+ * Start full directory scan.  Returned value should be passed to
+ * pefs_dircache_endupdate() to detect entries dropped during the scan.
+ */
+static __inline u_long
 pefs_dircache_beginupdate(struct pefs_dircache *pd)
 {
-}
-
-static __inline void
-pefs_dircache_endupdate(struct pefs_dircache *pd, u_long gen)
-{
-	atomic_store_rel_long(&pd->pd_gen, gen);
+	return (atomic_load_acq_long(&pd->pd_invalgen));
 }
 
 static __inline void
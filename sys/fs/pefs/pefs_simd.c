@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include <crypto/rijndael/rijndael.h>
+
+#include <fs/pefs/pefs_aes_ct.h>
+#include <fs/pefs/pefs_aesni.h>
+
+#include <immintrin.h>
+
+/*
+ * Zero buffer detection using vector registers.  Must be called within
+ * FPU kernel context.  Each iteration ORs a whole 64 byte cache line and
+ * stops on the first non-zero line, most sectors are not zero and are
+ * rejected after the first line.  Length should be multiple of 64 bytes.
+ */
+
+#define	SIMD_LINE	64
+
+int
+pefs_simd_iszero_sse2(const void *buf, size_t len)
+{
+	const __m128i *p, *end;
+	__m128i x;
+
+	p = buf;
+	end = p + len / sizeof(__m128i);
+	for (; p < end; p += SIMD_LINE / sizeof(__m128i)) {
+		x = _mm_or_si128(
+		    _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+		    _mm_or_si128(_mm_loadu_si128(p + 2),
+		    _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x,
+		    _mm_setzero_si128())) != 0xffff)
+			return (0);
+	}
+	return (1);
+}
+
+__attribute__((target("avx2"))) int
+pefs_simd_iszero_avx2(const void *buf, size_t len)
+{
+	const __m256i *p, *end;
+	__m256i x;
+
+	p = buf;
+	end = p + len / sizeof(__m256i);
+	for (; p < end; p += SIMD_LINE / sizeof(__m256i)) {
+		x = _mm256_or_si256(_mm256_loadu_si256(p),
+		    _mm256_loadu_si256(p + 1));
+		if (!_mm256_testz_si256(x, x)) {
+			_mm256_zeroupper();
+			return (0);
+		}
+	}
+	_mm256_zeroupper();
+	return (1);
+}
@@ -36,6 +36,7 @@ __FBSDID("$FreeBSD$");
 
 #include <sys/param.h>
 #include <sys/systm.h>
+#include <sys/counter.h>
 #include <sys/kernel.h>
 #include <sys/lock.h>
 #include <sys/malloc.h>
@@ -69,6 +70,8 @@ static struct pefs_node_listhead *pefs_nodehash_tbl;
 static u_long			pefs_nodehash_mask;
 
 static uma_zone_t		pefs_node_zone;
+static uma_zone_t		pefs_buf_small_zone;
+static uma_zone_t		pefs_buf_large_zone;
 
 MALLOC_DEFINE(M_PEFSHASH, "pefs_hash", "PEFS hash table");
 MALLOC_DEFINE(M_PEFSBUF, "pefs_buf", "PEFS buffers");
@@ -79,8 +82,68 @@ static u_long	pefs_nodes;
 SYSCTL_ULONG(_vfs_pefs, OID_AUTO, nodes, CTLFLAG_RD, &pefs_nodes, 0,
     "Allocated nodes");
 
+static counter_u64_t	pefs_buf_allocs;
+static u_long	pefs_buf_misses;
+static u_long	pefs_buf_bytes;
+
+static int	pefs_buf_hits_sysctl(SYSCTL_HANDLER_ARGS);
+
+SYSCTL_NODE(_vfs_pefs, OID_AUTO, buf, CTLFLAG_RW, 0,
+    "PEFS chunk buffer pool");
+SYSCTL_PROC(_vfs_pefs_buf, OID_AUTO, hits, CTLTYPE_ULONG | CTLFLAG_RD,
+    NULL, 0, pefs_buf_hits_sysctl, "LU",
+    "Buffers allocated from pool cache");
+SYSCTL_ULONG(_vfs_pefs_buf, OID_AUTO, misses, CTLFLAG_RD,
+    &pefs_buf_misses, 0, "Buffers allocated from system memory");
+SYSCTL_ULONG(_vfs_pefs_buf, OID_AUTO, bytes, CTLFLAG_RD,
+    &pefs_buf_bytes, 0, "Bytes held by pool");
+
 static void	pefs_node_free_proc(void *, int);
 
+/*
+ * Chunk buffers are cached by UMA per CPU.  Item init and fini are called
+ * only when buffer enters or leaves zone cache, i.e. on pool misses.
+ */
+static int
+pefs_buf_zone_init(void *mem __unused, int size, int flags __unused)
+{
+	atomic_add_long(&pefs_buf_misses, 1);
+	atomic_add_long(&pefs_buf_bytes, size);
+	return (0);
+}
+
+static void
+pefs_buf_zone_fini(void *mem __unused, int size)
+{
+	atomic_subtract_long(&pefs_buf_bytes, size);
+}
+
+static int
+pefs_buf_hits_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	u_long allocs, misses, hits;
+
+	allocs = counter_u64_fetch(pefs_buf_allocs);
+	misses = pefs_buf_misses;
+	hits = allocs > misses ? allocs - misses : 0;
+	return (sysctl_handle_long(oidp, &hits, 0, req));
+}
+
+static __inline uma_zone_t
+pefs_buf_zone(size_t size)
+{
+	MPASS(size <= PEFS_CHUNK_SEGSIZE);
+	return (size <= PEFS_SECTOR_SIZE ? pefs_buf_small_zone :
+	    pefs_buf_large_zone);
+}
+
+static void *
+pefs_buf_alloc(size_t size)
+{
+	counter_u64_add(pefs_buf_allocs, 1);
+	return (uma_zalloc(pefs_buf_zone(size), M_WAITOK));
+}
+
 /*
  * Initialise cache headers
  */
@@ -98,6 +161,13 @@ pefs_init(struct vfsconf *vfsp)
 
 	pefs_node_zone = uma_zcreate("pefs_node", sizeof(struct pefs_node),
 	    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
+	pefs_buf_small_zone = uma_zcreate("pefs_buf_small", PEFS_SECTOR_SIZE,
+	    NULL, NULL, pefs_buf_zone_init, pefs_buf_zone_fini,
+	    UMA_ALIGN_CACHE, 0);
+	pefs_buf_large_zone = uma_zcreate("pefs_buf_large",
+	    PEFS_CHUNK_SEGSIZE, NULL, NULL, pefs_buf_zone_init,
+	    pefs_buf_zone_fini, UMA_ALIGN_CACHE, 0);
+	pefs_buf_allocs = counter_u64_alloc(M_WAITOK);
 
 	pefs_nodehash_tbl = hashinit(desiredvnodes / 8, M_PEFSHASH,
 	    &pefs_nodehash_mask);
@@ -106,6 +176,8 @@ pefs_init(struct vfsconf *vfsp)
 
 	pefs_dircache_init();
 	pefs_crypto_init();
+	pefs_warmup_init();
+	pefs_readahead_init();
 
 	return (0);
 }
@@ -116,11 +188,16 @@ pefs_uninit(struct vfsconf *vfsp)
 	taskqueue_enqueue(pefs_taskq, &pefs_task_freenode);
 	taskqueue_drain(pefs_taskq, &pefs_task_freenode);
 	taskqueue_free(pefs_taskq);
+	pefs_readahead_uninit();
+	pefs_warmup_uninit();
 	pefs_dircache_uninit();
 	pefs_crypto_uninit();
 	mtx_destroy(&pefs_node_listmtx);
 	free(pefs_nodehash_tbl, M_PEFSHASH);
 	uma_zdestroy(pefs_node_zone);
+	uma_zdestroy(pefs_buf_small_zone);
+	uma_zdestroy(pefs_buf_large_zone);
+	counter_u64_free(pefs_buf_allocs);
 	return (0);
 }
 
@@ -134,16 +211,6 @@ pefs_zone_dtor_bzero(void *mem, int size, void *arg __unused)
 #endif
 }
 
-void
-pefs_zone_fini_bzero(void *mem, int size)
-{
-#if __FreeBSD_version > 1100036
-	explicit_bzero(mem, size);
-#else
-	bzero(mem, size);
-#endif
-}
-
 static __inline struct pefs_node_listhead *
 pefs_nodehash_gethead(struct vnode *vp)
 {
@@ -444,7 +511,8 @@ pefs_node_get(struct mount *mp, struct vnode *lvp, struct vnode **vpp,
 		return (0);
 	}
 	if (vp->v_type == VDIR)
-		pn->pn_dircache = pefs_dircache_create(VFS_TO_PEFS(mp)->pm_dircache_pool);
+		pn->pn_dircache = pefs_dircache_create(
+		    VFS_TO_PEFS(mp)->pm_dircache_pool, vp);
 	*vpp = vp;
 	MPASS(PEFS_LOWERVP(*vpp) == lvp);
 	ASSERT_VOP_LOCKED(*vpp, "pefs_node_get");
@@ -544,29 +612,6 @@ pefs_node_asyncfree(struct pefs_node *pn)
 	}
 }
 
-void
-pefs_node_buf_free(struct pefs_node *pn)
-{
-	void *bufs[2] = { NULL, NULL };
-	int ind = 0;
-
-	ASSERT_VI_UNLOCKED(pn->pn_vnode, "pefs_node_buf_free");
-	VI_LOCK(pn->pn_vnode);
-	if (pn->pn_buf_small != NULL &&
-	    (pn->pn_flags & PN_LOCKBUF_SMALL) == 0) {
-		bufs[ind++] = pn->pn_buf_small;
-		pn->pn_buf_small = NULL;
-	}
-	if (pn->pn_buf_large != NULL &&
-	    (pn->pn_flags & PN_LOCKBUF_LARGE) == 0) {
-		bufs[ind++] = pn->pn_buf_large;
-		pn->pn_buf_large = NULL;
-	}
-	VI_UNLOCK(pn->pn_vnode);
-	free(bufs[0], M_PEFSBUF);
-	free(bufs[1], M_PEFSBUF);
-}
-
 struct pefs_key*
 pefs_node_key(struct pefs_node *pn)
 {
@@ -583,80 +628,92 @@ pefs_node_key(struct pefs_node *pn)
 	return (pefs_key_ref(pk));
 }
 
-void
-pefs_chunk_create(struct pefs_chunk *pc, struct pefs_node *pn, size_t size)
+/*
+ * Set up iovecs to cover first pc_size bytes of the chunk.
+ */
+static int
+pefs_chunk_setiov(struct pefs_chunk *pc)
 {
-	size_t wantbufsize;
-	int nodebuf;
-	void **nodebuf_ptr;
+	size_t resid;
+	int i;
+
+	resid = pc->pc_size;
+	i = 0;
+	do {
+		MPASS(i < pc->pc_nsegs);
+		pc->pc_iovs[i].iov_base = pc->pc_segs[i];
+		pc->pc_iovs[i].iov_len = qmin(resid, PEFS_CHUNK_SEGSIZE);
+		resid -= pc->pc_iovs[i].iov_len;
+		i++;
+	} while (resid > 0);
+
+	return (i);
+}
+
+static void
+pefs_chunk_create_large(struct pefs_chunk *pc, size_t size)
+{
+	int i;
+
+	pc->pc_nsegs = howmany(size, PEFS_CHUNK_SEGSIZE);
+	pc->pc_segs = malloc(pc->pc_nsegs * sizeof(void *), M_PEFSBUF,
+	    M_WAITOK);
+	pc->pc_iovs = malloc(pc->pc_nsegs * sizeof(struct iovec), M_PEFSBUF,
+	    M_WAITOK);
+	for (i = 0; i < pc->pc_nsegs; i++)
+		pc->pc_segs[i] = pefs_buf_alloc(PEFS_CHUNK_SEGSIZE);
+	pc->pc_base = pc->pc_segs[0];
+	pc->pc_size = size;
+	pc->pc_capacity = pc->pc_size;
+}
 
-	if (size > DFLTPHYS)
+void
+pefs_chunk_create(struct pefs_chunk *pc, size_t size)
+{
+	if (size > PEFS_CHUNK_MAXSIZE)
 		panic("pefs_chunk_create: requested buffer is too large %zd",
 		    size);
-
-	nodebuf = 0;
-	wantbufsize = (size <= PEFS_SECTOR_SIZE ? PEFS_SECTOR_SIZE : DFLTPHYS);
-	if (pn != NULL) {
-		nodebuf = (size <= PEFS_SECTOR_SIZE ? PN_LOCKBUF_SMALL :
-		    PN_LOCKBUF_LARGE);
-		VI_LOCK(pn->pn_vnode);
-		if ((pn->pn_flags & nodebuf) == 0) {
-			pn->pn_flags |= nodebuf;
-			nodebuf_ptr = pefs_node_buf(pn, nodebuf);
-		} else if (nodebuf == PN_LOCKBUF_SMALL &&
-		    (pn->pn_flags & PN_LOCKBUF_LARGE) == 0)  {
-			nodebuf = PN_LOCKBUF_LARGE;
-			wantbufsize = DFLTPHYS;
-			pn->pn_flags |= nodebuf;
-			nodebuf_ptr = &pn->pn_buf_large;
-		} else
-			nodebuf = 0;
-		VI_UNLOCK(pn->pn_vnode);
-	}
-	if (nodebuf != 0) {
-		if (*nodebuf_ptr == NULL)
-			*nodebuf_ptr = malloc(wantbufsize, M_PEFSBUF, M_WAITOK);
-		pc->pc_nodebuf = nodebuf;
-		pc->pc_base = *nodebuf_ptr;
-	} else {
-		pc->pc_nodebuf = 0;
-		pc->pc_base = malloc(wantbufsize, M_PEFSBUF, M_WAITOK);
+	if (size > PEFS_CHUNK_SEGSIZE) {
+		pefs_chunk_create_large(pc, size);
+		return;
 	}
+
+	pc->pc_base = pefs_buf_alloc(size);
 	pc->pc_size = size;
 	pc->pc_capacity = pc->pc_size;
-	pc->pc_uio.uio_iovcnt = 1;
-	pc->pc_uio.uio_iov = &pc->pc_iov;
+	pc->pc_nsegs = 1;
+	pc->pc_segs = &pc->pc_base;
+	pc->pc_iovs = &pc->pc_iov;
 }
 
 void
 pefs_chunk_restore(struct pefs_chunk* pc)
 {
 	pc->pc_size = pc->pc_capacity;
-	pc->pc_iov.iov_base = pc->pc_base;
-	pc->pc_iov.iov_len = pc->pc_size;
+	pefs_chunk_setiov(pc);
 }
 
 void
-pefs_chunk_free(struct pefs_chunk* pc, struct pefs_node *pn)
-{
-	if (pc->pc_nodebuf != 0) {
-		MPASS(pn != NULL);
-		MPASS(pc->pc_base == *pefs_node_buf(pn, pc->pc_nodebuf));
-		VI_LOCK(pn->pn_vnode);
-		pn->pn_flags &= ~(pc->pc_nodebuf);
-		VI_UNLOCK(pn->pn_vnode);
+pefs_chunk_free(struct pefs_chunk* pc)
+{
+	int i;
+
+	if (pc->pc_nsegs > 1) {
+		for (i = 0; i < pc->pc_nsegs; i++)
+			uma_zfree(pefs_buf_large_zone, pc->pc_segs[i]);
+		free(pc->pc_segs, M_PEFSBUF);
+		free(pc->pc_iovs, M_PEFSBUF);
 	} else
-		free(pc->pc_base, M_PEFSBUF);
-	pc->pc_nodebuf = 0;
+		uma_zfree(pefs_buf_zone(pc->pc_capacity), pc->pc_base);
 	pc->pc_base = NULL;
+	pc->pc_nsegs = 0;
 }
 
 struct uio*
 pefs_chunk_uio(struct pefs_chunk *pc, off_t uio_offset, enum uio_rw uio_rw)
 {
-	pc->pc_iov.iov_base = pc->pc_base;
-	pc->pc_iov.iov_len = pc->pc_size;
-
+	pc->pc_uio.uio_iovcnt = pefs_chunk_setiov(pc);
+	pc->pc_uio.uio_iov = pc->pc_iovs;
 	pc->pc_uio.uio_offset = uio_offset;
 	pc->pc_uio.uio_resid = pc->pc_size;
 	pc->pc_uio.uio_rw = uio_rw;
@@ -669,17 +726,36 @@ pefs_chunk_uio(struct pefs_chunk *pc, off_t uio_offset, enum uio_rw uio_rw)
 void
 pefs_chunk_zero(struct pefs_chunk *pc)
 {
-	bzero(pc->pc_base, pc->pc_size);
+	size_t off, len;
+	int i;
+
+	for (i = 0, off = 0; off < pc->pc_size; i++, off += len) {
+		len = qmin(pc->pc_size - off, PEFS_CHUNK_SEGSIZE);
+		bzero(pc->pc_segs[i], len);
+	}
 }
 
 int
 pefs_chunk_copy(struct pefs_chunk *pc, size_t skip, struct uio *uio)
 {
-	int error;
+	size_t off, len;
+	int error, i;
 
 	MPASS(skip < pc->pc_size);
-	error = uiomove((char *)pc->pc_base + skip,
-	    qmin(pc->pc_size - skip, uio->uio_resid), uio);
+	error = 0;
+	i = skip / PEFS_CHUNK_SEGSIZE;
+	off = skip;
+	while (off < pc->pc_size && uio->uio_resid > 0) {
+		len = qmin(pc->pc_size, (size_t)(i + 1) * PEFS_CHUNK_SEGSIZE) -
+		    off;
+		error = uiomove((char *)pc->pc_segs[i] +
+		    (off - (size_t)i * PEFS_CHUNK_SEGSIZE),
+		    qmin(len, uio->uio_resid), uio);
+		if (error != 0)
+			break;
+		off += len;
+		i++;
+	}
 
 	return (error);
 }
@@ -691,6 +767,46 @@ pefs_chunk_setsize(struct pefs_chunk *pc, size_t size)
 	pc->pc_size = size;
 }
 
+/*
+ * Initialize chunk referencing part of another chunk buffer.
+ * Slice shouldn't be freed and is valid until source chunk is freed.
+ */
+void
+pefs_chunk_slice(struct pefs_chunk *pc, struct pefs_chunk *src, size_t skip,
+    size_t size)
+{
+	MPASS(skip + size <= src->pc_size);
+	MPASS(src->pc_nsegs == 1);
+	pc->pc_base = (char *)src->pc_base + skip;
+	pc->pc_size = size;
+	pc->pc_capacity = size;
+	pc->pc_nsegs = 1;
+	pc->pc_segs = &pc->pc_base;
+	pc->pc_iovs = &pc->pc_iov;
+}
+
+/*
+ * Initialize slice referencing segment i of the chunk.  Returns 0 if
+ * segment starts beyond chunk size.
+ */
+int
+pefs_chunk_segment(struct pefs_chunk *pc, int i, struct pefs_chunk *seg)
+{
+	size_t off;
+
+	off = (size_t)i * PEFS_CHUNK_SEGSIZE;
+	if (i >= pc->pc_nsegs || off >= pc->pc_size)
+		return (0);
+	seg->pc_base = pc->pc_segs[i];
+	seg->pc_size = qmin(pc->pc_size - off, PEFS_CHUNK_SEGSIZE);
+	seg->pc_capacity = seg->pc_size;
+	seg->pc_nsegs = 1;
+	seg->pc_segs = &seg->pc_base;
+	seg->pc_iovs = &seg->pc_iov;
+
+	return (1);
+}
+
 #ifdef DIAGNOSTIC
 struct vnode *
 pefs_checkvp(struct vnode *vp, char *fil, int lno)
@@ -0,0 +1,157 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+
+#include <crypto/rijndael/rijndael.h>
+
+#include <fs/pefs/pefs_aes_ct.h>
+#include <fs/pefs/pefs_aesni.h>
+
+#include <immintrin.h>
+
+/*
+ * VAES multi-block ECB.  Process 16 blocks per iteration in 8 ymm
+ * registers, 2 blocks per register.  zmm registers are not used to avoid
+ * frequency drop caused by 512-bit instructions on some CPUs.
+ */
+
+#define	VAES_LANES	8
+#define	VAES_BLOCKS	(VAES_LANES * 2)
+
+static __inline void
+pefs_vaes_load_schedule(__m256i *k, const void *key_schedule, int rounds)
+{
+	const __m128i *ks = key_schedule;
+	int r;
+
+	for (r = 0; r <= rounds; r++)
+		k[r] = _mm256_broadcastsi128_si256(_mm_load_si128(ks + r));
+}
+
+void
+pefs_vaes_encrypt_ecb(int rounds, const void *key_schedule, size_t len,
+    const uint8_t *from, uint8_t *to)
+{
+	__m256i k[AES256_ROUNDS + 1];
+	__m256i b[VAES_LANES], x;
+	__m128i y;
+	int i, r;
+
+	pefs_vaes_load_schedule(k, key_schedule, rounds);
+
+	for (; len >= VAES_BLOCKS * AES_BLOCK_LEN;
+	    len -= VAES_BLOCKS * AES_BLOCK_LEN) {
+		for (i = 0; i < VAES_LANES; i++)
+			b[i] = _mm256_xor_si256(k[0], _mm256_loadu_si256(
+			    (const __m256i *)from + i));
+		for (r = 1; r < rounds; r++)
+			for (i = 0; i < VAES_LANES; i++)
+				b[i] = _mm256_aesenc_epi128(b[i], k[r]);
+		for (i = 0; i < VAES_LANES; i++)
+			_mm256_storeu_si256((__m256i *)to + i,
+			    _mm256_aesenclast_epi128(b[i], k[rounds]));
+		from += VAES_BLOCKS * AES_BLOCK_LEN;
+		to += VAES_BLOCKS * AES_BLOCK_LEN;
+	}
+
+	for (; len >= 2 * AES_BLOCK_LEN; len -= 2 * AES_BLOCK_LEN) {
+		x = _mm256_xor_si256(k[0],
+		    _mm256_loadu_si256((const __m256i *)from));
+		for (r = 1; r < rounds; r++)
+			x = _mm256_aesenc_epi128(x, k[r]);
+		_mm256_storeu_si256((__m256i *)to,
+		    _mm256_aesenclast_epi128(x, k[rounds]));
+		from += 2 * AES_BLOCK_LEN;
+		to += 2 * AES_BLOCK_LEN;
+	}
+
+	if (len >= AES_BLOCK_LEN) {
+		y = _mm_xor_si128(_mm256_castsi256_si128(k[0]),
+		    _mm_loadu_si128((const __m128i *)from));
+		for (r = 1; r < rounds; r++)
+			y = _mm_aesenc_si128(y, _mm256_castsi256_si128(k[r]));
+		_mm_storeu_si128((__m128i *)to, _mm_aesenclast_si128(y,
+		    _mm256_castsi256_si128(k[rounds])));
+	}
+
+	_mm256_zeroupper();
+}
+
+void
+pefs_vaes_decrypt_ecb(int rounds, const void *key_schedule, size_t len,
+    const uint8_t *from, uint8_t *to)
+{
+	__m256i k[AES256_ROUNDS + 1];
+	__m256i b[VAES_LANES], x;
+	__m128i y;
+	int i, r;
+
+	pefs_vaes_load_schedule(k, key_schedule, rounds);
+
+	for (; len >= VAES_BLOCKS * AES_BLOCK_LEN;
+	    len -= VAES_BLOCKS * AES_BLOCK_LEN) {
+		for (i = 0; i < VAES_LANES; i++)
+			b[i] = _mm256_xor_si256(k[0], _mm256_loadu_si256(
+			    (const __m256i *)from + i));
+		for (r = 1; r < rounds; r++)
+			for (i = 0; i < VAES_LANES; i++)
+				b[i] = _mm256_aesdec_epi128(b[i], k[r]);
+		for (i = 0; i < VAES_LANES; i++)
+			_mm256_storeu_si256((__m256i *)to + i,
+			    _mm256_aesdeclast_epi128(b[i], k[rounds]));
+		from += VAES_BLOCKS * AES_BLOCK_LEN;
+		to += VAES_BLOCKS * AES_BLOCK_LEN;
+	}
+
+	for (; len >= 2 * AES_BLOCK_LEN; len -= 2 * AES_BLOCK_LEN) {
+		x = _mm256_xor_si256(k[0],
+		    _mm256_loadu_si256((const __m256i *)from));
+		for (r = 1; r < rounds; r++)
+			x = _mm256_aesdec_epi128(x, k[r]);
+		_mm256_storeu_si256((__m256i *)to,
+		    _mm256_aesdeclast_epi128(x, k[rounds]));
+		from += 2 * AES_BLOCK_LEN;
+		to += 2 * AES_BLOCK_LEN;
+	}
+
+	if (len >= AES_BLOCK_LEN) {
+		y = _mm_xor_si128(_mm256_castsi256_si128(k[0]),
+		    _mm_loadu_si128((const __m128i *)from));
+		for (r = 1; r < rounds; r++)
+			y = _mm_aesdec_si128(y, _mm256_castsi256_si128(k[r]));
+		_mm_storeu_si128((__m128i *)to, _mm_aesdeclast_si128(y,
+		    _mm256_castsi256_si128(k[rounds])));
+	}
+
+	_mm256_zeroupper();
+}
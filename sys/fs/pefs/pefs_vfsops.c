@@ -78,7 +78,15 @@ static const char		*pefs_opts[] = {
 	"export",
 	"dircache",
 	"nodircache",
+	"dircachemax",
+	"maxio",
 	"asyncreclaim",
+	"sparse",
+	"nosparse",
+	"namehint",
+	"nonamehint",
+	"warmup",
+	"nowarmup",
 	NULL
 };
 
@@ -138,7 +146,9 @@ pefs_mount(struct mount *mp)
 	struct pefs_mount *pm;
 	char *from, *from_free;
 	int isvnunlocked = 0, len;
-	int opt_dircache, opt_asyncreclaim;
+	int opt_dircache, opt_asyncreclaim, opt_sparse, opt_namehint;
+	int opt_warmup;
+	long opt_dircachemax, opt_maxio;
 	int error = 0;
 
 	PEFSDEBUG("pefs_mount(mp = %p)\n", (void *)mp);
@@ -157,11 +167,49 @@ pefs_mount(struct mount *mp)
 		vfs_deleteopt(mp->mnt_optnew, "nodircache");
 		opt_dircache = 0;
 	}
+	opt_dircachemax = -1;
+	if (vfs_getopt(mp->mnt_optnew, "dircachemax", NULL, NULL) == 0) {
+		if (vfs_scanopt(mp->mnt_optnew, "dircachemax", "%ld",
+		    &opt_dircachemax) != 1 || opt_dircachemax < 0)
+			return (EINVAL);
+	}
+	opt_maxio = -1;
+	if (vfs_getopt(mp->mnt_optnew, "maxio", NULL, NULL) == 0) {
+		if (vfs_scanopt(mp->mnt_optnew, "maxio", "%ld",
+		    &opt_maxio) != 1 || opt_maxio < PEFS_SECTOR_SIZE)
+			return (EINVAL);
+		opt_maxio = rounddown(qmin(opt_maxio, PEFS_CHUNK_MAXSIZE),
+		    PEFS_SECTOR_SIZE);
+	}
 	opt_asyncreclaim = -1;
 	if (vfs_flagopt(mp->mnt_optnew, "asyncreclaim", NULL, 0)) {
 		vfs_deleteopt(mp->mnt_optnew, "asyncreclaim");
 		opt_asyncreclaim = 1;
 	}
+	opt_sparse = -1;
+	if (vfs_flagopt(mp->mnt_optnew, "sparse", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "sparse");
+		opt_sparse = 1;
+	} else if (vfs_flagopt(mp->mnt_optnew, "nosparse", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "nosparse");
+		opt_sparse = 0;
+	}
+	opt_namehint = -1;
+	if (vfs_flagopt(mp->mnt_optnew, "namehint", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "namehint");
+		opt_namehint = 1;
+	} else if (vfs_flagopt(mp->mnt_optnew, "nonamehint", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "nonamehint");
+		opt_namehint = 0;
+	}
+	opt_warmup = -1;
+	if (vfs_flagopt(mp->mnt_optnew, "warmup", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "warmup");
+		opt_warmup = 1;
+	} else if (vfs_flagopt(mp->mnt_optnew, "nowarmup", NULL, 0)) {
+		vfs_deleteopt(mp->mnt_optnew, "nowarmup");
+		opt_warmup = 0;
+	}
 
 	if (mp->mnt_flag & MNT_UPDATE) {
 		error = EOPNOTSUPP;
@@ -172,11 +220,36 @@ pefs_mount(struct mount *mp)
 			    PM_DIRCACHE, "dircache");
 			error = 0;
 		}
+		if (opt_dircachemax >= 0) {
+			pefs_dircache_pool_setmax(
+			    VFS_TO_PEFS(mp)->pm_dircache_pool, opt_dircachemax);
+			error = 0;
+		}
+		if (opt_maxio > 0) {
+			VFS_TO_PEFS(mp)->pm_maxio = opt_maxio;
+			error = 0;
+		}
 		if (opt_asyncreclaim >= 0) {
 			pefs_opt_set(mp, opt_dircache, mp->mnt_data,
 			    PM_ASYNCRECLAIM, "asyncreclaim");
 			error = 0;
 		}
+		if (opt_sparse >= 0) {
+			pefs_opt_set(mp, opt_sparse, mp->mnt_data,
+			    PM_SPARSE, "sparse");
+			error = 0;
+		}
+		if (opt_namehint >= 0) {
+			pefs_opt_set(mp, opt_namehint, mp->mnt_data,
+			    PM_NAMEHINT, "namehint");
+			error = 0;
+		}
+		if (opt_warmup >= 0) {
+			pefs_opt_set(mp, opt_warmup, mp->mnt_data,
+			    PM_WARMUP, "warmup");
+			pefs_warmup_start(mp);
+			error = 0;
+		}
 		return (error);
 	}
 
@@ -273,8 +346,14 @@ pefs_mount(struct mount *mp)
 		pm->pm_flags |= PM_ROOT_CANRECURSE;
 	pefs_opt_set(mp, opt_dircache, pm, PM_DIRCACHE, "dircache");
 	pefs_opt_set(mp, opt_asyncreclaim, pm, PM_ASYNCRECLAIM, "asyncreclaim");
+	pefs_opt_set(mp, opt_sparse, pm, PM_SPARSE, "sparse");
+	pefs_opt_set(mp, opt_namehint, pm, PM_NAMEHINT, "namehint");
+	pefs_opt_set(mp, opt_warmup, pm, PM_WARMUP, "warmup");
+	pefs_warmup_mount(pm);
 
-	pm->pm_dircache_pool = pefs_dircache_pool_create();
+	pm->pm_dircache_pool = pefs_dircache_pool_create(
+	    opt_dircachemax > 0 ? opt_dircachemax : 0);
+	pm->pm_maxio = opt_maxio > 0 ? opt_maxio : DFLTPHYS;
 
 	mp->mnt_data = pm;
 
@@ -289,6 +368,7 @@ pefs_mount(struct mount *mp)
 	 */
 	if (error != 0) {
 		vput(lowerrootvp);
+		pefs_warmup_unmount(pm);
 		mtx_destroy(&pm->pm_keys_lock);
 		free(pm, M_PEFSMNT);
 		mp->mnt_data = NULL;
@@ -342,16 +422,23 @@ pefs_unmount(struct mount *mp, int mntflags)
 	if (mntflags & MNT_FORCE)
 		flags |= FORCECLOSE;
 
+	pm = VFS_TO_PEFS(mp);
+	pefs_warmup_block(pm);
+	/* Queued read-ahead holds vnode references. */
+	pefs_readahead_drain();
+
 	/* There is 1 extra root vnode reference (pm_rootvp). */
 	error = vflush(mp, 1, flags, curthread);
-	if (error != 0)
+	if (error != 0) {
+		pefs_warmup_unblock(pm);
 		return (error);
+	}
 
 	/*
 	 * Finally, throw away the pefs_mount structure
 	 */
-	pm = VFS_TO_PEFS(mp);
 	pefs_dircache_pool_free(pm->pm_dircache_pool);
+	pefs_warmup_unmount(pm);
 	mp->mnt_data = 0;
 	pefs_key_remove_all(pm);
 	mtx_destroy(&pm->pm_keys_lock);
@@ -455,9 +542,9 @@ static int
 pefs_sync(struct mount *mp, int waitfor)
 {
 	/*
-	 * XXX - Assumes no data cached at null layer.
+	 * Only partially written sectors are cached at pefs layer.
 	 */
-	return (0);
+	return (pefs_wbcache_sync(mp, waitfor));
 }
 
 static int
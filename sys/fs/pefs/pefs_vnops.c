@@ -48,9 +48,11 @@ __FBSDID("$FreeBSD$");
 #include <sys/priv.h>
 #include <sys/rwlock.h>
 #include <sys/sf_buf.h>
+#include <sys/smp.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
 #include <sys/sx.h>
+#include <sys/taskqueue.h>
 #include <sys/vnode.h>
 #include <sys/dirent.h>
 #include <sys/limits.h>
@@ -82,6 +84,19 @@ __FBSDID("$FreeBSD$");
 
 CTASSERT(PEFS_SECTOR_SIZE == PAGE_SIZE);
 
+#if __FreeBSD_version >= 1300100
+#define	PEFS_READAHEAD
+#define	PEFS_READAHEAD_MAX	8
+#define	PEFS_PAGER
+#endif
+
+/* Writes with these flags bypass write-back cache. */
+#ifdef IO_DATASYNC
+#define	PEFS_IO_SYNC		(IO_SYNC | IO_DATASYNC | IO_DIRECT)
+#else
+#define	PEFS_IO_SYNC		(IO_SYNC | IO_DIRECT)
+#endif
+
 struct pefs_enccn {
 	struct componentname	pec_cn;
 	void			*pec_buf;
@@ -103,10 +118,62 @@ SYSCTL_ULONG(_vfs_pefs, OID_AUTO, xlock_upgrade_restarts, CTLFLAG_RD,
     &pefs_xlock_upgrade_restarts, 0,
     "Number of lock upgrade failures due to rename in progress");
 
+#ifdef PEFS_READAHEAD
+SYSCTL_NODE(_vfs_pefs, OID_AUTO, readahead, CTLFLAG_RW, 0,
+    "PEFS sequential read-ahead");
+
+static int pefs_readahead_chunks = 4;
+SYSCTL_INT(_vfs_pefs_readahead, OID_AUTO, chunks, CTLFLAG_RW,
+    &pefs_readahead_chunks, 0,
+    "Number of chunks to read ahead and keep in flight, 0 to disable");
+
+static int pefs_readahead_seqcount = 2;
+SYSCTL_INT(_vfs_pefs_readahead, OID_AUTO, seqcount, CTLFLAG_RW,
+    &pefs_readahead_seqcount, 0,
+    "Minimal sequential access heuristic value to start read-ahead");
+
+static int pefs_readahead_threads = -1;
+SYSCTL_INT(_vfs_pefs_readahead, OID_AUTO, threads, CTLFLAG_RD,
+    &pefs_readahead_threads, 0,
+    "Number of read-ahead worker threads, 0 to read ahead synchronously");
+
+struct pefs_readahead_req {
+	struct task		prr_task;
+	struct vnode		*prr_vp;
+	struct ucred		*prr_cred;
+	off_t			prr_offset;
+	off_t			prr_end;
+	int			prr_ioflag;
+};
+
+static struct taskqueue		*pefs_readahead_tq;
+#endif
+
+SYSCTL_NODE(_vfs_pefs, OID_AUTO, wbcache, CTLFLAG_RW, 0,
+    "PEFS partial sector write-back cache");
+
+static int pefs_wbcache_enable = 1;
+SYSCTL_INT(_vfs_pefs_wbcache, OID_AUTO, enable, CTLFLAG_RW,
+    &pefs_wbcache_enable, 0,
+    "Cache partial sector writes");
+
+static u_long pefs_wbcache_writes;
+SYSCTL_ULONG(_vfs_pefs_wbcache, OID_AUTO, writes, CTLFLAG_RD,
+    &pefs_wbcache_writes, 0,
+    "Partial sector writes absorbed by cache");
+
+static u_long pefs_wbcache_flushes;
+SYSCTL_ULONG(_vfs_pefs_wbcache, OID_AUTO, flushes, CTLFLAG_RD,
+    &pefs_wbcache_flushes, 0,
+    "Cached sectors written to lower file");
+
 static int	pefs_read_int(struct vnode *vp, struct uio *uio, int ioflag,
 		    struct ucred *cred, u_quad_t fsize);
 static int	pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 		    struct ucred *cred, u_quad_t nsize);
+static int	pefs_wbcache_flush(struct vnode *vp, int ioflag,
+		    struct ucred *cred);
+static void	pefs_wbcache_free(struct pefs_wbsector *pws);
 
 static __inline u_long
 pefs_getgen(struct vnode *vp, struct ucred *cred)
@@ -139,28 +206,6 @@ pefs_tkey_cmp(struct pefs_tkey *a, struct pefs_tkey *b)
 	return (r);
 }
 
-static struct pefs_dircache_entry *
-pefs_cache_dirent(struct pefs_dircache *pd, struct dirent *de,
-    struct pefs_ctx *ctx, struct pefs_key *pk)
-{
-	struct pefs_dircache_entry *cache;
-	struct pefs_tkey ptk;
-	char buf[MAXNAMLEN + 1];
-	int name_len;
-
-	cache = pefs_dircache_enclookup(pd, de->d_name, de->d_namlen);
-	if (cache == NULL) {
-		name_len = pefs_name_decrypt(ctx, pk, &ptk,
-		    de->d_name, de->d_namlen, buf, sizeof(buf));
-		if (name_len <= 0)
-			return (NULL);
-		cache = pefs_dircache_insert(pd, &ptk,
-		    buf, name_len, de->d_name, de->d_namlen);
-	}
-
-	return (cache);
-}
-
 static __inline int
 pefs_name_skip(char *name, int namelen)
 {
@@ -170,6 +215,77 @@ pefs_name_skip(char *name, int namelen)
 	return (0);
 }
 
+static void
+pefs_cache_names(struct pefs_mount *pm, struct pefs_dircache *pd,
+    struct pefs_ctx *ctx, struct pefs_key *pk, struct pefs_keyorder *pko,
+    struct pefs_name_dec *pnd, int count)
+{
+	u_int trials;
+	int decrypted, i;
+
+	trials = pefs_name_decrypt_batch(ctx, pk, pko, pnd, count);
+	decrypted = 0;
+	for (i = 0; i < count; i++) {
+		if (pnd[i].pnd_namelen <= 0)
+			continue;
+		decrypted++;
+		pefs_dircache_insert(pd, &pnd[i].pnd_tkey, pnd[i].pnd_name,
+		    pnd[i].pnd_namelen, pnd[i].pnd_enc, pnd[i].pnd_enclen);
+	}
+	atomic_add_long(&pm->pm_stats.ps_names_decrypted, decrypted);
+	atomic_add_long(&pm->pm_stats.ps_name_trials, trials);
+}
+
+/*
+ * Decrypt names missing in directory cache in batches and add them to the
+ * cache.  Entries that are not in the cache afterwards can not be
+ * decrypted.  Caller should keep directory cache pinned until it's done
+ * looking up the entries.
+ */
+static void
+pefs_cache_dirents(struct pefs_mount *pm, struct pefs_dircache *pd,
+    struct pefs_ctx *ctx, struct pefs_key *pk, void *mem, size_t sz)
+{
+	struct pefs_keyorder pko;
+	struct pefs_name_dec *pnd;
+	struct dirent *de;
+	int count;
+
+	pnd = NULL;
+	count = 0;
+	for (de = (struct dirent*) mem; sz > DIRENT_MINSIZE;
+			sz -= de->d_reclen,
+			de = (struct dirent *)(((caddr_t)de) + de->d_reclen)) {
+		MPASS(de->d_reclen <= sz);
+		if (de->d_reclen == 0)
+			break;
+		if (de->d_type == DT_WHT || de->d_fileno == 0)
+			continue;
+		if (pefs_name_skip(de->d_name, de->d_namlen))
+			continue;
+		if (pefs_dircache_enclookup(pd, de->d_name,
+		    de->d_namlen) != NULL)
+			continue;
+		if (pnd == NULL) {
+			pnd = malloc(PEFS_NAME_BATCH * sizeof(*pnd), M_PEFSBUF,
+			    M_WAITOK);
+			pefs_dircache_keyorder_get(pd, &pko);
+		}
+		pnd[count].pnd_enc = de->d_name;
+		pnd[count].pnd_enclen = de->d_namlen;
+		if (++count == PEFS_NAME_BATCH) {
+			pefs_cache_names(pm, pd, ctx, pk, &pko, pnd, count);
+			count = 0;
+		}
+	}
+	if (count != 0)
+		pefs_cache_names(pm, pd, ctx, pk, &pko, pnd, count);
+	if (pnd != NULL) {
+		free(pnd, M_PEFSBUF);
+		pefs_dircache_keyorder_set(pd, &pko);
+	}
+}
+
 static __inline void
 pefs_enccn_init(struct pefs_enccn *pec)
 {
@@ -229,22 +345,42 @@ pefs_enccn_set(struct pefs_enccn *pec, struct pefs_tkey *ptk, char *encname,
 	pec->pec_cn.cn_namelen = encname_len;
 }
 
+/*
+ * Generate tweak for a new name in directory dvp.  Tweak is random unless key
+ * has PEFS_KEY_DETNAME flag, in which case it's derived from the name and
+ * parent directory tweak.  Name format is chosen according to mount options
+ * and preserved in ptk_flags for the lifetime of the name.
+ */
+static void
+pefs_tkey_generate(struct pefs_tkey *ptk, struct pefs_key *pk,
+    struct vnode *dvp, struct componentname *cnp)
+{
+	struct pefs_node *dpn = VP_TO_PN(dvp);
+
+	ptk->ptk_key = pk;
+	ptk->ptk_flags = 0;
+	if ((VFS_TO_PEFS(dvp->v_mount)->pm_flags & PM_NAMEHINT) != 0)
+		ptk->ptk_flags |= PEFS_TKEY_NAMEHINT;
+	if ((pk->pk_flags & PEFS_KEY_DETNAME) != 0)
+		pefs_name_tweak(NULL, ptk, (dpn->pn_flags & PN_HASKEY) != 0 ?
+		    dpn->pn_tkey.ptk_tweak : NULL, cnp->cn_nameptr,
+		    cnp->cn_namelen);
+	else
+		arc4rand(ptk->ptk_tweak, PEFS_TWEAK_SIZE, 0);
+}
+
 static int
-pefs_enccn_create(struct pefs_enccn *pec, struct pefs_key *pk, char *tweak,
+pefs_enccn_create(struct pefs_enccn *pec, struct pefs_tkey *ptk,
     struct componentname *cnp)
 {
 	int r;
 
-	MPASS(pec != NULL && cnp != NULL && pk != NULL);
+	MPASS(pec != NULL && cnp != NULL && ptk->ptk_key != NULL);
 	MPASS((cnp->cn_flags & ISDOTDOT) == 0);
 	MPASS(pefs_name_skip(cnp->cn_nameptr, cnp->cn_namelen) == 0);
 
 	pefs_enccn_alloc(pec, cnp);
-	if (tweak == NULL)
-		arc4rand(pec->pec_tkey.ptk_tweak, PEFS_TWEAK_SIZE, 0);
-	else
-		memcpy(pec->pec_tkey.ptk_tweak, tweak, PEFS_TWEAK_SIZE);
-	pec->pec_tkey.ptk_key = pk;
+	pec->pec_tkey = *ptk;
 	r = pefs_name_encrypt(NULL, &pec->pec_tkey, cnp->cn_nameptr,
 	    cnp->cn_namelen, pec->pec_buf, MAXPATHLEN);
 	if (r <= 0) {
@@ -262,12 +398,12 @@ static int
 pefs_enccn_create_node(struct pefs_enccn *pec, struct vnode *dvp,
     struct componentname *cnp)
 {
-	struct pefs_key *dpk;
+	struct pefs_tkey ptk;
 	int error;
 
-	dpk = pefs_node_key(VP_TO_PN(dvp));
-	error = pefs_enccn_create(pec, dpk, NULL, cnp);
-	pefs_key_release(dpk);
+	pefs_tkey_generate(&ptk, pefs_node_key(VP_TO_PN(dvp)), dvp, cnp);
+	error = pefs_enccn_create(pec, &ptk, cnp);
+	pefs_key_release(ptk.ptk_key);
 
 	return (error);
 }
@@ -296,13 +432,41 @@ pefs_enccn_get(struct pefs_enccn *pec, struct vnode *dvp, struct vnode *vp,
 		return (0);
 	}
 
-	error = pefs_enccn_create(pec, pn->pn_tkey.ptk_key,
-	    pn->pn_tkey.ptk_tweak, cnp);
+	error = pefs_enccn_create(pec, &pn->pn_tkey, cnp);
 	PEFSDEBUG("pefs_enccn_get: create: %s -> %s\n",
 	    cnp->cn_nameptr, pec->pec_cn.cn_nameptr);
 	return (error);
 }
 
+/*
+ * Keep directory cache valid while modifying directory: changes made by
+ * pefs are applied to the cache directly instead of rescanning directory.
+ */
+static __inline int
+pefs_dircache_begin(struct vnode *dvp, struct ucred *cred)
+{
+	return (pefs_dircache_beginchange(VP_TO_PN(dvp)->pn_dircache,
+	    pefs_getgen(dvp, cred)));
+}
+
+static __inline void
+pefs_dircache_end(struct vnode *dvp, struct ucred *cred, int valid)
+{
+	pefs_dircache_endchange(VP_TO_PN(dvp)->pn_dircache,
+	    valid ? pefs_getgen(dvp, cred) : 0);
+}
+
+static void
+pefs_dircache_add(struct vnode *dvp, struct pefs_enccn *pec,
+    struct componentname *cnp)
+{
+	if (pec->pec_tkey.ptk_key == NULL)
+		return;
+	pefs_dircache_insert(VP_TO_PN(dvp)->pn_dircache, &pec->pec_tkey,
+	    cnp->cn_nameptr, cnp->cn_namelen, pec->pec_cn.cn_nameptr,
+	    pec->pec_cn.cn_namelen);
+}
+
 #define	PEFS_ENCCN_ASSERT_NOENT(dvp, cnp)	((void)0)
 
 #define	PEFS_FLUSHKEY_ALL		1
@@ -321,6 +485,7 @@ pefs_flushkey(struct mount *mp, struct thread *td, int flags,
 	struct pefs_node *pn;
 	int error;
 
+	pefs_warmup_block(VFS_TO_PEFS(mp));
 #if __FreeBSD_version < 1300117 && (__FreeBSD_version >= 1200013 || defined(PEFS_OSREL_1200013_CACHE_PURGEVFS))
 	cache_purgevfs(mp, true);
 #else
@@ -404,20 +569,25 @@ loop:
 		pefs_dircache_purge(VP_TO_PN(rootvp)->pn_dircache);
 		PEFS_VOP_UNLOCK(rootvp);
 	}
+	pefs_warmup_unblock(VFS_TO_PEFS(mp));
 
 	return (0);
 }
 
 static void
-pefs_lookup_parsedir(struct pefs_dircache *pd, struct pefs_ctx *ctx,
-    struct pefs_key *pk, void *mem, size_t sz, char *name, size_t name_len,
-    struct pefs_dircache_entry **retval)
+pefs_lookup_parsedir(struct pefs_mount *pm, struct pefs_dircache *pd,
+    struct pefs_ctx *ctx, struct pefs_key *pk, void *mem, size_t sz,
+    char *name, size_t name_len, struct pefs_dircache_entry **retval)
 {
 	struct pefs_dircache_entry *cache;
 	struct dirent *de;
+	u_long entries;
 
 	PEFSDEBUG("pefs_lookup_parsedir: lookup %.*s\n", (int)name_len, name);
+	pefs_dircache_pin(pd);
+	pefs_cache_dirents(pm, pd, ctx, pk, mem, sz);
 	cache = NULL;
+	entries = 0;
 	for (de = (struct dirent*) mem; sz > DIRENT_MINSIZE;
 			sz -= de->d_reclen,
 			de = (struct dirent *)(((caddr_t)de) + de->d_reclen)) {
@@ -429,13 +599,17 @@ pefs_lookup_parsedir(struct pefs_dircache *pd, struct pefs_ctx *ctx,
 		if (pefs_name_skip(de->d_name, de->d_namlen))
 			continue;
 
-		cache = pefs_cache_dirent(pd, de, ctx, pk);
+		entries++;
+		cache = pefs_dircache_enclookup(pd, de->d_name,
+		    de->d_namlen);
 		if (cache != NULL && *retval == NULL &&
 		    cache->pde_namelen == name_len &&
 		    crypto_verify_bytes(name, cache->pde_name, name_len) == 0) {
 			*retval = cache;
 		}
 	}
+	pefs_dircache_unpin(pd);
+	atomic_add_long(&pm->pm_stats.ps_scan_entries, entries);
 }
 
 static int
@@ -449,25 +623,29 @@ pefs_lookup_readdir(struct pefs_enccn *pec, u_long gen, struct vnode *dvp,
 	struct pefs_ctx *ctx;
 	struct pefs_dircache_entry *cache;
 	struct pefs_key *dpn_key;
+	struct pefs_mount *pm;
 	off_t offset;
+	u_long invalgen;
 	int eofflag, error;
 
 	ldvp = PEFS_LOWERVP(dvp);
 	dpn = VP_TO_PN(dvp);
+	pm = VFS_TO_PEFS(dvp->v_mount);
 
 	MPASS(pec != NULL && dvp != NULL && cnp != NULL);
 
 	PEFSDEBUG("pefs_lookup_readdir: name=%.*s op=%d\n",
 	    (int)cnp->cn_namelen, cnp->cn_nameptr, (int) cnp->cn_nameiop);
 
+	atomic_add_long(&pm->pm_stats.ps_scans, 1);
 	error = 0;
 	offset = 0;
 	eofflag = 0;
 	cache = NULL;
 	ctx = pefs_ctx_get();
-	pefs_chunk_create(&pc, dpn, PEFS_SECTOR_SIZE);
+	pefs_chunk_create(&pc, PEFS_SECTOR_SIZE);
 	dpn_key = pefs_node_key(dpn);
-	pefs_dircache_beginupdate(dpn->pn_dircache);
+	invalgen = pefs_dircache_beginupdate(dpn->pn_dircache);
 	while (!eofflag) {
 		uio = pefs_chunk_uio(&pc, offset, UIO_READ);
 		error = VOP_READDIR(ldvp, uio, cnp->cn_cred, &eofflag,
@@ -479,19 +657,19 @@ pefs_lookup_readdir(struct pefs_enccn *pec, u_long gen, struct vnode *dvp,
 		if (pc.pc_size == uio->uio_resid)
 			break;
 		pefs_chunk_setsize(&pc, pc.pc_size - uio->uio_resid);
-		pefs_lookup_parsedir(dpn->pn_dircache, ctx, dpn_key,
+		pefs_lookup_parsedir(pm, dpn->pn_dircache, ctx, dpn_key,
 		    pc.pc_base, pc.pc_size, cnp->cn_nameptr, cnp->cn_namelen,
 		    &cache);
 		pefs_chunk_restore(&pc);
 	}
 	if (eofflag != 0 && error == 0)
-		pefs_dircache_endupdate(dpn->pn_dircache, gen);
+		pefs_dircache_endupdate(dpn->pn_dircache, gen, invalgen);
 	else
 		pefs_dircache_abortupdate(dpn->pn_dircache);
 
 	pefs_ctx_free(ctx);
 	pefs_key_release(dpn_key);
-	pefs_chunk_free(&pc, dpn);
+	pefs_chunk_free(&pc);
 	if (cache != NULL && error == 0)
 		pefs_enccn_set(pec, &cache->pde_tkey,
 		    cache->pde_encname, cache->pde_encnamelen, cnp);
@@ -501,6 +679,95 @@ pefs_lookup_readdir(struct pefs_enccn *pec, u_long gen, struct vnode *dvp,
 	return (error);
 }
 
+/*
+ * Read whole directory and add all names to directory cache.  Callback is
+ * invoked for every entry with the cache entry or NULL if the name can not
+ * be decrypted, non-zero return value stops the scan.  Cache is marked
+ * complete only if the directory was read till the end.
+ */
+int
+pefs_readdir_fill(struct vnode *dvp, struct ucred *cred, pefs_fill_cb_t *cb,
+    void *arg)
+{
+	struct uio *uio;
+	struct vnode *ldvp;
+	struct pefs_node *dpn;
+	struct pefs_chunk pc;
+	struct pefs_ctx *ctx;
+	struct pefs_dircache *pd;
+	struct pefs_dircache_entry *cache;
+	struct pefs_key *dpn_key;
+	struct pefs_mount *pm;
+	struct dirent *de;
+	off_t offset;
+	size_t sz;
+	u_long entries, gen, invalgen;
+	int eofflag, error, stop;
+
+	ASSERT_VOP_LOCKED(dvp, "pefs_readdir_fill");
+	MPASS(dvp->v_type == VDIR);
+	ldvp = PEFS_LOWERVP(dvp);
+	dpn = VP_TO_PN(dvp);
+	pd = dpn->pn_dircache;
+	pm = VFS_TO_PEFS(dvp->v_mount);
+
+	gen = pefs_getgen(dvp, cred);
+	atomic_add_long(&pm->pm_stats.ps_scans, 1);
+	error = 0;
+	offset = 0;
+	eofflag = 0;
+	stop = 0;
+	entries = 0;
+	ctx = pefs_ctx_get();
+	pefs_chunk_create(&pc, DFLTPHYS);
+	dpn_key = pefs_node_key(dpn);
+	invalgen = pefs_dircache_beginupdate(pd);
+	while (!eofflag && !stop) {
+		uio = pefs_chunk_uio(&pc, offset, UIO_READ);
+		error = VOP_READDIR(ldvp, uio, cred, &eofflag, NULL, NULL);
+		if (error != 0)
+			break;
+		offset = uio->uio_offset;
+
+		if (pc.pc_size == uio->uio_resid)
+			break;
+		pefs_chunk_setsize(&pc, pc.pc_size - uio->uio_resid);
+		pefs_dircache_pin(pd);
+		pefs_cache_dirents(pm, pd, ctx, dpn_key, pc.pc_base,
+		    pc.pc_size);
+		for (de = (struct dirent *)pc.pc_base, sz = pc.pc_size;
+				sz > DIRENT_MINSIZE && !stop;
+				sz -= de->d_reclen,
+				de = (struct dirent *)(((caddr_t)de) +
+				de->d_reclen)) {
+			MPASS(de->d_reclen <= sz);
+			if (de->d_reclen == 0)
+				break;
+			if (de->d_type == DT_WHT || de->d_fileno == 0)
+				continue;
+			if (pefs_name_skip(de->d_name, de->d_namlen))
+				continue;
+			entries++;
+			cache = pefs_dircache_enclookup(pd, de->d_name,
+			    de->d_namlen);
+			stop = cb(arg, de, cache);
+		}
+		pefs_dircache_unpin(pd);
+		pefs_chunk_restore(&pc);
+	}
+	if (eofflag != 0 && error == 0 && !stop)
+		pefs_dircache_endupdate(pd, gen, invalgen);
+	else
+		pefs_dircache_abortupdate(pd);
+	atomic_add_long(&pm->pm_stats.ps_scan_entries, entries);
+
+	pefs_ctx_free(ctx);
+	pefs_key_release(dpn_key);
+	pefs_chunk_free(&pc);
+
+	return (error);
+}
+
 static int
 pefs_lookup_lower(struct vnode *dvp, struct vnode **lvpp,
     struct componentname *cnp)
@@ -539,17 +806,24 @@ pefs_lookup_dircache(struct pefs_enccn *enccn, u_long gen, struct vnode *dvp,
 {
 	struct pefs_dircache *pd;
 	struct pefs_dircache_entry *cache;
+	struct pefs_mount *pm;
 	int error;
 
 	pd = VP_TO_PN(dvp)->pn_dircache;
+	pm = VFS_TO_PEFS(dvp->v_mount);
 	while (1) {
 		cache = pefs_dircache_lookup(pd, cnp->cn_nameptr,
 		    cnp->cn_namelen);
 		if (cache == NULL) {
-			if (pefs_dircache_valid(pd, gen))
+			if (pefs_dircache_valid(pd, gen)) {
+				atomic_add_long(&pm->pm_stats.ps_lookup_misses,
+				    1);
 				return (ENOENT);
+			}
+			atomic_add_long(&pm->pm_stats.ps_lookup_stale, 1);
 			return (EINVAL);
 		}
+		atomic_add_long(&pm->pm_stats.ps_lookup_hits, 1);
 
 		pefs_enccn_set(enccn, &cache->pde_tkey, cache->pde_encname,
 		    cache->pde_encnamelen, cnp);
@@ -565,6 +839,38 @@ pefs_lookup_dircache(struct pefs_enccn *enccn, u_long gen, struct vnode *dvp,
 	return (EINVAL);
 }
 
+/*
+ * Directory key has deterministic names: encrypt the name and look it up in
+ * lower directory directly.  Returns EINVAL if name is not found, it still may
+ * be present with random tweak or encrypted with another key.
+ */
+static int
+pefs_lookup_detname(struct pefs_enccn *enccn, struct vnode *dvp,
+    struct vnode **lvpp, struct componentname *cnp)
+{
+	struct pefs_tkey ptk;
+	int error;
+
+	ptk.ptk_key = pefs_node_key(VP_TO_PN(dvp));
+	if ((ptk.ptk_key->pk_flags & PEFS_KEY_DETNAME) == 0) {
+		pefs_key_release(ptk.ptk_key);
+		return (EINVAL);
+	}
+	pefs_tkey_generate(&ptk, ptk.ptk_key, dvp, cnp);
+	error = pefs_enccn_create(enccn, &ptk, cnp);
+	pefs_key_release(ptk.ptk_key);
+	if (error != 0)
+		return (error);
+
+	error = pefs_lookup_lower(dvp, lvpp, &enccn->pec_cn);
+	if (error != 0) {
+		pefs_enccn_free(enccn);
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
 static int
 pefs_lookup(struct vop_cachedlookup_args *ap)
 {
@@ -615,6 +921,8 @@ pefs_lookup(struct vop_cachedlookup_args *ap)
 		lvp = NULL;
 		gen = pefs_getgen(dvp, cnp->cn_cred);
 		error = pefs_lookup_dircache(&enccn, gen, dvp, &lvp, cnp);
+		if (error != 0 && error != ENOENT)
+			error = pefs_lookup_detname(&enccn, dvp, &lvp, cnp);
 		if (error != 0 && error != ENOENT)
 			error = pefs_lookup_readdir(&enccn, gen, dvp, cnp);
 		if (error == ENOENT && (cnp->cn_flags & ISLASTCN) &&
@@ -723,15 +1031,17 @@ pefs_truncate(struct vnode *vp, u_quad_t nsize, struct ucred *cred)
 	struct vnode *lvp = PEFS_LOWERVP(vp);
 	struct vattr va;
 	struct uio *puio;
-	struct pefs_node *pn = VP_TO_PN(vp);
 	struct pefs_chunk pc;
 	u_quad_t osize, diff;
 	size_t oskip, nskip;
 	int error;
 
 	MPASS(vp->v_type == VREG);
-	MPASS(pn->pn_flags & PN_HASKEY);
+	MPASS(VP_TO_PN(vp)->pn_flags & PN_HASKEY);
 
+	error = pefs_wbcache_flush(vp, 0, cred);
+	if (error != 0)
+		return (error);
 	error = VOP_GETATTR(lvp, &va, cred);
 	if (error != 0)
 		return (error);
@@ -758,7 +1068,7 @@ pefs_truncate(struct vnode *vp, u_quad_t nsize, struct ucred *cred)
 
 	oskip = osize & PEFS_SECTOR_MASK;
 	nskip = nsize & PEFS_SECTOR_MASK;
-	pefs_chunk_create(&pc, pn, PEFS_SECTOR_SIZE);
+	pefs_chunk_create(&pc, PEFS_SECTOR_SIZE);
 
 	if (nsize < osize && nskip != 0) {
 		pefs_chunk_setsize(&pc, nskip);
@@ -810,7 +1120,7 @@ pefs_truncate(struct vnode *vp, u_quad_t nsize, struct ucred *cred)
 	}
 
 out:
-	pefs_chunk_free(&pc, pn);
+	pefs_chunk_free(&pc);
 
 	return (error);
 }
@@ -888,6 +1198,8 @@ pefs_getattr(struct vop_getattr_args *ap)
 	vap->va_fsid = vp->v_mount->mnt_stat.f_fsid.val[0];
 	if (vap->va_type == VLNK)
 		vap->va_size = PEFS_NAME_PTON_SIZE(vap->va_size);
+	else if (vap->va_type == VREG)
+		vap->va_size = pefs_wbcache_size(VP_TO_PN(vp), vap->va_size);
 	return (0);
 }
 
@@ -965,11 +1277,16 @@ pefs_close(struct vop_close_args *ap)
 {
 	struct vnode *vp = ap->a_vp;
 	struct vnode *lvp = PEFS_LOWERVP(vp);
-	int error;
+	int error, wberror;
 
+	wberror = 0;
+	if (vp->v_type == VREG && VOP_ISLOCKED(vp) == LK_EXCLUSIVE)
+		wberror = pefs_wbcache_flush(vp, 0, curthread->td_ucred);
 	ap->a_vp = lvp;
 	error = VOP_CLOSE_AP(ap);
 	ap->a_vp = vp;
+	if (error == 0)
+		error = wberror;
 	return (error);
 }
 
@@ -1054,9 +1371,10 @@ pefs_rename(struct vop_rename_args *ap)
 	struct componentname *tcnp = ap->a_tcnp;
 	struct pefs_enccn fenccn, tenccn, txenccn;
 	struct vnode *lfdvp, *lfvp, *ltdvp, *ltvp;
+	struct pefs_enccn *txpec;
 	struct pefs_tkey *ptk;
 	struct mount *mp;
-	int error, lvp_ref;
+	int dcvalid, error, lvp_ref;
 
 	KASSERT(tcnp->cn_flags & (SAVENAME | SAVESTART),
 	    ("pefs_rename: no name"));
@@ -1068,6 +1386,7 @@ pefs_rename(struct vop_rename_args *ap)
 	ltdvp = PEFS_LOWERVP(tdvp);
 	ltvp = (tvp == NULL ? NULL : PEFS_LOWERVP(tvp));
 	mp = NULL;
+	txpec = NULL;
 
 	lvp_ref = 0;
 	pefs_enccn_init(&fenccn);
@@ -1149,8 +1468,7 @@ pefs_rename(struct vop_rename_args *ap)
 		 * to avoid race.
 		 */
 
-		error = pefs_enccn_create(&tenccn, fenccn.pec_tkey.ptk_key,
-		    fenccn.pec_tkey.ptk_tweak, tcnp);
+		error = pefs_enccn_create(&tenccn, &fenccn.pec_tkey, tcnp);
 		if (error != 0)
 			goto out_locked;
 
@@ -1159,9 +1477,7 @@ pefs_rename(struct vop_rename_args *ap)
 			goto out_locked;
 
 		VP_TO_PN(tvp)->pn_flags |= PN_WANTRECYCLE;
-		pefs_dircache_expire_encname(VP_TO_PN(tdvp)->pn_dircache,
-		    txenccn.pec_cn.cn_nameptr, txenccn.pec_cn.cn_namelen,
-		    PEFS_DF_FORCE_GC);
+		txpec = &txenccn;
 		cache_purge(tvp);
 		lvp_ref = 1;
 		vref(lfdvp);
@@ -1195,9 +1511,7 @@ pefs_rename(struct vop_rename_args *ap)
 		    (int)tcnp->cn_namelen, tcnp->cn_nameptr,
 		    (int)tenccn.pec_cn.cn_namelen, tenccn.pec_cn.cn_nameptr);
 		VP_TO_PN(tvp)->pn_flags |= PN_WANTRECYCLE;
-		pefs_dircache_expire_encname(VP_TO_PN(tdvp)->pn_dircache,
-		    tenccn.pec_cn.cn_nameptr, tenccn.pec_cn.cn_namelen,
-		    PEFS_DF_FORCE_GC);
+		txpec = &tenccn;
 		cache_purge(tvp);
 		error = pefs_rename_xlock_enter(fvp, 0);
 		if (error != 0) {
@@ -1206,8 +1520,7 @@ pefs_rename(struct vop_rename_args *ap)
 			goto out_locked;
 		}
 	} else {
-		error = pefs_enccn_create(&tenccn, fenccn.pec_tkey.ptk_key,
-		    fenccn.pec_tkey.ptk_tweak, tcnp);
+		error = pefs_enccn_create(&tenccn, &fenccn.pec_tkey, tcnp);
 		if (error != 0)
 			goto out_locked;
 	}
@@ -1225,9 +1538,18 @@ pefs_rename(struct vop_rename_args *ap)
 		lvp_ref = 0;
 	}
 
+	/*
+	 * Target directory cache is updated in place.  Source directory is
+	 * not locked, invalidate its cache unless it's the same directory.
+	 */
+	dcvalid = pefs_dircache_begin(tdvp, tcnp->cn_cred);
+	if (txpec != NULL)
+		pefs_dircache_expire_encname(VP_TO_PN(tdvp)->pn_dircache,
+		    txpec->pec_cn.cn_nameptr, txpec->pec_cn.cn_namelen,
+		    PEFS_DF_FORCE_GC | PEFS_DF_NOINVAL);
 	pefs_dircache_expire_encname(VP_TO_PN(fdvp)->pn_dircache,
 	    fenccn.pec_cn.cn_nameptr, fenccn.pec_cn.cn_namelen,
-	    0);
+	    fdvp == tdvp ? PEFS_DF_NOINVAL : 0);
 
 	error = VOP_RENAME(lfdvp, lfvp, &fenccn.pec_cn, ltdvp, ltvp,
 	    &tenccn.pec_cn);
@@ -1270,12 +1592,22 @@ pefs_rename(struct vop_rename_args *ap)
 				MPASS(ptk->ptk_key == tenccn.pec_tkey.ptk_key);
 				memcpy(ptk->ptk_tweak,
 				    tenccn.pec_tkey.ptk_tweak, PEFS_TWEAK_SIZE);
+				ptk->ptk_flags = tenccn.pec_tkey.ptk_flags;
 			}
 			PEFS_VOP_UNLOCK(fvp);
 		}
 		pefs_rename_xlock_exit(fvp);
 	}
 
+	vn_lock(tdvp, LK_EXCLUSIVE | LK_RETRY);
+	if (!VN_IS_DOOMED(tdvp)) {
+		if (error == 0 && dcvalid)
+			pefs_dircache_add(tdvp, &tenccn, tcnp);
+		pefs_dircache_end(tdvp, tcnp->cn_cred,
+		    dcvalid && error == 0);
+	}
+	PEFS_VOP_UNLOCK(tdvp);
+
 out_unlocked:
 	ASSERT_VOP_UNLOCKED(tdvp, "pefs_rename");
 	vrele(fdvp);
@@ -1498,6 +1830,15 @@ pefs_inactive(struct vop_inactive_args *ap)
 
 	MPASS(pn->pn_rename_xlock == 0);
 
+	if (pn->pn_wbsector != NULL) {
+		error = pefs_wbcache_flush(vp, 0, curthread->td_ucred);
+		if (error != 0) {
+			/* Sector is kept, written by sync or reclaim. */
+			PEFSDEBUG("pefs_inactive: failed to write cached "
+			    "sector: vp %p, error %d\n", vp, error);
+		}
+	}
+
 	if (vp->v_object != NULL && ((pn->pn_flags & PN_WANTRECYCLE) != 0 ||
 	    (pn->pn_flags & PN_HASKEY) == 0)) {
 		if (vp->v_object->resident_page_count > 0)
@@ -1524,8 +1865,6 @@ pefs_inactive(struct vop_inactive_args *ap)
 		}
 	}
 
-	pefs_node_buf_free(pn);
-
 	pefs_dircache_gc(pn->pn_dircache);
 
 	if ((pn->pn_flags & PN_WANTRECYCLE) != 0 ||
@@ -1546,6 +1885,7 @@ pefs_reclaim(struct vop_reclaim_args *ap)
 	struct vnode *vp = ap->a_vp;
 	struct pefs_node *pn;
 	struct vnode *lowervp;
+	int error;
 
 	pn = VP_TO_PN(vp);
 	lowervp = pn->pn_lowervp;
@@ -1556,6 +1896,17 @@ pefs_reclaim(struct vop_reclaim_args *ap)
 
 	MPASS(pn->pn_rename_xlock == 0);
 
+	if (pn->pn_wbsector != NULL) {
+		error = pefs_wbcache_flush(vp, IO_SYNC, curthread->td_ucred);
+		if (error != 0) {
+			printf("pefs: failed to write cached sector, "
+			    "data lost: offset %jd, error %d\n",
+			    (intmax_t)pn->pn_wbsector->pws_offset, error);
+			pefs_wbcache_free(pn->pn_wbsector);
+			pn->pn_wbsector = NULL;
+		}
+	}
+
 	if (pn->pn_flags & PN_HASKEY)
 		vnode_destroy_vobject(vp);
 	else
@@ -1567,14 +1918,8 @@ pefs_reclaim(struct vop_reclaim_args *ap)
 	 * prevent faults in pefs_lock().
 	 */
 
-	pefs_node_buf_free(pn);
-
 	lockmgr(&vp->v_lock, LK_EXCLUSIVE, NULL);
 	VI_LOCK(vp);
-#ifdef INVARIANTS
-	if ((pn->pn_flags & (PN_LOCKBUF_SMALL | PN_LOCKBUF_LARGE)) != 0)
-		printf("pefs_reclaim: node buffer leaked: vp: %p\n", vp);
-#endif
 	vp->v_data = NULL;
 	vp->v_vnlock = &vp->v_lock;
 	pn->pn_lowervp = NULL;
@@ -1632,13 +1977,16 @@ pefs_vptofh(struct vop_vptofh_args *ap)
 }
 
 static void
-pefs_readdir_decrypt(struct pefs_dircache *pd, struct pefs_ctx *ctx,
-    struct pefs_key *pk, int dflags, void *mem, size_t *psize)
+pefs_readdir_decrypt(struct pefs_mount *pm, struct pefs_dircache *pd,
+    struct pefs_ctx *ctx, struct pefs_key *pk, int dflags, void *mem,
+    size_t *psize)
 {
 	struct pefs_dircache_entry *cache;
 	struct dirent *de, *de_next;
 	size_t sz;
 
+	pefs_dircache_pin(pd);
+	pefs_cache_dirents(pm, pd, ctx, pk, mem, *psize);
 	for (de = (struct dirent*) mem, sz = *psize; sz > DIRENT_MINSIZE;
 	    de = de_next) {
 		MPASS(de->d_reclen <= sz);
@@ -1650,7 +1998,8 @@ pefs_readdir_decrypt(struct pefs_dircache *pd, struct pefs_ctx *ctx,
 			continue;
 		if (pefs_name_skip(de->d_name, de->d_namlen))
 			continue;
-		cache = pefs_cache_dirent(pd, de, ctx, pk);
+		cache = pefs_dircache_enclookup(pd, de->d_name,
+		    de->d_namlen);
 		if (cache != NULL) {
 			/* Do not change d_reclen */
 			MPASS(cache->pde_namelen + 1 <= de->d_namlen);
@@ -1663,6 +2012,7 @@ pefs_readdir_decrypt(struct pefs_dircache *pd, struct pefs_ctx *ctx,
 			de_next = de;
 		}
 	}
+	pefs_dircache_unpin(pd);
 }
 
 static int
@@ -1679,7 +2029,7 @@ pefs_readdir(struct vop_readdir_args *ap)
 	struct pefs_chunk pc;
 	struct pefs_ctx *ctx;
 	size_t mem_size;
-	u_long gen;
+	u_long gen, invalgen;
 	int error;
 	int r_ncookies = 0, r_ncookies_max = 0, ncookies = 0;
 	u_long *r_cookies = NULL, *cookies = NULL;
@@ -1705,9 +2055,9 @@ pefs_readdir(struct vop_readdir_args *ap)
 
 	gen = pefs_getgen(vp, cred);
 	ctx = pefs_ctx_get();
-	pefs_chunk_create(&pc, pn, qmin(uio->uio_resid, DFLTPHYS));
+	pefs_chunk_create(&pc, qmin(uio->uio_resid, DFLTPHYS));
 	pn_key = pefs_node_key(pn);
-	pefs_dircache_beginupdate(pn->pn_dircache);
+	invalgen = pefs_dircache_beginupdate(pn->pn_dircache);
 	if (!pefs_dircache_valid(pn->pn_dircache, gen) || uio->uio_offset != 0)
 		gen = 0;
 	while (1) {
@@ -1725,8 +2075,8 @@ pefs_readdir(struct vop_readdir_args *ap)
 		mem_size = pc.pc_size;
 		if (*eofflag == 0)
 			pefs_dircache_abortupdate(pn->pn_dircache);
-		pefs_readdir_decrypt(pn->pn_dircache, ctx, pn_key, pn->pn_flags,
-		    pc.pc_base, &mem_size);
+		pefs_readdir_decrypt(VFS_TO_PEFS(vp->v_mount), pn->pn_dircache,
+		    ctx, pn_key, pn->pn_flags, pc.pc_base, &mem_size);
 		pefs_chunk_setsize(&pc, mem_size);
 		error = pefs_chunk_copy(&pc, 0, uio);
 		if (error != 0)
@@ -1767,7 +2117,7 @@ pefs_readdir(struct vop_readdir_args *ap)
 		pefs_chunk_restore(&pc);
 	}
 	if (*eofflag != 0 && error == 0 && gen != 0)
-		pefs_dircache_endupdate(pn->pn_dircache, gen);
+		pefs_dircache_endupdate(pn->pn_dircache, gen, invalgen);
 	else
 		pefs_dircache_abortupdate(pn->pn_dircache);
 
@@ -1783,7 +2133,7 @@ pefs_readdir(struct vop_readdir_args *ap)
 
 	pefs_ctx_free(ctx);
 	pefs_key_release(pn_key);
-	pefs_chunk_free(&pc, pn);
+	pefs_chunk_free(&pc);
 
 	return (error);
 }
@@ -1795,7 +2145,7 @@ pefs_mkdir(struct vop_mkdir_args *ap)
 	struct vnode *lvp;
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_mkdir: no name"));
 	if (pefs_no_keys(dvp))
@@ -1806,7 +2156,11 @@ pefs_mkdir(struct vop_mkdir_args *ap)
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_MKDIR(PEFS_LOWERVP(dvp), &lvp, &enccn.pec_cn, ap->a_vap);
+	if (error == 0 && dcvalid)
+		pefs_dircache_add(dvp, &enccn, cnp);
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 	if (error == 0 && lvp != NULL) {
 		error = pefs_node_get_haskey(dvp->v_mount, lvp, ap->a_vpp,
 		    &enccn.pec_tkey);
@@ -1826,7 +2180,7 @@ pefs_rmdir(struct vop_rmdir_args *ap)
 	struct vnode *vp = ap->a_vp;
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_rmdir: no name"));
 	if (pefs_no_keys(vp))
@@ -1836,16 +2190,18 @@ pefs_rmdir(struct vop_rmdir_args *ap)
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_RMDIR(PEFS_LOWERVP(dvp), PEFS_LOWERVP(vp), &enccn.pec_cn);
 	VP_TO_PN(vp)->pn_flags |= PN_WANTRECYCLE;
 
 	if (error == 0) {
 		pefs_dircache_expire_encname(VP_TO_PN(dvp)->pn_dircache,
 		    enccn.pec_cn.cn_nameptr, enccn.pec_cn.cn_namelen,
-		    PEFS_DF_FORCE_GC);
+		    PEFS_DF_FORCE_GC | PEFS_DF_NOINVAL);
 		cache_purge(dvp);
 		cache_purge(vp);
 	}
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 
 	pefs_enccn_free(&enccn);
 
@@ -1859,7 +2215,7 @@ pefs_create(struct vop_create_args *ap)
 	struct vnode *lvp;
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_create: no name"));
 	if (pefs_no_keys(dvp))
@@ -1870,7 +2226,11 @@ pefs_create(struct vop_create_args *ap)
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_CREATE(PEFS_LOWERVP(dvp), &lvp, &enccn.pec_cn, ap->a_vap);
+	if (error == 0 && dcvalid)
+		pefs_dircache_add(dvp, &enccn, cnp);
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 	if (error == 0 && lvp != NULL) {
 		error = pefs_node_get_haskey(dvp->v_mount, lvp, ap->a_vpp,
 		    &enccn.pec_tkey);
@@ -1890,7 +2250,7 @@ pefs_remove(struct vop_remove_args *ap)
 	struct vnode *vp = ap->a_vp;
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_remove: no name"));
 	if (pefs_no_keys(dvp))
@@ -1900,15 +2260,17 @@ pefs_remove(struct vop_remove_args *ap)
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_REMOVE(PEFS_LOWERVP(dvp), PEFS_LOWERVP(vp), &enccn.pec_cn);
 	VP_TO_PN(vp)->pn_flags |= PN_WANTRECYCLE;
 
 	if (error == 0) {
 		pefs_dircache_expire_encname(VP_TO_PN(dvp)->pn_dircache,
 		    enccn.pec_cn.cn_nameptr, enccn.pec_cn.cn_namelen,
-		    PEFS_DF_FORCE_GC);
+		    PEFS_DF_FORCE_GC | PEFS_DF_NOINVAL);
 		cache_purge(vp);
 	}
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 
 	pefs_enccn_free(&enccn);
 
@@ -1923,7 +2285,7 @@ pefs_link(struct vop_link_args *ap)
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_node *pn = VP_TO_PN(vp);
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_link: no name"));
 	if (dvp->v_mount != vp->v_mount)
@@ -1932,12 +2294,15 @@ pefs_link(struct vop_link_args *ap)
 		return (EROFS);
 	pefs_enccn_init(&enccn);
 	PEFS_ENCCN_ASSERT_NOENT(ap->a_tdvp, cnp);
-	error = pefs_enccn_create(&enccn, pn->pn_tkey.ptk_key,
-	    pn->pn_tkey.ptk_tweak, cnp);
+	error = pefs_enccn_create(&enccn, &pn->pn_tkey, cnp);
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_LINK(PEFS_LOWERVP(dvp), PEFS_LOWERVP(vp), &enccn.pec_cn);
+	if (error == 0 && dcvalid)
+		pefs_dircache_add(dvp, &enccn, cnp);
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 
 	pefs_enccn_free(&enccn);
 
@@ -1951,17 +2316,15 @@ pefs_symlink(struct vop_symlink_args *ap)
 	struct vnode *ldvp;
 	struct vnode *lvp;
 	struct componentname *cnp = ap->a_cnp;
-	struct pefs_node *dpn;
 	struct pefs_enccn enccn;
 	struct pefs_chunk pc;
 	const char *target = ap->a_target;
 	char *enc_target, *penc_target;
 	size_t penc_target_len;
 	size_t target_len;
-	int error;
+	int dcvalid, error;
 
 	ldvp = PEFS_LOWERVP(dvp);
-	dpn = VP_TO_PN(dvp);
 
 	KASSERT(cnp->cn_flags & SAVENAME, ("pefs_symlink: no name"));
 	if (pefs_no_keys(dvp))
@@ -1979,7 +2342,7 @@ pefs_symlink(struct vop_symlink_args *ap)
 	if (error != 0)
 		return (error);
 
-	pefs_chunk_create(&pc, dpn, target_len);
+	pefs_chunk_create(&pc, target_len);
 	enc_target = pc.pc_base;
 	penc_target = malloc(penc_target_len, M_PEFSBUF, M_WAITOK);
 
@@ -1993,10 +2356,14 @@ pefs_symlink(struct vop_symlink_args *ap)
 		goto out;
 	}
 
-	pefs_chunk_free(&pc, dpn);
+	pefs_chunk_free(&pc);
 	enc_target = NULL;
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_SYMLINK(ldvp, &lvp, &enccn.pec_cn, ap->a_vap, penc_target);
+	if (error == 0 && dcvalid)
+		pefs_dircache_add(dvp, &enccn, cnp);
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 	if (error == 0) {
 		error = pefs_node_get_haskey(dvp->v_mount, lvp, ap->a_vpp,
 		    &enccn.pec_tkey);
@@ -2027,7 +2394,7 @@ pefs_readlink(struct vop_readlink_args *ap)
 		return (VOP_READLINK(lvp, uio, ap->a_cred));
 
 	MPASS(uio->uio_offset == 0);
-	pefs_chunk_create(&pc, pn, MAXPATHLEN);
+	pefs_chunk_create(&pc, MAXPATHLEN);
 	puio = pefs_chunk_uio(&pc, 0, uio->uio_rw);
 	error = VOP_READLINK(lvp, puio, ap->a_cred);
 	if (error == 0) {
@@ -2036,12 +2403,13 @@ pefs_readlink(struct vop_readlink_args *ap)
 		    target_len);
 		if (target_len >= 0) {
 			pefs_chunk_setsize(&pc, target_len);
-			pefs_data_decrypt(&pn->pn_tkey, 0, &pc);
+			pefs_data_decrypt(VFS_TO_PEFS(vp->v_mount),
+			    &pn->pn_tkey, 0, &pc);
 			uiomove(pc.pc_base, target_len, uio);
 		} else
 			error = EIO;
 	}
-	pefs_chunk_free(&pc, pn);
+	pefs_chunk_free(&pc);
 
 	return (error);
 }
@@ -2053,7 +2421,7 @@ pefs_mknod(struct vop_mknod_args *ap)
 	struct vnode *lvp;
 	struct componentname *cnp = ap->a_cnp;
 	struct pefs_enccn enccn;
-	int error;
+	int dcvalid, error;
 
 	if (pefs_no_keys(dvp))
 		return (EROFS);
@@ -2063,7 +2431,11 @@ pefs_mknod(struct vop_mknod_args *ap)
 	if (error != 0)
 		return (error);
 
+	dcvalid = pefs_dircache_begin(dvp, cnp->cn_cred);
 	error = VOP_MKNOD(PEFS_LOWERVP(dvp), &lvp, &enccn.pec_cn, ap->a_vap);
+	if (error == 0 && dcvalid)
+		pefs_dircache_add(dvp, &enccn, cnp);
+	pefs_dircache_end(dvp, cnp->cn_cred, dcvalid && error == 0);
 	if (error == 0 && lvp != NULL) {
 		error = pefs_node_get_haskey(dvp->v_mount, lvp, ap->a_vpp,
 		    &enccn.pec_tkey);
@@ -2083,7 +2455,7 @@ pefs_getsize(struct vnode *vp, u_quad_t *sizep, struct ucred *cred)
 
 	error = VOP_GETATTR(PEFS_LOWERVP(vp), &va, cred);
 	if (error == 0)
-		*sizep = va.va_size;
+		*sizep = pefs_wbcache_size(VP_TO_PN(vp), va.va_size);
 
 	return (error);
 }
@@ -2109,6 +2481,35 @@ pefs_ismapped(struct vnode *vp)
 	return (0);
 }
 
+/*
+ * Return length of the range at the beginning of [offset, offset + size)
+ * which has no pages in page cache, 0 if the first page is resident.  Only
+ * resident pages may be newer than lower file data, the rest of the file is
+ * accessed in large chunks even if pages were installed by read-ahead.
+ */
+static ssize_t
+pefs_nonresident(struct vnode *vp, off_t offset, ssize_t size)
+{
+#if __FreeBSD_version >= 1200014 || defined(PEFS_OSREL_1200014_VM_PAGE_CACHE)
+	vm_object_t object = vp->v_object;
+	vm_page_t m;
+	off_t moffset;
+
+	MPASS((offset & PAGE_MASK) == 0);
+	if (object == NULL)
+		return (size);
+	VM_OBJECT_RLOCK(object);
+	m = vm_page_find_least(object, OFF_TO_IDX(offset));
+	moffset = m != NULL ? IDX_TO_OFF(m->pindex) : offset + size;
+	VM_OBJECT_RUNLOCK(object);
+
+	return (qmin(moffset - offset, size));
+#else
+	/* Cached pages are not visible to vm_page_find_least(). */
+	return (pefs_ismapped(vp) != 0 ? 0 : size);
+#endif
+}
+
 static int
 pefs_readmapped(struct vnode *vp, struct uio *uio, ssize_t bsize,
     vm_page_t *mp)
@@ -2294,75 +2695,382 @@ pefs_bufsize(struct uio *uio, ssize_t maxsize)
 	return (qmin(roundup2(uio->uio_resid, PEFS_SECTOR_SIZE), maxsize));
 }
 
+/*
+ * Decrypt chunk into uio segment by segment.  skip applies to the first
+ * segment only.
+ */
 static int
-pefs_read(struct vop_read_args *ap)
+pefs_chunk_decrypt_uio(struct pefs_mount *pm, struct pefs_tkey *ptk,
+    off_t offset, struct pefs_chunk *pc, size_t skip, struct uio *uio)
 {
-	struct vnode *vp = ap->a_vp;
-	struct vnode *lvp = PEFS_LOWERVP(vp);
-	struct uio *uio = ap->a_uio;
-	struct ucred *cred = ap->a_cred;
-	struct pefs_node *pn = VP_TO_PN(vp);
-	u_quad_t fsize;
-	int ioflag = ap->a_ioflag;
-	int error;
-
-	if (vp->v_type == VDIR)
-		return (EISDIR);
-	if ((pn->pn_flags & PN_HASKEY) == 0 || vp->v_type == VFIFO)
-		return (VOP_READ(lvp, uio, ioflag, cred));
-	if (vp->v_type != VREG)
-		return (EOPNOTSUPP);
-	if (uio->uio_resid == 0)
-		return (0);
-	if (uio->uio_offset < 0 || uio->uio_resid < 0)
-		return (EINVAL);
-	if ((uoff_t)uio->uio_offset + (uoff_t)uio->uio_resid > (uoff_t)OFF_MAX)
-                return (EFBIG);
+	struct pefs_chunk seg;
+	int error, i;
 
-	error = pefs_getsize(vp, &fsize, cred);
-	if (error != 0)
-		return (error);
+	error = 0;
+	for (i = 0; uio->uio_resid > 0 &&
+	    pefs_chunk_segment(pc, i, &seg) != 0; i++) {
+		error = pefs_data_decrypt_uio(pm, ptk,
+		    offset + (off_t)i * PEFS_CHUNK_SEGSIZE, &seg,
+		    i == 0 ? skip : 0, uio);
+		if (error != 0)
+			break;
+	}
 
-	error = pefs_read_int(vp, uio, ioflag, cred, fsize);
 	return (error);
 }
 
 static int
-pefs_read_int(struct vnode *vp, struct uio *uio, int ioflag, struct ucred *cred,
-    u_quad_t fsize)
+pefs_chunk_encrypt_uio(struct pefs_tkey *ptk, off_t offset,
+    struct pefs_chunk *pc, size_t skip, struct uio *uio)
 {
-	struct vnode *lvp = PEFS_LOWERVP(vp);
-	struct uio *puio;
-	struct pefs_node *pn = VP_TO_PN(vp);
-	struct pefs_chunk pc;
-	struct sf_buf *sf;
-	vm_page_t m;
-	char *ma;
-	ssize_t bsize, bskip, done;
-	off_t poffset;
-	int error = 0, mapped, nocopy;
+	struct pefs_chunk seg;
+	int error, i;
 
-	MPASS(vp->v_type == VREG);
-	MPASS(uio->uio_resid != 0);
-	MPASS(uio->uio_offset >= 0);
+	error = 0;
+	for (i = 0; pefs_chunk_segment(pc, i, &seg) != 0; i++) {
+		error = pefs_data_encrypt_uio(ptk,
+		    offset + (off_t)i * PEFS_CHUNK_SEGSIZE, &seg,
+		    i == 0 ? skip : 0, uio);
+		if (error != 0)
+			break;
+	}
 
-	mapped = pefs_ismapped(vp);
-	if (mapped != 0)
-		bsize = PEFS_SECTOR_SIZE;
-	else
-		bsize = pefs_bufsize(uio, DFLTPHYS);
+	return (error);
+}
 
-	pefs_chunk_create(&pc, pn, bsize);
-	m = NULL;
-	nocopy = 0;
-	while (uio->uio_resid > 0 && uio->uio_offset < fsize) {
-		MPASS(nocopy == 0);
-		bskip = uio->uio_offset & PEFS_SECTOR_MASK;
-		poffset = uio->uio_offset - bskip;
-		bsize = pefs_bufsize(uio, bsize);
-		bsize = qmin(fsize - poffset, bsize);
+#if defined(PEFS_READAHEAD) || defined(PEFS_PAGER)
+/*
+ * Copy decrypted data into vnode pages which are not resident.  Pages
+ * already in page cache may contain newer data and are skipped.
+ */
+static u_long
+pefs_readahead_install(struct vnode *vp, off_t offset, char *buf, size_t size)
+{
+	vm_page_t ma[DFLTPHYS / PAGE_SIZE];
+	vm_object_t object = vp->v_object;
+	struct sf_buf *sf;
+	size_t pos;
+	int i, count;
+
+	MPASS(size <= DFLTPHYS);
+	count = 0;
+	VM_OBJECT_WLOCK(object);
+	for (pos = 0; pos + PAGE_SIZE <= size; pos += PAGE_SIZE) {
+		if (vm_page_lookup(object, OFF_TO_IDX(offset + pos)) != NULL)
+			continue;
+		ma[count] = vm_page_alloc(object, OFF_TO_IDX(offset + pos),
+		    VM_ALLOC_NORMAL);
+		if (ma[count] == NULL)
+			break;
+		count++;
+	}
+	VM_OBJECT_WUNLOCK(object);
+
+	for (i = 0; i < count; i++) {
+		pos = IDX_TO_OFF(ma[i]->pindex) - offset;
+		sched_pin();
+		sf = sf_buf_alloc(ma[i], SFB_CPUPRIVATE);
+		memcpy((char *)sf_buf_kva(sf), buf + pos, PAGE_SIZE);
+		sf_buf_free(sf);
+		sched_unpin();
+	}
+
+	VM_OBJECT_WLOCK(object);
+	for (i = 0; i < count; i++) {
+		vm_page_valid(ma[i]);
+		vm_page_readahead_finish(ma[i]);
+	}
+	VM_OBJECT_WUNLOCK(object);
+
+	return (count);
+}
+#endif
+
+#ifdef PEFS_READAHEAD
+/*
+ * Read page aligned range [offset, end) into page cache.  Up to
+ * pefs_readahead_chunks chunks are in flight: chunk is decrypted by crypto
+ * worker thread while the following chunks are read from lower vnode.
+ */
+static void
+pefs_readahead_fill(struct vnode *vp, off_t offset, off_t end, int ioflag,
+    struct ucred *cred)
+{
+	struct pefs_chunk pc[PEFS_READAHEAD_MAX];
+	struct pefs_crypto_async *pca[PEFS_READAHEAD_MAX];
+	off_t poffset[PEFS_READAHEAD_MAX];
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_mount *pm = VFS_TO_PEFS(vp->v_mount);
+	struct uio *puio;
+	ssize_t done, size;
+	u_long pages;
+	int error, head, i, inflight, nslots, tail;
+
+	MPASS((offset & PAGE_MASK) == 0 && (end & PAGE_MASK) == 0);
+
+	nslots = imin(pefs_readahead_chunks, PEFS_READAHEAD_MAX);
+	pages = 0;
+	head = tail = inflight = 0;
+	for (i = 0; i < nslots; i++)
+		pc[i].pc_base = NULL;
+	while (offset < end || inflight != 0) {
+		if (offset < end && inflight < nslots) {
+			i = head % nslots;
+			size = qmin(end - offset, DFLTPHYS);
+			if (pc[i].pc_base == NULL)
+				pefs_chunk_create(&pc[i], DFLTPHYS);
+			pefs_chunk_setsize(&pc[i], size);
+			puio = pefs_chunk_uio(&pc[i], offset, UIO_READ);
+			error = VOP_READ(lvp, puio, ioflag, cred);
+			done = error == 0 ? trunc_page(size - puio->uio_resid) :
+			    0;
+			if (done != size)
+				end = offset;
+			if (done == 0)
+				continue;
+			pefs_chunk_setsize(&pc[i], done);
+			poffset[i] = offset;
+			pca[i] = pefs_data_decrypt_async(&pn->pn_tkey, offset,
+			    &pc[i]);
+			offset += done;
+			head++;
+			inflight++;
+			continue;
+		}
+		i = tail++ % nslots;
+		pefs_data_decrypt_wait(pm, pca[i]);
+		pages += pefs_readahead_install(vp, poffset[i], pc[i].pc_base,
+		    pc[i].pc_size);
+		inflight--;
+	}
+	for (i = 0; i < nslots; i++)
+		if (pc[i].pc_base != NULL)
+			pefs_chunk_free(&pc[i]);
+	if (pages != 0)
+		atomic_add_long(&pm->pm_stats.ps_readahead, pages);
+}
+
+/*
+ * Fill read-ahead window by worker thread.  Request holds vnode reference,
+ * nothing is done if vnode was reclaimed meanwhile.  File size is checked
+ * again with vnode locked, file could be truncated after request was queued.
+ */
+static void
+pefs_readahead_task(void *context, int pending __unused)
+{
+	struct pefs_readahead_req *prr = context;
+	struct vnode *vp = prr->prr_vp;
+	struct pefs_node *pn;
+	u_quad_t fsize;
+	off_t end;
+
+	vn_lock(vp, LK_SHARED | LK_RETRY);
+	if (!VN_IS_DOOMED(vp)) {
+		pn = VP_TO_PN(vp);
+		if ((pn->pn_flags & PN_HASKEY) != 0 &&
+		    pn->pn_wbsector == NULL &&
+		    pefs_getsize(vp, &fsize, prr->prr_cred) == 0) {
+			end = qmin(prr->prr_end, trunc_page(fsize));
+			if (prr->prr_offset < end)
+				pefs_readahead_fill(vp, prr->prr_offset, end,
+				    prr->prr_ioflag, prr->prr_cred);
+		}
+		atomic_store_rel_int(&pn->pn_readahead, 0);
+	}
+	vput(vp);
+	crfree(prr->prr_cred);
+	free(prr, M_PEFSBUF);
+}
 
-		if (mapped != 0) {
+/*
+ * Read ahead sequentially accessed file into page cache after the request
+ * was served.  Window is filled by worker thread while the caller consumes
+ * data, following reads are then served from page cache by pefs_read_int.
+ * Only one request per file is queued at a time.  Read-ahead starts at the
+ * first page not in cache if it's within half of the read-ahead window
+ * after the end of the request.
+ */
+static void
+pefs_readahead(struct vnode *vp, struct uio *uio, int ioflag,
+    struct ucred *cred, u_quad_t fsize)
+{
+	vm_object_t object = vp->v_object;
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_readahead_req *prr;
+	off_t end, offset, reqend, window;
+
+	if (pefs_readahead_chunks <= 0 || object == NULL ||
+	    uio->uio_segflg == UIO_NOCOPY || pn->pn_wbsector != NULL ||
+	    pn->pn_readahead != 0 ||
+	    (ioflag >> IO_SEQSHIFT) < pefs_readahead_seqcount)
+		return;
+
+	window = (off_t)imin(pefs_readahead_chunks, PEFS_READAHEAD_MAX) *
+	    DFLTPHYS;
+	reqend = uio->uio_offset + uio->uio_resid;
+	end = trunc_page(qmin(reqend + window, fsize));
+	offset = trunc_page(uio->uio_offset);
+	VM_OBJECT_RLOCK(object);
+	for (; offset < end; offset += PAGE_SIZE)
+		if (vm_page_lookup(object, OFF_TO_IDX(offset)) == NULL)
+			break;
+	VM_OBJECT_RUNLOCK(object);
+	if (offset >= end || offset >= reqend + window / 2)
+		return;
+
+	PEFSDEBUG("pefs_readahead: vp=%p offset=0x%jx end=0x%jx\n",
+	    vp, (intmax_t)offset, (intmax_t)end);
+	if (pefs_readahead_tq == NULL) {
+		pefs_readahead_fill(vp, offset, end, ioflag, cred);
+		return;
+	}
+	if (atomic_cmpset_int(&pn->pn_readahead, 0, 1) == 0)
+		return;
+	prr = malloc(sizeof(*prr), M_PEFSBUF, M_WAITOK);
+	vref(vp);
+	prr->prr_vp = vp;
+	prr->prr_cred = crhold(cred);
+	prr->prr_offset = offset;
+	prr->prr_end = end;
+	prr->prr_ioflag = ioflag;
+	TASK_INIT(&prr->prr_task, 0, pefs_readahead_task, prr);
+	taskqueue_enqueue(pefs_readahead_tq, &prr->prr_task);
+}
+#endif
+
+void
+pefs_readahead_init(void)
+{
+#ifdef PEFS_READAHEAD
+	TUNABLE_INT_FETCH("vfs.pefs.readahead.threads",
+	    &pefs_readahead_threads);
+	if (pefs_readahead_threads < 0)
+		pefs_readahead_threads = MAX(1, mp_ncpus / 2);
+	if (pefs_readahead_threads > 0) {
+		pefs_readahead_tq = taskqueue_create("pefs_readahead",
+		    M_WAITOK, taskqueue_thread_enqueue, &pefs_readahead_tq);
+		taskqueue_start_threads(&pefs_readahead_tq,
+		    pefs_readahead_threads, PVFS, "pefs readahead");
+	}
+#endif
+}
+
+void
+pefs_readahead_uninit(void)
+{
+#ifdef PEFS_READAHEAD
+	if (pefs_readahead_tq != NULL) {
+		taskqueue_free(pefs_readahead_tq);
+		pefs_readahead_tq = NULL;
+	}
+#endif
+}
+
+/*
+ * Wait for queued read-ahead requests to release vnode references.
+ */
+void
+pefs_readahead_drain(void)
+{
+#ifdef PEFS_READAHEAD
+	if (pefs_readahead_tq != NULL)
+		taskqueue_drain_all(pefs_readahead_tq);
+#endif
+}
+
+static int
+pefs_read(struct vop_read_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct uio *uio = ap->a_uio;
+	struct ucred *cred = ap->a_cred;
+	struct pefs_node *pn = VP_TO_PN(vp);
+	u_quad_t fsize;
+	int ioflag = ap->a_ioflag;
+	int error;
+
+	if (vp->v_type == VDIR)
+		return (EISDIR);
+	if ((pn->pn_flags & PN_HASKEY) == 0 || vp->v_type == VFIFO)
+		return (VOP_READ(lvp, uio, ioflag, cred));
+	if (vp->v_type != VREG)
+		return (EOPNOTSUPP);
+	if (uio->uio_resid == 0)
+		return (0);
+	if (uio->uio_offset < 0 || uio->uio_resid < 0)
+		return (EINVAL);
+	if ((uoff_t)uio->uio_offset + (uoff_t)uio->uio_resid > (uoff_t)OFF_MAX)
+                return (EFBIG);
+
+	error = pefs_getsize(vp, &fsize, cred);
+	if (error != 0)
+		return (error);
+
+	error = pefs_read_int(vp, uio, ioflag, cred, fsize);
+#ifdef PEFS_READAHEAD
+	if (error == 0)
+		pefs_readahead(vp, uio, ioflag, cred, fsize);
+#endif
+	return (error);
+}
+
+static int
+pefs_read_int(struct vnode *vp, struct uio *uio, int ioflag, struct ucred *cred,
+    u_quad_t fsize)
+{
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct uio *puio;
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_mount *pm = VFS_TO_PEFS(vp->v_mount);
+	struct pefs_chunk pc;
+	struct sf_buf *sf;
+	struct pefs_wbsector *pws;
+	vm_page_t m;
+	char *ma;
+	ssize_t bmaxsize, bsize, bskip, done, nonresident;
+	off_t poffset;
+	int error = 0, cached, mapped, nocopy;
+
+	MPASS(vp->v_type == VREG);
+	MPASS(uio->uio_resid != 0);
+	MPASS(uio->uio_offset >= 0);
+
+	mapped = pefs_ismapped(vp);
+	bmaxsize = pefs_bufsize(uio, pm->pm_maxio);
+
+	pefs_chunk_create(&pc, bmaxsize);
+	m = NULL;
+	nocopy = 0;
+	while (uio->uio_resid > 0 && uio->uio_offset < fsize) {
+		MPASS(nocopy == 0);
+		bskip = uio->uio_offset & PEFS_SECTOR_MASK;
+		poffset = uio->uio_offset - bskip;
+		bsize = pefs_bufsize(uio, bmaxsize);
+		bsize = qmin(fsize - poffset, bsize);
+
+		/* Resident pages are read one by one. */
+		nonresident = mapped != 0 ?
+		    pefs_nonresident(vp, poffset, bsize) : bsize;
+		if (nonresident == 0)
+			bsize = qmin(bsize, PEFS_SECTOR_SIZE);
+		else
+			bsize = nonresident;
+
+		/* Sector in write-back cache is newer than lower file data. */
+		cached = 0;
+		pws = pn->pn_wbsector;
+		if (pws != NULL && pws->pws_offset >= poffset &&
+		    pws->pws_offset < poffset + bsize) {
+			if (pws->pws_offset == poffset) {
+				bsize = qmin(bsize, pws->pws_size);
+				cached = 1;
+			} else
+				bsize = pws->pws_offset - poffset;
+		}
+
+		if (nonresident == 0) {
 			error = pefs_readmapped(vp, uio, bsize, &m);
 			if (error == EJUSTRETURN) {
 				error = 0;
@@ -2377,24 +3085,35 @@ pefs_read_int(struct vnode *vp, struct uio *uio, int ioflag, struct ucred *cred,
 		pefs_chunk_setsize(&pc, bsize);
 
 		PEFSDEBUG("pefs_read: mapped=%d m=%d offset=0x%jx size=0x%zx\n",
-		    mapped, m != NULL, uio->uio_offset, bsize - bskip);
-		puio = pefs_chunk_uio(&pc, poffset, uio->uio_rw);
-		error = VOP_READ(lvp, puio, ioflag, cred);
-		if (error != 0)
-			break;
-
-		done = pc.pc_size - puio->uio_resid;
+		    nonresident == 0, m != NULL, uio->uio_offset,
+		    bsize - bskip);
+		if (cached != 0) {
+			memcpy(pc.pc_base, pws->pws_chunk.pc_base, bsize);
+			done = bsize;
+		} else {
+			puio = pefs_chunk_uio(&pc, poffset, uio->uio_rw);
+			error = VOP_READ(lvp, puio, ioflag, cred);
+			if (error != 0)
+				break;
+			done = pc.pc_size - puio->uio_resid;
+		}
 		if (done <= bskip)
 			break;
 
 		/* XXX assert full buffer is read */
 		pefs_chunk_setsize(&pc, done);
-		pefs_data_decrypt(&pn->pn_tkey, poffset, &pc);
 		if (nocopy == 0) {
-			error = pefs_chunk_copy(&pc, bskip, uio);
+			if (cached != 0)
+				error = pefs_chunk_copy(&pc, bskip, uio);
+			else
+				error = pefs_chunk_decrypt_uio(pm,
+				    &pn->pn_tkey, poffset, &pc, bskip, uio);
 			if (error != 0)
 				break;
 		} else {
+			if (cached == 0)
+				pefs_data_decrypt(pm, &pn->pn_tkey, poffset,
+				    &pc);
 			nocopy = 0;
 			sched_pin();
 			sf = sf_buf_alloc(m, SFB_CPUPRIVATE);
@@ -2435,7 +3154,7 @@ pefs_read_int(struct vnode *vp, struct uio *uio, int ioflag, struct ucred *cred,
 		VM_OBJECT_UNLOCK(vp->v_object);
 #endif
 	}
-	pefs_chunk_free(&pc, pn);
+	pefs_chunk_free(&pc);
 
 	return (error);
 }
@@ -2656,6 +3375,266 @@ pefs_write(struct vop_write_args *ap)
 	return (error);
 }
 
+/*
+ * Encrypt and write chunk to the lower file preserving holes.  All-zero
+ * sectors are not encrypted: they are skipped if located beyond the end of
+ * the lower file (file is extended with truncate afterwards), otherwise
+ * range is deallocated by lower file system or zero filled.  Zero sectors
+ * read back as holes by pefs_data_decrypt.
+ */
+static int
+pefs_write_sparse(struct vnode *vp, struct pefs_chunk *pc, off_t poffset,
+    int ioflag, struct ucred *cred, u_quad_t *lsizep)
+{
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_mount *pm = VFS_TO_PEFS(vp->v_mount);
+	struct pefs_chunk run;
+	struct vattr va;
+	struct uio *puio;
+	size_t off, len;
+	off_t roffset;
+#if __FreeBSD_version >= 1400032
+	off_t doffset, dlen;
+#endif
+	u_long holes;
+	int error, zero, nextzero;
+
+	error = 0;
+	holes = 0;
+	zero = pefs_data_iszero(pc, 0);
+	for (off = 0; off < pc->pc_size; off += len, zero = nextzero) {
+		len = 0;
+		nextzero = 0;
+		do {
+			len += qmin(PEFS_SECTOR_SIZE, pc->pc_size - off - len);
+			if (off + len >= pc->pc_size)
+				break;
+			nextzero = pefs_data_iszero(pc, off + len);
+		} while (nextzero == zero);
+
+		roffset = poffset + off;
+		pefs_chunk_slice(&run, pc, off, len);
+		if (zero != 0) {
+			holes += len / PEFS_SECTOR_SIZE;
+			if ((u_quad_t)roffset >= *lsizep)
+				continue;
+#if __FreeBSD_version >= 1400032
+			doffset = roffset;
+			dlen = qmin(len, *lsizep - roffset);
+			/* May return early, restart as vn_deallocate does. */
+			do {
+				error = VOP_DEALLOCATE(lvp, &doffset, &dlen, 0,
+				    ioflag, cred);
+			} while (error == 0 && dlen > 0);
+			if (error != EOPNOTSUPP && error != EINVAL) {
+				if (error != 0)
+					break;
+				continue;
+			}
+#endif
+		} else
+			pefs_data_encrypt(&pn->pn_tkey, roffset, &run);
+		puio = pefs_chunk_uio(&run, roffset, UIO_WRITE);
+		error = VOP_WRITE(lvp, puio, ioflag, cred);
+		if (error != 0)
+			break;
+		MPASS(puio->uio_resid == 0);
+		if ((u_quad_t)(roffset + len) > *lsizep)
+			*lsizep = roffset + len;
+	}
+
+	if (error == 0 && (u_quad_t)(poffset + pc->pc_size) > *lsizep) {
+		VATTR_NULL(&va);
+		va.va_size = poffset + pc->pc_size;
+		error = VOP_SETATTR(lvp, &va, cred);
+		if (error == 0)
+			*lsizep = va.va_size;
+	}
+	if (holes != 0)
+		atomic_add_long(&pm->pm_stats.ps_holes_written, holes);
+
+	return (error);
+}
+
+static struct pefs_wbsector *
+pefs_wbcache_alloc(off_t offset)
+{
+	struct pefs_wbsector *pws;
+
+	pws = malloc(sizeof(*pws), M_PEFSBUF, M_WAITOK);
+	pefs_chunk_create(&pws->pws_chunk, PEFS_SECTOR_SIZE);
+	pefs_chunk_zero(&pws->pws_chunk);
+	pws->pws_offset = offset;
+	pws->pws_size = 0;
+
+	return (pws);
+}
+
+static void
+pefs_wbcache_free(struct pefs_wbsector *pws)
+{
+	pefs_chunk_free(&pws->pws_chunk);
+	free(pws, M_PEFSBUF);
+}
+
+/*
+ * Encrypt copy of cached sector and write it to the lower file.  Sector is
+ * dropped from cache only after successful write, on failure it's retried
+ * and error is reported again by the next flush, fsync or close.
+ * Synchronous write flags in ioflag are passed to the lower file system.
+ */
+static int
+pefs_wbcache_flush(struct vnode *vp, int ioflag, struct ucred *cred)
+{
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_wbsector *pws;
+	struct pefs_chunk pc;
+	struct vattr va;
+	struct uio *puio;
+	u_quad_t lsize;
+	int error;
+
+	pws = pn->pn_wbsector;
+	if (pws == NULL)
+		return (0);
+	ASSERT_VOP_ELOCKED(vp, "pefs_wbcache_flush");
+
+	PEFSDEBUG("pefs_wbcache_flush: vp=%p offset=0x%jx size=0x%zx\n",
+	    vp, (intmax_t)pws->pws_offset, pws->pws_size);
+	ioflag = IO_UNIT | (ioflag & PEFS_IO_SYNC);
+	pefs_chunk_create(&pc, PEFS_SECTOR_SIZE);
+	pefs_chunk_setsize(&pc, pws->pws_size);
+	memcpy(pc.pc_base, pws->pws_chunk.pc_base, pws->pws_size);
+	if ((VFS_TO_PEFS(vp->v_mount)->pm_flags & PM_SPARSE) != 0) {
+		error = VOP_GETATTR(lvp, &va, cred);
+		if (error == 0) {
+			lsize = va.va_size;
+			error = pefs_write_sparse(vp, &pc, pws->pws_offset,
+			    ioflag, cred, &lsize);
+		}
+	} else {
+		pefs_data_encrypt(&pn->pn_tkey, pws->pws_offset, &pc);
+		puio = pefs_chunk_uio(&pc, pws->pws_offset, UIO_WRITE);
+		error = VOP_WRITE(lvp, puio, ioflag, cred);
+	}
+	pefs_chunk_free(&pc);
+	if (error != 0)
+		return (error);
+	pn->pn_wbsector = NULL;
+	pefs_wbcache_free(pws);
+	atomic_add_long(&pefs_wbcache_flushes, 1);
+
+	return (0);
+}
+
+/*
+ * Write part of a sector into write-back cache.  Sector is read from lower
+ * file only when it's not cached yet, consecutive small writes to the same
+ * sector are merged.  Sector is flushed once it's written up to the end.
+ */
+static int
+pefs_wbcache_write(struct vnode *vp, struct uio *uio, off_t poffset,
+    size_t bskip, u_quad_t fsize, struct ucred *cred)
+{
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_wbsector *pws;
+	struct uio *puio;
+	ssize_t len, resid;
+	int error;
+
+	MPASS(bskip < PEFS_SECTOR_SIZE);
+	pws = pn->pn_wbsector;
+	if (pws != NULL && pws->pws_offset != poffset) {
+		error = pefs_wbcache_flush(vp, 0, cred);
+		if (error != 0)
+			return (error);
+		pws = NULL;
+	}
+	if (pws == NULL) {
+		pws = pefs_wbcache_alloc(poffset);
+		if ((u_quad_t)poffset < fsize) {
+			pws->pws_size = qmin(fsize - poffset, PEFS_SECTOR_SIZE);
+			pefs_chunk_setsize(&pws->pws_chunk, pws->pws_size);
+			puio = pefs_chunk_uio(&pws->pws_chunk, poffset,
+			    UIO_READ);
+			error = pefs_read_int(vp, puio, IO_UNIT, cred, fsize);
+			if (error != 0) {
+				pefs_wbcache_free(pws);
+				return (error);
+			}
+		}
+		pn->pn_wbsector = pws;
+	}
+
+	resid = uio->uio_resid;
+	len = qmin(PEFS_SECTOR_SIZE - bskip, resid);
+	error = uiomove((char *)pws->pws_chunk.pc_base + bskip, len, uio);
+	len = resid - uio->uio_resid;
+	pws->pws_size = qmax(pws->pws_size, bskip + len);
+	if (error != 0)
+		return (error);
+	atomic_add_long(&pefs_wbcache_writes, 1);
+	if (bskip + len == PEFS_SECTOR_SIZE)
+		error = pefs_wbcache_flush(vp, 0, cred);
+
+	return (error);
+}
+
+/*
+ * Write back cached sectors of the file system.  Called by syncer
+ * periodically.
+ */
+int
+pefs_wbcache_sync(struct mount *mp, int waitfor)
+{
+	int error = 0;
+#if __FreeBSD_version >= 1000025
+	struct vnode *vp, *mvp;
+	int lkflags, rv;
+
+	lkflags = LK_EXCLUSIVE | LK_INTERLOCK;
+	if (waitfor == MNT_LAZY)
+		lkflags |= LK_NOWAIT;
+loop:
+#if __FreeBSD_version < 1300113
+	MNT_VNODE_FOREACH_ACTIVE(vp, mp, mvp) {
+#else
+	MNT_VNODE_FOREACH_ALL(vp, mp, mvp) {
+#endif
+		if (vp->v_type != VREG || vp->v_data == NULL ||
+		    VP_TO_PN(vp)->pn_wbsector == NULL) {
+			VI_UNLOCK(vp);
+			continue;
+		}
+#if __FreeBSD_version < 1300109
+		rv = vget(vp, lkflags, curthread);
+#else
+		rv = vget(vp, lkflags);
+#endif
+		if (rv != 0) {
+			if (rv == ENOENT) {
+#if __FreeBSD_version < 1300113
+				MNT_VNODE_FOREACH_ACTIVE_ABORT(mp, mvp);
+#else
+				MNT_VNODE_FOREACH_ALL_ABORT(mp, mvp);
+#endif
+				goto loop;
+			}
+			continue;
+		}
+		rv = pefs_wbcache_flush(vp,
+		    waitfor == MNT_WAIT ? IO_SYNC : 0, curthread->td_ucred);
+		if (rv != 0)
+			error = rv;
+		vput(vp);
+	}
+#endif
+
+	return (error);
+}
+
 static int
 pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
     struct ucred *cred, u_quad_t fsize)
@@ -2663,24 +3642,25 @@ pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 	struct vnode *lvp = PEFS_LOWERVP(vp);
 	struct uio *puio;
 	struct pefs_node *pn = VP_TO_PN(vp);
-	struct pefs_chunk pc;
-	u_quad_t nsize;
+	struct pefs_chunk pc, seg;
+	struct pefs_wbsector *pws;
+	u_quad_t nsize, lsize;
 	off_t poffset;
-	ssize_t bmaxsize, bsize, bskip;
-	int error = 0, mapped;
+	ssize_t bmaxsize, bsize, bskip, nonresident;
+	int error = 0, encrypted, i, mapped, sparse, wbcache;
 
 	MPASS(vp->v_type == VREG);
 	MPASS(uio->uio_resid != 0);
 	MPASS(uio->uio_offset >= 0);
 
 	mapped = pefs_ismapped(vp);
-	if (mapped != 0)
-		bmaxsize = PEFS_SECTOR_SIZE;
-	else
-		bmaxsize = pefs_bufsize(uio, DFLTPHYS);
+	bmaxsize = pefs_bufsize(uio, VFS_TO_PEFS(vp->v_mount)->pm_maxio);
 	bsize = bmaxsize;
 
-	nsize = fsize;
+	sparse = (VFS_TO_PEFS(vp->v_mount)->pm_flags & PM_SPARSE) != 0;
+	wbcache = pefs_wbcache_enable != 0 && uio->uio_segflg != UIO_NOCOPY &&
+	    (ioflag & PEFS_IO_SYNC) == 0;
+	lsize = nsize = fsize;
 	MPASS(uio->uio_offset <= fsize);
 	if (uio->uio_offset + uio->uio_resid > nsize) {
 		PEFSDEBUG("pefs_write: extend: 0x%jx (old size: 0x%jx)\n",
@@ -2689,10 +3669,21 @@ pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 		vnode_pager_setsize(vp, nsize);
 	}
 
-	pefs_chunk_create(&pc, pn, bsize);
+	pefs_chunk_create(&pc, bsize);
 	while (uio->uio_resid > 0) {
 		bskip = uio->uio_offset & PEFS_SECTOR_MASK;
 		poffset = uio->uio_offset - bskip;
+		/* Resident pages are updated one by one. */
+		nonresident = mapped != 0 ?
+		    pefs_nonresident(vp, poffset, bmaxsize) : bmaxsize;
+		if (wbcache != 0 && nonresident != 0 &&
+		    (bskip != 0 || uio->uio_resid < PEFS_SECTOR_SIZE)) {
+			error = pefs_wbcache_write(vp, uio, poffset, bskip,
+			    fsize, cred);
+			if (error != 0)
+				break;
+			continue;
+		}
 		if (bskip != 0)
 			bsize = PEFS_SECTOR_SIZE;
 		else {
@@ -2703,9 +3694,21 @@ pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 			bsize = qmin(bsize, bmaxsize);
 		}
 		bsize = qmin(nsize - poffset, bsize);
+		if (nonresident == 0)
+			bsize = qmin(bsize, PEFS_SECTOR_SIZE);
+		else
+			bsize = qmin(bsize, nonresident);
+		pws = pn->pn_wbsector;
+		if (pws != NULL && pws->pws_offset >= poffset &&
+		    pws->pws_offset < poffset + bsize) {
+			error = pefs_wbcache_flush(vp, ioflag, cred);
+			if (error != 0)
+				break;
+		}
 		pefs_chunk_setsize(&pc, bsize);
+		encrypted = 0;
 
-		if (mapped != 0) {
+		if (nonresident == 0) {
 			error = pefs_writemapped(vp, uio, bsize, pc.pc_base);
 			if (error == EJUSTRETURN) {
 				error = 0;
@@ -2738,7 +3741,13 @@ pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 				    puio->uio_resid);
 			}
 		}
-		error = pefs_chunk_copy(&pc, bskip, uio);
+		if (sparse != 0)
+			error = pefs_chunk_copy(&pc, bskip, uio);
+		else {
+			error = pefs_chunk_encrypt_uio(&pn->pn_tkey, poffset,
+			    &pc, bskip, uio);
+			encrypted = 1;
+		}
 		if (error != 0) {
 			PEFSDEBUG("pefs_write: chunk copy error: "
 			    "offset=0x%jx resid=%0jx\n",
@@ -2747,12 +3756,26 @@ pefs_write_int(struct vnode *vp, struct uio *uio, int ioflag,
 		}
 lower_update:
 		PEFSDEBUG("pefs_write: mapped=%d offset=0x%jx size=0x%jx\n",
-		    mapped, poffset + bskip, (intmax_t)bsize - bskip);
-		pefs_data_encrypt(&pn->pn_tkey, poffset, &pc);
-		puio = pefs_chunk_uio(&pc, poffset, uio->uio_rw);
-
+		    nonresident == 0, poffset + bskip, (intmax_t)bsize - bskip);
 		/* IO_APPEND handled above to prevent offset change races. */
-		error = VOP_WRITE(lvp, puio, ioflag, cred);
+		if (sparse != 0) {
+			for (i = 0; pefs_chunk_segment(&pc, i, &seg) != 0;
+			    i++) {
+				error = pefs_write_sparse(vp, &seg,
+				    poffset + (off_t)i * PEFS_CHUNK_SEGSIZE,
+				    ioflag, cred, &lsize);
+				if (error != 0)
+					break;
+			}
+		} else {
+			if (encrypted == 0) {
+				MPASS(pc.pc_nsegs == 1);
+				pefs_data_encrypt(&pn->pn_tkey, poffset, &pc);
+			}
+			puio = pefs_chunk_uio(&pc, poffset, uio->uio_rw);
+			error = VOP_WRITE(lvp, puio, ioflag, cred);
+			MPASS(error != 0 || puio->uio_resid == 0);
+		}
 		if (error != 0) {
 			/*
 			 * XXX Original uio is not preserved thus can't be
@@ -2775,9 +3798,8 @@ lower_update:
 			uio->uio_offset = poffset + bsize;
 			break;
 		}
-		MPASS(puio->uio_resid == 0);
 	}
-	pefs_chunk_free(&pc, pn);
+	pefs_chunk_free(&pc);
 
 	return (error);
 }
@@ -2787,6 +3809,13 @@ pefs_fsync(struct vop_fsync_args *ap)
 {
 	int error;
 
+	if (ap->a_vp->v_type == VREG &&
+	    VOP_ISLOCKED(ap->a_vp) == LK_EXCLUSIVE) {
+		error = pefs_wbcache_flush(ap->a_vp, 0,
+		    curthread->td_ucred);
+		if (error != 0)
+			return (error);
+	}
 	error = vop_stdfsync(ap);
 	if (error != 0)
 		return (error);
@@ -2802,6 +3831,7 @@ pefs_setkey(struct vnode *vp, struct pefs_key *pk, struct ucred *cred,
 	struct componentname cn;
 	struct pefs_node *pn = VP_TO_PN(vp);
 	struct pefs_enccn fenccn, tenccn;
+	struct pefs_tkey ptk;
 	char *namebuf;
 	int error;
 #if __FreeBSD_version < 1300113
@@ -2864,7 +3894,8 @@ pefs_setkey(struct vnode *vp, struct pefs_key *pk, struct ucred *cred,
 		goto out;
 	}
 	cn.cn_nameiop = RENAME;
-	error = pefs_enccn_create(&tenccn, pk, NULL, &cn);
+	pefs_tkey_generate(&ptk, pk, dvp, &cn);
+	error = pefs_enccn_create(&tenccn, &ptk, &cn);
 	if (error != 0) {
 		PEFS_VOP_UNLOCK(vp);
 #if __FreeBSD_version >= 900501
@@ -2933,11 +3964,25 @@ out:
 
 	return (error);
 }
+
+static __inline uint32_t
+pefs_key_xalg(struct pefs_key *pk)
+{
+	uint32_t alg;
+
+	alg = pk->pk_algid;
+	if ((pk->pk_flags & PEFS_KEY_DETNAME) != 0)
+		alg |= PEFS_ALG_DETNAME;
+	return (alg);
+}
+
 static int
 pefs_ioctl(struct vop_ioctl_args *ap)
 {
 	struct vnode *vp = ap->a_vp;
 	struct pefs_xkey *xk = ap->a_data;
+	struct pefs_xstats *xs;
+	struct pefs_dircache_stats pds;
 	struct ucred *cred = ap->a_cred;
 	struct thread *td = ap->a_td;
 	struct mount *mp = vp->v_mount;
@@ -2976,7 +4021,7 @@ pefs_ioctl(struct vop_ioctl_args *ap)
 			if (i++ == xk->pxk_index) {
 				memcpy(xk->pxk_keyid, pk->pk_keyid,
 				    PEFS_KEYID_SIZE);
-				xk->pxk_alg = pk->pk_algid;
+				xk->pxk_alg = pefs_key_xalg(pk);
 				xk->pxk_keybits = pk->pk_keybits;
 				break;
 			}
@@ -2992,7 +4037,7 @@ pefs_ioctl(struct vop_ioctl_args *ap)
 			mtx_lock(&pm->pm_keys_lock);
 			pk = pn->pn_tkey.ptk_key;
 			memcpy(xk->pxk_keyid, pk->pk_keyid, PEFS_KEYID_SIZE);
-			xk->pxk_alg = pk->pk_algid;
+			xk->pxk_alg = pefs_key_xalg(pk);
 			xk->pxk_keybits = pk->pk_keybits;
 			mtx_unlock(&pm->pm_keys_lock);
 		} else {
@@ -3025,9 +4070,10 @@ pefs_ioctl(struct vop_ioctl_args *ap)
 			break;
 		}
 		error = pefs_key_add(pm, xk->pxk_index, pk);
-		if (error == 0)
+		if (error == 0) {
 			pefs_flushkey(mp, td, 0, NULL);
-		else
+			pefs_warmup_start(mp);
+		} else
 			pefs_key_release(pk);
 		break;
 	case PEFS_DELKEY:
@@ -3050,6 +4096,25 @@ pefs_ioctl(struct vop_ioctl_args *ap)
 		if (pefs_key_remove_all(pm))
 			pefs_flushkey(mp, td, PEFS_FLUSHKEY_ALL, NULL);
 		break;
+	case PEFS_GETSTATS:
+		xs = ap->a_data;
+		xs->pxs_holes = pm->pm_stats.ps_holes;
+		xs->pxs_decrypted = pm->pm_stats.ps_decrypted;
+		xs->pxs_holes_written = pm->pm_stats.ps_holes_written;
+		xs->pxs_lookup_hits = pm->pm_stats.ps_lookup_hits;
+		xs->pxs_lookup_misses = pm->pm_stats.ps_lookup_misses;
+		xs->pxs_lookup_stale = pm->pm_stats.ps_lookup_stale;
+		xs->pxs_scans = pm->pm_stats.ps_scans;
+		xs->pxs_scan_entries = pm->pm_stats.ps_scan_entries;
+		xs->pxs_names_decrypted = pm->pm_stats.ps_names_decrypted;
+		xs->pxs_name_trials = pm->pm_stats.ps_name_trials;
+		pefs_dircache_pool_stats(pm->pm_dircache_pool, &pds);
+		xs->pxs_dircache_entries = pds.pds_entries;
+		xs->pxs_dircache_evictions = pds.pds_evictions;
+		xs->pxs_dircache_collisions = pds.pds_collisions;
+		xs->pxs_dircache_purges = pds.pds_purges;
+		xs->pxs_readahead = pm->pm_stats.ps_readahead;
+		break;
 	default:
 		error = ENOTTY;
 		break;
@@ -3098,6 +4163,257 @@ pefs_pathconf(struct vop_pathconf_args *ap)
 	return (0);
 }
 
+#ifdef PEFS_PAGER
+/*
+ * Address of byte at offset off of the chunk.
+ */
+static __inline char *
+pefs_chunk_ptr(struct pefs_chunk *pc, size_t off)
+{
+	MPASS(off < pc->pc_capacity);
+	return ((char *)pc->pc_segs[off / PEFS_CHUNK_SEGSIZE] +
+	    off % PEFS_CHUNK_SEGSIZE);
+}
+
+/*
+ * Install decrypted range [from, to) of chunk starting at file offset
+ * start into non-resident pages.
+ */
+static int
+pefs_pager_install(struct vnode *vp, struct pefs_chunk *pc, off_t start,
+    size_t from, size_t to)
+{
+	size_t len, pos;
+	int count;
+
+	count = 0;
+	for (pos = from; pos < to; pos += len) {
+		len = qmin(PEFS_CHUNK_SEGSIZE - pos % PEFS_CHUNK_SEGSIZE,
+		    to - pos);
+		count += pefs_readahead_install(vp, start + pos,
+		    pefs_chunk_ptr(pc, pos), len);
+	}
+
+	return (count);
+}
+
+/*
+ * Read requested pages together with up to rbehind and rahead neighbouring
+ * non-resident pages from lower vnode in one request.  Whole run is
+ * decrypted at once and neighbouring pages are entered into page cache.
+ */
+static int
+pefs_getpages(struct vop_getpages_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct pefs_node *pn = VP_TO_PN(vp);
+	struct pefs_mount *pm = VFS_TO_PEFS(vp->v_mount);
+	vm_object_t object = vp->v_object;
+	vm_page_t *ma = ap->a_m;
+	struct pefs_wbsector *pws;
+	struct pefs_chunk pc, seg;
+	struct sf_buf *sf;
+	struct uio *puio;
+	off_t end, fsize, offset, start;
+	size_t done, pos, size;
+	int ahead, behind, count, error, i, maxpages;
+
+	if ((pn->pn_flags & PN_HASKEY) == 0)
+		return (vop_stdgetpages(ap));
+
+	count = ap->a_count;
+	offset = IDX_TO_OFF(ma[0]->pindex);
+	end = IDX_TO_OFF(ma[count - 1]->pindex + 1);
+	if (end - offset > PEFS_CHUNK_MAXSIZE)
+		return (vop_stdgetpages(ap));
+	maxpages = imax(pm->pm_maxio / PAGE_SIZE, count);
+	behind = ap->a_rbehind != NULL ? *ap->a_rbehind : 0;
+	ahead = ap->a_rahead != NULL ? *ap->a_rahead : 0;
+	behind = imin(behind, maxpages - count);
+	if ((vm_pindex_t)behind > ma[0]->pindex)
+		behind = ma[0]->pindex;
+	ahead = imin(ahead, maxpages - count - behind);
+
+	VM_OBJECT_RLOCK(object);
+	fsize = object->un_pager.vnp.vnp_size;
+	if (offset >= fsize) {
+		VM_OBJECT_RUNLOCK(object);
+		return (VM_PAGER_BAD);
+	}
+	for (i = 0; i < behind; i++)
+		if (vm_page_lookup(object, ma[0]->pindex - i - 1) != NULL)
+			break;
+	behind = i;
+	for (i = 0; i < ahead && end + IDX_TO_OFF(i) < fsize; i++)
+		if (vm_page_lookup(object, ma[count - 1]->pindex + i + 1) !=
+		    NULL)
+			break;
+	ahead = i;
+	VM_OBJECT_RUNLOCK(object);
+
+	start = offset - IDX_TO_OFF(behind);
+	size = round_page(qmin(end + IDX_TO_OFF(ahead), fsize) - start);
+	PEFSDEBUG("pefs_getpages: vp=%p offset=0x%jx count=%d "
+	    "behind=%d ahead=%d\n", vp, (intmax_t)offset, count, behind,
+	    ahead);
+
+	pefs_chunk_create(&pc, size);
+	puio = pefs_chunk_uio(&pc, start, UIO_READ);
+	error = VOP_READ(PEFS_LOWERVP(vp), puio, 0, curthread->td_ucred);
+	if (error != 0) {
+		pefs_chunk_free(&pc);
+		return (VM_PAGER_ERROR);
+	}
+	done = pc.pc_size - puio->uio_resid;
+	pefs_chunk_setsize(&pc, done);
+	for (i = 0; pefs_chunk_segment(&pc, i, &seg) != 0; i++)
+		pefs_data_decrypt(pm, &pn->pn_tkey,
+		    start + (off_t)i * PEFS_CHUNK_SEGSIZE, &seg);
+
+	/* Sector in write-back cache is newer than lower file data. */
+	pws = pn->pn_wbsector;
+	if (pws != NULL && pws->pws_offset >= start &&
+	    pws->pws_offset < start + (off_t)size) {
+		pos = pws->pws_offset - start;
+		memcpy(pefs_chunk_ptr(&pc, pos), pws->pws_chunk.pc_base,
+		    pws->pws_size);
+		done = qmax(done, pos + pws->pws_size);
+	}
+	if ((done & PAGE_MASK) != 0)
+		bzero(pefs_chunk_ptr(&pc, done),
+		    PAGE_SIZE - (done & PAGE_MASK));
+	done = round_page(done);
+
+	for (i = 0; i < count; i++) {
+		if (vm_page_all_valid(ma[i]))
+			continue;
+		pos = IDX_TO_OFF(ma[i]->pindex) - start;
+		sched_pin();
+		sf = sf_buf_alloc(ma[i], SFB_CPUPRIVATE);
+		if (pos < done)
+			memcpy((char *)sf_buf_kva(sf), pefs_chunk_ptr(&pc, pos),
+			    PAGE_SIZE);
+		else
+			bzero((char *)sf_buf_kva(sf), PAGE_SIZE);
+		sf_buf_free(sf);
+		sched_unpin();
+		vm_page_valid(ma[i]);
+	}
+
+	behind = pefs_pager_install(vp, &pc, start, 0,
+	    qmin(offset - start, done));
+	ahead = end - start < (off_t)done ?
+	    pefs_pager_install(vp, &pc, start, end - start, done) : 0;
+	if (ap->a_rbehind != NULL)
+		*ap->a_rbehind = behind;
+	if (ap->a_rahead != NULL)
+		*ap->a_rahead = ahead;
+	pefs_chunk_free(&pc);
+
+	return (VM_PAGER_OK);
+}
+
+/*
+ * Encrypt run of dirty pages at once and write it to lower vnode in one
+ * request.
+ */
+static int
+pefs_putpages(struct vop_putpages_args *ap)
+{
+	struct vnode *vp = ap->a_vp;
+	struct vnode *lvp = PEFS_LOWERVP(vp);
+	struct pefs_node *pn = VP_TO_PN(vp);
+	vm_object_t object = vp->v_object;
+	vm_page_t *ma = ap->a_m;
+	int *rtvals = ap->a_rtvals;
+	struct pefs_wbsector *pws;
+	struct pefs_chunk pc, seg;
+	struct sf_buf *sf;
+	struct ucred *cred;
+	struct vattr va;
+	struct uio *puio;
+	u_quad_t lsize;
+	off_t fsize, offset;
+	size_t len, pos, size;
+	int count, error, i, ioflag, ncount;
+
+	if ((pn->pn_flags & PN_HASKEY) == 0)
+		return (vop_stdputpages(ap));
+
+	count = ap->a_count;
+	offset = IDX_TO_OFF(ma[0]->pindex);
+	if (IDX_TO_OFF(count) > PEFS_CHUNK_MAXSIZE)
+		return (vop_stdputpages(ap));
+	for (i = 0; i < count; i++)
+		rtvals[i] = VM_PAGER_ERROR;
+
+	VM_OBJECT_WLOCK(object);
+	fsize = object->un_pager.vnp.vnp_size;
+	size = offset < fsize ? qmin(IDX_TO_OFF(count), fsize - offset) : 0;
+	ncount = howmany(size, PAGE_SIZE);
+	for (i = ncount; i < count; i++)
+		rtvals[i] = VM_PAGER_BAD;
+	if ((size & PAGE_MASK) != 0) {
+		pos = roundup2(size & PAGE_MASK, DEV_BSIZE);
+		vm_page_clear_dirty(ma[ncount - 1], pos, PAGE_SIZE - pos);
+	}
+	VM_OBJECT_WUNLOCK(object);
+	if (ncount == 0)
+		return (rtvals[0]);
+
+	cred = curthread->td_ucred;
+	ioflag = vnode_pager_putpages_ioflags(ap->a_sync);
+	pws = pn->pn_wbsector;
+	if (pws != NULL && pws->pws_offset >= offset &&
+	    pws->pws_offset < offset + (off_t)size) {
+		error = pefs_wbcache_flush(vp, ioflag, cred);
+		if (error != 0)
+			return (rtvals[0]);
+	}
+
+	PEFSDEBUG("pefs_putpages: vp=%p offset=0x%jx size=0x%zx\n",
+	    vp, (intmax_t)offset, size);
+	pefs_chunk_create(&pc, size);
+	for (i = 0; i < ncount; i++) {
+		pos = IDX_TO_OFF(i);
+		len = qmin(PAGE_SIZE, size - pos);
+		sched_pin();
+		sf = sf_buf_alloc(ma[i], SFB_CPUPRIVATE);
+		memcpy(pefs_chunk_ptr(&pc, pos), (char *)sf_buf_kva(sf), len);
+		sf_buf_free(sf);
+		sched_unpin();
+	}
+
+	if ((VFS_TO_PEFS(vp->v_mount)->pm_flags & PM_SPARSE) != 0) {
+		error = VOP_GETATTR(lvp, &va, cred);
+		lsize = error == 0 ? va.va_size : 0;
+		for (i = 0; error == 0 &&
+		    pefs_chunk_segment(&pc, i, &seg) != 0; i++)
+			error = pefs_write_sparse(vp, &seg,
+			    offset + (off_t)i * PEFS_CHUNK_SEGSIZE, ioflag,
+			    cred, &lsize);
+	} else {
+		for (i = 0; pefs_chunk_segment(&pc, i, &seg) != 0; i++)
+			pefs_data_encrypt(&pn->pn_tkey,
+			    offset + (off_t)i * PEFS_CHUNK_SEGSIZE, &seg);
+		puio = pefs_chunk_uio(&pc, offset, UIO_WRITE);
+		error = VOP_WRITE(lvp, puio, ioflag, cred);
+	}
+	pefs_chunk_free(&pc);
+	if (error != 0)
+		return (rtvals[0]);
+
+	VM_OBJECT_WLOCK(object);
+	for (i = 0; i < ncount; i++) {
+		vm_page_undirty(ma[i]);
+		rtvals[i] = VM_PAGER_OK;
+	}
+	VM_OBJECT_WUNLOCK(object);
+
+	return (rtvals[0]);
+}
+#endif
+
 #if __FreeBSD_version >= 1100091
 static int
 pefs_bmap(struct vop_bmap_args *ap)
@@ -3156,8 +4472,13 @@ struct vop_vector pefs_vnodeops = {
 #else
 	.vop_bmap =		VOP_EOPNOTSUPP,
 #endif
+#ifdef PEFS_PAGER
+	.vop_getpages =		pefs_getpages,
+	.vop_putpages =		pefs_putpages,
+#else
 	.vop_getpages =		vop_stdgetpages,
 	.vop_putpages =		vop_stdputpages,
+#endif
 	.vop_fsync =		pefs_fsync,
 	.vop_ioctl =		pefs_ioctl,
 	.vop_pathconf =		pefs_pathconf,
@@ -0,0 +1,355 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * Background directory cache warm-up.
+ *
+ * Directory tree is walked starting from the mount root, every directory is
+ * read and decrypted by a separate task, subdirectories found are queued
+ * after it.  Tasks are executed in FIFO order by a pool of worker threads
+ * resulting in approximately breadth-first traversal limited by depth and
+ * number of entries scanned.  Workers run with low priority and never wait
+ * for a directory lock, busy directories are retried later.
+ */
+
+#include <sys/cdefs.h>
+__FBSDID("$FreeBSD$");
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/dirent.h>
+#include <sys/kernel.h>
+#include <sys/lock.h>
+#include <sys/malloc.h>
+#include <sys/mount.h>
+#include <sys/mutex.h>
+#include <sys/priority.h>
+#include <sys/proc.h>
+#include <sys/queue.h>
+#include <sys/smp.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+#include <sys/vnode.h>
+
+#include <fs/pefs/pefs.h>
+#include <fs/pefs/pefs_compat.h>
+#include <fs/pefs/pefs_dircache.h>
+
+#define	WARMUP_THREADS_ENV	"vfs.pefs.warmup.threads"
+#define	WARMUP_RETRIES		8
+
+struct pefs_warmup_dir {
+	struct task		pwd_task;
+	STAILQ_ENTRY(pefs_warmup_dir) pwd_entry;
+	struct mount		*pwd_mp;
+	struct pefs_tkey	pwd_tkey;	/* NULL key for mount root */
+	ino_t			pwd_fileno;
+	int			pwd_depth;
+	int			pwd_retries;
+};
+
+STAILQ_HEAD(pefs_warmup_dirhead, pefs_warmup_dir);
+
+struct pefs_warmup_scan {
+	struct pefs_warmup_dirhead pws_dirs;
+	struct pefs_warmup_dir	*pws_parent;
+	struct pefs_warmup	*pws_warmup;
+};
+
+static struct taskqueue		*pefs_warmup_tq;
+
+SYSCTL_NODE(_vfs_pefs, OID_AUTO, warmup, CTLFLAG_RW, 0,
+    "PEFS directory cache warm-up");
+
+static int	pefs_warmup_threads = -1;
+SYSCTL_INT(_vfs_pefs_warmup, OID_AUTO, threads, CTLFLAG_RD,
+    &pefs_warmup_threads, 0, "Number of worker threads");
+
+static int	pefs_warmup_depth = 3;
+SYSCTL_INT(_vfs_pefs_warmup, OID_AUTO, depth, CTLFLAG_RW,
+    &pefs_warmup_depth, 0, "Maximum directory depth to warm up");
+
+static u_long	pefs_warmup_maxentries = 65536;
+SYSCTL_ULONG(_vfs_pefs_warmup, OID_AUTO, maxentries, CTLFLAG_RW,
+    &pefs_warmup_maxentries, 0,
+    "Maximum number of directory entries to scan per warm-up");
+
+static u_long	pefs_warmup_dirs;
+SYSCTL_ULONG(_vfs_pefs_warmup, OID_AUTO, dirs, CTLFLAG_RD,
+    &pefs_warmup_dirs, 0, "Number of directories warmed up");
+
+static void	pefs_warmup_task(void *context, int pending);
+
+void
+pefs_warmup_init(void)
+{
+	TUNABLE_INT_FETCH(WARMUP_THREADS_ENV, &pefs_warmup_threads);
+	if (pefs_warmup_threads < 0)
+		pefs_warmup_threads = MAX(1, mp_ncpus / 2);
+	if (pefs_warmup_threads > 0) {
+		pefs_warmup_tq = taskqueue_create("pefs_warmup", M_WAITOK,
+		    taskqueue_thread_enqueue, &pefs_warmup_tq);
+		taskqueue_start_threads(&pefs_warmup_tq, pefs_warmup_threads,
+		    PUSER, "pefs warmup");
+	}
+}
+
+void
+pefs_warmup_uninit(void)
+{
+	if (pefs_warmup_tq != NULL) {
+		taskqueue_free(pefs_warmup_tq);
+		pefs_warmup_tq = NULL;
+	}
+}
+
+void
+pefs_warmup_mount(struct pefs_mount *pm)
+{
+	mtx_init(&pm->pm_warmup.pw_mtx, "pefs_warmup_mtx", NULL, MTX_DEF);
+}
+
+void
+pefs_warmup_unmount(struct pefs_mount *pm)
+{
+	MPASS(pm->pm_warmup.pw_pending == 0);
+	mtx_destroy(&pm->pm_warmup.pw_mtx);
+}
+
+static void
+pefs_warmup_dir_free(struct pefs_warmup_dir *pwd)
+{
+	pefs_key_release(pwd->pwd_tkey.ptk_key);
+	free(pwd, M_PEFSBUF);
+}
+
+/*
+ * Queue directory unless warm-up is blocked or entry budget is exhausted.
+ * Restart resets the budget if no warm-up is in progress.
+ */
+static void
+pefs_warmup_enqueue(struct pefs_mount *pm, struct pefs_warmup_dir *pwd,
+    int restart)
+{
+	struct pefs_warmup *pw;
+
+	pw = &pm->pm_warmup;
+	mtx_lock(&pw->pw_mtx);
+	if (restart) {
+		if (pw->pw_pending != 0) {
+			mtx_unlock(&pw->pw_mtx);
+			pefs_warmup_dir_free(pwd);
+			return;
+		}
+		pw->pw_entries = 0;
+	}
+	if (pw->pw_blocked != 0 || pw->pw_entries >= pefs_warmup_maxentries) {
+		mtx_unlock(&pw->pw_mtx);
+		pefs_warmup_dir_free(pwd);
+		return;
+	}
+	pw->pw_pending++;
+	mtx_unlock(&pw->pw_mtx);
+
+	TASK_INIT(&pwd->pwd_task, 0, pefs_warmup_task, pwd);
+	taskqueue_enqueue(pefs_warmup_tq, &pwd->pwd_task);
+}
+
+static void
+pefs_warmup_done(struct pefs_mount *pm)
+{
+	struct pefs_warmup *pw;
+
+	pw = &pm->pm_warmup;
+	mtx_lock(&pw->pw_mtx);
+	MPASS(pw->pw_pending > 0);
+	if (--pw->pw_pending == 0)
+		wakeup(&pw->pw_pending);
+	mtx_unlock(&pw->pw_mtx);
+}
+
+/*
+ * Start warm-up from the mount root.  Does nothing if warm-up is disabled
+ * or already running.
+ */
+void
+pefs_warmup_start(struct mount *mp)
+{
+	struct pefs_mount *pm;
+	struct pefs_warmup_dir *pwd;
+
+	pm = VFS_TO_PEFS(mp);
+	if ((pm->pm_flags & PM_WARMUP) == 0 || pefs_warmup_tq == NULL)
+		return;
+	PEFSDEBUG("pefs_warmup_start: mp=%p\n", mp);
+	pwd = malloc(sizeof(*pwd), M_PEFSBUF, M_WAITOK | M_ZERO);
+	pwd->pwd_mp = mp;
+	pefs_warmup_enqueue(pm, pwd, 1);
+}
+
+/*
+ * Abort warm-up in progress and wait for workers to finish.  New warm-up
+ * can not be started until pefs_warmup_unblock is called.
+ */
+void
+pefs_warmup_block(struct pefs_mount *pm)
+{
+	struct pefs_warmup *pw;
+
+	pw = &pm->pm_warmup;
+	mtx_lock(&pw->pw_mtx);
+	pw->pw_blocked++;
+	while (pw->pw_pending != 0)
+		msleep(&pw->pw_pending, &pw->pw_mtx, PVFS, "pefswu", 0);
+	mtx_unlock(&pw->pw_mtx);
+}
+
+void
+pefs_warmup_unblock(struct pefs_mount *pm)
+{
+	struct pefs_warmup *pw;
+
+	pw = &pm->pm_warmup;
+	mtx_lock(&pw->pw_mtx);
+	MPASS(pw->pw_blocked > 0);
+	pw->pw_blocked--;
+	mtx_unlock(&pw->pw_mtx);
+}
+
+static int
+pefs_warmup_dirent(void *arg, struct dirent *de,
+    struct pefs_dircache_entry *pde)
+{
+	struct pefs_warmup_scan *pws = arg;
+	struct pefs_warmup *pw = pws->pws_warmup;
+	struct pefs_warmup_dir *pwd;
+
+	if (pw->pw_blocked != 0)
+		return (1);
+	if (atomic_fetchadd_long(&pw->pw_entries, 1) >= pefs_warmup_maxentries)
+		return (1);
+	maybe_yield();
+
+	if (pde == NULL || de->d_type != DT_DIR ||
+	    pws->pws_parent->pwd_depth >= pefs_warmup_depth)
+		return (0);
+	pwd = malloc(sizeof(*pwd), M_PEFSBUF, M_WAITOK | M_ZERO);
+	pwd->pwd_mp = pws->pws_parent->pwd_mp;
+	pwd->pwd_tkey = pde->pde_tkey;
+	pefs_key_ref(pwd->pwd_tkey.ptk_key);
+	pwd->pwd_fileno = de->d_fileno;
+	pwd->pwd_depth = pws->pws_parent->pwd_depth + 1;
+	STAILQ_INSERT_TAIL(&pws->pws_dirs, pwd, pwd_entry);
+
+	return (0);
+}
+
+/*
+ * Get locked directory vnode without waiting for the lock.
+ */
+static int
+pefs_warmup_vget(struct pefs_warmup_dir *pwd, struct vnode **vpp)
+{
+	struct mount *mp = pwd->pwd_mp;
+	struct pefs_mount *pm = VFS_TO_PEFS(mp);
+	struct vnode *lvp, *vp;
+	int error;
+
+	if (pwd->pwd_tkey.ptk_key == NULL) {
+		vp = pm->pm_rootvp;
+		vref(vp);
+		error = vn_lock(vp, LK_SHARED | LK_NOWAIT);
+		if (error != 0) {
+			vrele(vp);
+			return (error);
+		}
+		*vpp = vp;
+		return (0);
+	}
+
+	error = VFS_VGET(pm->pm_lowervfs, pwd->pwd_fileno,
+	    LK_SHARED | LK_NOWAIT, &lvp);
+	if (error != 0)
+		return (error);
+	if (lvp->v_type != VDIR) {
+		vput(lvp);
+		return (ENOTDIR);
+	}
+	error = pefs_node_get_haskey(mp, lvp, vpp, &pwd->pwd_tkey);
+	if (error != 0)
+		vput(lvp);
+
+	return (error);
+}
+
+static void
+pefs_warmup_task(void *context, int pending __unused)
+{
+	struct pefs_warmup_dir *pwd = context, *child;
+	struct pefs_warmup_scan pws;
+	struct pefs_mount *pm;
+	struct vnode *vp;
+	int error;
+
+	pm = VFS_TO_PEFS(pwd->pwd_mp);
+	STAILQ_INIT(&pws.pws_dirs);
+	pws.pws_parent = pwd;
+	pws.pws_warmup = &pm->pm_warmup;
+
+	if (pm->pm_warmup.pw_blocked != 0)
+		goto done;
+	error = pefs_warmup_vget(pwd, &vp);
+	if (error == EBUSY && pwd->pwd_retries++ < WARMUP_RETRIES) {
+		/* Directory is in use, give way to foreground operation. */
+		pause("pefswu", hz / 10);
+		taskqueue_enqueue(pefs_warmup_tq, &pwd->pwd_task);
+		return;
+	}
+	if (error != 0) {
+		PEFSDEBUG("pefs_warmup_task: vget error %d\n", error);
+		goto done;
+	}
+	if (VN_IS_DOOMED(vp) || pefs_no_keys(vp)) {
+		vput(vp);
+		goto done;
+	}
+	error = pefs_readdir_fill(vp, pwd->pwd_mp->mnt_cred,
+	    pefs_warmup_dirent, &pws);
+	vput(vp);
+	atomic_add_long(&pefs_warmup_dirs, 1);
+	PEFSDEBUG("pefs_warmup_task: depth=%d error=%d\n", pwd->pwd_depth,
+	    error);
+
+	while ((child = STAILQ_FIRST(&pws.pws_dirs)) != NULL) {
+		STAILQ_REMOVE_HEAD(&pws.pws_dirs, pwd_entry);
+		pefs_warmup_enqueue(pm, child, 0);
+	}
+done:
+	pefs_warmup_dir_free(pwd);
+	pefs_warmup_done(pm);
+}
@@ -41,6 +41,8 @@
 
 #define	XTS_BLK_BYTES		16
 #define	XTS_BLK_MASK		(XTS_BLK_BYTES - 1)
+#define	XTS_BATCH_BLOCKS	16
+#define	XTS_LANES		8
 
 static __inline void
 xor128(void *dst, const void *src1, const void *src2)
@@ -68,6 +70,62 @@ gf_mul128(uint64_t *dst, const uint64_t *src)
 	((uint8_t *)dst)[0] ^= c1;
 }
 
+/*
+ * Multiply by x^8.  Used to advance XTS_LANES independent tweak sequences
+ * at once, without data-dependent branches or table lookups.
+ */
+static __inline void
+gf_mul128_x8(uint64_t *dst, const uint64_t *src)
+{
+#if _BYTE_ORDER == _LITTLE_ENDIAN
+	uint64_t hi;
+
+	hi = src[1] >> 56;
+	dst[1] = (src[1] << 8) | (src[0] >> 56);
+	dst[0] = (src[0] << 8) ^ hi ^ (hi << 1) ^ (hi << 2) ^ (hi << 7);
+#else
+	int i;
+
+	gf_mul128(dst, src);
+	for (i = 1; i < 8; i++)
+		gf_mul128(dst, dst);
+#endif
+}
+
+/*
+ * Initialize tweak lanes: lane i holds tweak of block i.
+ */
+static __inline void
+xts_tweak_lanes(uint64_t lanes[XTS_LANES][XTS_BLK_BYTES / 8],
+    const uint64_t *tweak)
+{
+	int i;
+
+	lanes[0][0] = tweak[0];
+	lanes[0][1] = tweak[1];
+	for (i = 1; i < XTS_LANES; i++)
+		gf_mul128(lanes[i], lanes[i - 1]);
+}
+
+/*
+ * Generate tweaks for the next XTS_BATCH_BLOCKS blocks.  Tweak of block
+ * i + XTS_LANES is computed from tweak of block i, so there is no loop
+ * carried dependency between lanes.
+ */
+static __inline void
+xts_tweak_batch(uint64_t lanes[XTS_LANES][XTS_BLK_BYTES / 8],
+    uint64_t tweaks[XTS_BATCH_BLOCKS][XTS_BLK_BYTES / 8])
+{
+	int i, l;
+
+	for (i = 0; i < XTS_BATCH_BLOCKS; i++) {
+		l = i % XTS_LANES;
+		tweaks[i][0] = lanes[l][0];
+		tweaks[i][1] = lanes[l][1];
+		gf_mul128_x8(lanes[l], lanes[l]);
+	}
+}
+
 static __inline void
 xts_fullblock(algop_crypt_t *data_crypt, const struct pefs_session *ses,
     const struct pefs_ctx *data_ctx,
@@ -79,6 +137,60 @@ xts_fullblock(algop_crypt_t *data_crypt, const struct pefs_session *ses,
 	gf_mul128(tweak, tweak);
 }
 
+/*
+ * Process nblocks full blocks using multi-block ECB operation.  Tweaks for
+ * the batch are computed first and saved to be applied after block cipher
+ * pass.  On return tweak is set to the tweak of the block following the
+ * last one processed.
+ */
+static __inline void
+xts_fullblocks(algop_crypt_t *data_crypt,
+    algop_crypt_blocks_t *data_crypt_blocks,
+    const struct pefs_session *ses, const struct pefs_ctx *data_ctx,
+    uint64_t *tweak, const uint8_t *src, uint8_t *dst, int nblocks)
+{
+	uint64_t tweaks[XTS_BATCH_BLOCKS][XTS_BLK_BYTES / 8];
+	uint64_t lanes[XTS_LANES][XTS_BLK_BYTES / 8];
+	int i, n;
+
+	if (data_crypt_blocks == NULL) {
+		for (; nblocks > 0; nblocks--) {
+			xts_fullblock(data_crypt, ses, data_ctx, tweak,
+			    src, dst);
+			dst += XTS_BLK_BYTES;
+			src += XTS_BLK_BYTES;
+		}
+		return;
+	}
+
+	if (nblocks == 0)
+		return;
+
+	xts_tweak_lanes(lanes, tweak);
+	do {
+		n = MIN(nblocks, XTS_BATCH_BLOCKS);
+		xts_tweak_batch(lanes, tweaks);
+		for (i = 0; i < n; i++)
+			xor128(dst + i * XTS_BLK_BYTES, src + i * XTS_BLK_BYTES,
+			    tweaks[i]);
+		data_crypt_blocks(ses, data_ctx, dst, dst, n);
+		for (i = 0; i < n; i++)
+			xor128(dst + i * XTS_BLK_BYTES, dst + i * XTS_BLK_BYTES,
+			    tweaks[i]);
+		dst += n * XTS_BLK_BYTES;
+		src += n * XTS_BLK_BYTES;
+		nblocks -= n;
+	} while (nblocks > 0);
+
+	if (n < XTS_BATCH_BLOCKS) {
+		tweak[0] = tweaks[n][0];
+		tweak[1] = tweaks[n][1];
+	} else {
+		tweak[0] = lanes[0][0];
+		tweak[1] = lanes[0][1];
+	}
+}
+
 static __inline void
 xts_lastblock(algop_crypt_t *data_crypt, const struct pefs_session *ses,
     const struct pefs_ctx *data_ctx,
@@ -145,12 +257,11 @@ pefs_xts_block_encrypt(const struct pefs_alg *alg,
 		return;
 	}
 
-	while (len >= XTS_BLK_BYTES) {
-		xts_fullblock(alg->pa_encrypt, ses, data_ctx, tweak, src, dst);
-		dst += XTS_BLK_BYTES;
-		src += XTS_BLK_BYTES;
-		len -= XTS_BLK_BYTES;
-	}
+	xts_fullblocks(alg->pa_encrypt, alg->pa_encrypt_blocks, ses, data_ctx,
+	    tweak, src, dst, len / XTS_BLK_BYTES);
+	dst += len & ~XTS_BLK_MASK;
+	src += len & ~XTS_BLK_MASK;
+	len &= XTS_BLK_MASK;
 
 	if (len != 0)
 		xts_lastblock(alg->pa_encrypt, ses, data_ctx, tweak,
@@ -177,12 +288,11 @@ pefs_xts_block_decrypt(const struct pefs_alg *alg,
 	if ((len & XTS_BLK_MASK) != 0)
 		len -= XTS_BLK_BYTES;
 
-	while (len >= XTS_BLK_BYTES) {
-		xts_fullblock(alg->pa_decrypt, ses, data_ctx, tweak, src, dst);
-		dst += XTS_BLK_BYTES;
-		src += XTS_BLK_BYTES;
-		len -= XTS_BLK_BYTES;
-	}
+	xts_fullblocks(alg->pa_decrypt, alg->pa_decrypt_blocks, ses, data_ctx,
+	    tweak, src, dst, len / XTS_BLK_BYTES);
+	dst += len & ~XTS_BLK_MASK;
+	src += len & ~XTS_BLK_MASK;
+	len &= XTS_BLK_MASK;
 
 	if (len != 0) {
 		len += XTS_BLK_BYTES;
@@ -0,0 +1,694 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+#include <sys/param.h>
+#include <sys/endian.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__amd64__) || defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define	PEFS_BENCH_TSC
+#endif
+
+#include <fs/pefs/pefs.h>
+#include <fs/pefs/pefs_crypto.h>
+#include <fs/pefs/vmac.h>
+
+#ifdef PEFS_BENCH_VAES
+#include <crypto/aesni/aesni.h>
+#endif
+
+#define	BENCH_MINSIZE		16
+#define	BENCH_MAXSIZE		PEFS_SECTOR_SIZE
+
+enum bench_format {
+	FORMAT_CSV,
+	FORMAT_JSON,
+};
+
+struct bench_alg {
+	const char	*ba_name;
+	int		ba_id;
+};
+
+struct bench_result {
+	const char	*br_test;
+	const char	*br_alg;
+	int		br_keybits;
+	size_t		br_size;
+	uint64_t	br_iterations;
+	double		br_seconds;
+	uint64_t	br_cycles;
+};
+
+static const struct bench_alg bench_algs[] = {
+	{ "aes-xts",		PEFS_ALG_AES_XTS },
+#ifdef PEFS_BENCH_CAMELLIA
+	{ "camellia-xts",	PEFS_ALG_CAMELLIA_XTS },
+#endif
+};
+
+/* Context of any block cipher implementation used by ECB benchmark. */
+struct bench_ecb_ctx {
+	union {
+		rijndael_ctx		table;
+		struct pefs_aes_ct_ctx	ct;
+#ifdef PEFS_BENCH_VAES
+		struct {
+			uint8_t		enc[AES_SCHED_LEN] __aligned(16);
+			uint8_t		dec[AES_SCHED_LEN] __aligned(16);
+			int		rounds;
+		} aesni;
+#endif
+	} o;
+};
+
+typedef int	bench_ecb_supported_t(void);
+typedef void	bench_ecb_setkey_t(struct bench_ecb_ctx *ctx,
+	    const uint8_t *key, int keybits);
+typedef void	bench_ecb_crypt_t(const struct bench_ecb_ctx *ctx,
+	    const uint8_t *in, uint8_t *out, size_t size);
+
+struct bench_ecb {
+	const char		*be_name;
+	bench_ecb_supported_t	*be_supported;
+	bench_ecb_setkey_t	*be_setkey;
+	bench_ecb_crypt_t	*be_encrypt;
+	bench_ecb_crypt_t	*be_decrypt;
+};
+
+static bench_ecb_setkey_t	bench_ecb_table_setkey;
+static bench_ecb_crypt_t	bench_ecb_table_encrypt;
+static bench_ecb_crypt_t	bench_ecb_table_decrypt;
+static bench_ecb_setkey_t	bench_ecb_ct_setkey;
+static bench_ecb_crypt_t	bench_ecb_ct_encrypt;
+static bench_ecb_crypt_t	bench_ecb_ct_decrypt;
+
+#ifdef PEFS_BENCH_VAES
+typedef void	bench_aesni_ecb_t(int rounds, const void *key_schedule,
+	    size_t len, const uint8_t *from, uint8_t *to);
+
+int	pefs_bench_aesni_supported(int vaes);
+int	pefs_bench_aesni_setkey(const uint8_t *key, int keybits, uint8_t *enc,
+	    uint8_t *dec);
+bench_aesni_ecb_t	pefs_bench_aesni_encrypt_ecb;
+bench_aesni_ecb_t	pefs_bench_aesni_decrypt_ecb;
+bench_aesni_ecb_t	pefs_vaes_encrypt_ecb;
+bench_aesni_ecb_t	pefs_vaes_decrypt_ecb;
+
+static bench_ecb_supported_t	bench_ecb_aesni_supported;
+static bench_ecb_supported_t	bench_ecb_vaes_supported;
+static bench_ecb_setkey_t	bench_ecb_aesni_setkey;
+static bench_ecb_crypt_t	bench_ecb_aesni_encrypt;
+static bench_ecb_crypt_t	bench_ecb_aesni_decrypt;
+static bench_ecb_crypt_t	bench_ecb_vaes_encrypt;
+static bench_ecb_crypt_t	bench_ecb_vaes_decrypt;
+#endif
+
+/*
+ * Multi-block ECB backends.  Table driven rijndael is the reference, others
+ * are checked against it.  On amd64 8 block interleaved AES-NI, the same
+ * algorithm as aesni_encrypt_ecb() in sys/crypto/aesni, is compared with
+ * VAES from pefs_vaes.c.
+ */
+static const struct bench_ecb bench_ecbs[] = {
+	{ "rijndael",	NULL, bench_ecb_table_setkey,
+	    bench_ecb_table_encrypt, bench_ecb_table_decrypt },
+	{ "aes-ct",	NULL, bench_ecb_ct_setkey,
+	    bench_ecb_ct_encrypt, bench_ecb_ct_decrypt },
+#ifdef PEFS_BENCH_VAES
+	{ "aesni",	bench_ecb_aesni_supported, bench_ecb_aesni_setkey,
+	    bench_ecb_aesni_encrypt, bench_ecb_aesni_decrypt },
+	{ "vaes",	bench_ecb_vaes_supported, bench_ecb_aesni_setkey,
+	    bench_ecb_vaes_encrypt, bench_ecb_vaes_decrypt },
+#endif
+};
+
+static const int bench_keybits[] = { 128, 192, 256 };
+
+/* Typical file name lengths: short names, source files, long downloads. */
+static const size_t bench_namelen[] = { 8, 16, 32, 64, 128 };
+
+static const size_t bench_vmaclen[] = { 16, 64, 256, 1024, 4096 };
+
+static enum bench_format bench_format = FORMAT_CSV;
+static double bench_mintime = 0.25;
+static int bench_nresults;
+
+static struct pefs_mount bench_mount;
+static char bench_buf[BENCH_MAXSIZE] __aligned(CACHE_LINE_SIZE);
+
+void
+pefs_zone_dtor_bzero(void *mem, int size, void *arg __unused)
+{
+	explicit_bzero(mem, size);
+}
+
+static double
+bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static uint64_t
+bench_cycles(void)
+{
+#ifdef PEFS_BENCH_TSC
+	return (__rdtsc());
+#else
+	return (0);
+#endif
+}
+
+static void
+bench_fill(void *buf, size_t size, uint32_t seed)
+{
+	uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		p[i] = seed >> 16;
+	}
+}
+
+static void
+bench_output(const struct bench_result *r)
+{
+	double rate, mbps, cpb;
+	uint64_t bytes;
+
+	rate = r->br_iterations / r->br_seconds;
+	bytes = r->br_iterations * r->br_size;
+	mbps = bytes / r->br_seconds / (1024 * 1024);
+	cpb = (r->br_cycles != 0 && bytes != 0) ?
+	    (double)r->br_cycles / bytes : 0;
+
+	switch (bench_format) {
+	case FORMAT_CSV:
+		if (bench_nresults == 0)
+			printf("test,alg,keybits,size,iterations,seconds,"
+			    "ops_per_sec,mb_per_sec,cycles_per_byte\n");
+		printf("%s,%s,%d,%zu,%ju,%.4f,%.0f,%.2f,", r->br_test,
+		    r->br_alg, r->br_keybits, r->br_size,
+		    (uintmax_t)r->br_iterations, r->br_seconds, rate, mbps);
+		if (r->br_cycles != 0)
+			printf("%.2f", cpb);
+		printf("\n");
+		break;
+	case FORMAT_JSON:
+		printf("%s\n  {\"test\": \"%s\", \"alg\": \"%s\", "
+		    "\"keybits\": %d, \"size\": %zu, \"iterations\": %ju, "
+		    "\"seconds\": %.4f, \"ops_per_sec\": %.0f, "
+		    "\"mb_per_sec\": %.2f, \"cycles_per_byte\": ",
+		    bench_nresults == 0 ? "[" : ",", r->br_test, r->br_alg,
+		    r->br_keybits, r->br_size, (uintmax_t)r->br_iterations,
+		    r->br_seconds, rate, mbps);
+		if (r->br_cycles != 0)
+			printf("%.2f}", cpb);
+		else
+			printf("null}");
+		break;
+	}
+	bench_nresults++;
+}
+
+static void
+bench_finish(void)
+{
+	if (bench_format == FORMAT_JSON)
+		printf("%s]\n", bench_nresults == 0 ? "[" : "\n");
+}
+
+/*
+ * Run the test in batches doubling batch size until minimal run time is
+ * reached to keep timer overhead out of results.
+ */
+#define	BENCH_RUN(r, stmt) do {						\
+	uint64_t _batch, _i, _c0;					\
+	double _t0, _t;							\
+									\
+	(r)->br_iterations = 0;						\
+	(r)->br_seconds = 0;						\
+	(r)->br_cycles = 0;						\
+	for (_batch = 1; (r)->br_seconds < bench_mintime; _batch *= 2) { \
+		_t0 = bench_time();					\
+		_c0 = bench_cycles();					\
+		for (_i = 0; _i < _batch; _i++) {			\
+			stmt;						\
+		}							\
+		(r)->br_cycles += bench_cycles() - _c0;			\
+		_t = bench_time() - _t0;				\
+		(r)->br_seconds += _t;					\
+		(r)->br_iterations += _batch;				\
+	}								\
+} while (0)
+
+static struct pefs_key *
+bench_key(int alg, int keybits)
+{
+	char key[PEFS_KEY_SIZE], keyid[PEFS_KEYID_SIZE];
+	struct pefs_key *pk;
+
+	bench_fill(key, sizeof(key), alg * 1000 + keybits);
+	bench_fill(keyid, sizeof(keyid), keybits);
+	pk = pefs_key_get(alg, keybits, key, keyid);
+	if (pk == NULL) {
+		fprintf(stderr, "pefs-bench: cannot create key: "
+		    "alg %d, keybits %d\n", alg, keybits);
+		exit(1);
+	}
+	if (pefs_key_add(&bench_mount, 0, pk) != 0) {
+		fprintf(stderr, "pefs-bench: cannot add key\n");
+		exit(1);
+	}
+	return (pk);
+}
+
+static void
+bench_key_free(struct pefs_key *pk)
+{
+	pefs_key_remove_all(&bench_mount);
+}
+
+static void
+bench_data(const struct bench_alg *ba, int keybits)
+{
+	struct bench_result r;
+	struct pefs_chunk pc;
+	struct pefs_tkey ptk;
+	size_t size;
+
+	ptk.ptk_key = bench_key(ba->ba_id, keybits);
+	ptk.ptk_flags = 0;
+	bench_fill(ptk.ptk_tweak, sizeof(ptk.ptk_tweak), 1);
+
+	memset(&pc, 0, sizeof(pc));
+	pc.pc_base = bench_buf;
+	pc.pc_capacity = sizeof(bench_buf);
+
+	r.br_alg = ba->ba_name;
+	r.br_keybits = keybits;
+	for (size = BENCH_MINSIZE; size <= BENCH_MAXSIZE; size *= 2) {
+		bench_fill(bench_buf, size, size);
+		pc.pc_size = size;
+		r.br_size = size;
+
+		r.br_test = "data-encrypt";
+		BENCH_RUN(&r, pefs_data_encrypt(&ptk, 0, &pc));
+		bench_output(&r);
+
+		r.br_test = "data-decrypt";
+		BENCH_RUN(&r, pefs_data_decrypt(&bench_mount, &ptk, 0, &pc));
+		bench_output(&r);
+	}
+
+	bench_key_free(ptk.ptk_key);
+}
+
+/*
+ * Decrypt PEFS_NAME_BATCH names encrypted with different tweaks at once,
+ * results are reported per name.
+ */
+static void
+bench_name_batch(struct pefs_tkey *ptk, const char *plain, size_t len,
+    struct bench_result *r)
+{
+	char enc[PEFS_NAME_BATCH][MAXNAMLEN + 1];
+	struct pefs_name_dec *pnd;
+	struct pefs_tkey tk;
+	int i, enclen;
+
+	pnd = calloc(PEFS_NAME_BATCH, sizeof(*pnd));
+	tk = *ptk;
+	for (i = 0; i < PEFS_NAME_BATCH; i++) {
+		bench_fill(tk.ptk_tweak, sizeof(tk.ptk_tweak), i);
+		enclen = pefs_name_encrypt(NULL, &tk, plain, len, enc[i],
+		    sizeof(enc[i]));
+		pnd[i].pnd_enc = enc[i];
+		pnd[i].pnd_enclen = enclen;
+	}
+
+	r->br_test = "name-decrypt-batch";
+	BENCH_RUN(r, pefs_name_decrypt_batch(NULL, ptk->ptk_key, NULL,
+	    pnd, PEFS_NAME_BATCH));
+	for (i = 0; i < PEFS_NAME_BATCH; i++) {
+		bench_fill(tk.ptk_tweak, sizeof(tk.ptk_tweak), i);
+		if (pnd[i].pnd_namelen != (int)len ||
+		    memcmp(pnd[i].pnd_name, plain, len + 1) != 0 ||
+		    pnd[i].pnd_tkey.ptk_key != ptk->ptk_key ||
+		    memcmp(pnd[i].pnd_tkey.ptk_tweak, tk.ptk_tweak,
+		    PEFS_TWEAK_SIZE) != 0) {
+			fprintf(stderr, "pefs-bench: batch name decryption "
+			    "mismatch\n");
+			exit(1);
+		}
+	}
+	r->br_iterations *= PEFS_NAME_BATCH;
+	bench_output(r);
+	free(pnd);
+}
+
+static void
+bench_name(const struct bench_alg *ba, int keybits)
+{
+	char plain[MAXNAMLEN + 1], enc[MAXNAMLEN + 1], dec[MAXNAMLEN + 1];
+	struct bench_result r;
+	struct pefs_tkey ptk;
+	size_t i, len;
+	int enclen = 0;
+
+	ptk.ptk_key = bench_key(ba->ba_id, keybits);
+	ptk.ptk_flags = 0;
+	bench_fill(ptk.ptk_tweak, sizeof(ptk.ptk_tweak), 2);
+
+	r.br_alg = ba->ba_name;
+	r.br_keybits = keybits;
+	for (i = 0; i < nitems(bench_namelen); i++) {
+		len = bench_namelen[i];
+		memset(plain, 'a', len);
+		plain[len] = '\0';
+		r.br_size = len;
+
+		r.br_test = "name-encrypt";
+		BENCH_RUN(&r, enclen = pefs_name_encrypt(NULL, &ptk, plain,
+		    len, enc, sizeof(enc)));
+		if (enclen <= 0) {
+			fprintf(stderr, "pefs-bench: name encryption "
+			    "failed: %d\n", enclen);
+			exit(1);
+		}
+		bench_output(&r);
+
+		r.br_test = "name-decrypt";
+		BENCH_RUN(&r, pefs_name_decrypt(NULL, ptk.ptk_key, NULL, enc,
+		    enclen, dec, sizeof(dec)));
+		if (pefs_name_decrypt(NULL, ptk.ptk_key, NULL, enc, enclen,
+		    dec, sizeof(dec)) != (int)len ||
+		    memcmp(plain, dec, len) != 0) {
+			fprintf(stderr, "pefs-bench: name decryption "
+			    "mismatch\n");
+			exit(1);
+		}
+		bench_output(&r);
+
+		bench_name_batch(&ptk, plain, len, &r);
+	}
+
+	bench_key_free(ptk.ptk_key);
+}
+
+static void
+bench_vmac(void)
+{
+	unsigned char key[VMAC_KEY_LEN / 8], nonce[16];
+	struct bench_result r;
+	struct pefs_ctx *ctx;
+	size_t i, len;
+
+	ctx = pefs_ctx_get();
+	bench_fill(key, sizeof(key), 3);
+	bench_fill(nonce, sizeof(nonce), 4);
+	nonce[0] &= 0x7f;
+	vmac_set_key(key, &ctx->o.pctx_vmac);
+
+	r.br_test = "vmac";
+	r.br_alg = "vmac-aes";
+	r.br_keybits = VMAC_KEY_LEN;
+	for (i = 0; i < nitems(bench_vmaclen); i++) {
+		len = bench_vmaclen[i];
+		bench_fill(bench_buf, len, len);
+		r.br_size = len;
+		BENCH_RUN(&r, vmac(bench_buf, len, nonce, NULL,
+		    &ctx->o.pctx_vmac));
+		bench_output(&r);
+	}
+
+	pefs_ctx_free(ctx);
+}
+
+static void
+bench_ecb_table_setkey(struct bench_ecb_ctx *ctx, const uint8_t *key,
+    int keybits)
+{
+	rijndael_set_key(&ctx->o.table, key, keybits);
+}
+
+static void
+bench_ecb_table_encrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i += 16)
+		rijndael_encrypt(&ctx->o.table, in + i, out + i);
+}
+
+static void
+bench_ecb_table_decrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i += 16)
+		rijndael_decrypt(&ctx->o.table, in + i, out + i);
+}
+
+static void
+bench_ecb_ct_setkey(struct bench_ecb_ctx *ctx, const uint8_t *key,
+    int keybits)
+{
+	pefs_aes_ct_setkey(&ctx->o.ct, key, keybits);
+}
+
+static void
+bench_ecb_ct_encrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_aes_ct_encrypt(&ctx->o.ct, in, out, size / 16);
+}
+
+static void
+bench_ecb_ct_decrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_aes_ct_decrypt(&ctx->o.ct, in, out, size / 16);
+}
+
+#ifdef PEFS_BENCH_VAES
+static int
+bench_ecb_aesni_supported(void)
+{
+	return (pefs_bench_aesni_supported(0));
+}
+
+static int
+bench_ecb_vaes_supported(void)
+{
+	return (pefs_bench_aesni_supported(1));
+}
+
+static void
+bench_ecb_aesni_setkey(struct bench_ecb_ctx *ctx, const uint8_t *key,
+    int keybits)
+{
+	ctx->o.aesni.rounds = pefs_bench_aesni_setkey(key, keybits,
+	    ctx->o.aesni.enc, ctx->o.aesni.dec);
+}
+
+static void
+bench_ecb_aesni_encrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_bench_aesni_encrypt_ecb(ctx->o.aesni.rounds, ctx->o.aesni.enc,
+	    size, in, out);
+}
+
+static void
+bench_ecb_aesni_decrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_bench_aesni_decrypt_ecb(ctx->o.aesni.rounds, ctx->o.aesni.dec,
+	    size, in, out);
+}
+
+static void
+bench_ecb_vaes_encrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_vaes_encrypt_ecb(ctx->o.aesni.rounds, ctx->o.aesni.enc, size,
+	    in, out);
+}
+
+static void
+bench_ecb_vaes_decrypt(const struct bench_ecb_ctx *ctx, const uint8_t *in,
+    uint8_t *out, size_t size)
+{
+	pefs_vaes_decrypt_ecb(ctx->o.aesni.rounds, ctx->o.aesni.dec, size,
+	    in, out);
+}
+#endif
+
+/*
+ * Check results against rijndael before measuring, backends compiled with
+ * vector instructions are not covered by anything else outside of kernel.
+ */
+static void
+bench_ecb_verify(const struct bench_ecb *be, const struct bench_ecb_ctx *ctx,
+    const struct bench_ecb_ctx *ref, size_t size)
+{
+	uint8_t exp[BENCH_MAXSIZE], buf[BENCH_MAXSIZE];
+
+	bench_fill(bench_buf, size, size);
+	bench_ecb_table_encrypt(ref, bench_buf, exp, size);
+	be->be_encrypt(ctx, bench_buf, buf, size);
+	if (memcmp(buf, exp, size) != 0) {
+		fprintf(stderr, "pefs-bench: %s encryption mismatch\n",
+		    be->be_name);
+		exit(1);
+	}
+	be->be_decrypt(ctx, buf, buf, size);
+	if (memcmp(buf, bench_buf, size) != 0) {
+		fprintf(stderr, "pefs-bench: %s decryption mismatch\n",
+		    be->be_name);
+		exit(1);
+	}
+}
+
+static void
+bench_ecb(int keybits)
+{
+	static struct bench_ecb_ctx ctx, ref;
+	const struct bench_ecb *be;
+	struct bench_result r;
+	uint8_t key[32];
+	size_t i, size;
+
+	bench_fill(key, sizeof(key), keybits);
+	bench_ecb_table_setkey(&ref, key, keybits);
+
+	r.br_keybits = keybits;
+	for (i = 0; i < nitems(bench_ecbs); i++) {
+		be = &bench_ecbs[i];
+		if (be->be_supported != NULL && !be->be_supported()) {
+			if (keybits == bench_keybits[0])
+				fprintf(stderr, "pefs-bench: %s is not "
+				    "supported by CPU\n", be->be_name);
+			continue;
+		}
+		be->be_setkey(&ctx, key, keybits);
+		r.br_alg = be->be_name;
+		for (size = BENCH_MINSIZE; size <= BENCH_MAXSIZE; size *= 2) {
+			bench_ecb_verify(be, &ctx, &ref, size);
+			r.br_size = size;
+
+			r.br_test = "ecb-encrypt";
+			BENCH_RUN(&r, be->be_encrypt(&ctx, bench_buf,
+			    bench_buf, size));
+			bench_output(&r);
+
+			r.br_test = "ecb-decrypt";
+			BENCH_RUN(&r, be->be_decrypt(&ctx, bench_buf,
+			    bench_buf, size));
+			bench_output(&r);
+		}
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pefs-bench [-j] [-t seconds] "
+	    "[-T data|name|ecb|vmac]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *test;
+	size_t a, k;
+	int ch;
+
+	test = NULL;
+	while ((ch = getopt(argc, argv, "jt:T:")) != -1) {
+		switch (ch) {
+		case 'j':
+			bench_format = FORMAT_JSON;
+			break;
+		case 't':
+			bench_mintime = strtod(optarg, NULL);
+			if (bench_mintime <= 0)
+				usage();
+			break;
+		case 'T':
+			test = optarg;
+			if (strcmp(test, "data") != 0 &&
+			    strcmp(test, "name") != 0 &&
+			    strcmp(test, "ecb") != 0 &&
+			    strcmp(test, "vmac") != 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	pefs_crypto_init();
+	TAILQ_INIT(&bench_mount.pm_keys);
+
+	for (a = 0; a < nitems(bench_algs); a++) {
+		for (k = 0; k < nitems(bench_keybits); k++) {
+			if (test == NULL || strcmp(test, "data") == 0)
+				bench_data(&bench_algs[a], bench_keybits[k]);
+			if (test == NULL || strcmp(test, "name") == 0)
+				bench_name(&bench_algs[a], bench_keybits[k]);
+		}
+	}
+	if (test == NULL || strcmp(test, "ecb") == 0) {
+		for (k = 0; k < nitems(bench_keybits); k++)
+			bench_ecb(bench_keybits[k]);
+	}
+	if (test == NULL || strcmp(test, "vmac") == 0)
+		bench_vmac();
+	bench_finish();
+
+	pefs_crypto_uninit();
+
+	return (0);
+}
@@ -0,0 +1,148 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * AES-NI helpers for VAES benchmark: key schedule setup and 8 block
+ * interleaved ECB, the same algorithm aesni_encrypt_ecb() and
+ * aesni_decrypt_ecb() from sys/crypto/aesni use in kernel.  Compiled with
+ * VAES enabled, callers check CPU features first.
+ */
+
+#include <sys/param.h>
+#include <sys/endian.h>
+
+#include <immintrin.h>
+
+#include <crypto/rijndael/rijndael.h>
+
+#include <fs/pefs/pefs_aes_ct.h>
+#include <fs/pefs/pefs_aesni.h>
+
+#define	AESNI_LANES	8
+
+int
+pefs_bench_aesni_supported(int vaes)
+{
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("aes"))
+		return (0);
+	if (vaes && (!__builtin_cpu_supports("avx2") ||
+	    !__builtin_cpu_supports("vaes")))
+		return (0);
+	return (1);
+}
+
+int
+pefs_bench_aesni_setkey(const uint8_t *key, int keybits, uint8_t *enc,
+    uint8_t *dec)
+{
+	uint32_t rk[4 * (AES256_ROUNDS + 1)];
+	__m128i *ek = (__m128i *)enc, *dk = (__m128i *)dec;
+	int i, rounds;
+
+	rounds = rijndaelKeySetupEnc(rk, key, keybits);
+	for (i = 0; i < 4 * (rounds + 1); i++)
+		be32enc(enc + i * 4, rk[i]);
+	dk[0] = ek[rounds];
+	for (i = 1; i < rounds; i++)
+		dk[i] = _mm_aesimc_si128(ek[rounds - i]);
+	dk[rounds] = ek[0];
+	explicit_bzero(rk, sizeof(rk));
+
+	return (rounds);
+}
+
+void
+pefs_bench_aesni_encrypt_ecb(int rounds, const void *key_schedule,
+    size_t len, const uint8_t *from, uint8_t *to)
+{
+	const __m128i *k = key_schedule;
+	__m128i b[AESNI_LANES];
+	int i, r;
+
+	for (; len >= AESNI_LANES * AES_BLOCK_LEN;
+	    len -= AESNI_LANES * AES_BLOCK_LEN) {
+		for (i = 0; i < AESNI_LANES; i++)
+			b[i] = _mm_xor_si128(k[0],
+			    _mm_loadu_si128((const __m128i *)from + i));
+		for (r = 1; r < rounds; r++)
+			for (i = 0; i < AESNI_LANES; i++)
+				b[i] = _mm_aesenc_si128(b[i], k[r]);
+		for (i = 0; i < AESNI_LANES; i++)
+			_mm_storeu_si128((__m128i *)to + i,
+			    _mm_aesenclast_si128(b[i], k[rounds]));
+		from += AESNI_LANES * AES_BLOCK_LEN;
+		to += AESNI_LANES * AES_BLOCK_LEN;
+	}
+
+	for (; len >= AES_BLOCK_LEN; len -= AES_BLOCK_LEN) {
+		b[0] = _mm_xor_si128(k[0], _mm_loadu_si128(
+		    (const __m128i *)from));
+		for (r = 1; r < rounds; r++)
+			b[0] = _mm_aesenc_si128(b[0], k[r]);
+		_mm_storeu_si128((__m128i *)to,
+		    _mm_aesenclast_si128(b[0], k[rounds]));
+		from += AES_BLOCK_LEN;
+		to += AES_BLOCK_LEN;
+	}
+}
+
+void
+pefs_bench_aesni_decrypt_ecb(int rounds, const void *key_schedule,
+    size_t len, const uint8_t *from, uint8_t *to)
+{
+	const __m128i *k = key_schedule;
+	__m128i b[AESNI_LANES];
+	int i, r;
+
+	for (; len >= AESNI_LANES * AES_BLOCK_LEN;
+	    len -= AESNI_LANES * AES_BLOCK_LEN) {
+		for (i = 0; i < AESNI_LANES; i++)
+			b[i] = _mm_xor_si128(k[0],
+			    _mm_loadu_si128((const __m128i *)from + i));
+		for (r = 1; r < rounds; r++)
+			for (i = 0; i < AESNI_LANES; i++)
+				b[i] = _mm_aesdec_si128(b[i], k[r]);
+		for (i = 0; i < AESNI_LANES; i++)
+			_mm_storeu_si128((__m128i *)to + i,
+			    _mm_aesdeclast_si128(b[i], k[rounds]));
+		from += AESNI_LANES * AES_BLOCK_LEN;
+		to += AESNI_LANES * AES_BLOCK_LEN;
+	}
+
+	for (; len >= AES_BLOCK_LEN; len -= AES_BLOCK_LEN) {
+		b[0] = _mm_xor_si128(k[0], _mm_loadu_si128(
+		    (const __m128i *)from));
+		for (r = 1; r < rounds; r++)
+			b[0] = _mm_aesdec_si128(b[0], k[r]);
+		_mm_storeu_si128((__m128i *)to,
+		    _mm_aesdeclast_si128(b[0], k[rounds]));
+		from += AES_BLOCK_LEN;
+		to += AES_BLOCK_LEN;
+	}
+}
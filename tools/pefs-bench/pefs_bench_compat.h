@@ -0,0 +1,594 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * Minimal userland environment required to compile pefs crypto and directory
+ * cache code outside of FreeBSD kernel.  Included before every source file.
+ * Kernel headers referenced by sources are replaced by empty files generated
+ * by Makefile.
+ */
+
+#ifndef _PEFS_BENCH_COMPAT_H_
+#define	_PEFS_BENCH_COMPAT_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define	_KERNEL
+
+#ifndef __FBSDID
+#define	__FBSDID(s)
+#endif
+#ifndef __unused
+#define	__unused		__attribute__((__unused__))
+#endif
+#ifndef __aligned
+#define	__aligned(x)		__attribute__((__aligned__(x)))
+#endif
+#ifndef __inline
+#define	__inline		inline
+#endif
+#define	__weak_reference(sym, alias)					\
+	extern __typeof(sym) alias __attribute__((__weak__, __alias__(#sym)))
+
+typedef uint8_t		u_int8_t;
+typedef uint16_t	u_int16_t;
+typedef uint32_t	u_int32_t;
+typedef uint64_t	u_int64_t;
+typedef unsigned char	u_char;
+typedef unsigned short	u_short;
+typedef unsigned int	u_int;
+typedef unsigned long	u_long;
+typedef uint64_t	u_quad_t;
+typedef int64_t		quad_t;
+
+#define	_BYTE_ORDER		__BYTE_ORDER
+#define	_LITTLE_ENDIAN		__LITTLE_ENDIAN
+#define	_BIG_ENDIAN		__BIG_ENDIAN
+
+#define	CACHE_LINE_SIZE		64
+#define	MAXNAMLEN		255
+#define	MAXCPU			256
+#define	PRIBIO			0
+
+#ifndef MIN
+#define	MIN(a, b)		(((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define	MAX(a, b)		(((a) > (b)) ? (a) : (b))
+#endif
+#ifndef LIST_FOREACH_SAFE
+#define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
+	for ((var) = LIST_FIRST((head));				\
+	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
+	    (var) = (tvar))
+#endif
+#ifndef nitems
+#define	nitems(x)		(sizeof((x)) / sizeof((x)[0]))
+#endif
+#ifndef howmany
+#define	howmany(x, y)		(((x) + ((y) - 1)) / (y))
+#endif
+#ifndef roundup
+#define	roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#endif
+#ifndef roundup2
+#define	roundup2(x, y)		(((x) + ((y) - 1)) & (~((y) - 1)))
+#endif
+#ifndef rounddown
+#define	rounddown(x, y)		(((x) / (y)) * (y))
+#endif
+
+static __inline quad_t qmin(quad_t a, quad_t b) { return (a < b ? a : b); }
+static __inline quad_t qmax(quad_t a, quad_t b) { return (a > b ? a : b); }
+
+#define	CTASSERT(x)		_Static_assert(x, "compile-time assertion")
+#define	KASSERT(exp, msg)	assert(exp)
+#define	MPASS(exp)		assert(exp)
+#define	panic(fmt, ...)		do {					\
+	fprintf(stderr, "panic: " fmt "\n", ##__VA_ARGS__);		\
+	abort();							\
+} while (0)
+
+#define	bootverbose		0
+#define	mp_ncpus		1
+#define	TUNABLE_INT_FETCH(path, var)	pefs_bench_tunable((path), (var), \
+	sizeof(*(var)))
+#define	TUNABLE_ULONG_FETCH(path, var)	TUNABLE_INT_FETCH(path, var)
+
+static __inline void
+pefs_bench_tunable(const char *path, void *var, size_t size)
+{
+	const char *s;
+	long v;
+
+	s = getenv(path);
+	if (s == NULL)
+		return;
+	v = strtol(s, NULL, 0);
+	if (size == sizeof(int))
+		*(int *)var = v;
+	else
+		*(long *)var = v;
+}
+
+#define	SYSCTL_DECL(name)		struct __hack
+#define	SYSCTL_NODE(...)		struct __hack
+#define	SYSCTL_INT(...)			struct __hack
+#define	SYSCTL_UINT(...)		struct __hack
+#define	SYSCTL_LONG(...)		struct __hack
+#define	SYSCTL_ULONG(...)		struct __hack
+
+/* Memory allocation. */
+#define	M_WAITOK		0x0001
+#define	M_NOWAIT		0x0002
+#define	M_ZERO			0x0100
+#define	MALLOC_DEFINE(type, shortdesc, longdesc) \
+	static int type __unused
+#define	MALLOC_DECLARE(type)	struct __hack
+
+struct uma_zone {
+	size_t		uz_size;
+	void		(*uz_dtor)(void *mem, int size, void *arg);
+};
+typedef struct uma_zone *uma_zone_t;
+
+#define	UMA_ALIGN_PTR		(sizeof(void *) - 1)
+#define	UMA_ALIGN_CACHE		(CACHE_LINE_SIZE - 1)
+
+static __inline uma_zone_t
+uma_zcreate(const char *name __unused, size_t size, void *ctor __unused,
+    void (*dtor)(void *, int, void *), void *init __unused,
+    void *fini __unused, int align __unused, int flags __unused)
+{
+	uma_zone_t zone;
+
+	zone = calloc(1, sizeof(*zone));
+	zone->uz_size = roundup(size, CACHE_LINE_SIZE);
+	zone->uz_dtor = dtor;
+	return (zone);
+}
+
+static __inline void
+uma_zdestroy(uma_zone_t zone)
+{
+	free(zone);
+}
+
+static __inline void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	void *mem;
+
+	if (posix_memalign(&mem, CACHE_LINE_SIZE, zone->uz_size) != 0)
+		abort();
+	if ((flags & M_ZERO) != 0)
+		memset(mem, 0, zone->uz_size);
+	return (mem);
+}
+
+static __inline void
+uma_zfree(uma_zone_t zone, void *mem)
+{
+	if (zone->uz_dtor != NULL)
+		zone->uz_dtor(mem, zone->uz_size, NULL);
+	free(mem);
+}
+
+/* Locking and atomics. */
+struct mtx {
+	pthread_mutex_t	mtx_lock;
+};
+#define	MTX_DEF			0
+#define	MA_OWNED		0
+#define	mtx_init(m, name, type, opts)	\
+	pthread_mutex_init(&(m)->mtx_lock, NULL)
+#define	mtx_destroy(m)			pthread_mutex_destroy(&(m)->mtx_lock)
+#define	mtx_lock(m)			pthread_mutex_lock(&(m)->mtx_lock)
+#define	mtx_trylock(m)			\
+	(pthread_mutex_trylock(&(m)->mtx_lock) == 0)
+#define	mtx_unlock(m)			pthread_mutex_unlock(&(m)->mtx_lock)
+#define	mtx_assert(m, what)		((void)(m))
+#define	wakeup(chan)			((void)(chan))
+
+struct sx {
+	pthread_rwlock_t sx_lock;
+};
+#define	sx_init(sx, name)		pthread_rwlock_init(&(sx)->sx_lock, NULL)
+#define	sx_destroy(sx)			pthread_rwlock_destroy(&(sx)->sx_lock)
+#define	sx_slock(sx)			pthread_rwlock_rdlock(&(sx)->sx_lock)
+#define	sx_sunlock(sx)			pthread_rwlock_unlock(&(sx)->sx_lock)
+#define	sx_xlock(sx)			pthread_rwlock_wrlock(&(sx)->sx_lock)
+#define	sx_xunlock(sx)			pthread_rwlock_unlock(&(sx)->sx_lock)
+
+#define	atomic_add_long(p, v)		__atomic_fetch_add((p), (v), \
+	__ATOMIC_RELAXED)
+#define	atomic_subtract_long(p, v)	__atomic_fetch_sub((p), (v), \
+	__ATOMIC_RELAXED)
+#define	atomic_readandclear_int(p)	__atomic_exchange_n((p), 0, \
+	__ATOMIC_SEQ_CST)
+#define	atomic_load_acq_long(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	atomic_load_acq_ptr(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	atomic_store_rel_int(p, v)	__atomic_store_n((p), (v), \
+	__ATOMIC_RELEASE)
+#define	atomic_store_rel_long(p, v)	__atomic_store_n((p), (v), \
+	__ATOMIC_RELEASE)
+#define	atomic_store_rel_ptr(p, v)	__atomic_store_n((p), (v), \
+	__ATOMIC_RELEASE)
+
+static __inline int
+atomic_cmpset_int(volatile u_int *p, u_int cmpval, u_int newval)
+{
+	return (__atomic_compare_exchange_n(p, &cmpval, newval, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+#define	refcount_init(p, v)		(*(p) = (v))
+#define	refcount_acquire(p)		__atomic_fetch_add((p), 1, \
+	__ATOMIC_RELAXED)
+#define	refcount_release(p)		\
+	(__atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL) == 0)
+
+static __inline int
+msleep(void *chan __unused, struct mtx *m __unused, int pri __unused,
+    const char *wmesg __unused, int timo __unused)
+{
+	return (0);
+}
+
+/* Worker threads are never started: mp_ncpus is 1. */
+struct task {
+	void		(*ta_func)(void *context, int pending);
+	void		*ta_context;
+};
+struct taskqueue;
+#define	taskqueue_thread		((struct taskqueue *)NULL)
+#define	taskqueue_drain(tq, task)	((void)(task))
+#define	TASK_INIT(task, priority, func, context) do {			\
+	(task)->ta_func = (func);					\
+	(task)->ta_context = (context);					\
+} while (0)
+#define	taskqueue_create(name, flags, enqueue, context)	(NULL)
+#define	taskqueue_free(tq)				((void)(tq))
+
+static __inline int
+taskqueue_start_threads(struct taskqueue **tqp __unused, int count __unused,
+    int pri __unused, const char *name __unused, ...)
+{
+	return (0);
+}
+
+static __inline int
+taskqueue_enqueue(struct taskqueue *tq __unused, struct task *task)
+{
+	task->ta_func(task->ta_context, 1);
+	return (0);
+}
+
+/* File system types referenced by pefs.h. */
+struct vfsconf;
+struct ucred;
+struct componentname;
+struct vop_vector;
+struct mount {
+	void		*mnt_data;
+};
+struct vnode {
+	void		*v_data;
+	struct mount	*v_mount;
+	int		v_iflag;
+};
+enum uio_rw { UIO_READ, UIO_WRITE };
+enum uio_seg { UIO_USERSPACE, UIO_SYSSPACE, UIO_NOCOPY };
+struct uio {
+	struct iovec	*uio_iov;
+	int		uio_iovcnt;
+	off_t		uio_offset;
+	ssize_t		uio_resid;
+	enum uio_seg	uio_segflg;
+	enum uio_rw	uio_rw;
+	struct thread	*uio_td;
+};
+#define	uiomove(cp, n, uio)		(ENOSYS)
+
+/* Byte order. */
+static __inline uint16_t
+le16dec(const void *pp)
+{
+	uint16_t v;
+
+	memcpy(&v, pp, sizeof(v));
+	return (le16toh(v));
+}
+
+static __inline void
+le16enc(void *pp, uint16_t u)
+{
+	u = htole16(u);
+	memcpy(pp, &u, sizeof(u));
+}
+
+static __inline uint32_t
+le32dec(const void *pp)
+{
+	uint32_t v;
+
+	memcpy(&v, pp, sizeof(v));
+	return (le32toh(v));
+}
+
+static __inline void
+le32enc(void *pp, uint32_t u)
+{
+	u = htole32(u);
+	memcpy(pp, &u, sizeof(u));
+}
+
+static __inline uint64_t
+le64dec(const void *pp)
+{
+	uint64_t v;
+
+	memcpy(&v, pp, sizeof(v));
+	return (le64toh(v));
+}
+
+static __inline void
+le64enc(void *pp, uint64_t u)
+{
+	u = htole64(u);
+	memcpy(pp, &u, sizeof(u));
+}
+
+static __inline uint32_t
+be32dec(const void *pp)
+{
+	uint32_t v;
+
+	memcpy(&v, pp, sizeof(v));
+	return (be32toh(v));
+}
+
+static __inline void
+be32enc(void *pp, uint32_t u)
+{
+	u = htobe32(u);
+	memcpy(pp, &u, sizeof(u));
+}
+
+static __inline uint64_t
+be64dec(const void *pp)
+{
+	uint64_t v;
+
+	memcpy(&v, pp, sizeof(v));
+	return (be64toh(v));
+}
+
+static __inline void
+be64enc(void *pp, uint64_t u)
+{
+	u = htobe64(u);
+	memcpy(pp, &u, sizeof(u));
+}
+
+#define	bswap32(x)		__builtin_bswap32(x)
+#define	bswap64(x)		__builtin_bswap64(x)
+
+#ifdef PEFS_BENCH_DIRCACHE
+/*
+ * Directory cache.  Vnodes are never locked: stale entries are only freed by
+ * the benchmark itself.  epoch(9) is implemented by pefs_dircache_bench.c.
+ */
+#define	P_OSREL_MAJOR(x)		((x) / 100000)
+#define	VI_DOOMED			0x0080
+#define	LK_EXCLUSIVE			0x080000
+#define	LK_NOWAIT			0x200000
+#define	vn_lock(vp, flags)		(EBUSY)
+#define	VOP_UNLOCK(vp, flags)		((void)(vp))
+#define	vhold(vp)			((void)(vp))
+#define	vdrop(vp)			((void)(vp))
+
+extern int desiredvnodes;
+
+typedef void *eventhandler_tag;
+#define	EVENTHANDLER_PRI_FIRST		0
+#define	EVENTHANDLER_REGISTER(name, func, arg, pri)			\
+	((void)(func), (eventhandler_tag)NULL)
+#define	EVENTHANDLER_DEREGISTER(name, tag)	((void)(tag))
+
+static __inline int
+flsl(long mask)
+{
+	return (mask == 0 ? 0 :
+	    (int)(sizeof(mask) * CHAR_BIT) - __builtin_clzl(mask));
+}
+
+static __inline u_long
+ulmin(u_long a, u_long b)
+{
+	return (a < b ? a : b);
+}
+
+#ifndef __containerof
+#define	__containerof(x, s, m)		\
+	((s *)(void *)((char *)(x) - offsetof(s, m)))
+#endif
+
+/* Kernel malloc(9), libc functions are still available as (malloc)(). */
+#define	malloc(size, type, flags)	pefs_bench_malloc((size), (flags))
+#define	free(addr, type)		(free)(addr)
+
+static __inline void *
+pefs_bench_malloc(size_t size, int flags)
+{
+	void *mem;
+
+	mem = (malloc)(size);
+	if (mem == NULL)
+		abort();
+	if ((flags & M_ZERO) != 0)
+		memset(mem, 0, size);
+	return (mem);
+}
+
+typedef struct epoch *epoch_t;
+struct epoch_context {
+	struct epoch_context	*ec_next;
+	void			(*ec_callback)(struct epoch_context *);
+	uint64_t		ec_epoch;
+};
+typedef struct epoch_context *epoch_context_t;
+typedef void epoch_callback_t(epoch_context_t);
+struct epoch_tracker {
+	int			et_slot;
+};
+#define	EPOCH_PREEMPT			0x1
+
+epoch_t	epoch_alloc(const char *name, int flags);
+void	epoch_free(epoch_t epoch);
+void	epoch_enter_preempt(epoch_t epoch, struct epoch_tracker *et);
+void	epoch_exit_preempt(epoch_t epoch, struct epoch_tracker *et);
+void	epoch_call(epoch_t epoch, epoch_callback_t *callback,
+	    epoch_context_t ctx);
+void	epoch_drain_callbacks(epoch_t epoch);
+void	epoch_wait_preempt(epoch_t epoch);
+
+/* seqc(9) */
+typedef uint32_t seqc_t;
+
+static __inline seqc_t
+seqc_read(const seqc_t *seqcp)
+{
+	seqc_t ret;
+
+	while (((ret = __atomic_load_n(seqcp, __ATOMIC_ACQUIRE)) & 1) != 0)
+		sched_yield();
+	return (ret);
+}
+
+static __inline int
+seqc_consistent(const seqc_t *seqcp, seqc_t oldseqc)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(seqcp, __ATOMIC_RELAXED) == oldseqc);
+}
+
+static __inline void
+seqc_write_begin(seqc_t *seqcp)
+{
+	__atomic_store_n(seqcp, *seqcp + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static __inline void
+seqc_write_end(seqc_t *seqcp)
+{
+	__atomic_store_n(seqcp, *seqcp + 1, __ATOMIC_RELEASE);
+}
+
+static __inline void
+arc4rand(void *ptr, u_int len, int reseed __unused)
+{
+	if (getentropy(ptr, len) != 0)
+		abort();
+}
+
+/* Sysctl handlers are compiled but never registered. */
+#define	SYSCTL_PROC(...)		struct __hack
+#define	SYSCTL_HANDLER_ARGS						\
+	void *oidp __unused, void *arg1 __unused,			\
+	intmax_t arg2 __unused, void *req
+
+struct sbuf {
+	FILE		*s_file;
+};
+
+static __inline struct sbuf *
+sbuf_new_for_sysctl(struct sbuf *sb, char *buf __unused, int len __unused,
+    void *req __unused)
+{
+	sb->s_file = stdout;
+	return (sb);
+}
+
+#define	sbuf_printf(sb, ...)		fprintf((sb)->s_file, __VA_ARGS__)
+#define	sbuf_finish(sb)			(fflush((sb)->s_file) == 0 ? 0 : EIO)
+#define	sbuf_delete(sb)			((void)(sb))
+
+/* ck_queue(3) lists: readers may traverse list concurrently with writer. */
+#define	CK_LIST_HEAD(name, type)					\
+struct name {								\
+	struct type *clh_first;						\
+}
+#define	CK_LIST_ENTRY(type)						\
+struct {								\
+	struct type *cle_next;						\
+	struct type **cle_prev;						\
+}
+#define	CK_LIST_FIRST(head)						\
+	__atomic_load_n(&(head)->clh_first, __ATOMIC_ACQUIRE)
+#define	CK_LIST_NEXT(elm, field)					\
+	__atomic_load_n(&(elm)->field.cle_next, __ATOMIC_ACQUIRE)
+#define	CK_LIST_INIT(head)						\
+	__atomic_store_n(&(head)->clh_first, NULL, __ATOMIC_RELEASE)
+#define	CK_LIST_FOREACH(var, head, field)				\
+	for ((var) = CK_LIST_FIRST(head); (var) != NULL;		\
+	    (var) = CK_LIST_NEXT((var), field))
+#define	CK_LIST_INSERT_HEAD(head, elm, field) do {			\
+	(elm)->field.cle_next = (head)->clh_first;			\
+	if ((elm)->field.cle_next != NULL)				\
+		(head)->clh_first->field.cle_prev =			\
+		    &(elm)->field.cle_next;				\
+	(elm)->field.cle_prev = &(head)->clh_first;			\
+	__atomic_store_n(&(head)->clh_first, (elm), __ATOMIC_RELEASE);	\
+} while (0)
+#define	CK_LIST_REMOVE(elm, field) do {					\
+	__atomic_store_n((elm)->field.cle_prev, (elm)->field.cle_next,	\
+	    __ATOMIC_RELEASE);						\
+	if ((elm)->field.cle_next != NULL)				\
+		(elm)->field.cle_next->field.cle_prev =			\
+		    (elm)->field.cle_prev;				\
+} while (0)
+#endif /* PEFS_BENCH_DIRCACHE */
+
+#endif /* _PEFS_BENCH_COMPAT_H_ */
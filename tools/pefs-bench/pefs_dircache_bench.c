@@ -0,0 +1,526 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * Directory cache hash table stress test and benchmark.  Reader threads look
+ * up names in their directories and verify results, optional writer thread
+ * concurrently replaces entries of other directories sharing the same hash
+ * chains, or fills and purges them to make hash table grow and shrink.
+ * Lookup rate is measured for 1 to N reader threads.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs/pefs/pefs.h>
+#include <fs/pefs/pefs_dircache.h>
+
+#ifdef PEFS_DIRCACHE_EPOCH
+#define	BENCH_VARIANT		"epoch"
+#else
+#define	BENCH_VARIANT		"locked"
+#endif
+
+#define	BENCH_MAXTHREADS	256
+#define	BENCH_WRITER_DIRS	8
+/* Enough to make table grow and shrink back with one reader directory. */
+#define	BENCH_RESIZE_DIRS	32
+#define	BENCH_NAMELEN		32
+
+/* Epoch slots: reader threads, writer thread, main thread. */
+#define	BENCH_SLOT_WRITER	BENCH_MAXTHREADS
+#define	BENCH_SLOT_MAIN		(BENCH_MAXTHREADS + 1)
+#define	BENCH_NSLOTS		(BENCH_MAXTHREADS + 2)
+
+/* Run deferred callbacks once that many are pending. */
+#define	BENCH_EPOCH_BATCH	256
+
+struct bench_dir {
+	struct vnode		bd_vnode;
+	struct pefs_dircache	*bd_dircache;
+};
+
+struct bench_thread {
+	pthread_t		bt_thread;
+	struct bench_dir	*bt_dirs;
+	u_int			bt_ndirs;
+	int			bt_slot;
+	uint32_t		bt_seed;
+	uint64_t		bt_ops;
+} __aligned(CACHE_LINE_SIZE);
+
+struct epoch {
+	pthread_mutex_t		e_mtx;
+	struct epoch_context	*e_head;
+	struct epoch_context	**e_tail;
+	u_long			e_pending;
+	uint64_t		e_global;
+	struct {
+		uint64_t	es_epoch;
+	} __aligned(CACHE_LINE_SIZE) e_slots[BENCH_NSLOTS];
+};
+
+int desiredvnodes = 1 << 20;
+
+static __thread int bench_slot = BENCH_SLOT_MAIN;
+
+static double bench_seconds = 1;
+static u_int bench_ndirs = 64;
+static u_int bench_nnames = 1024;
+static u_int bench_maxthreads;
+static int bench_writer;
+static int bench_resize;
+static u_int bench_writer_ndirs;
+
+static volatile int bench_stop;
+static struct pefs_tkey bench_tkey;
+static struct bench_dir *bench_dirs;
+static char (*bench_names)[BENCH_NAMELEN];
+static char (*bench_encnames)[BENCH_NAMELEN];
+static size_t *bench_namelens;
+static size_t *bench_encnamelens;
+
+void
+pefs_zone_dtor_bzero(void *mem, int size, void *arg __unused)
+{
+	explicit_bzero(mem, size);
+}
+
+/*
+ * Userland epoch(9).  Readers publish global epoch in per-thread slot while
+ * inside epoch section, callbacks are deferred until every reader has left
+ * or entered a newer epoch.
+ */
+epoch_t
+epoch_alloc(const char *name __unused, int flags __unused)
+{
+	struct epoch *e;
+
+	if (posix_memalign((void **)&e, CACHE_LINE_SIZE, sizeof(*e)) != 0)
+		abort();
+	memset(e, 0, sizeof(*e));
+	pthread_mutex_init(&e->e_mtx, NULL);
+	e->e_tail = &e->e_head;
+	e->e_global = 1;
+	return (e);
+}
+
+void
+epoch_free(epoch_t e)
+{
+	MPASS(e->e_head == NULL);
+	pthread_mutex_destroy(&e->e_mtx);
+	(free)(e);
+}
+
+void
+epoch_enter_preempt(epoch_t e, struct epoch_tracker *et)
+{
+	uint64_t v;
+
+	et->et_slot = bench_slot;
+	v = __atomic_load_n(&e->e_global, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&e->e_slots[et->et_slot].es_epoch, v,
+	    __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void
+epoch_exit_preempt(epoch_t e, struct epoch_tracker *et)
+{
+	__atomic_store_n(&e->e_slots[et->et_slot].es_epoch, 0,
+	    __ATOMIC_RELEASE);
+}
+
+static void
+bench_epoch_reclaim(epoch_t e)
+{
+	struct epoch_context *ctx;
+	uint64_t min, v;
+	int i;
+
+	min = UINT64_MAX;
+	for (i = 0; i < BENCH_NSLOTS; i++) {
+		v = __atomic_load_n(&e->e_slots[i].es_epoch, __ATOMIC_SEQ_CST);
+		if (v != 0 && v < min)
+			min = v;
+	}
+	while ((ctx = e->e_head) != NULL && ctx->ec_epoch < min) {
+		e->e_head = ctx->ec_next;
+		if (e->e_head == NULL)
+			e->e_tail = &e->e_head;
+		e->e_pending--;
+		ctx->ec_callback(ctx);
+	}
+}
+
+void
+epoch_call(epoch_t e, epoch_callback_t *callback, epoch_context_t ctx)
+{
+	ctx->ec_callback = callback;
+	ctx->ec_next = NULL;
+	pthread_mutex_lock(&e->e_mtx);
+	ctx->ec_epoch = __atomic_fetch_add(&e->e_global, 1, __ATOMIC_SEQ_CST);
+	*e->e_tail = ctx;
+	e->e_tail = &ctx->ec_next;
+	if (++e->e_pending >= BENCH_EPOCH_BATCH)
+		bench_epoch_reclaim(e);
+	pthread_mutex_unlock(&e->e_mtx);
+}
+
+void
+epoch_wait_preempt(epoch_t e)
+{
+	uint64_t v, w;
+	int i;
+
+	v = __atomic_fetch_add(&e->e_global, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < BENCH_NSLOTS; i++) {
+		while ((w = __atomic_load_n(&e->e_slots[i].es_epoch,
+		    __ATOMIC_SEQ_CST)) != 0 && w <= v)
+			sched_yield();
+	}
+}
+
+void
+epoch_drain_callbacks(epoch_t e)
+{
+	pthread_mutex_lock(&e->e_mtx);
+	while (e->e_head != NULL) {
+		bench_epoch_reclaim(e);
+		if (e->e_head != NULL) {
+			pthread_mutex_unlock(&e->e_mtx);
+			sched_yield();
+			pthread_mutex_lock(&e->e_mtx);
+		}
+	}
+	pthread_mutex_unlock(&e->e_mtx);
+}
+
+static double
+bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static __inline uint32_t
+bench_random(uint32_t *seed)
+{
+	uint32_t x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return (x);
+}
+
+static void
+bench_fail(const char *msg, u_int n)
+{
+	fprintf(stderr, "pefs-dircache-bench: %s: %s\n", msg, bench_names[n]);
+	exit(1);
+}
+
+static void
+bench_dir_fill(struct bench_dir *bd)
+{
+	u_int n;
+
+	for (n = 0; n < bench_nnames; n++)
+		pefs_dircache_insert(bd->bd_dircache, &bench_tkey,
+		    bench_names[n], bench_namelens[n],
+		    bench_encnames[n], bench_encnamelens[n]);
+}
+
+static void *
+bench_reader(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct pefs_dircache_entry *pde;
+	struct pefs_dircache *pd;
+	uint64_t ops;
+	u_int n;
+
+	bench_slot = bt->bt_slot;
+	for (ops = 0; bench_stop == 0; ops++) {
+		pd = bt->bt_dirs[bench_random(&bt->bt_seed) %
+		    bt->bt_ndirs].bd_dircache;
+		n = bench_random(&bt->bt_seed) % bench_nnames;
+		if ((ops & 1) == 0) {
+			pde = pefs_dircache_lookup(pd, bench_names[n],
+			    bench_namelens[n]);
+			if (pde == NULL ||
+			    pde->pde_namelen != bench_namelens[n] ||
+			    memcmp(pde->pde_name, bench_names[n],
+			    bench_namelens[n]) != 0)
+				bench_fail("name lookup failed", n);
+		} else {
+			pde = pefs_dircache_enclookup(pd, bench_encnames[n],
+			    bench_encnamelens[n]);
+			if (pde == NULL ||
+			    pde->pde_encnamelen != bench_encnamelens[n] ||
+			    memcmp(pde->pde_encname, bench_encnames[n],
+			    bench_encnamelens[n]) != 0)
+				bench_fail("encrypted name lookup failed", n);
+		}
+	}
+	bt->bt_ops = ops;
+	return (NULL);
+}
+
+/*
+ * Replace entries in writer directories.  Expired entries are freed at once
+ * while readers may still traverse them in shared hash chains.
+ */
+static void *
+bench_writer_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct pefs_dircache_entry *pde;
+	struct pefs_dircache *pd;
+	uint64_t ops;
+	u_int n;
+
+	bench_slot = bt->bt_slot;
+	for (ops = 0; bench_stop == 0; ops++) {
+		pd = bt->bt_dirs[bench_random(&bt->bt_seed) %
+		    bt->bt_ndirs].bd_dircache;
+		n = bench_random(&bt->bt_seed) % bench_nnames;
+		pde = pefs_dircache_lookup(pd, bench_names[n],
+		    bench_namelens[n]);
+		if (pde == NULL)
+			bench_fail("writer lookup failed", n);
+		pefs_dircache_expire(pde, PEFS_DF_FORCE_GC);
+		pefs_dircache_insert(pd, &bench_tkey,
+		    bench_names[n], bench_namelens[n],
+		    bench_encnames[n], bench_encnamelens[n]);
+	}
+	bt->bt_ops = ops;
+	return (NULL);
+}
+
+/*
+ * Fill writer directories and purge them afterwards.  Number of entries
+ * oscillates, hash table is resized while readers are running.
+ */
+static void *
+bench_resize_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	uint64_t ops;
+	u_int i;
+
+	bench_slot = bt->bt_slot;
+	for (ops = 0; bench_stop == 0; ops += 2 * bt->bt_ndirs) {
+		for (i = 0; i < bt->bt_ndirs; i++)
+			bench_dir_fill(&bt->bt_dirs[i]);
+		for (i = 0; i < bt->bt_ndirs; i++)
+			pefs_dircache_purge(bt->bt_dirs[i].bd_dircache);
+	}
+	bt->bt_ops = ops;
+	return (NULL);
+}
+
+static void
+bench_run(u_int nthreads, double *base)
+{
+	struct bench_thread *threads, writer;
+	struct timespec ts;
+	uint64_t ops;
+	double rate, t;
+	u_int i;
+
+	if (posix_memalign((void **)&threads, CACHE_LINE_SIZE,
+	    nthreads * sizeof(*threads)) != 0)
+		abort();
+	memset(threads, 0, nthreads * sizeof(*threads));
+	memset(&writer, 0, sizeof(writer));
+	bench_stop = 0;
+
+	t = bench_time();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].bt_dirs = bench_dirs;
+		threads[i].bt_ndirs = bench_ndirs;
+		threads[i].bt_slot = i;
+		threads[i].bt_seed = 0x9e3779b9 * (i + 1);
+		if (pthread_create(&threads[i].bt_thread, NULL, bench_reader,
+		    &threads[i]) != 0)
+			abort();
+	}
+	if (bench_writer != 0) {
+		writer.bt_dirs = bench_dirs + bench_ndirs;
+		writer.bt_ndirs = bench_writer_ndirs;
+		writer.bt_slot = BENCH_SLOT_WRITER;
+		writer.bt_seed = 0x85ebca6b;
+		if (pthread_create(&writer.bt_thread, NULL,
+		    bench_resize != 0 ? bench_resize_thread :
+		    bench_writer_thread, &writer) != 0)
+			abort();
+	}
+
+	ts.tv_sec = bench_seconds;
+	ts.tv_nsec = (bench_seconds - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+	bench_stop = 1;
+
+	ops = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].bt_thread, NULL);
+		ops += threads[i].bt_ops;
+	}
+	if (bench_writer != 0)
+		pthread_join(writer.bt_thread, NULL);
+	t = bench_time() - t;
+
+	rate = ops / t;
+	if (*base == 0)
+		*base = rate;
+	printf("%s,%u,%ju,%ju,%.4f,%.0f,%.2f\n", BENCH_VARIANT, nthreads,
+	    (uintmax_t)ops, (uintmax_t)writer.bt_ops, t, rate, rate / *base);
+	(free)(threads);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pefs-dircache-bench [-rw] [-d dirs] "
+	    "[-n names] [-t seconds] [-T threads]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char key[PEFS_KEY_SIZE], keyid[PEFS_KEYID_SIZE];
+	struct pefs_dircache_pool *pool;
+	double base;
+	u_int i, n, ndirs, nthreads;
+	int ch;
+
+	bench_maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(argc, argv, "d:n:rt:T:w")) != -1) {
+		switch (ch) {
+		case 'd':
+			bench_ndirs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			bench_nnames = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			bench_resize = 1;
+			bench_writer = 1;
+			break;
+		case 't':
+			bench_seconds = strtod(optarg, NULL);
+			break;
+		case 'T':
+			bench_maxthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			bench_writer = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || bench_ndirs == 0 || bench_nnames == 0 ||
+	    bench_seconds <= 0)
+		usage();
+	if (bench_maxthreads == 0)
+		bench_maxthreads = 1;
+	if (bench_maxthreads > BENCH_MAXTHREADS)
+		bench_maxthreads = BENCH_MAXTHREADS;
+
+	if (bench_writer != 0)
+		bench_writer_ndirs = bench_resize != 0 ? BENCH_RESIZE_DIRS :
+		    BENCH_WRITER_DIRS;
+	ndirs = bench_ndirs + bench_writer_ndirs;
+	/* Avoid eviction, it would make reader lookups fail. */
+	if ((u_long)ndirs * bench_nnames > (u_long)desiredvnodes)
+		desiredvnodes = ndirs * bench_nnames;
+
+	pefs_crypto_init();
+	pefs_dircache_init();
+
+	memset(key, 0x5a, sizeof(key));
+	memset(keyid, 0xa5, sizeof(keyid));
+	bench_tkey.ptk_key = pefs_key_get(PEFS_ALG_AES_XTS, 256, key, keyid);
+	if (bench_tkey.ptk_key == NULL) {
+		fprintf(stderr, "pefs-dircache-bench: cannot create key\n");
+		exit(1);
+	}
+
+	bench_names = calloc(bench_nnames, sizeof(*bench_names));
+	bench_encnames = calloc(bench_nnames, sizeof(*bench_encnames));
+	bench_namelens = calloc(bench_nnames, sizeof(*bench_namelens));
+	bench_encnamelens = calloc(bench_nnames, sizeof(*bench_encnamelens));
+	for (n = 0; n < bench_nnames; n++) {
+		bench_namelens[n] = snprintf(bench_names[n],
+		    sizeof(bench_names[n]), "file-%u.c", n);
+		bench_encnamelens[n] = snprintf(bench_encnames[n],
+		    sizeof(bench_encnames[n]), "%08x%08x.%u",
+		    n * 0x9e3779b9, ~n * 0x85ebca6b, n);
+	}
+
+	pool = pefs_dircache_pool_create(0);
+	bench_dirs = calloc(ndirs, sizeof(*bench_dirs));
+	for (i = 0; i < ndirs; i++) {
+		bench_dirs[i].bd_dircache = pefs_dircache_create(pool,
+		    &bench_dirs[i].bd_vnode);
+		bench_dir_fill(&bench_dirs[i]);
+	}
+
+	printf("variant,threads,lookups,writer_ops,seconds,lookups_per_sec,"
+	    "speedup\n");
+	base = 0;
+	for (nthreads = 1; ; nthreads *= 2) {
+		if (nthreads > bench_maxthreads)
+			nthreads = bench_maxthreads;
+		bench_run(nthreads, &base);
+		if (nthreads == bench_maxthreads)
+			break;
+	}
+
+	for (i = 0; i < ndirs; i++)
+		pefs_dircache_free(bench_dirs[i].bd_dircache);
+	pefs_dircache_pool_free(pool);
+	pefs_dircache_uninit();
+	pefs_key_release(bench_tkey.ptk_key);
+	pefs_crypto_uninit();
+
+	return (0);
+}
@@ -0,0 +1,447 @@
+/*-
+ * Copyright (c) 2026 Gleb Kurtsou <gleb@FreeBSD.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * $FreeBSD$
+ */
+
+/*
+ * XTS known-answer test.  IEEE 1619-2007 test vectors are checked with
+ * per-block and batched (multi-block ECB) XTS implementations, then batched
+ * implementations are compared with per-block one for every data unit length
+ * up to XTS_TEST_MAXLEN, including lengths requiring ciphertext stealing.
+ */
+
+#include <sys/param.h>
+
+#include <getopt.h>
+#include <stdarg.h>
+
+#include <fs/pefs/pefs.h>
+#include <fs/pefs/pefs_crypto.h>
+
+#define	XTS_TEST_MAXLEN		(PEFS_SECTOR_SIZE + 3 * 16 + 15)
+#define	XTS_TEST_SEQLEN		512
+
+struct xts_test_alg {
+	const char		*xa_name;
+	struct pefs_alg		xa_alg;
+};
+
+struct xts_test_vector {
+	int			xv_num;
+	int			xv_keybits;
+	const char		*xv_key1;
+	const char		*xv_key2;
+	uint64_t		xv_sector;
+	int			xv_len;
+	const char		*xv_ptx;	/* NULL: 00 01 02 ... ff 00 ... */
+	const char		*xv_ctx;
+};
+
+static algop_keysetup_t	xts_test_rijndael_keysetup;
+static algop_crypt_t	xts_test_rijndael_encrypt;
+static algop_crypt_t	xts_test_rijndael_decrypt;
+static algop_crypt_blocks_t xts_test_rijndael_encrypt_blocks;
+static algop_crypt_blocks_t xts_test_rijndael_decrypt_blocks;
+
+/*
+ * Per-block reference is listed first.  Batched table driven rijndael checks
+ * tweak generation of xts_fullblocks() independent of block cipher backend.
+ */
+static struct xts_test_alg xts_test_algs[] = {
+	{ "rijndael", {
+		.pa_keysetup =		xts_test_rijndael_keysetup,
+		.pa_encrypt =		xts_test_rijndael_encrypt,
+		.pa_decrypt =		xts_test_rijndael_decrypt,
+	} },
+	{ "rijndael-batch", {
+		.pa_keysetup =		xts_test_rijndael_keysetup,
+		.pa_encrypt =		xts_test_rijndael_encrypt,
+		.pa_decrypt =		xts_test_rijndael_decrypt,
+		.pa_encrypt_blocks =	xts_test_rijndael_encrypt_blocks,
+		.pa_decrypt_blocks =	xts_test_rijndael_decrypt_blocks,
+	} },
+	{ "aes-ct", { } },
+};
+
+static const struct xts_test_vector xts_test_vectors[] = {
+	{ 1, 128,
+	    "00000000000000000000000000000000",
+	    "00000000000000000000000000000000",
+	    0, 32,
+	    "0000000000000000000000000000000000000000000000000000000000000000",
+	    "917cf69ebd68b2ec9b9fe9a3eadda692cd43d2f59598ed858c02c2652fbf922e"
+	},
+	{ 2, 128,
+	    "11111111111111111111111111111111",
+	    "22222222222222222222222222222222",
+	    0x3333333333ULL, 32,
+	    "4444444444444444444444444444444444444444444444444444444444444444",
+	    "c454185e6a16936e39334038acef838bfb186fff7480adc4289382ecd6d394f0"
+	},
+	{ 3, 128,
+	    "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0",
+	    "22222222222222222222222222222222",
+	    0x3333333333ULL, 32,
+	    "4444444444444444444444444444444444444444444444444444444444444444",
+	    "af85336b597afc1a900b2eb21ec949d292df4c047e0b21532186a5971a227a89"
+	},
+	{ 4, 128,
+	    "27182818284590452353602874713526",
+	    "31415926535897932384626433832795",
+	    0, XTS_TEST_SEQLEN, NULL,
+	    "27a7479befa1d476489f308cd4cfa6e2a96e4bbe3208ff25287dd3819616e89c"
+	    "c78cf7f5e543445f8333d8fa7f56000005279fa5d8b5e4ad40e736ddb4d35412"
+	    "328063fd2aab53e5ea1e0a9f332500a5df9487d07a5c92cc512c8866c7e860ce"
+	    "93fdf166a24912b422976146ae20ce846bb7dc9ba94a767aaef20c0d61ad0265"
+	    "5ea92dc4c4e41a8952c651d33174be51a10c421110e6d81588ede82103a252d8"
+	    "a750e8768defffed9122810aaeb99f9172af82b604dc4b8e51bcb08235a6f434"
+	    "1332e4ca60482a4ba1a03b3e65008fc5da76b70bf1690db4eae29c5f1badd03c"
+	    "5ccf2a55d705ddcd86d449511ceb7ec30bf12b1fa35b913f9f747a8afd1b130e"
+	    "94bff94effd01a91735ca1726acd0b197c4e5b03393697e126826fb6bbde8ecc"
+	    "1e08298516e2c9ed03ff3c1b7860f6de76d4cecd94c8119855ef5297ca67e9f3"
+	    "e7ff72b1e99785ca0a7e7720c5b36dc6d72cac9574c8cbbc2f801e23e56fd344"
+	    "b07f22154beba0f08ce8891e643ed995c94d9a69c9f1b5f499027a78572aeebd"
+	    "74d20cc39881c213ee770b1010e4bea718846977ae119f7a023ab58cca0ad752"
+	    "afe656bb3c17256a9f6e9bf19fdd5a38fc82bbe872c5539edb609ef4f79c203e"
+	    "bb140f2e583cb2ad15b4aa5b655016a8449277dbd477ef2c8d6c017db738b18d"
+	    "eb4a427d1923ce3ff262735779a418f20a282df920147beabe421ee5319d0568"
+	},
+	{ 10, 256,
+	    "2718281828459045235360287471352662497757247093699959574966967627",
+	    "3141592653589793238462643383279502884197169399375105820974944592",
+	    0xff, XTS_TEST_SEQLEN, NULL,
+	    "1c3b3a102f770386e4836c99e370cf9bea00803f5e482357a4ae12d414a3e63b"
+	    "5d31e276f8fe4a8d66b317f9ac683f44680a86ac35adfc3345befecb4bb188fd"
+	    "5776926c49a3095eb108fd1098baec70aaa66999a72a82f27d848b21d4a741b0"
+	    "c5cd4d5fff9dac89aeba122961d03a757123e9870f8acf1000020887891429ca"
+	    "2a3e7a7d7df7b10355165c8b9a6d0a7de8b062c4500dc4cd120c0f7418dae3d0"
+	    "b5781c34803fa75421c790dfe1de1834f280d7667b327f6c8cd7557e12ac3a0f"
+	    "93ec05c52e0493ef31a12d3d9260f79a289d6a379bc70c50841473d1a8cc81ec"
+	    "583e9645e07b8d9670655ba5bbcfecc6dc3966380ad8fecb17b6ba02469a020a"
+	    "84e18e8f84252070c13e9f1f289be54fbc481457778f616015e1327a02b140f1"
+	    "505eb309326d68378f8374595c849d84f4c333ec4423885143cb47bd71c5edae"
+	    "9be69a2ffeceb1bec9de244fbe15992b11b77c040f12bd8f6a975a44a0f90c29"
+	    "a9abc3d4d893927284c58754cce294529f8614dcd2aba991925fedc4ae74ffac"
+	    "6e333b93eb4aff0479da9a410e4450e0dd7ae4c6e2910900575da401fc07059f"
+	    "645e8b7e9bfdef33943054ff84011493c27b3429eaedb4ed5376441a77ed4385"
+	    "1ad77f16f541dfd269d50d6a5f14fb0aab1cbb4c1550be97f7ab4066193c4caa"
+	    "773dad38014bd2092fa755c824bb5e54c4f36ffda9fcea70b9c6e693e148c151"
+	},
+	{ 15, 128,
+	    "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0",
+	    "bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0",
+	    0x123456789aULL, 17, NULL,
+	    "6c1625db4671522d3d7599601de7ca09ed"
+	},
+	{ 16, 128,
+	    "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0",
+	    "bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0",
+	    0x123456789aULL, 18, NULL,
+	    "d069444b7a7e0cab09e24447d24deb1fedbf"
+	},
+	{ 17, 128,
+	    "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0",
+	    "bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0",
+	    0x123456789aULL, 19, NULL,
+	    "e5df1351c0544ba1350b3363cd8ef4beedbf9d"
+	},
+	{ 18, 128,
+	    "fffefdfcfbfaf9f8f7f6f5f4f3f2f1f0",
+	    "bfbebdbcbbbab9b8b7b6b5b4b3b2b1b0",
+	    0x123456789aULL, 20, NULL,
+	    "9d84c813f719aa2c7be3f66171c7c5c2edbf9dac"
+	},
+	{ 19, 128,
+	    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef",
+	    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf",
+	    0xa987654321ULL, XTS_TEST_SEQLEN, NULL,
+	    "38b45812ef43a05bd957e545907e223b954ab4aaf088303ad910eadf14b42be6"
+	    "8b2461149d8c8ba85f992be970bc621f1b06573f63e867bf5875acafa04e42cc"
+	    "bd7bd3c2a0fb1fff791ec5ec36c66ae4ac1e806d81fbf709dbe29e471fad3854"
+	    "9c8e66f5345d7c1eb94f405d1ec785cc6f6a68f6254dd8339f9d84057e01a177"
+	    "41990482999516b5611a38f41bb6478e6f173f320805dd71b1932fc333cb9ee3"
+	    "9936beea9ad96fa10fb4112b901734ddad40bc1878995f8e11aee7d141a2f5d4"
+	    "8b7a4e1e7f0b2c04830e69a4fd1378411c2f287edf48c6c4e5c247a19680f7fe"
+	    "41cefbd49b582106e3616cbbe4dfb2344b2ae9519391f3e0fb4922254b1d6d2d"
+	    "19c6d4d537b3a26f3bcc51588b32f3eca0829b6a5ac72578fb814fb43cf80d64"
+	    "a233e3f997a3f02683342f2b33d25b492536b93becb2f5e1a8b82f5b88334272"
+	    "9e8ae09d16938841a21a97fb543eea3bbff59f13c1a18449e398701c1ad51648"
+	    "346cbc04c27bb2da3b93a1372ccae548fb53bee476f9e9c91773b1bb19828394"
+	    "d55d3e1a20ed69113a860b6829ffa847224604435070221b257e8dff783615d2"
+	    "cae4803a93aa4334ab482a0afac9c0aeda70b45a481df5dec5df8cc0f423c77a"
+	    "5fd46cd312021d4b438862419a791be03bb4d97c0e59578542531ba466a83baf"
+	    "92cefc151b5cc1611a167893819b63fb8a6b18e86de60290fa72b797b0ce59f3"
+	},
+};
+
+static const int xts_test_keybits[] = { 128, 192, 256 };
+
+static struct pefs_session xts_test_ses;
+static int xts_test_verbose;
+static int xts_test_failed;
+
+void
+pefs_zone_dtor_bzero(void *mem, int size, void *arg __unused)
+{
+	explicit_bzero(mem, size);
+}
+
+static int
+xts_test_rijndael_keysetup(const struct pefs_session *ses __unused,
+    struct pefs_ctx *ctx, const uint8_t *key, uint32_t keybits)
+{
+	rijndael_set_key(&ctx->o.pctx_aes, key, keybits);
+	return (0);
+}
+
+static void
+xts_test_rijndael_encrypt(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out)
+{
+	rijndael_encrypt(&ctx->o.pctx_aes, in, out);
+}
+
+static void
+xts_test_rijndael_decrypt(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out)
+{
+	rijndael_decrypt(&ctx->o.pctx_aes, in, out);
+}
+
+static void
+xts_test_rijndael_encrypt_blocks(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	for (; nblocks > 0; nblocks--) {
+		rijndael_encrypt(&ctx->o.pctx_aes, in, out);
+		in += 16;
+		out += 16;
+	}
+}
+
+static void
+xts_test_rijndael_decrypt_blocks(const struct pefs_session *ses __unused,
+    const struct pefs_ctx *ctx, const uint8_t *in, uint8_t *out,
+    size_t nblocks)
+{
+	for (; nblocks > 0; nblocks--) {
+		rijndael_decrypt(&ctx->o.pctx_aes, in, out);
+		in += 16;
+		out += 16;
+	}
+}
+
+static void
+xts_test_fill(void *buf, size_t size, uint32_t seed)
+{
+	uint8_t *p = buf;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		p[i] = seed >> 16;
+	}
+}
+
+static int
+xts_test_hex(const char *s, uint8_t *buf, size_t size)
+{
+	u_int v;
+	size_t i;
+
+	for (i = 0; s[0] != '\0' && s[1] != '\0'; i++, s += 2) {
+		if (i >= size || sscanf(s, "%2x", &v) != 1)
+			abort();
+		buf[i] = v;
+	}
+	return (i);
+}
+
+static void
+xts_test_result(int ok, const char *alg, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok && !xts_test_verbose)
+		return;
+	printf("%s %s: ", ok ? "ok" : "FAIL", alg);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!ok)
+		xts_test_failed++;
+}
+
+static void
+xts_test_setkey(struct xts_test_alg *xa, struct pefs_ctx *data_ctx,
+    struct pefs_ctx *tweak_ctx, const uint8_t *key1, const uint8_t *key2,
+    int keybits)
+{
+
+	xa->xa_alg.pa_keysetup(&xts_test_ses, data_ctx, key1, keybits);
+	xa->xa_alg.pa_keysetup(&xts_test_ses, tweak_ctx, key2, keybits);
+}
+
+static void
+xts_test_vector(struct xts_test_alg *xa, const struct xts_test_vector *xv)
+{
+	uint8_t key1[32], key2[32], ptx[XTS_TEST_SEQLEN], ctx[XTS_TEST_SEQLEN];
+	uint8_t buf[XTS_TEST_SEQLEN], xtweak[PEFS_TWEAK_SIZE];
+	struct pefs_ctx data_ctx, tweak_ctx;
+	int i;
+
+	xts_test_hex(xv->xv_key1, key1, sizeof(key1));
+	xts_test_hex(xv->xv_key2, key2, sizeof(key2));
+	if (xv->xv_ptx == NULL) {
+		for (i = 0; i < xv->xv_len; i++)
+			ptx[i] = i;
+	} else
+		xts_test_hex(xv->xv_ptx, ptx, sizeof(ptx));
+	xts_test_hex(xv->xv_ctx, ctx, sizeof(ctx));
+	/* Upper 64 bits of IEEE 1619 data unit sequence number. */
+	memset(xtweak, 0, sizeof(xtweak));
+
+	xts_test_setkey(xa, &data_ctx, &tweak_ctx, key1, key2, xv->xv_keybits);
+
+	pefs_xts_block_encrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+	    &data_ctx, xv->xv_sector, xtweak, xv->xv_len, ptx, buf);
+	xts_test_result(memcmp(buf, ctx, xv->xv_len) == 0, xa->xa_name,
+	    "IEEE 1619 vector %d encrypt", xv->xv_num);
+
+	pefs_xts_block_decrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+	    &data_ctx, xv->xv_sector, xtweak, xv->xv_len, ctx, buf);
+	xts_test_result(memcmp(buf, ptx, xv->xv_len) == 0, xa->xa_name,
+	    "IEEE 1619 vector %d decrypt", xv->xv_num);
+
+	/* pefs encrypts in place. */
+	memcpy(buf, ptx, xv->xv_len);
+	pefs_xts_block_encrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+	    &data_ctx, xv->xv_sector, xtweak, xv->xv_len, buf, buf);
+	xts_test_result(memcmp(buf, ctx, xv->xv_len) == 0, xa->xa_name,
+	    "IEEE 1619 vector %d encrypt in place", xv->xv_num);
+	pefs_xts_block_decrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+	    &data_ctx, xv->xv_sector, xtweak, xv->xv_len, buf, buf);
+	xts_test_result(memcmp(buf, ptx, xv->xv_len) == 0, xa->xa_name,
+	    "IEEE 1619 vector %d decrypt in place", xv->xv_num);
+}
+
+/*
+ * Compare batched implementation with per-block reference for every length
+ * from one block up to XTS_TEST_MAXLEN: partial batches, batches with
+ * ciphertext stealing tail and several batches in a row.
+ */
+static void
+xts_test_batch(struct xts_test_alg *ref, struct xts_test_alg *xa,
+    int keybits)
+{
+	uint8_t key1[32], key2[32], xtweak[PEFS_TWEAK_SIZE];
+	uint8_t ptx[XTS_TEST_MAXLEN], exp[XTS_TEST_MAXLEN];
+	uint8_t buf[XTS_TEST_MAXLEN];
+	struct pefs_ctx ref_data, ref_tweak, data_ctx, tweak_ctx;
+	uint64_t sector;
+	int len, nfail;
+
+	xts_test_fill(key1, sizeof(key1), keybits);
+	xts_test_fill(key2, sizeof(key2), keybits + 1);
+	xts_test_fill(xtweak, sizeof(xtweak), keybits + 2);
+	xts_test_setkey(ref, &ref_data, &ref_tweak, key1, key2, keybits);
+	xts_test_setkey(xa, &data_ctx, &tweak_ctx, key1, key2, keybits);
+
+	nfail = 0;
+	for (len = 16; len <= XTS_TEST_MAXLEN; len++) {
+		sector = (uint64_t)len * PEFS_SECTOR_SIZE;
+		xts_test_fill(ptx, len, len);
+
+		pefs_xts_block_encrypt(&ref->xa_alg, &xts_test_ses, &ref_tweak,
+		    &ref_data, sector, xtweak, len, ptx, exp);
+		memcpy(buf, ptx, len);
+		pefs_xts_block_encrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+		    &data_ctx, sector, xtweak, len, buf, buf);
+		if (memcmp(buf, exp, len) != 0 && nfail++ == 0)
+			xts_test_result(0, xa->xa_name, "%d bits, length %d "
+			    "encrypt differs from %s", keybits, len,
+			    ref->xa_name);
+
+		pefs_xts_block_decrypt(&xa->xa_alg, &xts_test_ses, &tweak_ctx,
+		    &data_ctx, sector, xtweak, len, exp, buf);
+		if (memcmp(buf, ptx, len) != 0 && nfail++ == 0)
+			xts_test_result(0, xa->xa_name, "%d bits, length %d "
+			    "decrypt mismatch", keybits, len);
+	}
+	if (nfail == 0)
+		xts_test_result(1, xa->xa_name, "%d bits, lengths 16-%d "
+		    "match %s", keybits, XTS_TEST_MAXLEN, ref->xa_name);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: pefs-xts-test [-v]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t a, i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			xts_test_verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	/* Constant-time backend provides multi-block operations. */
+	setenv("vfs.pefs.aes_ct_enable", "1", 1);
+	pefs_aes_ct_init(&xts_test_algs[2].xa_alg);
+
+	for (a = 0; a < nitems(xts_test_algs); a++) {
+		for (i = 0; i < nitems(xts_test_vectors); i++)
+			xts_test_vector(&xts_test_algs[a],
+			    &xts_test_vectors[i]);
+	}
+	for (a = 1; a < nitems(xts_test_algs); a++) {
+		for (i = 0; i < nitems(xts_test_keybits); i++)
+			xts_test_batch(&xts_test_algs[0], &xts_test_algs[a],
+			    xts_test_keybits[i]);
+	}
+
+	if (xts_test_failed != 0) {
+		printf("%d tests failed\n", xts_test_failed);
+		return (1);
+	}
+	printf("all tests passed\n");
+	return (0);
+}
@@ -0,0 +1,5 @@
+#define CAMELLIA_BLOCK_SIZE 16
+typedef struct { int bits; } camellia_ctx;
+#define camellia_set_key(ctx, key, bits) abort()
+#define camellia_encrypt(ctx, in, out) abort()
+#define camellia_decrypt(ctx, in, out) abort()